@@ -0,0 +1,80 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// Fixed-size run of values allocated in an Arena
+template <typename T>
+class ArenaList {
+private:
+    T* items;
+    size_t count;
+
+public:
+    ArenaList() : items(nullptr), count(0) {}
+    ArenaList(T* i, size_t c) : items(i), count(c) {}
+
+    T* begin() const { return items; }
+    T* end() const { return items + count; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    T& operator[](size_t idx) const { return items[idx]; }
+};
+
+// Bump allocator owning everything built for one compilation: AST nodes,
+// their child lists and the identifier/string text they refer to. Nothing is
+// freed individually, so objects placed here must be trivially destructible.
+class Arena {
+private:
+    static const size_t BLOCK_SIZE = 64 * 1024;
+
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char* cursor;
+    char* limit;
+    std::unordered_set<std::string> strings;
+
+    void* allocateSlow(size_t size, size_t align);
+
+public:
+    Arena() : cursor(nullptr), limit(nullptr) {}
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t size, size_t align) {
+        uintptr_t p = (reinterpret_cast<uintptr_t>(cursor) + align - 1) & ~static_cast<uintptr_t>(align - 1);
+        if (cursor && p + size <= reinterpret_cast<uintptr_t>(limit)) {
+            cursor = reinterpret_cast<char*>(p + size);
+            return reinterpret_cast<void*>(p);
+        }
+        return allocateSlow(size, align);
+    }
+
+    template <typename T, typename... Args>
+    T* make(Args&&... args) {
+        static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    template <typename T>
+    ArenaList<T> list(const T* first, size_t count) {
+        static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+        if (count == 0) return ArenaList<T>();
+        T* items = static_cast<T*>(allocate(sizeof(T) * count, alignof(T)));
+        std::uninitialized_copy(first, first + count, items);
+        return ArenaList<T>(items, count);
+    }
+
+    // Equal text is stored once and the reference stays valid for the
+    // arena's lifetime
+    const std::string& intern(const std::string& text) { return *strings.insert(text).first; }
+};
+
+#endif
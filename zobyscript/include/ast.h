@@ -1,9 +1,31 @@
 #ifndef AST_H
 #define AST_H
 
+#include "arena.h"
 #include <string>
-#include <vector>
-#include <memory>
+#include <utility>
+
+enum class BinaryOp {
+    ADD,
+    SUBTRACT,
+    MULTIPLY,
+    DIVIDE,
+    LESS,
+    GREATER,
+    LESS_EQUAL,
+    GREATER_EQUAL,
+    EQUAL,
+    NOT_EQUAL,
+    AND,
+    OR
+};
+
+enum class UnaryOp {
+    NEGATE,
+    NOT
+};
+
+const char* binaryOpSymbol(BinaryOp op);
 
 enum class ASTNodeType {
     NUMBER,
@@ -13,6 +35,7 @@ enum class ASTNodeType {
     ARRAY,
     HASHMAP,
     INDEX,
+    INDEX_ASSIGNMENT,
     IDENTIFIER,
     BINARY_OP,
     UNARY_OP,
@@ -31,11 +54,13 @@ enum class ASTNodeType {
     PROGRAM
 };
 
+// Nodes live in the Arena passed to the Parser and are released with it.
+// Children are plain pointers and strings are references to arena-interned
+// text, which keeps every node trivially destructible.
 class ASTNode {
 public:
     ASTNodeType type;
-    virtual ~ASTNode() = default;
-    
+
 protected:
     ASTNode(ASTNodeType t) : type(t) {}
 };
@@ -48,7 +73,7 @@ public:
 
 class StringNode : public ASTNode {
 public:
-    std::string value;
+    const std::string& value;
     StringNode(const std::string& v) : ASTNode(ASTNodeType::STRING), value(v) {}
 };
 
@@ -65,128 +90,137 @@ public:
 
 class ArrayNode : public ASTNode {
 public:
-    std::vector<std::unique_ptr<ASTNode>> elements;
-    ArrayNode(std::vector<std::unique_ptr<ASTNode>> elems)
-        : ASTNode(ASTNodeType::ARRAY), elements(std::move(elems)) {}
+    ArenaList<ASTNode*> elements;
+    ArrayNode(ArenaList<ASTNode*> elems)
+        : ASTNode(ASTNodeType::ARRAY), elements(elems) {}
 };
 
 class HashMapNode : public ASTNode {
 public:
-    std::vector<std::pair<std::string, std::unique_ptr<ASTNode>>> pairs;
-    HashMapNode(std::vector<std::pair<std::string, std::unique_ptr<ASTNode>>> p)
-        : ASTNode(ASTNodeType::HASHMAP), pairs(std::move(p)) {}
+    ArenaList<std::pair<ASTNode*, ASTNode*>> pairs;
+    HashMapNode(ArenaList<std::pair<ASTNode*, ASTNode*>> p)
+        : ASTNode(ASTNodeType::HASHMAP), pairs(p) {}
 };
 
 class IndexNode : public ASTNode {
 public:
-    std::unique_ptr<ASTNode> array;
-    std::unique_ptr<ASTNode> index;
-    IndexNode(std::unique_ptr<ASTNode> arr, std::unique_ptr<ASTNode> idx)
-        : ASTNode(ASTNodeType::INDEX), array(std::move(arr)), index(std::move(idx)) {}
+    ASTNode* array;
+    ASTNode* index;
+    IndexNode(ASTNode* arr, ASTNode* idx)
+        : ASTNode(ASTNodeType::INDEX), array(arr), index(idx) {}
+};
+
+class IndexAssignmentNode : public ASTNode {
+public:
+    ASTNode* array;
+    ASTNode* index;
+    ASTNode* value;
+    IndexAssignmentNode(ASTNode* arr, ASTNode* idx, ASTNode* v)
+        : ASTNode(ASTNodeType::INDEX_ASSIGNMENT), array(arr), index(idx), value(v) {}
 };
 
 class IdentifierNode : public ASTNode {
 public:
-    std::string name;
+    const std::string& name;
     IdentifierNode(const std::string& n) : ASTNode(ASTNodeType::IDENTIFIER), name(n) {}
 };
 
 class BinaryOpNode : public ASTNode {
 public:
-    std::string op;
-    std::unique_ptr<ASTNode> left;
-    std::unique_ptr<ASTNode> right;
+    BinaryOp op;
+    ASTNode* left;
+    ASTNode* right;
     
-    BinaryOpNode(const std::string& o, std::unique_ptr<ASTNode> l, std::unique_ptr<ASTNode> r)
-        : ASTNode(ASTNodeType::BINARY_OP), op(o), left(std::move(l)), right(std::move(r)) {}
+    BinaryOpNode(BinaryOp o, ASTNode* l, ASTNode* r)
+        : ASTNode(ASTNodeType::BINARY_OP), op(o), left(l), right(r) {}
 };
 
 class UnaryOpNode : public ASTNode {
 public:
-    std::string op;
-    std::unique_ptr<ASTNode> operand;
+    UnaryOp op;
+    ASTNode* operand;
     
-    UnaryOpNode(const std::string& o, std::unique_ptr<ASTNode> operand)
-        : ASTNode(ASTNodeType::UNARY_OP), op(o), operand(std::move(operand)) {}
+    UnaryOpNode(UnaryOp o, ASTNode* operand)
+        : ASTNode(ASTNodeType::UNARY_OP), op(o), operand(operand) {}
 };
 
 class AssignmentNode : public ASTNode {
 public:
-    std::string name;
-    std::unique_ptr<ASTNode> value;
+    const std::string& name;
+    ASTNode* value;
     
-    AssignmentNode(const std::string& n, std::unique_ptr<ASTNode> v)
-        : ASTNode(ASTNodeType::ASSIGNMENT), name(n), value(std::move(v)) {}
+    AssignmentNode(const std::string& n, ASTNode* v)
+        : ASTNode(ASTNodeType::ASSIGNMENT), name(n), value(v) {}
 };
 
 class FunctionCallNode : public ASTNode {
 public:
-    std::string name;
-    std::vector<std::unique_ptr<ASTNode>> arguments;
+    const std::string& name;
+    ArenaList<ASTNode*> arguments;
     
-    FunctionCallNode(const std::string& n, std::vector<std::unique_ptr<ASTNode>> args)
-        : ASTNode(ASTNodeType::FUNCTION_CALL), name(n), arguments(std::move(args)) {}
+    FunctionCallNode(const std::string& n, ArenaList<ASTNode*> args)
+        : ASTNode(ASTNodeType::FUNCTION_CALL), name(n), arguments(args) {}
 };
 
 class FunctionDefNode : public ASTNode {
 public:
-    std::string name;
-    std::vector<std::string> params;
-    std::unique_ptr<ASTNode> body;
+    const std::string& name;
+    ArenaList<const std::string*> params;
+    ASTNode* body;
     
-    FunctionDefNode(const std::string& n, std::vector<std::string> p, std::unique_ptr<ASTNode> b)
-        : ASTNode(ASTNodeType::FUNCTION_DEF), name(n), params(std::move(p)), body(std::move(b)) {}
+    FunctionDefNode(const std::string& n, ArenaList<const std::string*> p, ASTNode* b)
+        : ASTNode(ASTNodeType::FUNCTION_DEF), name(n), params(p), body(b) {}
 };
 
 class ReturnNode : public ASTNode {
 public:
-    std::unique_ptr<ASTNode> value;
+    ASTNode* value;
     
-    ReturnNode(std::unique_ptr<ASTNode> v)
-        : ASTNode(ASTNodeType::RETURN), value(std::move(v)) {}
+    ReturnNode(ASTNode* v)
+        : ASTNode(ASTNodeType::RETURN), value(v) {}
 };
 
 class BlockNode : public ASTNode {
 public:
-    std::vector<std::unique_ptr<ASTNode>> statements;
+    ArenaList<ASTNode*> statements;
     
-    BlockNode(std::vector<std::unique_ptr<ASTNode>> stmts)
-        : ASTNode(ASTNodeType::BLOCK), statements(std::move(stmts)) {}
+    BlockNode(ArenaList<ASTNode*> stmts)
+        : ASTNode(ASTNodeType::BLOCK), statements(stmts) {}
 };
 
 class IfStatementNode : public ASTNode {
 public:
-    std::unique_ptr<ASTNode> condition;
-    std::unique_ptr<ASTNode> thenBranch;
-    std::unique_ptr<ASTNode> elseBranch;
+    ASTNode* condition;
+    ASTNode* thenBranch;
+    ASTNode* elseBranch;
     
-    IfStatementNode(std::unique_ptr<ASTNode> cond, std::unique_ptr<ASTNode> then, std::unique_ptr<ASTNode> els = nullptr)
-        : ASTNode(ASTNodeType::IF_STATEMENT), condition(std::move(cond)), thenBranch(std::move(then)), elseBranch(std::move(els)) {}
+    IfStatementNode(ASTNode* cond, ASTNode* then, ASTNode* els = nullptr)
+        : ASTNode(ASTNodeType::IF_STATEMENT), condition(cond), thenBranch(then), elseBranch(els) {}
 };
 
 class WhileStatementNode : public ASTNode {
 public:
-    std::unique_ptr<ASTNode> condition;
-    std::unique_ptr<ASTNode> body;
+    ASTNode* condition;
+    ASTNode* body;
     
-    WhileStatementNode(std::unique_ptr<ASTNode> cond, std::unique_ptr<ASTNode> b)
-        : ASTNode(ASTNodeType::WHILE_STATEMENT), condition(std::move(cond)), body(std::move(b)) {}
+    WhileStatementNode(ASTNode* cond, ASTNode* b)
+        : ASTNode(ASTNodeType::WHILE_STATEMENT), condition(cond), body(b) {}
 };
 
 class ForStatementNode : public ASTNode {
 public:
-    std::unique_ptr<ASTNode> init;
-    std::unique_ptr<ASTNode> condition;
-    std::unique_ptr<ASTNode> increment;
-    std::unique_ptr<ASTNode> body;
+    ASTNode* init;
+    ASTNode* condition;
+    ASTNode* increment;
+    ASTNode* body;
     
-    ForStatementNode(std::unique_ptr<ASTNode> i, std::unique_ptr<ASTNode> c, std::unique_ptr<ASTNode> inc, std::unique_ptr<ASTNode> b)
-        : ASTNode(ASTNodeType::FOR_STATEMENT), init(std::move(i)), condition(std::move(c)), increment(std::move(inc)), body(std::move(b)) {}
+    ForStatementNode(ASTNode* i, ASTNode* c, ASTNode* inc, ASTNode* b)
+        : ASTNode(ASTNodeType::FOR_STATEMENT), init(i), condition(c), increment(inc), body(b) {}
 };
 
 class UseStatementNode : public ASTNode {
 public:
-    std::string library;
+    const std::string& library;
     UseStatementNode(const std::string& lib)
         : ASTNode(ASTNodeType::USE_STATEMENT), library(lib) {}
 };
@@ -203,19 +237,19 @@ public:
 
 class TernaryNode : public ASTNode {
 public:
-    std::unique_ptr<ASTNode> condition;
-    std::unique_ptr<ASTNode> thenExpr;
-    std::unique_ptr<ASTNode> elseExpr;
-    TernaryNode(std::unique_ptr<ASTNode> cond, std::unique_ptr<ASTNode> then, std::unique_ptr<ASTNode> els)
-        : ASTNode(ASTNodeType::TERNARY), condition(std::move(cond)), thenExpr(std::move(then)), elseExpr(std::move(els)) {}
+    ASTNode* condition;
+    ASTNode* thenExpr;
+    ASTNode* elseExpr;
+    TernaryNode(ASTNode* cond, ASTNode* then, ASTNode* els)
+        : ASTNode(ASTNodeType::TERNARY), condition(cond), thenExpr(then), elseExpr(els) {}
 };
 
 class ProgramNode : public ASTNode {
 public:
-    std::vector<std::unique_ptr<ASTNode>> statements;
+    ArenaList<ASTNode*> statements;
     
-    ProgramNode(std::vector<std::unique_ptr<ASTNode>> stmts)
-        : ASTNode(ASTNodeType::PROGRAM), statements(std::move(stmts)) {}
+    ProgramNode(ArenaList<ASTNode*> stmts)
+        : ASTNode(ASTNodeType::PROGRAM), statements(stmts) {}
 };
 
 #endif
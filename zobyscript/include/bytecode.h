@@ -1,10 +1,13 @@
 #ifndef BYTECODE_H
 #define BYTECODE_H
 
+#include "value.h"
 #include <vector>
 #include <string>
-#include <map>
 #include <cstdint>
+#include <initializer_list>
+#include <stdexcept>
+#include <unordered_map>
 
 enum class OpCode : uint8_t {
     OP_CONSTANT,
@@ -51,80 +54,91 @@ enum class OpCode : uint8_t {
     OP_MUL_INT,
     OP_CONSTANT_0,
     OP_CONSTANT_1,
-    OP_GET_GLOBAL_CACHED,
-    OP_SET_GLOBAL_CACHED
-};
-
-struct Value {
-    enum Type { NUMBER, STRING, BOOLEAN, ARRAY, HASHMAP, NULLVAL } type;
-    double number;
-    std::string string;
-    bool boolean;
-    std::vector<Value>* array;
-    std::map<std::string, Value>* hashmap;
-    
-    Value() : type(NUMBER), number(0), array(nullptr), hashmap(nullptr) {}
-    Value(double n) : type(NUMBER), number(n), array(nullptr), hashmap(nullptr) {}
-    Value(const std::string& s) : type(STRING), string(s), array(nullptr), hashmap(nullptr) {}
-    Value(bool b) : type(BOOLEAN), boolean(b), array(nullptr), hashmap(nullptr) {}
-    Value(std::vector<Value>* arr) : type(ARRAY), number(0), array(arr), hashmap(nullptr) {}
-    Value(std::map<std::string, Value>* hm) : type(HASHMAP), number(0), array(nullptr), hashmap(hm) {}
-    static Value Null() { Value v; v.type = NULLVAL; v.array = nullptr; v.hashmap = nullptr; return v; }
-    
-    ~Value() {
-        if (type == ARRAY && array) delete array;
-        if (type == HASHMAP && hashmap) delete hashmap;
-    }
-    
-    Value(const Value& other) : type(other.type), number(other.number), string(other.string), boolean(other.boolean) {
-        if (other.type == ARRAY && other.array) {
-            array = new std::vector<Value>(*other.array);
-        } else {
-            array = nullptr;
-        }
-        if (other.type == HASHMAP && other.hashmap) {
-            hashmap = new std::map<std::string, Value>(*other.hashmap);
-        } else {
-            hashmap = nullptr;
-        }
-    }
-    
-    Value& operator=(const Value& other) {
-        if (this != &other) {
-            if (type == ARRAY && array) delete array;
-            if (type == HASHMAP && hashmap) delete hashmap;
-            type = other.type;
-            number = other.number;
-            string = other.string;
-            boolean = other.boolean;
-            if (other.type == ARRAY && other.array) {
-                array = new std::vector<Value>(*other.array);
-            } else {
-                array = nullptr;
-            }
-            if (other.type == HASHMAP && other.hashmap) {
-                hashmap = new std::map<std::string, Value>(*other.hashmap);
-            } else {
-                hashmap = nullptr;
-            }
-        }
-        return *this;
-    }
+    // Superinstructions for the hottest sequences in the benchmarks
+    OP_SET_GLOBAL_POP,          // global = pop()
+    OP_SET_LOCAL_POP,           // local = pop()
+    OP_SET_GLOBAL_CONST,        // global = constants[k]
+    OP_SET_LOCAL_CONST,         // local = constants[k]
+    OP_INC_GLOBAL,              // global = global + constants[k]
+    OP_INC_LOCAL,               // local = local + constants[k]
+    OP_ADD_GLOBALS,             // push(global a + global b)
+    OP_ADD_LOCALS,              // push(local a + local b)
+    OP_POP_JUMP_IF_FALSE,       // jump if !pop()
+    OP_JUMP_IF_NOT_LESS,        // b = pop(), a = pop(); jump if !(a < b)
+    OP_JUMP_IF_NOT_LESS_EQUAL,
+    OP_JUMP_IF_NOT_GREATER,
+    OP_JUMP_IF_NOT_GREATER_EQUAL,
+    // Quickened forms. The VM rewrites a generic instruction into one of
+    // these after it sees number operands (an array and a number index for
+    // OP_INDEX_GET), and back to the generic form when the guard fails.
+    // The compiler never emits them.
+    OP_ADD_NUM,
+    OP_EQUAL_NUM,
+    OP_NOT_EQUAL_NUM,
+    OP_INDEX_GET_ARRAY,
+    // Prefix: every one-byte operand of the next instruction is 24-bit
+    // instead. Jump offsets keep their 16-bit encoding.
+    OP_WIDE,
+    OP_CALL_NATIVE,             // id argc: push(nativeTable()[id](top argc values))
+    OP_TAIL_CALL,               // funcId argc: return functions[funcId](top argc values), reusing the frame
+    // Record field access with a string constant key k, cached per site in
+    // chunk.fieldCaches[c]
+    OP_GET_FIELD,               // k c: push(pop()[constants[k]])
+    OP_SET_FIELD,               // k c: value = pop(); pop()[constants[k]] = value
+    // Written by the trace JIT over the backward OP_JUMP of a loop it has
+    // compiled; same operand as OP_JUMP. The compiler never emits it.
+    OP_LOOP_TRACE
 };
 
 struct Chunk {
+    static const int MAX_OPERAND = 0xFFFFFF;
+
     std::vector<uint8_t> code;
     std::vector<Value> constants;
+    std::unordered_map<uint64_t, int> constantSlots;  // raw bits -> index
+    // One per OP_GET_FIELD/OP_SET_FIELD; run-time state, filled in as the
+    // code runs, so writable even through a const Chunk
+    mutable std::vector<FieldCache> fieldCaches;
+    // Global slots the whole program uses; set on the main chunk only
+    uint32_t globalCount = 0;
+    // Deepest operand stack use above the frame; set by verifyProgram
+    uint32_t maxStack = 0;
     
     void write(uint8_t byte) { code.push_back(byte); }
     void write(OpCode op) { code.push_back(static_cast<uint8_t>(op)); }
+    // Writes op with its index/count operands, one byte each when they all
+    // fit (or wide is false) and as 24-bit values behind OP_WIDE otherwise
+    void writeOp(OpCode op, std::initializer_list<int> operands, bool wide = false) {
+        for (int operand : operands) {
+            if (operand < 0 || operand > MAX_OPERAND) throw std::runtime_error("Bytecode operand out of range");
+            if (operand > 0xFF) wide = true;
+        }
+        if (wide) write(OpCode::OP_WIDE);
+        write(op);
+        for (int operand : operands) {
+            if (wide) {
+                write(static_cast<uint8_t>(operand >> 16));
+                write(static_cast<uint8_t>(operand >> 8));
+            }
+            write(static_cast<uint8_t>(operand));
+        }
+    }
     void write16(int value) {
         code.push_back((value >> 8) & 0xFF);
         code.push_back(value & 0xFF);
     }
+    // Equal numbers (bit for bit) and strings (interned) share one slot
     int addConstant(const Value& value) {
+        auto slot = constantSlots.find(value.raw());
+        if (slot != constantSlots.end()) return slot->second;
+        int idx = static_cast<int>(constants.size());
         constants.push_back(value);
-        return static_cast<int>(constants.size() - 1);
+        constantSlots[value.raw()] = idx;
+        return idx;
+    }
+    int addFieldCache() {
+        fieldCaches.emplace_back();
+        return static_cast<int>(fieldCaches.size() - 1);
     }
     void patchJump(int offset) {
         int jump = code.size() - offset - 2;
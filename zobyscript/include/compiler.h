@@ -3,6 +3,7 @@
 
 #include "ast.h"
 #include "bytecode.h"
+#include <functional>
 #include <map>
 #include <set>
 #include <string>
@@ -15,43 +16,65 @@ struct Function {
     std::vector<std::string> params;
 };
 
+struct IRProgram;
+struct IRFunction;
+
 class Compiler {
 private:
-    Chunk* currentChunk;
     std::map<std::string, int> globals;
     std::map<std::string, int> locals;
     std::map<std::string, int> functions;
     std::vector<Function> functionTable;
     std::set<std::string> loadedLibraries;
-    std::map<std::string, Value> stringInternTable;
     int localCount;
     bool inFunction;
     bool obfuscate;
     bool optimizationsEnabled;
-    std::string currentFunctionName;
+    bool peepholeEnabled;
+    bool irDump;
+    int peepholeRemoved;
     
-    void compileExpression(ASTNode* node);
-    void compileStatement(ASTNode* node);
+    // Fills ir with the SSA form of the program and its functions, giving
+    // each function its table slot (ir_builder.cpp)
+    void buildIR(ProgramNode* program, IRProgram& ir);
+    // Builds the IR, runs the pass pipeline over each function and hands it
+    // to lower, main first; the backends differ only in lower
+    Chunk compileIR(ProgramNode* program, const std::function<void(IRFunction&, Chunk&)>& lower);
     int resolveGlobal(const std::string& name);
     int resolveLocal(const std::string& name);
-    void beginScope();
-    void endScope();
 
-    std::unique_ptr<ASTNode> optimizeConstantFolding(ASTNode* node);
-    std::string* internString(const std::string& str);
-    bool isTailCall(ASTNode* node, const std::string& funcName);
-    void peepholeOptimize(Chunk& chunk);
+    // Evaluates an expression made only of literals, operators and pure
+    // natives
+    bool optimizeConstantFolding(ASTNode* node, Value& result);
+    ObjString* internString(const std::string& str);
+    bool isTailCall(ASTNode* node);
+    // Rewrites a finished stack chunk in place and returns the number of
+    // instructions it removed (peephole.cpp)
+    int peepholeOptimize(Chunk& chunk);
+
+    friend class IRBuilder;
     
 public:
     Compiler();
     Chunk compile(ProgramNode* program);
+    // Lowers the program to RegOpCode bytecode for RegisterVM instead. Both
+    // backends fill the same function table, so use one Compiler per backend.
+    Chunk compileRegisters(ProgramNode* program);
     const std::vector<Function>& getFunctions() const { return functionTable; }
+    std::vector<Function>& getFunctions() { return functionTable; }
+    // Slot of a top-level variable, for VM::getGlobal/setGlobal, or -1
+    int globalSlot(const std::string& name) const;
     void loadStandardLibrary(const std::string& libName);
     bool isObfuscated() const { return obfuscate; }
     void saveBytecode(const std::string& filename, const Chunk& chunk);
     Chunk loadBytecode(const std::string& filename);
     void enableOptimizations(bool enable) { optimizationsEnabled = enable; }
-    void enablePeephole(bool enable) { optimizationsEnabled = enable; }
+    void enablePeephole(bool enable) { peepholeEnabled = enable; }
+    // Instructions the peephole pass removed from the chunks compile() made
+    int peepholeRemovedCount() const { return peepholeRemoved; }
+    // compile() and compileRegisters() print each function's IR to stdout,
+    // before and after the passes
+    void enableIRDump(bool enable) { irDump = enable; }
 };
 
 #endif
@@ -0,0 +1,174 @@
+#ifndef IR_H
+#define IR_H
+
+#include "bytecode.h"
+#include "value.h"
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Mid-level SSA form between the AST and bytecode. Compiler::compile builds
+// it per function (ir_builder.cpp), runs the pass pipeline over it
+// (ir_passes.cpp) and lowers the result to stack VM code (ir_codegen.cpp);
+// Compiler::compileRegisters lowers the same optimized form to register VM
+// code (ir_register_codegen.cpp).
+//
+// Function locals are SSA values: every assignment defines a new value and
+// control-flow merges get phis. Globals stay memory, read and written with
+// LOAD_GLOBAL/STORE_GLOBAL, since called functions read them.
+
+enum class IROp {
+    // Values
+    CONST,          // constant
+    ENTRY,          // frame slot index as the function was entered
+    PHI,            // one argument per predecessor, in the same order
+    COPY,           // args[0] assigned to a local; removed by copy propagation
+    LOAD_GLOBAL,    // globals[index]
+    ADD,
+    SUBTRACT,
+    MULTIPLY,
+    DIVIDE,
+    LESS,
+    GREATER,
+    LESS_EQUAL,
+    GREATER_EQUAL,
+    EQUAL,
+    NOT_EQUAL,
+    NEGATE,
+    NOT,
+    ARRAY,          // elements
+    HASHMAP,        // key, value, key, value...
+    INDEX_GET,      // container, index
+    GET_FIELD,      // container; constant is the key
+    CALL,           // arguments; index is the function id
+    CALL_NATIVE,    // arguments; index is the native id
+    // Effects
+    STORE_GLOBAL,   // globals[index] = args[0]
+    INDEX_SET,      // container, index, value
+    SET_FIELD,      // container, value; constant is the key
+    PRINT,          // arguments
+    // Terminators, exactly one at the end of every block
+    JUMP,           // to succs[0]
+    BRANCH,         // to succs[0] if args[0] is truthy, else succs[1]
+    RETURN,
+    TAIL_CALL,      // arguments; index is the function id
+    HALT,
+    BREAK,          // break outside a loop, an error when reached
+    CONTINUE
+};
+
+struct IRBlock;
+
+struct IRInstr {
+    IROp op;
+    int id;                          // dense per function, %id in dumps
+    std::vector<IRInstr*> args;
+    Value constant;                  // CONST value, GET_FIELD/SET_FIELD key
+    int index = 0;
+    IRBlock* block = nullptr;
+    const std::string* name = nullptr;  // variable or callee, for dumps
+    // Set by a pass that makes this instruction redundant; uses are
+    // rewritten and the instruction dropped by applyReplacements()
+    IRInstr* replacement = nullptr;
+
+    IRInstr(IROp op, int id) : op(op), id(id) {}
+};
+
+struct IRBlock {
+    int id;
+    std::vector<IRInstr*> instrs;    // phis first, terminator last
+    std::vector<IRBlock*> preds;
+    std::vector<IRBlock*> succs;
+    IRBlock* idom = nullptr;         // set by computeDominators()
+
+    explicit IRBlock(int id) : id(id) {}
+    IRInstr* terminator() const { return instrs.empty() ? nullptr : instrs.back(); }
+};
+
+struct IRFunction {
+    std::string name;                // "main" for the top level
+    int arity = 0;
+    bool isMain = false;
+    std::vector<IRBlock*> blocks;    // layout order; blocks[0] is the entry
+    int instrCount = 0;              // ids handed out so far
+    int blockCount = 0;
+
+    IRBlock* newBlock();
+    IRInstr* newInstr(IROp op);
+    size_t size() const;             // live instructions
+
+private:
+    std::vector<std::unique_ptr<IRBlock>> blockPool;
+    std::vector<std::unique_ptr<IRInstr>> instrPool;
+};
+
+// The main program and every function it defines, by function table id
+struct IRProgram {
+    std::unique_ptr<IRFunction> main;
+    std::vector<std::unique_ptr<IRFunction>> functions;
+};
+
+bool isTerminator(IROp op);
+// Instructions that must run even when their result is unused
+bool hasSideEffects(IROp op);
+bool producesValue(IROp op);
+const char* irOpName(IROp op);
+// Evaluates op on constant operands the way the VMs would (index is the
+// native id of a CALL_NATIVE). False when the result is left to run time:
+// impure natives, division by zero, operands the op does not take.
+bool foldConstant(IROp op, int index, const std::vector<Value>& args, Value& result);
+
+void addEdge(IRBlock* from, IRBlock* to);
+// Follows replacement links to the instruction that stands for instr now
+IRInstr* resolve(IRInstr* instr);
+// Points every use at its replacement and drops replaced instructions
+void applyReplacements(IRFunction& fn);
+// Drops blocks the entry cannot reach, and their phi arguments. Returns the
+// number of instructions removed.
+int removeUnreachableBlocks(IRFunction& fn);
+// Fills IRBlock::idom (the entry's is itself) and returns the blocks in
+// reverse postorder. Expects unreachable blocks to be gone.
+std::vector<IRBlock*> computeDominators(IRFunction& fn);
+
+void printIR(std::ostream& out, const IRFunction& fn);
+
+// A pass returns the number of instructions it removed, for --dump-ir
+struct IRPass {
+    const char* name;
+    std::function<int(IRFunction& fn)> run;
+};
+
+class IRPassManager {
+private:
+    std::vector<IRPass> passes;
+    std::ostream* log;
+
+public:
+    explicit IRPassManager(std::ostream* log = nullptr) : log(log) {}
+    void add(const char* name, std::function<int(IRFunction& fn)> run) { passes.push_back({name, std::move(run)}); }
+    // Unreachable blocks go first, so every pass sees a connected CFG
+    void run(IRFunction& fn);
+};
+
+// Passes, in ir_passes.cpp
+int propagateCopies(IRFunction& fn);       // COPY and trivial phis
+int propagateConstants(IRFunction& fn);    // folds values and branches (SCCP)
+int numberValues(IRFunction& fn);          // global value numbering / CSE
+int eliminateDeadCode(IRFunction& fn);
+// Replaces loads of globals the program only ever sets to one constant.
+// Runs over every function at once, so it goes in main's pipeline: the
+// functions are lowered after main.
+int propagateGlobalConstants(IRProgram& program);
+
+// Lowers fn to stack VM bytecode in chunk. Without optimize, no
+// superinstructions are selected.
+void lowerToStackCode(IRFunction& fn, Chunk& chunk, bool optimize);
+// Lowers fn to register VM code in chunk (ir_register_codegen.cpp). Main
+// must come first: it keeps the program's globalCount top-level variables
+// in its frame, and sets frameGlobals to how many of them live there for
+// the functions that read them.
+void lowerToRegisterCode(IRFunction& fn, Chunk& chunk, int globalCount, int& frameGlobals);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "bytecode.h"
+#include "compiler.h"
+#include "value.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class VM;
+struct JitState;
+
+// Baseline JIT for the stack VM (--jit). Every chunk of a program is
+// translated up front into x86-64 machine code, one template per
+// instruction. The value stack stays in memory, numbers take inline fast
+// paths and everything else calls out-of-line helpers built on the shared
+// runtime. Script calls switch between chunks through a private frame stack
+// rather than the machine stack, so recursion has the interpreter's limits.
+class Jit : public GCRoots {
+private:
+    VM& vm;
+    uint8_t* code;
+    size_t codeSize;
+    size_t entryOffset;
+    size_t mainOffset;
+    JitState* state;  // set while run() is executing
+
+public:
+    // True on x86-64 Linux and macOS
+    static bool supported();
+
+    explicit Jit(VM& vm);
+    ~Jit();
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+
+    // Translates the program; false when it contains an instruction the JIT
+    // does not handle, in which case the caller interprets it instead
+    bool compile(Chunk& mainChunk, std::vector<Function>& functions);
+    // Runs the compiled program, throwing the interpreter's errors
+    void run();
+    void markRoots(Heap& heap) override;
+};
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef NATIVE_H
+#define NATIVE_H
+
+#include "value.h"
+#include <string>
+#include <vector>
+
+// C++ functions callable from scripts. The built-ins come first; a host
+// embedding the VM appends its own with registerNative. The compilers resolve
+// a call to its index in the table, and the VMs pass the arguments as a
+// pointer into their stack or register window, so a call neither looks up a
+// name nor copies its arguments. userdata is the pointer the function was
+// registered with, for hosts whose functions need state of their own.
+typedef Value (*NativeFn)(const Value* args, int argc, void* userdata);
+
+struct NativeFunction {
+    std::string name;
+    NativeFn fn;
+    int arity;  // -1 when fn checks argc itself
+    // The result depends only on the arguments and the call has no other
+    // effect, so the compiler may evaluate calls with constant arguments
+    bool pure = false;
+    void* userdata = nullptr;  // passed to every call of fn
+};
+
+// Every native indexed by id. Register functions before compiling and running
+// scripts: ids are baked into the bytecode and the VMs keep a pointer to the
+// table while they run.
+const std::vector<NativeFunction>& nativeTable();
+
+// Makes fn callable from scripts as name(...) with exactly arity arguments,
+// which the compiler checks, so fn may read args[0] to args[arity - 1]
+// without checking argc. The pointer is only valid during the call. fn may
+// allocate (the collector only runs between instructions). Pass pure only
+// when fn reads nothing but its arguments, changes nothing and never
+// throws. Every call gets userdata, which the host keeps alive while
+// scripts run. Throws if the name is taken; returns the new id.
+int registerNative(const std::string& name, int arity, NativeFn fn, bool pure = false,
+                   void* userdata = nullptr);
+
+// Id of the native called name, or -1. Throws when a fixed-arity native is
+// called with the wrong number of arguments.
+int resolveNative(const std::string& name, int argc);
+
+#endif
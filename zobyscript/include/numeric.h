@@ -0,0 +1,14 @@
+#ifndef NUMERIC_H
+#define NUMERIC_H
+
+#include "value.h"
+
+// Reductions behind the sum/mean/min/max/dot builtins. Packed arrays run the
+// AVX2 kernels when the CPU has them; mixed arrays take a scalar loop that
+// skips non-number elements.
+double arraySum(const ObjArray* arr);
+bool arrayMin(const ObjArray* arr, double& result);  // false if there are no numbers
+bool arrayMax(const ObjArray* arr, double& result);
+double arrayDot(const ObjArray* a, const ObjArray* b);  // over the shorter length
+
+#endif
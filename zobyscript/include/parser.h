@@ -3,41 +3,46 @@
 
 #include "lexer.h"
 #include "ast.h"
+#include "arena.h"
 #include <vector>
-#include <memory>
 
+// Builds the tree into the caller's Arena, which must outlive it. The token
+// vector is borrowed, not copied, and is not needed after parse() returns.
 class Parser {
 private:
-    std::vector<Token> tokens;
+    const std::vector<Token>& tokens;
     size_t position;
+    Arena& arena;
+    std::vector<ASTNode*> scratch;  // children of the lists being parsed, innermost last
 
-    Token& current();
-    Token& peek();
+    const Token& current();
+    const Token& peek();
     bool match(TokenType type);
     void consume(TokenType type, const std::string& message);
+    ArenaList<ASTNode*> finishList(size_t start);
     
-    std::unique_ptr<ASTNode> parseExpression();
-    std::unique_ptr<ASTNode> parseTerm();
-    std::unique_ptr<ASTNode> parseFactor();
-    std::unique_ptr<ASTNode> parseUnary();
-    std::unique_ptr<ASTNode> parseStatement();
-    std::unique_ptr<ASTNode> parseAssignment();
-    std::unique_ptr<ASTNode> parseFunctionCall();
-    std::unique_ptr<ASTNode> parseFunctionDef();
-    std::unique_ptr<ASTNode> parseReturn();
-    std::unique_ptr<ASTNode> parseBlock();
-    std::unique_ptr<ASTNode> parseIfStatement();
-    std::unique_ptr<ASTNode> parseWhileStatement();
-    std::unique_ptr<ASTNode> parseForStatement();
-    std::unique_ptr<ASTNode> parseUseStatement();
-    std::unique_ptr<ASTNode> parseArray();
-    std::unique_ptr<ASTNode> parseComparison();
-    std::unique_ptr<ASTNode> parseLogicalOr();
-    std::unique_ptr<ASTNode> parseLogicalAnd();
+    ASTNode* parseExpression();
+    ASTNode* parseTerm();
+    ASTNode* parseFactor();
+    ASTNode* parseUnary();
+    ASTNode* parseStatement();
+    ASTNode* parseAssignment();
+    ASTNode* parseFunctionCall();
+    ASTNode* parseFunctionDef();
+    ASTNode* parseReturn();
+    ASTNode* parseBlock();
+    ASTNode* parseIfStatement();
+    ASTNode* parseWhileStatement();
+    ASTNode* parseForStatement();
+    ASTNode* parseUseStatement();
+    ASTNode* parseArray();
+    ASTNode* parseComparison();
+    ASTNode* parseLogicalOr();
+    ASTNode* parseLogicalAnd();
 
 public:
-    Parser(const std::vector<Token>& toks);
-    std::unique_ptr<ProgramNode> parse();
+    Parser(const std::vector<Token>& toks, Arena& arena);
+    ProgramNode* parse();
 };
 
 #endif
@@ -2,72 +2,119 @@
 #define REGISTER_VM_H
 
 #include "bytecode.h"
+#include "compiler.h"
 #include <vector>
 #include <string>
 
-// Register-based opcodes (3-5x faster than stack)
+// Register-based opcodes, produced by Compiler::compileRegisters. Operands
+// are one byte (registers are frame-relative, K indexes the chunk's
+// constants) except jump offsets, which are signed 16-bit and relative to
+// the end of the instruction, and the 24-bit Bx of the _WIDE forms. Top-level
+// variables live in registers of the main frame, so script-level loops need
+// no global loads or stores; those that do not fit beside main's own values
+// are spilled to a separate array, sized by the main chunk's globalCount.
 enum class RegOpCode : uint8_t {
-    // Arithmetic: dest = src1 op src2
-    REG_ADD,      // R[A] = R[B] + R[C]
-    REG_SUB,      // R[A] = R[B] - R[C]
-    REG_MUL,      // R[A] = R[B] * R[C]
-    REG_DIV,      // R[A] = R[B] / R[C]
-    
-    // Fast integer arithmetic
-    REG_ADDI,     // R[A] = R[B] + C (immediate)
-    REG_SUBI,     // R[A] = R[B] - C
-    REG_MULI,     // R[A] = R[B] * C
-    
     // Load/Store
-    REG_LOADK,    // R[A] = K[B] (constant)
-    REG_LOAD0,    // R[A] = 0
-    REG_LOAD1,    // R[A] = 1
-    REG_MOVE,     // R[A] = R[B]
-    
+    REG_MOVE,      // R[A] = R[B]
+    REG_LOADK,     // R[A] = K[B]
+    REG_GETGLOBAL, // R[A] = main frame R[B]
+    REG_LOADK_WIDE,     // R[A] = K[Bx]
+    REG_GETGLOBAL_WIDE, // R[A] = spilled globals[Bx]
+    REG_SETGLOBAL_WIDE, // spilled globals[Bx] = R[A]
+
+    // Arithmetic: dest = src1 op src2
+    REG_ADD,       // R[A] = R[B] + R[C]
+    REG_SUB,       // R[A] = R[B] - R[C]
+    REG_MUL,       // R[A] = R[B] * R[C]
+    REG_DIV,       // R[A] = R[B] / R[C]
+    REG_ADDK,      // R[A] = R[B] + K[C]
+    REG_SUBK,      // R[A] = R[B] - K[C]
+    REG_MULK,      // R[A] = R[B] * K[C]
+    REG_DIVK,      // R[A] = R[B] / K[C]
+    REG_NEG,       // R[A] = -R[B]
+    REG_NOT,       // R[A] = !R[B]
+
     // Comparisons
-    REG_LT,       // R[A] = R[B] < R[C]
-    REG_LE,       // R[A] = R[B] <= R[C]
-    REG_EQ,       // R[A] = R[B] == R[C]
-    
+    REG_LT,        // R[A] = R[B] < R[C]
+    REG_LE,        // R[A] = R[B] <= R[C]
+    REG_GT,        // R[A] = R[B] > R[C]
+    REG_GE,        // R[A] = R[B] >= R[C]
+    REG_EQ,        // R[A] = R[B] == R[C]
+    REG_NE,        // R[A] = R[B] != R[C]
+
     // Jumps
-    REG_JMP,      // PC += offset
-    REG_JMPF,     // if !R[A] then PC += offset
-    REG_JMPT,     // if R[A] then PC += offset
-    
+    REG_JMP,       // PC += offset
+    REG_JMPF,      // if !R[A] then PC += offset
+    REG_JMPT,      // if R[A] then PC += offset
+    REG_JNLT,      // if !(R[A] < R[B]) then PC += offset
+    REG_JNLE,      // if !(R[A] <= R[B]) then PC += offset
+    REG_JNGT,      // if !(R[A] > R[B]) then PC += offset
+    REG_JNGE,      // if !(R[A] >= R[B]) then PC += offset
+    REG_JNLTK,     // if !(R[A] < K[B]) then PC += offset
+    REG_JNLEK,     // if !(R[A] <= K[B]) then PC += offset
+    REG_JNGTK,     // if !(R[A] > K[B]) then PC += offset
+    REG_JNGEK,     // if !(R[A] >= K[B]) then PC += offset
+
+    // Arrays and maps
+    REG_NEWARRAY,  // R[A] = [R[B] ... R[B+C-1]]
+    REG_NEWMAP,    // R[A] = {R[B]: R[B+1], ...} with C pairs
+    REG_APPEND,    // append R[B] ... R[B+C-1] to the array R[A]
+    REG_GETINDEX,  // R[A] = R[B][R[C]]
+    REG_SETINDEX,  // R[A][R[B]] = R[C]
+    REG_GETFIELD,  // R[A] = R[B][K[C]], inline cache fieldCaches[D]
+    REG_SETFIELD,  // R[A][K[B]] = R[C], inline cache fieldCaches[D]
+
     // Function calls
-    REG_CALL,     // R[A] = func(R[B]...R[B+C])
-    REG_RET,      // return R[A]
-    
-    // Global access
-    REG_GETGLOBAL, // R[A] = globals[B]
-    REG_SETGLOBAL, // globals[A] = R[B]
-    
+    REG_ENTER,     // first instruction of a chunk: frame uses A registers
+    REG_CALL,      // R[A] = functions[B](R[C] ... R[C+D-1])
+    REG_TAILCALL,  // return functions[A](R[B] ... R[B+C-1]), reusing the frame
+    REG_BUILTIN,   // R[A] = nativeTable()[B](R[C] ... R[C+D-1])
+    REG_RET,       // return R[A]
+    REG_CALL_WIDE,     // REG_CALL with a 24-bit function id Bx
+    REG_TAILCALL_WIDE, // REG_TAILCALL with a 24-bit function id Ax
+    REG_BUILTIN_WIDE,  // REG_BUILTIN with a 24-bit native id Bx
+
     // Print/Misc
-    REG_PRINT,
+    REG_PRINT,     // print(R[A] ... R[A+B-1])
+    REG_PRINTPART, // the same without ending the line, for long prints
+    REG_BREAK,
+    REG_CONTINUE,
     REG_HALT
 };
 
+// Caller state saved by REG_CALL and restored by REG_RET
 struct RegisterFrame {
-    std::vector<Value> registers;  // Local registers (fast!)
-    int pc;
-    int returnReg;
-    
-    RegisterFrame(int size = 256) : registers(size), pc(0), returnReg(0) {}
+    const Chunk* chunk;
+    const uint8_t* returnPC;
+    Value* base;
+    Value* top;
+    uint8_t returnReg;
 };
 
-class RegisterVM {
+// Each call's registers are a window of one flat register file. A callee's
+// window starts at the caller's first argument register, so arguments are
+// passed without copying.
+class RegisterVM : public GCRoots {
 private:
-    std::vector<Value> globals;
-    std::vector<RegisterFrame> callStack;
-    RegisterFrame* currentFrame;
+    std::vector<Value> registers;
+    Value* registersEnd;
+    Value* top;  // one past the current frame's last register
+    std::vector<RegisterFrame> frames;
+    std::vector<Value> spilledGlobals;  // top-level variables main has no register for
+    size_t maxFrames;
     const std::vector<Function>* functions;
-    
-    Value& R(int idx) { return currentFrame->registers[idx]; }
-    
+    const Chunk* mainChunk;
+
+    void collectIfNeeded() { if (Heap::instance().shouldCollect()) Heap::instance().collect(); }
+    void execute(const Chunk& entry);
+
 public:
-    RegisterVM();
+    static const size_t DEFAULT_REGISTER_SLOTS = 256 * 1024;
+
+    explicit RegisterVM(size_t registerSlots = DEFAULT_REGISTER_SLOTS);
+    ~RegisterVM();
     void run(const Chunk& mainChunk, const std::vector<Function>& funcs);
-    Value callBuiltin(const std::string& name, const std::vector<Value>& args);
+    void markRoots(Heap& heap) override;
 };
 
 #endif
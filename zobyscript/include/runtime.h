@@ -0,0 +1,34 @@
+#ifndef RUNTIME_H
+#define RUNTIME_H
+
+#include "value.h"
+
+// Language semantics shared by the stack and register engines, so both
+// produce the same results for the same program. Helpers that allocate may
+// leave garbage behind; callers run the collector at their own safe points.
+
+bool isTruthy(const Value& value);
+
+// Arithmetic and comparison operand: anything that is not a number counts
+// as 0, so null, booleans and strings never reach the FPU as NaN boxes
+inline double toNumber(const Value& value) { return value.isNumber() ? value.asNumber() : 0; }
+
+// OP_ADD semantics: numbers add, anything involving a string concatenates
+Value addValues(const Value& a, const Value& b);
+bool valuesEqual(const Value& a, const Value& b);
+
+// array[index], map[key] and string[index]; out-of-range reads give 0 for
+// arrays and "" for strings
+Value indexGet(const Value& container, const Value& index);
+void indexSet(const Value& container, const Value& index, const Value& value);
+
+// indexGet/indexSet for a string constant key. A hashmap whose shape matches
+// the cache is a load from the cached entry; otherwise the key is looked up
+// and the cache refilled from the map's shape.
+Value getField(const Value& container, const Value& key, FieldCache& cache);
+void setField(const Value& container, const Value& key, const Value& value, FieldCache& cache);
+
+// Writes values space-separated on one line, as print() does
+void printValues(const Value* values, int count, bool endLine = true);
+
+#endif
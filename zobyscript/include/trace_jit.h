@@ -0,0 +1,55 @@
+#ifndef TRACE_JIT_H
+#define TRACE_JIT_H
+
+#include "bytecode.h"
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+
+class VM;
+struct Trace;
+
+// Trace JIT for the stack VM (--jit=trace). The interpreter counts loop
+// back-edges; once a loop is hot, one iteration runs under a recording
+// interpreter that logs each instruction, the direction of every branch
+// and the variables touched. The trace is compiled to native code that
+// keeps each of those variables unboxed in an xmm register for as long as
+// it loops. Type guards run once on entry, since the trace only ever
+// stores numbers; branch guards leave through side exits that write the
+// registers back and resume the interpreter. An exit that keeps firing is
+// recorded too and compiled into the same code as a side trace.
+class TraceJit {
+public:
+    static const int HOT_LOOP = 56;   // back-edges before a loop is recorded
+    static const int HOT_EXIT = 8;    // side exits before one is recorded
+    static const int HOT_SLOTS = 64;  // back-edge counters, hashed by address
+
+private:
+    uint16_t hotCounts[HOT_SLOTS];
+    std::unordered_map<const uint8_t*, std::unique_ptr<Trace>> traces;  // by back-edge jump
+    std::unordered_set<const uint8_t*> blacklist;                        // loops that failed to trace
+
+public:
+    TraceJit();
+    ~TraceJit();
+    TraceJit(const TraceJit&) = delete;
+    TraceJit& operator=(const TraceJit&) = delete;
+
+    // Called on every backward OP_JUMP; true once its loop is hot
+    bool countBackEdge(const uint8_t* jump) {
+        uint16_t& count = hotCounts[(reinterpret_cast<uintptr_t>(jump) >> 2) % HOT_SLOTS];
+        if (--count != 0) return false;
+        count = HOT_LOOP;
+        return true;
+    }
+    // Records the next iteration of the loop that jump closes, executing it
+    // on the VM, and returns where the interpreter resumes. A compiled loop
+    // has its jump rewritten to OP_LOOP_TRACE.
+    uint8_t* recordLoop(VM& vm, Chunk& chunk, uint8_t* jump, uint8_t* header);
+    // Runs the trace behind an OP_LOOP_TRACE and returns where the
+    // interpreter resumes
+    uint8_t* enter(VM& vm, Chunk& chunk, uint8_t* jump, uint8_t* header);
+};
+
+#endif
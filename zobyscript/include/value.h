@@ -0,0 +1,296 @@
+#ifndef VALUE_H
+#define VALUE_H
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <unordered_map>
+
+struct Obj;
+struct ObjString;
+struct ObjRope;
+struct ObjArray;
+struct ObjHashMap;
+
+enum class ObjType : uint8_t {
+    STRING,
+    ROPE,
+    ARRAY,
+    HASHMAP
+};
+
+// 8-byte NaN-boxed value. Numbers are stored as plain doubles; null, booleans
+// and heap object pointers live in the payload of a quiet NaN.
+class Value {
+public:
+    // Tag layout, public for the JIT, which tests raw bits in machine code
+    static constexpr uint64_t SIGN_BIT = 0x8000000000000000ULL;
+    static constexpr uint64_t QNAN = 0x7ffc000000000000ULL;
+    static constexpr uint64_t TAG_NULL = 1;
+    static constexpr uint64_t TAG_FALSE = 2;
+    static constexpr uint64_t TAG_TRUE = 3;
+    // The only NaN a Value holds; compiled code stores it for NaN results
+    static constexpr uint64_t CANONICAL_NAN = 0x7ff8000000000000ULL;
+
+private:
+    uint64_t bits;
+
+public:
+    enum Type { NUMBER, STRING, BOOLEAN, ARRAY, HASHMAP, NULLVAL };
+
+    Value() : bits(0) {}
+    // Every NaN is stored as the one canonical quiet NaN, so no arithmetic
+    // result can alias a tag or pointer payload
+    Value(double n) {
+        std::memcpy(&bits, &n, sizeof(double));
+        if (n != n) bits = CANONICAL_NAN;
+    }
+    Value(bool b) : bits(QNAN | (b ? TAG_TRUE : TAG_FALSE)) {}
+    Value(Obj* obj) : bits(SIGN_BIT | QNAN | static_cast<uint64_t>(reinterpret_cast<uintptr_t>(obj))) {}
+    Value(const char*) = delete;  // would silently become a boolean
+    static Value Null() { Value v; v.bits = QNAN | TAG_NULL; return v; }
+
+    bool isNumber() const { return (bits & QNAN) != QNAN; }
+    bool isBool() const { return (bits | 1) == (QNAN | TAG_TRUE); }
+    bool isNull() const { return bits == (QNAN | TAG_NULL); }
+    bool isObj() const { return (bits & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT); }
+    inline bool isString() const;
+    inline bool isArray() const;
+    inline bool isHashMap() const;
+
+    double asNumber() const { double n; std::memcpy(&n, &bits, sizeof(double)); return n; }
+    bool asBool() const { return bits == (QNAN | TAG_TRUE); }
+    Obj* asObj() const { return reinterpret_cast<Obj*>(static_cast<uintptr_t>(bits & ~(SIGN_BIT | QNAN))); }
+    inline ObjString* asString() const;  // flattens ropes
+    inline size_t stringLength() const;
+    ObjArray* asArray() const { return reinterpret_cast<ObjArray*>(asObj()); }
+    ObjHashMap* asHashMap() const { return reinterpret_cast<ObjHashMap*>(asObj()); }
+
+    inline Type type() const;
+    uint64_t raw() const { return bits; }
+};
+
+static_assert(sizeof(Value) == 8, "Value must stay NaN-boxed");
+
+struct Obj {
+    ObjType type;
+    bool marked;
+    Obj* next;
+    Obj(ObjType t) : type(t), marked(false), next(nullptr) {}
+};
+
+// Strings are immutable and interned, so two equal strings are always the
+// same object and equality is a pointer compare.
+struct ObjString : Obj {
+    const std::string chars;
+    const uint32_t hash;
+    ObjString(std::string s, uint32_t h) : Obj(ObjType::STRING), chars(std::move(s)), hash(h) {}
+};
+
+// Lazy concatenation produced by OP_ADD for long strings. Children are
+// ObjString or ObjRope; the rope is flattened into an interned string the
+// first time something needs contiguous bytes.
+struct ObjRope : Obj {
+    Obj* left;
+    Obj* right;
+    size_t length;
+    ObjString* flat;
+    ObjRope(Obj* l, Obj* r, size_t len) : Obj(ObjType::ROPE), left(l), right(r), length(len), flat(nullptr) {}
+};
+
+// While every element is a number the buffer is a packed float64 array (a
+// number Value is its own IEEE bits), which the numeric builtins reduce
+// directly and the collector skips. Mutate through push/pop/set/assign so
+// nonNumbers stays exact; reading elements directly is fine.
+struct ObjArray : Obj {
+    std::vector<Value> elements;
+    size_t nonNumbers;
+
+    ObjArray() : Obj(ObjType::ARRAY), nonNumbers(0) {}
+    bool isPacked() const { return nonNumbers == 0; }
+
+    void push(Value value) {
+        elements.push_back(value);
+        if (!value.isNumber()) nonNumbers++;
+    }
+    Value pop() {
+        Value value = elements.back();
+        elements.pop_back();
+        if (!value.isNumber()) nonNumbers--;
+        return value;
+    }
+    void set(size_t idx, Value value) {
+        if (!elements[idx].isNumber()) nonNumbers--;
+        if (!value.isNumber()) nonNumbers++;
+        elements[idx] = value;
+    }
+    template <typename It>
+    void assign(It first, It last) {
+        elements.assign(first, last);
+        nonNumbers = 0;
+        for (const Value& v : elements) {
+            if (!v.isNumber()) nonNumbers++;
+        }
+    }
+};
+
+// Hidden class of a hashmap used as a record: the sequence of string keys
+// it was built with. Maps that get the same keys in the same order share a
+// Shape, so a key's entry index can be cached against it. Shapes form a
+// transition tree from empty() and are never freed. A non-string key, or a
+// map or tree past the limits, moves the map to dictionary() for good.
+struct Shape {
+    static const uint32_t MAX_KEYS = 64;
+    static const size_t MAX_SHAPES = 4096;
+
+    uint32_t keyCount;
+    std::unordered_map<uint64_t, Shape*> transitions;  // by interned key bits
+
+    explicit Shape(uint32_t count) : keyCount(count) {}
+    static Shape* empty();
+    static Shape* dictionary();
+    // Shape after appending key (already normalized) to a map of this shape
+    Shape* withKey(Value key);
+};
+
+// Monomorphic inline cache of one constant-key access site: maps of this
+// shape hold the key at entries[index]
+struct FieldCache {
+    const Shape* shape;
+    uint32_t index;
+    FieldCache() : shape(nullptr), index(0) {}
+};
+
+// Open-addressing table in the Swiss-table style: one control byte per slot
+// holding 7 bits of the hash, probed 16 slots at a time. Slots index into a
+// dense entry array, which keeps insertion order for keys()/values().
+// Keys are strings (interned, so compared by pointer) or numbers. Keys are
+// never removed, so a map's shape only changes when set() appends one.
+struct ObjHashMap : Obj {
+    struct Entry {
+        Value key;
+        Value value;
+    };
+
+    std::vector<Entry> entries;
+    std::vector<int8_t> control;
+    std::vector<uint32_t> slots;
+    Shape* shape;
+
+    ObjHashMap() : Obj(ObjType::HASHMAP), shape(Shape::empty()) {}
+    const Value* get(Value key) const;
+    void set(Value key, Value value);
+    // Entry index of key, or -1
+    int find(Value key) const;
+
+private:
+    size_t findSlot(Value key, uint64_t hash) const;
+    void insertSlot(uint32_t entryIdx, uint64_t hash);
+    void rehash(size_t capacity);
+};
+
+bool Value::isString() const {
+    return isObj() && (asObj()->type == ObjType::STRING || asObj()->type == ObjType::ROPE);
+}
+bool Value::isArray() const { return isObj() && asObj()->type == ObjType::ARRAY; }
+bool Value::isHashMap() const { return isObj() && asObj()->type == ObjType::HASHMAP; }
+
+Value::Type Value::type() const {
+    if (isNumber()) return NUMBER;
+    if (isObj()) {
+        switch (asObj()->type) {
+            case ObjType::STRING:
+            case ObjType::ROPE: return STRING;
+            case ObjType::ARRAY: return ARRAY;
+            case ObjType::HASHMAP: return HASHMAP;
+        }
+    }
+    if (isNull()) return NULLVAL;
+    return BOOLEAN;
+}
+
+class Heap;
+
+uint32_t hashString(const char* chars, size_t length);
+
+// Weak set of every live string, keyed by contents. Entries for strings the
+// collector is about to free are dropped before the sweep.
+class StringTable {
+private:
+    std::vector<ObjString*> slots;
+    size_t used;  // live entries plus tombstones
+
+    void grow();
+
+public:
+    StringTable() : used(0) {}
+    ObjString* find(const std::string& chars, uint32_t hash) const;
+    void insert(ObjString* str);
+    void removeUnmarked();
+};
+
+// Anything that holds Values outside the heap (VM stacks, globals, constant
+// pools) registers itself so the collector can mark from it.
+class GCRoots {
+public:
+    virtual ~GCRoots() = default;
+    virtual void markRoots(Heap& heap) = 0;
+};
+
+// Owns every heap object. Objects are linked into a single list and reclaimed
+// by a mark-and-sweep collection once the allocated size crosses nextGC.
+class Heap {
+private:
+    Obj* objects;
+    size_t bytesAllocated;
+    size_t nextGC;
+    std::vector<Obj*> grayStack;
+    std::vector<GCRoots*> roots;
+    StringTable strings;
+
+    void link(Obj* obj, size_t size);
+    void freeObject(Obj* obj);
+    size_t objectSize(Obj* obj) const;
+    void blacken(Obj* obj);
+    void sweep();
+
+public:
+    Heap();
+    ~Heap();
+    static Heap& instance();
+
+    ObjString* newString(std::string chars);  // returns the interned copy
+    Obj* concatenate(Obj* left, Obj* right);  // ObjString or ObjRope operands
+    ObjString* flatten(ObjRope* rope);
+    ObjArray* newArray();
+    ObjHashMap* newHashMap();
+
+    void addRoots(GCRoots* root);
+    void removeRoots(GCRoots* root);
+    void markObject(Obj* obj);
+    void markValue(Value value) { if (value.isObj()) markObject(value.asObj()); }
+    void markValues(const std::vector<Value>& values) { for (const Value& v : values) markValue(v); }
+
+    // Only call at points where every live Value is reachable from a root.
+    bool shouldCollect() const { return bytesAllocated > nextGC; }
+    void collect();
+    size_t allocated() const { return bytesAllocated; }
+};
+
+ObjString* Value::asString() const {
+    Obj* obj = asObj();
+    if (obj->type == ObjType::ROPE) return Heap::instance().flatten(static_cast<ObjRope*>(obj));
+    return static_cast<ObjString*>(obj);
+}
+
+size_t Value::stringLength() const {
+    Obj* obj = asObj();
+    if (obj->type == ObjType::ROPE) return static_cast<ObjRope*>(obj)->length;
+    return static_cast<ObjString*>(obj)->chars.size();
+}
+
+inline Value makeString(std::string chars) { return Value(Heap::instance().newString(std::move(chars))); }
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef VERIFIER_H
+#define VERIFIER_H
+
+#include "bytecode.h"
+#include "compiler.h"
+#include <string>
+#include <vector>
+
+// Load-time checks for stack VM bytecode. Every chunk is decoded and its
+// control flow walked once, proving that instructions and jump targets are
+// well formed, that constant, global, local, field cache, function and
+// native operands are in range, that no path runs off the end of the code,
+// and that the stack depth agrees wherever paths meet and never drops below
+// the frame. Each chunk's deepest stack use is recorded in Chunk::maxStack,
+// which lets the VM check for overflow once per frame instead of on every
+// push.
+//
+// Returns false with the reason in error (when given) for the first
+// problem found. Chunks may already hold quickened instructions. On success
+// globalsUsed (when given) is 1 + the highest global index any instruction
+// names.
+bool verifyProgram(Chunk& mainChunk, std::vector<Function>& functions, std::string* error = nullptr,
+                   uint32_t* globalsUsed = nullptr);
+
+// Instruction shapes, shared with the peephole optimizer
+int operandCount(OpCode op);  // index/count operands; -1 if not executable
+bool isJump(OpCode op);       // followed by a 16-bit offset
+bool endsPath(OpCode op);
+
+#endif
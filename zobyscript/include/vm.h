@@ -6,30 +6,43 @@
 #include <vector>
 #include <map>
 #include <string>
+#include <memory>
 
+class TraceJit;
+
+// Caller state saved by OP_CALL and restored by OP_RET
 struct CallFrame {
-    int returnIP;
-    int basePointer;
-    int functionId;
+    Chunk* chunk;
+    uint8_t* returnIP;
+    Value* basePointer;
 };
 
-struct InlineCache {
-    int globalIdx;
-    Value cachedValue;
-    bool valid;
-    InlineCache() : globalIdx(-1), valid(false) {}
-};
+class VM : public GCRoots {
+    friend class Jit;  // runs on the VM's stack and globals
+    friend class TraceJit;
+
+public:
+    static const size_t DEFAULT_STACK_SLOTS = 256 * 1024;
 
-class VM {
 private:
+    // Fixed-size value stack; sp points one past the top. Calls never
+    // recurse in C++, so depth is bounded by this size alone.
     std::vector<Value> stack;
-    std::vector<CallFrame> callStack;
-    std::vector<Value> globals;  // Changed from map to vector for O(1) access
-    std::vector<InlineCache> globalCaches;
-    const std::vector<Function>* functions;
-    int ip;
-    int bp;
+    Value* sp;
+    Value* stackEnd;
+    std::vector<CallFrame> frames;
+    size_t maxFrames;
+    // One slot per top-level variable, sized when run() links the program
+    // and never moved while it executes, so instructions index it directly
+    std::vector<Value> globals;
+    uint64_t globalsVersion;
+    std::vector<Function>* functions;
+    const Chunk* mainChunk;
+    Value* bp;
     bool optimizationsEnabled;
+    bool jitEnabled;
+    bool running;  // inside run(), where globals must not grow
+    std::unique_ptr<TraceJit> tracer;  // set when loops are traced
     
     // Fast path registers for common operations
     Value fastReg[4];
@@ -37,14 +50,36 @@ private:
     void push(const Value& value);
     Value pop();
     Value peek(int offset = 0);
-    void executeChunk(const Chunk& chunk);
-    bool isTruthy(const Value& value);
-    Value callBuiltin(const std::string& name, const std::vector<Value>& args);
+    // Programs are verified before they run, so stack use is checked once
+    // per frame. Checked is only true for a main chunk deeper than the whole
+    // stack, where every push and pop is checked instead.
+    template <bool Checked>
+    void executeChunk(Chunk& entry);
+    void collectIfNeeded() { if (Heap::instance().shouldCollect()) Heap::instance().collect(); }
+    void link(const Chunk& mainChunk);
 
 public:
-    VM();
-    void run(const Chunk& mainChunk, const std::vector<Function>& funcs);
+    explicit VM(size_t stackSlots = DEFAULT_STACK_SLOTS);
+    ~VM();
+    // Chunks are not const: hot instructions are rewritten in place into
+    // type-specialized forms as they run
+    void run(Chunk& mainChunk, std::vector<Function>& funcs);
     void enableOptimizations(bool enable) { optimizationsEnabled = enable; }
+    // Compile to machine code before running; programs the JIT cannot
+    // translate are interpreted as usual
+    void enableJit(bool enable) { jitEnabled = enable; }
+    // Record and compile hot loops while interpreting
+    void enableTraceJit(bool enable);
+    // Top-level variables for embedders, by the slot Compiler::globalSlot
+    // gives a name. Slots the program has not linked yet read as 0; setting
+    // one adds it before run(), but throws while a program is running.
+    Value getGlobal(int slot) const;
+    void setGlobal(int slot, const Value& value);
+    // Bumped whenever the host writes a global or run() relinks the slots.
+    // Scripts' own stores never change it, so anything that caches global
+    // values compares this instead of being told about every store.
+    uint64_t globalVersion() const { return globalsVersion; }
+    void markRoots(Heap& heap) override;
 };
 
 #endif
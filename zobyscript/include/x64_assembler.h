@@ -0,0 +1,196 @@
+#ifndef X64_ASSEMBLER_H
+#define X64_ASSEMBLER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Native code generation is only wired up for the x86-64 System V ABI
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define ZS_JIT_X64 1
+#endif
+
+namespace x64 {
+
+// Minimal x86-64 encoder shared by the method and trace JITs: just the
+// instruction forms their templates use. Memory operands are
+// [base + disp8/disp32] or [rip + label].
+
+enum Reg { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+enum Cond { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7, CC_P = 0xA, CC_NP = 0xB };
+
+// Opcode bytes for the ALU and SSE forms below
+const uint8_t ALU_ADD = 0x01, ALU_AND = 0x21, ALU_SUB = 0x29, ALU_XOR = 0x31, ALU_CMP = 0x39, ALU_TEST = 0x85;
+const uint8_t SSE_LOAD = 0x10, SSE_STORE = 0x11, SSE_ADD = 0x58, SSE_MUL = 0x59, SSE_SUB = 0x5C, SSE_DIV = 0x5E;
+
+class Assembler {
+private:
+    struct Fixup {
+        size_t at;
+        int label;
+    };
+    std::vector<long> labels;
+    std::vector<Fixup> fixups;
+
+    void rex(bool wide, int reg, int rm) {
+        uint8_t prefix = 0x40 | (wide ? 8 : 0) | ((reg >> 3) & 1) << 2 | ((rm >> 3) & 1);
+        if (prefix != 0x40) byte(prefix);
+    }
+    void modrmReg(int reg, int rm) { byte(0xC0 | (reg & 7) << 3 | (rm & 7)); }
+    void modrmMem(int reg, int base, int32_t disp) {
+        bool short8 = disp >= -128 && disp <= 127;
+        byte((short8 ? 0x40 : 0x80) | (reg & 7) << 3 | (base & 7));
+        if ((base & 7) == RSP) byte(0x24);  // SIB for rsp/r12 bases
+        if (short8) byte(static_cast<uint8_t>(disp));
+        else dword(static_cast<uint32_t>(disp));
+    }
+    void rel32(int label) {
+        fixups.push_back(Fixup{code.size(), label});
+        dword(0);
+    }
+
+public:
+    std::vector<uint8_t> code;
+
+    void byte(uint8_t b) { code.push_back(b); }
+    void dword(uint32_t v) { for (int i = 0; i < 4; i++) byte(static_cast<uint8_t>(v >> (8 * i))); }
+    void qword(uint64_t v) { for (int i = 0; i < 8; i++) byte(static_cast<uint8_t>(v >> (8 * i))); }
+
+    int newLabel() {
+        labels.push_back(-1);
+        return static_cast<int>(labels.size()) - 1;
+    }
+    void bind(int label) { labels[label] = static_cast<long>(code.size()); }
+    long offset(int label) const { return labels[label]; }
+
+    // Resolves every rel32 reference; false if a label was never bound
+    bool finish() {
+        for (const Fixup& fixup : fixups) {
+            if (labels[fixup.label] < 0) return false;
+            int32_t rel = static_cast<int32_t>(labels[fixup.label] - static_cast<long>(fixup.at + 4));
+            std::memcpy(&code[fixup.at], &rel, 4);
+        }
+        return true;
+    }
+
+    void load(Reg dst, Reg base, int32_t disp) { rex(true, dst, base); byte(0x8B); modrmMem(dst, base, disp); }
+    void store(Reg base, int32_t disp, Reg src) { rex(true, src, base); byte(0x89); modrmMem(src, base, disp); }
+    // mov qword [base + disp], imm32 (sign-extended)
+    void storeImm(Reg base, int32_t disp, int32_t imm) {
+        rex(true, 0, base);
+        byte(0xC7);
+        modrmMem(0, base, disp);
+        dword(static_cast<uint32_t>(imm));
+    }
+    void movImm(Reg dst, uint64_t imm) {
+        if (imm <= 0xFFFFFFFFULL) {
+            rex(false, 0, dst);
+            byte(0xB8 + (dst & 7));
+            dword(static_cast<uint32_t>(imm));
+        } else {
+            rex(true, 0, dst);
+            byte(0xB8 + (dst & 7));
+            qword(imm);
+        }
+    }
+    void mov(Reg dst, Reg src) { alu(0x89, dst, src); }
+    void lea(Reg dst, Reg base, int32_t disp) { rex(true, dst, base); byte(0x8D); modrmMem(dst, base, disp); }
+    // lea dst, [rip + label]
+    void leaLabel(Reg dst, int label) {
+        rex(true, dst, 0);
+        byte(0x8D);
+        byte(0x05 | (dst & 7) << 3);
+        rel32(label);
+    }
+
+    // op r/m64, r64 (dst is the r/m operand)
+    void alu(uint8_t op, Reg dst, Reg src) { rex(true, src, dst); byte(op); modrmReg(src, dst); }
+    void alu32(uint8_t op, Reg dst, Reg src) { rex(false, src, dst); byte(op); modrmReg(src, dst); }
+    void imul32(Reg dst, Reg src) { rex(false, dst, src); byte(0x0F); byte(0xAF); modrmReg(dst, src); }
+    void addImm(Reg r, int32_t imm) { aluImm(0, r, imm); }
+    void subImm(Reg r, int32_t imm) { aluImm(5, r, imm); }
+    void aluImm(int digit, Reg r, int32_t imm) {
+        rex(true, 0, r);
+        if (imm >= -128 && imm <= 127) {
+            byte(0x83);
+            modrmReg(digit, r);
+            byte(static_cast<uint8_t>(imm));
+        } else {
+            byte(0x81);
+            modrmReg(digit, r);
+            dword(static_cast<uint32_t>(imm));
+        }
+    }
+    // cmp r64, [base + disp]
+    void cmpMem(Reg r, Reg base, int32_t disp) { rex(true, r, base); byte(0x3B); modrmMem(r, base, disp); }
+    void shl(Reg r, uint8_t count) { rex(true, 0, r); byte(0xC1); modrmReg(4, r); byte(count); }
+
+    // Byte ops on al/cl/dl/bl only, which need no REX prefix
+    void setcc(Cond cond, Reg r8) { byte(0x0F); byte(0x90 + cond); modrmReg(0, r8); }
+    void and8(Reg dst, Reg src) { byte(0x20); modrmReg(src, dst); }
+    void or8(Reg dst, Reg src) { byte(0x08); modrmReg(src, dst); }
+    void movzx8(Reg dst, Reg src8) { byte(0x0F); byte(0xB6); modrmReg(dst, src8); }
+
+    // Scalar double ops: prefix 0F op xmm, [base + disp]
+    void sse(uint8_t prefix, uint8_t op, int xmm, Reg base, int32_t disp) {
+        byte(prefix);
+        rex(false, xmm, base);
+        byte(0x0F);
+        byte(op);
+        modrmMem(xmm, base, disp);
+    }
+    void sseReg(uint8_t prefix, uint8_t op, int reg, int rm) {
+        byte(prefix);
+        rex(false, reg, rm);
+        byte(0x0F);
+        byte(op);
+        modrmReg(reg, rm);
+    }
+    void movsdLoad(int xmm, Reg base, int32_t disp) { sse(0xF2, SSE_LOAD, xmm, base, disp); }
+    void movsdStore(Reg base, int32_t disp, int xmm) { sse(0xF2, SSE_STORE, xmm, base, disp); }
+    void movsd(int dst, int src) { sseReg(0xF2, SSE_LOAD, dst, src); }
+    // prefix 0F op xmm, [rip + label], for constants placed after the code
+    void sseLabel(uint8_t prefix, uint8_t op, int xmm, int label) {
+        byte(prefix);
+        rex(false, xmm, 0);
+        byte(0x0F);
+        byte(op);
+        byte(0x05 | (xmm & 7) << 3);
+        rel32(label);
+    }
+    void arith(uint8_t op, int dst, int src) { sseReg(0xF2, op, dst, src); }
+    void ucomisd(int a, int b) { sseReg(0x66, 0x2E, a, b); }
+    void ucomisdMem(int a, Reg base, int32_t disp) { sse(0x66, 0x2E, a, base, disp); }
+    void xorpd(int dst, int src) { sseReg(0x66, 0x57, dst, src); }
+    void cvttsd2si(Reg dst, int xmm) { sseReg(0xF2, 0x2C, dst, xmm); }
+    void cvtsi2sd(int xmm, Reg src) { sseReg(0xF2, 0x2A, xmm, src); }
+    void movqToXmm(int xmm, Reg r) {
+        byte(0x66);
+        rex(true, xmm, r);
+        byte(0x0F);
+        byte(0x6E);
+        modrmReg(xmm, r);
+    }
+
+    void jcc(Cond cond, int label) { byte(0x0F); byte(0x80 + cond); rel32(label); }
+    void jmp(int label) { byte(0xE9); rel32(label); }
+    void jmpReg(Reg r) { rex(false, 0, r); byte(0xFF); modrmReg(4, r); }
+    void jmpMem(Reg base, int32_t disp) { rex(false, 0, base); byte(0xFF); modrmMem(4, base, disp); }
+    void call(const void* fn) {
+        movImm(RAX, reinterpret_cast<uint64_t>(fn));
+        byte(0xFF);
+        modrmReg(2, RAX);
+    }
+    void push(Reg r) { rex(false, 0, r); byte(0x50 + (r & 7)); }
+    void pop(Reg r) { rex(false, 0, r); byte(0x58 + (r & 7)); }
+    void ret() { byte(0xC3); }
+};
+
+// Copies code into fresh executable memory; nullptr on failure
+uint8_t* mapExecutable(const std::vector<uint8_t>& code);
+void unmapExecutable(uint8_t* code, size_t size);
+
+}  // namespace x64
+
+#endif
@@ -0,0 +1,16 @@
+#include "../include/arena.h"
+
+void* Arena::allocateSlow(size_t size, size_t align) {
+    // Oversized requests get a block of their own so the current block keeps
+    // its free space
+    size_t needed = size + align;
+    if (needed > BLOCK_SIZE / 4) {
+        blocks.emplace_back(new char[needed]);
+        uintptr_t p = reinterpret_cast<uintptr_t>(blocks.back().get());
+        return reinterpret_cast<void*>((p + align - 1) & ~static_cast<uintptr_t>(align - 1));
+    }
+    blocks.emplace_back(new char[BLOCK_SIZE]);
+    cursor = blocks.back().get();
+    limit = cursor + BLOCK_SIZE;
+    return allocate(size, align);
+}
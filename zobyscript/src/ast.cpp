@@ -1,4 +1,19 @@
 #include "../include/ast.h"
 
-// AST node implementations are header-only with inline constructors
-// This file exists for potential future implementations
+const char* binaryOpSymbol(BinaryOp op) {
+    switch (op) {
+        case BinaryOp::ADD: return "+";
+        case BinaryOp::SUBTRACT: return "-";
+        case BinaryOp::MULTIPLY: return "*";
+        case BinaryOp::DIVIDE: return "/";
+        case BinaryOp::LESS: return "<";
+        case BinaryOp::GREATER: return ">";
+        case BinaryOp::LESS_EQUAL: return "<=";
+        case BinaryOp::GREATER_EQUAL: return ">=";
+        case BinaryOp::EQUAL: return "==";
+        case BinaryOp::NOT_EQUAL: return "!=";
+        case BinaryOp::AND: return "and";
+        case BinaryOp::OR: return "or";
+    }
+    return "?";
+}
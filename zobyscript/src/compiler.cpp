@@ -1,39 +1,95 @@
 #include "../include/compiler.h"
+#include "../include/ir.h"
+#include "../include/native.h"
+#include "../include/runtime.h"
+#include "../include/verifier.h"
 #include <stdexcept>
 #include <fstream>
+#include <iostream>
 
-Compiler::Compiler() : currentChunk(nullptr), localCount(0), inFunction(false), obfuscate(false), optimizationsEnabled(true), currentFunctionName("") {}
+Compiler::Compiler()
+    : localCount(0), inFunction(false), obfuscate(false), optimizationsEnabled(true), peepholeEnabled(true),
+      irDump(false), peepholeRemoved(0) {}
 
-std::string* Compiler::internString(const std::string& str) {
-    if (stringInternTable.find(str) == stringInternTable.end()) {
-        stringInternTable[str] = Value(str);
-    }
-    return &stringInternTable[str].string;
+ObjString* Compiler::internString(const std::string& str) {
+    return Heap::instance().newString(str);
 }
 
-std::unique_ptr<ASTNode> Compiler::optimizeConstantFolding(ASTNode* node) {
-    if (!optimizationsEnabled || node->type != ASTNodeType::BINARY_OP) {
-        return nullptr;
-    }
-    
-    BinaryOpNode* binNode = static_cast<BinaryOpNode*>(node);
-    
-    // Check if both operands are numbers
-    if (binNode->left->type == ASTNodeType::NUMBER && binNode->right->type == ASTNodeType::NUMBER) {
-        NumberNode* left = static_cast<NumberNode*>(binNode->left.get());
-        NumberNode* right = static_cast<NumberNode*>(binNode->right.get());
-        
-        double result = 0;
-        if (binNode->op == "+") result = left->value + right->value;
-        else if (binNode->op == "-") result = left->value - right->value;
-        else if (binNode->op == "*") result = left->value * right->value;
-        else if (binNode->op == "/") result = left->value / right->value;
-        else return nullptr;
-        
-        return std::make_unique<NumberNode>(result);
+// Every operand has to fold, even one that and/or or a ternary would skip,
+// so mistakes in it (an undefined function, say) are still reported
+bool Compiler::optimizeConstantFolding(ASTNode* node, Value& result) {
+    if (!optimizationsEnabled) return false;
+    switch (node->type) {
+        case ASTNodeType::NUMBER:
+            result = Value(static_cast<NumberNode*>(node)->value);
+            return true;
+        case ASTNodeType::STRING:
+            result = Value(internString(static_cast<StringNode*>(node)->value));
+            return true;
+        case ASTNodeType::BOOLEAN:
+            result = Value(static_cast<BooleanNode*>(node)->value);
+            return true;
+        case ASTNodeType::NULLVAL:
+            result = Value::Null();
+            return true;
+        case ASTNodeType::UNARY_OP: {
+            UnaryOpNode* unaryNode = static_cast<UnaryOpNode*>(node);
+            Value operand;
+            if (!optimizeConstantFolding(unaryNode->operand, operand)) return false;
+            IROp op = unaryNode->op == UnaryOp::NEGATE ? IROp::NEGATE : IROp::NOT;
+            return foldConstant(op, 0, {operand}, result);
+        }
+        case ASTNodeType::BINARY_OP: {
+            BinaryOpNode* binNode = static_cast<BinaryOpNode*>(node);
+            Value left, right;
+            if (!optimizeConstantFolding(binNode->left, left) || !optimizeConstantFolding(binNode->right, right)) {
+                return false;
+            }
+            IROp op;
+            switch (binNode->op) {
+                // The left operand when it decides, else the right
+                case BinaryOp::AND: result = isTruthy(left) ? right : left; return true;
+                case BinaryOp::OR: result = isTruthy(left) ? left : right; return true;
+                case BinaryOp::ADD: op = IROp::ADD; break;
+                case BinaryOp::SUBTRACT: op = IROp::SUBTRACT; break;
+                case BinaryOp::MULTIPLY: op = IROp::MULTIPLY; break;
+                case BinaryOp::DIVIDE: op = IROp::DIVIDE; break;
+                case BinaryOp::LESS: op = IROp::LESS; break;
+                case BinaryOp::GREATER: op = IROp::GREATER; break;
+                case BinaryOp::LESS_EQUAL: op = IROp::LESS_EQUAL; break;
+                case BinaryOp::GREATER_EQUAL: op = IROp::GREATER_EQUAL; break;
+                case BinaryOp::EQUAL: op = IROp::EQUAL; break;
+                case BinaryOp::NOT_EQUAL: op = IROp::NOT_EQUAL; break;
+                default: return false;
+            }
+            return foldConstant(op, 0, {left, right}, result);
+        }
+        case ASTNodeType::TERNARY: {
+            TernaryNode* ternNode = static_cast<TernaryNode*>(node);
+            Value condition, thenValue, elseValue;
+            if (!optimizeConstantFolding(ternNode->condition, condition) ||
+                !optimizeConstantFolding(ternNode->thenExpr, thenValue) ||
+                !optimizeConstantFolding(ternNode->elseExpr, elseValue)) {
+                return false;
+            }
+            result = isTruthy(condition) ? thenValue : elseValue;
+            return true;
+        }
+        case ASTNodeType::FUNCTION_CALL: {
+            FunctionCallNode* callNode = static_cast<FunctionCallNode*>(node);
+            if (callNode->name == "print") return false;
+            int nativeId = resolveNative(callNode->name, static_cast<int>(callNode->arguments.size()));
+            if (nativeId < 0 || !nativeTable()[nativeId].pure) return false;
+            std::vector<Value> args;
+            for (ASTNode* arg : callNode->arguments) {
+                args.push_back(Value());
+                if (!optimizeConstantFolding(arg, args.back())) return false;
+            }
+            return foldConstant(IROp::CALL_NATIVE, nativeId, args, result);
+        }
+        default:
+            return false;
     }
-    
-    return nullptr;
 }
 
 void Compiler::loadStandardLibrary(const std::string& libName) {
@@ -52,6 +108,11 @@ int Compiler::resolveGlobal(const std::string& name) {
     return globals[name];
 }
 
+int Compiler::globalSlot(const std::string& name) const {
+    auto it = globals.find(name);
+    return it == globals.end() ? -1 : it->second;
+}
+
 int Compiler::resolveLocal(const std::string& name) {
     if (locals.find(name) != locals.end()) {
         return locals[name];
@@ -59,401 +120,18 @@ int Compiler::resolveLocal(const std::string& name) {
     return -1;
 }
 
-void Compiler::beginScope() {
-    localCount = 0;
-    locals.clear();
+// A call to a script function, so `return f(...)` can reuse the caller's
+// frame. print and natives return to the chunk that called them.
+bool Compiler::isTailCall(ASTNode* node) {
+    if (node->type != ASTNodeType::FUNCTION_CALL) return false;
+    FunctionCallNode* callNode = static_cast<FunctionCallNode*>(node);
+    int argc = static_cast<int>(callNode->arguments.size());
+    return callNode->name != "print" && resolveNative(callNode->name, argc) < 0 &&
+           functions.find(callNode->name) != functions.end();
 }
 
-void Compiler::endScope() {
-    locals.clear();
-    localCount = 0;
-}
-
-void Compiler::compileExpression(ASTNode* node) {
-    if (node->type == ASTNodeType::NUMBER) {
-        NumberNode* numNode = static_cast<NumberNode*>(node);
-        if (optimizationsEnabled && numNode->value == 0.0) {
-            currentChunk->write(OpCode::OP_CONSTANT_0);
-        } else if (optimizationsEnabled && numNode->value == 1.0) {
-            currentChunk->write(OpCode::OP_CONSTANT_1);
-        } else {
-            int constIdx = currentChunk->addConstant(Value(numNode->value));
-            currentChunk->write(OpCode::OP_CONSTANT);
-            currentChunk->write(constIdx);
-        }
-    }
-    else if (node->type == ASTNodeType::STRING) {
-        StringNode* strNode = static_cast<StringNode*>(node);
-        int constIdx = currentChunk->addConstant(Value(strNode->value));
-        currentChunk->write(OpCode::OP_STRING);
-        currentChunk->write(constIdx);
-    }
-    else if (node->type == ASTNodeType::BOOLEAN) {
-        BooleanNode* boolNode = static_cast<BooleanNode*>(node);
-        currentChunk->write(boolNode->value ? OpCode::OP_TRUE : OpCode::OP_FALSE);
-    }
-    else if (node->type == ASTNodeType::NULLVAL) {
-        currentChunk->write(OpCode::OP_NULL);
-    }
-    else if (node->type == ASTNodeType::HASHMAP) {
-        HashMapNode* hmNode = static_cast<HashMapNode*>(node);
-        for (auto& pair : hmNode->pairs) {
-            int keyIdx = currentChunk->addConstant(Value(pair.first));
-            currentChunk->write(OpCode::OP_STRING);
-            currentChunk->write(keyIdx);
-            compileExpression(pair.second.get());
-        }
-        currentChunk->write(OpCode::OP_HASHMAP);
-        currentChunk->write(static_cast<uint8_t>(hmNode->pairs.size()));
-    }
-    else if (node->type == ASTNodeType::TERNARY) {
-        TernaryNode* ternNode = static_cast<TernaryNode*>(node);
-        compileExpression(ternNode->condition.get());
-        int elseJump = currentChunk->code.size();
-        currentChunk->write(OpCode::OP_JUMP_IF_FALSE);
-        currentChunk->write16(0);
-        currentChunk->write(OpCode::OP_POP);
-        compileExpression(ternNode->thenExpr.get());
-        int endJump = currentChunk->code.size();
-        currentChunk->write(OpCode::OP_JUMP);
-        currentChunk->write16(0);
-        currentChunk->patchJump(elseJump + 1);
-        currentChunk->write(OpCode::OP_POP);
-        compileExpression(ternNode->elseExpr.get());
-        currentChunk->patchJump(endJump + 1);
-    }
-    else if (node->type == ASTNodeType::ARRAY) {
-        ArrayNode* arrNode = static_cast<ArrayNode*>(node);
-        for (auto& elem : arrNode->elements) {
-            compileExpression(elem.get());
-        }
-        currentChunk->write(OpCode::OP_ARRAY);
-        currentChunk->write(static_cast<uint8_t>(arrNode->elements.size()));
-    }
-    else if (node->type == ASTNodeType::INDEX) {
-        IndexNode* idxNode = static_cast<IndexNode*>(node);
-        compileExpression(idxNode->array.get());
-        compileExpression(idxNode->index.get());
-        currentChunk->write(OpCode::OP_INDEX_GET);
-    }
-    else if (node->type == ASTNodeType::IDENTIFIER) {
-        IdentifierNode* idNode = static_cast<IdentifierNode*>(node);
-        int localIdx = resolveLocal(idNode->name);
-        if (localIdx != -1) {
-            currentChunk->write(OpCode::OP_GET_LOCAL);
-            currentChunk->write(localIdx);
-        } else {
-            int globalIdx = resolveGlobal(idNode->name);
-            currentChunk->write(OpCode::OP_GET_GLOBAL);
-            currentChunk->write(globalIdx);
-        }
-    }
-    else if (node->type == ASTNodeType::BINARY_OP) {
-        BinaryOpNode* binNode = static_cast<BinaryOpNode*>(node);
-        
-        auto optimized = optimizeConstantFolding(node);
-        if (optimized) {
-            compileExpression(optimized.get());
-            return;
-        }
-        
-        if (binNode->op == "and") {
-            compileExpression(binNode->left.get());
-            int jumpOffset = currentChunk->code.size();
-            currentChunk->write(OpCode::OP_JUMP_IF_FALSE);
-            currentChunk->write16(0);
-            currentChunk->write(OpCode::OP_POP);
-            compileExpression(binNode->right.get());
-            currentChunk->patchJump(jumpOffset + 1);
-        } else if (binNode->op == "or") {
-            compileExpression(binNode->left.get());
-            int jumpOffset = currentChunk->code.size();
-            currentChunk->write(OpCode::OP_JUMP_IF_FALSE);
-            currentChunk->write16(0);
-            int endJump = currentChunk->code.size();
-            currentChunk->write(OpCode::OP_JUMP);
-            currentChunk->write16(0);
-            currentChunk->patchJump(jumpOffset + 1);
-            currentChunk->write(OpCode::OP_POP);
-            compileExpression(binNode->right.get());
-            currentChunk->patchJump(endJump + 1);
-        } else {
-            compileExpression(binNode->left.get());
-            compileExpression(binNode->right.get());
-            
-            bool leftIsInt = binNode->left->type == ASTNodeType::NUMBER && 
-                           static_cast<NumberNode*>(binNode->left.get())->value == 
-                           static_cast<int>(static_cast<NumberNode*>(binNode->left.get())->value);
-            bool rightIsInt = binNode->right->type == ASTNodeType::NUMBER && 
-                            static_cast<NumberNode*>(binNode->right.get())->value == 
-                            static_cast<int>(static_cast<NumberNode*>(binNode->right.get())->value);
-            
-            if (optimizationsEnabled && leftIsInt && rightIsInt) {
-                if (binNode->op == "+") currentChunk->write(OpCode::OP_ADD_INT);
-                else if (binNode->op == "-") currentChunk->write(OpCode::OP_SUB_INT);
-                else if (binNode->op == "*") currentChunk->write(OpCode::OP_MUL_INT);
-                else if (binNode->op == "/") currentChunk->write(OpCode::OP_DIVIDE);
-                else if (binNode->op == "<") currentChunk->write(OpCode::OP_LESS);
-                else if (binNode->op == ">") currentChunk->write(OpCode::OP_GREATER);
-                else if (binNode->op == "<=") currentChunk->write(OpCode::OP_LESS_EQUAL);
-                else if (binNode->op == ">=") currentChunk->write(OpCode::OP_GREATER_EQUAL);
-                else if (binNode->op == "==") currentChunk->write(OpCode::OP_EQUAL);
-                else if (binNode->op == "!=") currentChunk->write(OpCode::OP_NOT_EQUAL);
-            } else {
-                if (binNode->op == "+") currentChunk->write(OpCode::OP_ADD);
-                else if (binNode->op == "-") currentChunk->write(OpCode::OP_SUBTRACT);
-                else if (binNode->op == "*") currentChunk->write(OpCode::OP_MULTIPLY);
-                else if (binNode->op == "/") currentChunk->write(OpCode::OP_DIVIDE);
-                else if (binNode->op == "<") currentChunk->write(OpCode::OP_LESS);
-                else if (binNode->op == ">") currentChunk->write(OpCode::OP_GREATER);
-                else if (binNode->op == "<=") currentChunk->write(OpCode::OP_LESS_EQUAL);
-                else if (binNode->op == ">=") currentChunk->write(OpCode::OP_GREATER_EQUAL);
-                else if (binNode->op == "==") currentChunk->write(OpCode::OP_EQUAL);
-                else if (binNode->op == "!=") currentChunk->write(OpCode::OP_NOT_EQUAL);
-            }
-        }
-    }
-    else if (node->type == ASTNodeType::UNARY_OP) {
-        UnaryOpNode* unaryNode = static_cast<UnaryOpNode*>(node);
-        compileExpression(unaryNode->operand.get());
-        if (unaryNode->op == "-") currentChunk->write(OpCode::OP_NEGATE);
-        else if (unaryNode->op == "!") currentChunk->write(OpCode::OP_NOT);
-    }
-    else if (node->type == ASTNodeType::FUNCTION_CALL) {
-        FunctionCallNode* callNode = static_cast<FunctionCallNode*>(node);
-        
-        for (auto& arg : callNode->arguments) {
-            compileExpression(arg.get());
-        }
-        
-        if (callNode->name == "print") {
-            currentChunk->write(OpCode::OP_PRINT);
-            currentChunk->write(static_cast<uint8_t>(callNode->arguments.size()));
-        } else if (callNode->name == "len" || callNode->name == "push" || callNode->name == "pop" ||
-                   callNode->name == "sqrt" || callNode->name == "pow" || callNode->name == "abs" ||
-                   callNode->name == "floor" || callNode->name == "ceil" || callNode->name == "sin" ||
-                   callNode->name == "cos" || callNode->name == "tan" || callNode->name == "random" ||
-                   callNode->name == "min" || callNode->name == "max" || callNode->name == "round" ||
-                   callNode->name == "str" || callNode->name == "num" || callNode->name == "type" ||
-                   callNode->name == "input" || callNode->name == "upper" || callNode->name == "lower" ||
-                   callNode->name == "split" || callNode->name == "join" || callNode->name == "keys" ||
-                   callNode->name == "values" || callNode->name == "read" || callNode->name == "write" ||
-                   callNode->name == "append" || callNode->name == "exists" || callNode->name == "delete") {
-            currentChunk->write(OpCode::OP_CALL);
-            currentChunk->write(255);
-            currentChunk->write(static_cast<uint8_t>(callNode->arguments.size()));
-            int nameIdx = currentChunk->addConstant(Value(callNode->name));
-            currentChunk->write(static_cast<uint8_t>(nameIdx));
-        } else {
-            if (functions.find(callNode->name) == functions.end()) {
-                throw std::runtime_error("Undefined function: " + callNode->name);
-            }
-            int funcId = functions[callNode->name];
-            currentChunk->write(OpCode::OP_CALL);
-            currentChunk->write(static_cast<uint8_t>(funcId));
-            currentChunk->write(static_cast<uint8_t>(callNode->arguments.size()));
-        }
-    }
-}
-
-void Compiler::compileStatement(ASTNode* node) {
-    if (node->type == ASTNodeType::ASSIGNMENT) {
-        AssignmentNode* assignNode = static_cast<AssignmentNode*>(node);
-        compileExpression(assignNode->value.get());
-        
-        int localIdx = resolveLocal(assignNode->name);
-        if (localIdx != -1) {
-            currentChunk->write(OpCode::OP_SET_LOCAL);
-            currentChunk->write(localIdx);
-        } else {
-            if (inFunction) {
-                locals[assignNode->name] = localCount++;
-                currentChunk->write(OpCode::OP_SET_LOCAL);
-                currentChunk->write(locals[assignNode->name]);
-            } else {
-                int globalIdx = resolveGlobal(assignNode->name);
-                currentChunk->write(OpCode::OP_SET_GLOBAL);
-                currentChunk->write(globalIdx);
-            }
-        }
-    }
-    else if (node->type == ASTNodeType::FUNCTION_CALL) {
-        FunctionCallNode* callNode = static_cast<FunctionCallNode*>(node);
-        compileExpression(node);
-        if (callNode->name != "print") {
-            currentChunk->write(OpCode::OP_POP);
-        }
-    }
-    else if (node->type == ASTNodeType::FUNCTION_DEF) {
-        FunctionDefNode* funcNode = static_cast<FunctionDefNode*>(node);
-        
-        Function func;
-        func.name = funcNode->name;
-        func.arity = static_cast<int>(funcNode->params.size());
-        func.params = funcNode->params;
-        
-        functions[funcNode->name] = static_cast<int>(functionTable.size());
-        
-        Chunk* prevChunk = currentChunk;
-        currentChunk = &func.chunk;
-        bool wasInFunction = inFunction;
-        inFunction = true;
-        
-        beginScope();
-        for (size_t i = 0; i < funcNode->params.size(); i++) {
-            locals[funcNode->params[i]] = static_cast<int>(i);
-            localCount++;
-        }
-        
-        currentChunk->write(OpCode::OP_MAKEFRAME);
-        currentChunk->write(localCount);
-        
-        if (funcNode->body->type == ASTNodeType::BLOCK) {
-            BlockNode* block = static_cast<BlockNode*>(funcNode->body.get());
-            for (auto& stmt : block->statements) {
-                compileStatement(stmt.get());
-            }
-        }
-        
-        int constIdx = currentChunk->addConstant(Value(0.0));
-        currentChunk->write(OpCode::OP_CONSTANT);
-        currentChunk->write(constIdx);
-        currentChunk->write(OpCode::OP_RET);
-        
-        endScope();
-        inFunction = wasInFunction;
-        currentChunk = prevChunk;
-        
-        functionTable.push_back(std::move(func));
-    }
-    else if (node->type == ASTNodeType::RETURN) {
-        ReturnNode* retNode = static_cast<ReturnNode*>(node);
-        compileExpression(retNode->value.get());
-        currentChunk->write(OpCode::OP_RET);
-    }
-    else if (node->type == ASTNodeType::IF_STATEMENT) {
-        IfStatementNode* ifNode = static_cast<IfStatementNode*>(node);
-        
-        if (optimizationsEnabled && ifNode->condition->type == ASTNodeType::BOOLEAN) {
-            BooleanNode* boolNode = static_cast<BooleanNode*>(ifNode->condition.get());
-            if (boolNode->value) {
-                if (ifNode->thenBranch->type == ASTNodeType::BLOCK) {
-                    BlockNode* block = static_cast<BlockNode*>(ifNode->thenBranch.get());
-                    for (auto& stmt : block->statements) {
-                        compileStatement(stmt.get());
-                    }
-                }
-                return;
-            } else {
-                if (ifNode->elseBranch && ifNode->elseBranch->type == ASTNodeType::BLOCK) {
-                    BlockNode* block = static_cast<BlockNode*>(ifNode->elseBranch.get());
-                    for (auto& stmt : block->statements) {
-                        compileStatement(stmt.get());
-                    }
-                }
-                return;
-            }
-        }
-        
-        compileExpression(ifNode->condition.get());
-        int thenJump = currentChunk->code.size();
-        currentChunk->write(OpCode::OP_JUMP_IF_FALSE);
-        currentChunk->write16(0);
-        currentChunk->write(OpCode::OP_POP);
-        
-        if (ifNode->thenBranch->type == ASTNodeType::BLOCK) {
-            BlockNode* block = static_cast<BlockNode*>(ifNode->thenBranch.get());
-            for (auto& stmt : block->statements) {
-                compileStatement(stmt.get());
-            }
-        }
-        
-        if (ifNode->elseBranch) {
-            int elseJump = currentChunk->code.size();
-            currentChunk->write(OpCode::OP_JUMP);
-            currentChunk->write16(0);
-            
-            currentChunk->patchJump(thenJump + 1);
-            currentChunk->write(OpCode::OP_POP);
-            
-            if (ifNode->elseBranch->type == ASTNodeType::BLOCK) {
-                BlockNode* block = static_cast<BlockNode*>(ifNode->elseBranch.get());
-                for (auto& stmt : block->statements) {
-                    compileStatement(stmt.get());
-                }
-            }
-            
-            currentChunk->patchJump(elseJump + 1);
-        } else {
-            currentChunk->patchJump(thenJump + 1);
-            currentChunk->write(OpCode::OP_POP);
-        }
-    }
-    else if (node->type == ASTNodeType::WHILE_STATEMENT) {
-        WhileStatementNode* whileNode = static_cast<WhileStatementNode*>(node);
-        
-        int loopStart = currentChunk->code.size();
-        compileExpression(whileNode->condition.get());
-        
-        int exitJump = currentChunk->code.size();
-        currentChunk->write(OpCode::OP_JUMP_IF_FALSE);
-        currentChunk->write16(0);
-        currentChunk->write(OpCode::OP_POP);
-        
-        if (whileNode->body->type == ASTNodeType::BLOCK) {
-            BlockNode* block = static_cast<BlockNode*>(whileNode->body.get());
-            for (auto& stmt : block->statements) {
-                compileStatement(stmt.get());
-            }
-        }
-        
-        int offset = currentChunk->code.size() - loopStart + 3;
-        currentChunk->write(OpCode::OP_JUMP);
-        currentChunk->write16(-offset);
-        
-        currentChunk->patchJump(exitJump + 1);
-        currentChunk->write(OpCode::OP_POP);
-    }
-    else if (node->type == ASTNodeType::FOR_STATEMENT) {
-        ForStatementNode* forNode = static_cast<ForStatementNode*>(node);
-        
-        compileStatement(forNode->init.get());
-        
-        int loopStart = currentChunk->code.size();
-        compileExpression(forNode->condition.get());
-        
-        int exitJump = currentChunk->code.size();
-        currentChunk->write(OpCode::OP_JUMP_IF_FALSE);
-        currentChunk->write16(0);
-        currentChunk->write(OpCode::OP_POP);
-        
-        if (forNode->body->type == ASTNodeType::BLOCK) {
-            BlockNode* block = static_cast<BlockNode*>(forNode->body.get());
-            for (auto& stmt : block->statements) {
-                compileStatement(stmt.get());
-            }
-        }
-        
-        compileStatement(forNode->increment.get());
-        
-        int offset = currentChunk->code.size() - loopStart + 3;
-        currentChunk->write(OpCode::OP_JUMP);
-        currentChunk->write16(-offset);
-        
-        currentChunk->patchJump(exitJump + 1);
-        currentChunk->write(OpCode::OP_POP);
-    }
-    else if (node->type == ASTNodeType::USE_STATEMENT) {
-        UseStatementNode* useNode = static_cast<UseStatementNode*>(node);
-        loadStandardLibrary(useNode->library);
-    }
-    else if (node->type == ASTNodeType::BREAK_STATEMENT) {
-        currentChunk->write(OpCode::OP_BREAK);
-    }
-    else if (node->type == ASTNodeType::CONTINUE_STATEMENT) {
-        currentChunk->write(OpCode::OP_CONTINUE);
-    }
-}
+// Bumped whenever the instruction encoding changes
+static const uint8_t BYTECODE_VERSION = 8;
 
 void Compiler::saveBytecode(const std::string& filename, const Chunk& chunk) {
     std::ofstream file(filename, std::ios::binary);
@@ -463,7 +141,7 @@ void Compiler::saveBytecode(const std::string& filename, const Chunk& chunk) {
     file.write("ZSC", 3);
     
     // Version
-    uint8_t version = 3;
+    uint8_t version = BYTECODE_VERSION;
     file.write(reinterpret_cast<const char*>(&version), 1);
     
     // Code size
@@ -479,20 +157,30 @@ void Compiler::saveBytecode(const std::string& filename, const Chunk& chunk) {
     
     // Constants
     for (const auto& val : chunk.constants) {
-        uint8_t type = static_cast<uint8_t>(val.type);
+        uint8_t type = static_cast<uint8_t>(val.type());
         file.write(reinterpret_cast<const char*>(&type), 1);
         
-        if (val.type == Value::NUMBER) {
-            file.write(reinterpret_cast<const char*>(&val.number), sizeof(double));
-        } else if (val.type == Value::STRING) {
-            uint32_t len = static_cast<uint32_t>(val.string.length());
+        if (val.isNumber()) {
+            double num = val.asNumber();
+            file.write(reinterpret_cast<const char*>(&num), sizeof(double));
+        } else if (val.isString()) {
+            const std::string& str = val.asString()->chars;
+            uint32_t len = static_cast<uint32_t>(str.length());
             file.write(reinterpret_cast<const char*>(&len), 4);
-            file.write(val.string.c_str(), len);
-        } else if (val.type == Value::BOOLEAN) {
-            file.write(reinterpret_cast<const char*>(&val.boolean), 1);
+            file.write(str.c_str(), len);
+        } else if (val.isBool()) {
+            bool b = val.asBool();
+            file.write(reinterpret_cast<const char*>(&b), 1);
         }
     }
     
+    // Global slot count
+    file.write(reinterpret_cast<const char*>(&chunk.globalCount), 4);
+    
+    // Inline cache count; the caches themselves start out empty
+    uint32_t cacheCount = static_cast<uint32_t>(chunk.fieldCaches.size());
+    file.write(reinterpret_cast<const char*>(&cacheCount), 4);
+    
     // Functions size
     uint32_t funcSize = static_cast<uint32_t>(functionTable.size());
     file.write(reinterpret_cast<const char*>(&funcSize), 4);
@@ -506,19 +194,34 @@ Chunk Compiler::loadBytecode(const std::string& filename) {
     if (!file.is_open()) return chunk;
     
     // Verify magic number
-    char magic[3];
+    char magic[3] = {};
     file.read(magic, 3);
     if (magic[0] != 'Z' || magic[1] != 'S' || magic[2] != 'C') return chunk;
     
     // Version
     uint8_t version;
     file.read(reinterpret_cast<char*>(&version), 1);
+    if (version != BYTECODE_VERSION) {
+        throw std::runtime_error("Unsupported bytecode version " + std::to_string(version) +
+                                 " (recompile the .zs source)");
+    }
+    
+    // Sizes come from the file, so bound them by what it holds before
+    // allocating
+    std::streampos start = file.tellg();
+    file.seekg(0, std::ios::end);
+    uint64_t remaining = static_cast<uint64_t>(file.tellg() - start);
+    file.seekg(start);
     
     // Code
-    uint32_t codeSize;
+    uint32_t codeSize = 0;
     file.read(reinterpret_cast<char*>(&codeSize), 4);
+    if (codeSize > remaining) throw std::runtime_error("Truncated bytecode file");
     chunk.code.resize(codeSize);
     file.read(reinterpret_cast<char*>(chunk.code.data()), codeSize);
+    if (!file) throw std::runtime_error("Truncated bytecode file");
+    // The VM has no end-of-code check, so never let it run off the end
+    if (!chunk.code.empty()) chunk.write(OpCode::OP_HALT);
     
     // Constants
     uint32_t constSize;
@@ -533,34 +236,95 @@ Chunk Compiler::loadBytecode(const std::string& filename) {
             file.read(reinterpret_cast<char*>(&num), sizeof(double));
             chunk.constants.push_back(Value(num));
         } else if (type == static_cast<uint8_t>(Value::STRING)) {
-            uint32_t len;
+            uint32_t len = 0;
             file.read(reinterpret_cast<char*>(&len), 4);
+            if (len > remaining) throw std::runtime_error("Truncated bytecode file");
             std::string str(len, '\0');
             file.read(&str[0], len);
-            chunk.constants.push_back(Value(str));
+            chunk.constants.push_back(makeString(str));
         } else if (type == static_cast<uint8_t>(Value::BOOLEAN)) {
             bool b;
             file.read(reinterpret_cast<char*>(&b), 1);
             chunk.constants.push_back(Value(b));
+        } else {
+            throw std::runtime_error("Invalid bytecode: unknown constant type " + std::to_string(type));
         }
+        if (!file) throw std::runtime_error("Truncated bytecode file");
+    }
+    
+    file.read(reinterpret_cast<char*>(&chunk.globalCount), 4);
+    
+    uint32_t cacheCount = 0;
+    file.read(reinterpret_cast<char*>(&cacheCount), 4);
+    if (!file) throw std::runtime_error("Truncated bytecode file");
+    if (chunk.globalCount > static_cast<uint32_t>(Chunk::MAX_OPERAND) + 1) {
+        throw std::runtime_error("Invalid bytecode: too many globals");
     }
+    if (cacheCount > chunk.code.size()) throw std::runtime_error("Invalid bytecode: too many field caches");
+    chunk.fieldCaches.resize(cacheCount);
     
     file.close();
+    
+    // Reject anything that could misbehave before it runs rather than
+    // partway through
+    std::string error;
+    uint32_t globalsUsed = 0;
+    if (!verifyProgram(chunk, functionTable, &error, &globalsUsed)) {
+        throw std::runtime_error("Invalid bytecode: " + error);
+    }
+    // Nothing outside the code can name a global of a loaded program, so
+    // the VM only sizes the slots the code uses, whatever the file claims
+    chunk.globalCount = globalsUsed;
     return chunk;
 }
 
-void Compiler::peepholeOptimize(Chunk& chunk) {
-    return;
-}
-
-Chunk Compiler::compile(ProgramNode* program) {
-    Chunk mainChunk;
-    currentChunk = &mainChunk;
+Chunk Compiler::compileIR(ProgramNode* program, const std::function<void(IRFunction&, Chunk&)>& lower) {
+    IRProgram ir;
+    buildIR(program, ir);
     
-    for (auto& stmt : program->statements) {
-        compileStatement(stmt.get());
+    IRPassManager passes(irDump ? &std::cout : nullptr);
+    if (optimizationsEnabled) {
+        passes.add("copyprop", propagateCopies);
+        passes.add("constprop", propagateConstants);
+        passes.add("globals", [&](IRFunction& fn) { return fn.isMain ? propagateGlobalConstants(ir) : 0; });
+        passes.add("gvn", numberValues);
+        passes.add("copyprop", propagateCopies);
+        passes.add("dce", eliminateDeadCode);
     }
+    auto optimizeAndLower = [&](IRFunction& fn, Chunk& chunk) {
+        if (irDump) {
+            printIR(std::cout, fn);
+            std::cout << "passes:\n";
+        }
+        passes.run(fn);
+        if (irDump) printIR(std::cout, fn);
+        lower(fn, chunk);
+        if (irDump) std::cout << std::endl;
+    };
     
-    currentChunk->write(OpCode::OP_HALT);
+    Chunk mainChunk;
+    optimizeAndLower(*ir.main, mainChunk);
+    mainChunk.globalCount = static_cast<uint32_t>(globals.size());
+    for (size_t i = 0; i < ir.functions.size(); i++) {
+        optimizeAndLower(*ir.functions[i], functionTable[i].chunk);
+    }
     return mainChunk;
 }
+
+Chunk Compiler::compile(ProgramNode* program) {
+    return compileIR(program, [this](IRFunction& fn, Chunk& chunk) {
+        lowerToStackCode(fn, chunk, optimizationsEnabled);
+        if (optimizationsEnabled && peepholeEnabled) {
+            int removed = peepholeOptimize(chunk);
+            peepholeRemoved += removed;
+            if (irDump) std::cout << "peephole: " << removed << " removed\n";
+        }
+    });
+}
+
+Chunk Compiler::compileRegisters(ProgramNode* program) {
+    int frameGlobals = 0;
+    return compileIR(program, [&](IRFunction& fn, Chunk& chunk) {
+        lowerToRegisterCode(fn, chunk, static_cast<int>(globals.size()), frameGlobals);
+    });
+}
@@ -28,17 +28,17 @@ double Interpreter::evaluate(ASTNode* node) {
     }
     else if (node->type == ASTNodeType::BINARY_OP) {
         BinaryOpNode* binNode = static_cast<BinaryOpNode*>(node);
-        double left = evaluate(binNode->left.get());
-        double right = evaluate(binNode->right.get());
+        double left = evaluate(binNode->left);
+        double right = evaluate(binNode->right);
         
-        if (binNode->op == "+") {
+        if (binNode->op == BinaryOp::ADD) {
             return left + right;
         }
-        else if (binNode->op == "-") {
+        else if (binNode->op == BinaryOp::SUBTRACT) {
             return left - right;
         }
         
-        throw std::runtime_error("Unknown operator: " + binNode->op);
+        throw std::runtime_error(std::string("Unknown operator: ") + binaryOpSymbol(binNode->op));
     }
     
     throw std::runtime_error("Cannot evaluate node");
@@ -60,7 +60,7 @@ void Interpreter::executeBuiltin(const std::string& name, const std::vector<doub
 void Interpreter::execute(ASTNode* node) {
     if (node->type == ASTNodeType::ASSIGNMENT) {
         AssignmentNode* assignNode = static_cast<AssignmentNode*>(node);
-        double value = evaluate(assignNode->value.get());
+        double value = evaluate(assignNode->value);
         env.set(assignNode->name, value);
     }
     else if (node->type == ASTNodeType::FUNCTION_CALL) {
@@ -68,7 +68,7 @@ void Interpreter::execute(ASTNode* node) {
         std::vector<double> args;
         
         for (auto& arg : callNode->arguments) {
-            args.push_back(evaluate(arg.get()));
+            args.push_back(evaluate(arg));
         }
         
         executeBuiltin(callNode->name, args);
@@ -77,6 +77,6 @@ void Interpreter::execute(ASTNode* node) {
 
 void Interpreter::run(ProgramNode* program) {
     for (auto& statement : program->statements) {
-        execute(statement.get());
+        execute(statement);
     }
 }
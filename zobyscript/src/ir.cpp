@@ -0,0 +1,383 @@
+#include "../include/ir.h"
+#include "../include/native.h"
+#include "../include/runtime.h"
+#include <algorithm>
+
+IRBlock* IRFunction::newBlock() {
+    blockPool.push_back(std::unique_ptr<IRBlock>(new IRBlock(blockCount++)));
+    return blockPool.back().get();
+}
+
+IRInstr* IRFunction::newInstr(IROp op) {
+    instrPool.push_back(std::unique_ptr<IRInstr>(new IRInstr(op, instrCount++)));
+    return instrPool.back().get();
+}
+
+size_t IRFunction::size() const {
+    size_t count = 0;
+    for (const IRBlock* block : blocks) count += block->instrs.size();
+    return count;
+}
+
+bool isTerminator(IROp op) {
+    switch (op) {
+        case IROp::JUMP:
+        case IROp::BRANCH:
+        case IROp::RETURN:
+        case IROp::TAIL_CALL:
+        case IROp::HALT:
+        case IROp::BREAK:
+        case IROp::CONTINUE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool hasSideEffects(IROp op) {
+    switch (op) {
+        // Division by zero throws
+        case IROp::DIVIDE:
+        case IROp::CALL:
+        case IROp::CALL_NATIVE:
+        case IROp::STORE_GLOBAL:
+        case IROp::INDEX_SET:
+        case IROp::SET_FIELD:
+        case IROp::PRINT:
+            return true;
+        default:
+            return isTerminator(op);
+    }
+}
+
+bool producesValue(IROp op) {
+    switch (op) {
+        case IROp::STORE_GLOBAL:
+        case IROp::INDEX_SET:
+        case IROp::SET_FIELD:
+        case IROp::PRINT:
+            return false;
+        default:
+            return !isTerminator(op);
+    }
+}
+
+// Text a value contributes to a concatenation, as addValues builds it
+static std::string concatText(const Value& value) {
+    if (value.isString()) return value.asString()->chars;
+    if (value.isNumber()) return std::to_string(static_cast<int>(value.asNumber()));
+    return "";
+}
+
+// Results that fit in a CONST: anything the VM could load from a chunk
+static bool isConstant(const Value& value) {
+    return value.isNumber() || value.isString() || value.isBool() || value.isNull();
+}
+
+bool foldConstant(IROp op, int index, const std::vector<Value>& args, Value& result) {
+    bool numbers = true;
+    for (const Value& arg : args) numbers = numbers && arg.isNumber();
+    switch (op) {
+        case IROp::ADD:
+            if (numbers) {
+                result = Value(args[0].asNumber() + args[1].asNumber());
+            } else if (args[0].isString() || args[1].isString()) {
+                result = makeString(concatText(args[0]) + concatText(args[1]));
+            } else {
+                return false;
+            }
+            return true;
+        case IROp::EQUAL:
+        case IROp::NOT_EQUAL:
+            result = Value(valuesEqual(args[0], args[1]) == (op == IROp::EQUAL));
+            return true;
+        case IROp::NOT:
+            result = Value(!isTruthy(args[0]));
+            return true;
+        case IROp::CALL_NATIVE: {
+            const NativeFunction& native = nativeTable()[index];
+            if (!native.pure) return false;
+            result = native.fn(args.data(), static_cast<int>(args.size()), native.userdata);
+            return isConstant(result);
+        }
+        default:
+            break;
+    }
+    // The rest are only folded for numbers; anything else is left to run time
+    if (!numbers) return false;
+    switch (op) {
+        case IROp::SUBTRACT: result = Value(args[0].asNumber() - args[1].asNumber()); return true;
+        case IROp::MULTIPLY: result = Value(args[0].asNumber() * args[1].asNumber()); return true;
+        case IROp::DIVIDE:
+            // Left in place to throw at run time
+            if (args[1].asNumber() == 0) return false;
+            result = Value(args[0].asNumber() / args[1].asNumber());
+            return true;
+        case IROp::LESS: result = Value(args[0].asNumber() < args[1].asNumber()); return true;
+        case IROp::GREATER: result = Value(args[0].asNumber() > args[1].asNumber()); return true;
+        case IROp::LESS_EQUAL: result = Value(args[0].asNumber() <= args[1].asNumber()); return true;
+        case IROp::GREATER_EQUAL: result = Value(args[0].asNumber() >= args[1].asNumber()); return true;
+        case IROp::NEGATE: result = Value(-args[0].asNumber()); return true;
+        default: return false;
+    }
+}
+
+const char* irOpName(IROp op) {
+    switch (op) {
+        case IROp::CONST: return "const";
+        case IROp::ENTRY: return "entry";
+        case IROp::PHI: return "phi";
+        case IROp::COPY: return "copy";
+        case IROp::LOAD_GLOBAL: return "load_global";
+        case IROp::ADD: return "add";
+        case IROp::SUBTRACT: return "sub";
+        case IROp::MULTIPLY: return "mul";
+        case IROp::DIVIDE: return "div";
+        case IROp::LESS: return "lt";
+        case IROp::GREATER: return "gt";
+        case IROp::LESS_EQUAL: return "le";
+        case IROp::GREATER_EQUAL: return "ge";
+        case IROp::EQUAL: return "eq";
+        case IROp::NOT_EQUAL: return "ne";
+        case IROp::NEGATE: return "neg";
+        case IROp::NOT: return "not";
+        case IROp::ARRAY: return "array";
+        case IROp::HASHMAP: return "hashmap";
+        case IROp::INDEX_GET: return "index_get";
+        case IROp::GET_FIELD: return "get_field";
+        case IROp::CALL: return "call";
+        case IROp::CALL_NATIVE: return "call_native";
+        case IROp::STORE_GLOBAL: return "store_global";
+        case IROp::INDEX_SET: return "index_set";
+        case IROp::SET_FIELD: return "set_field";
+        case IROp::PRINT: return "print";
+        case IROp::JUMP: return "jump";
+        case IROp::BRANCH: return "branch";
+        case IROp::RETURN: return "return";
+        case IROp::TAIL_CALL: return "tail_call";
+        case IROp::HALT: return "halt";
+        case IROp::BREAK: return "break";
+        case IROp::CONTINUE: return "continue";
+    }
+    return "?";
+}
+
+void addEdge(IRBlock* from, IRBlock* to) {
+    from->succs.push_back(to);
+    to->preds.push_back(from);
+}
+
+IRInstr* resolve(IRInstr* instr) {
+    while (instr->replacement) instr = instr->replacement;
+    return instr;
+}
+
+void applyReplacements(IRFunction& fn) {
+    for (IRBlock* block : fn.blocks) {
+        std::vector<IRInstr*>& instrs = block->instrs;
+        instrs.erase(std::remove_if(instrs.begin(), instrs.end(),
+                                    [](IRInstr* instr) { return instr->replacement != nullptr; }),
+                     instrs.end());
+        for (IRInstr* instr : instrs) {
+            for (IRInstr*& arg : instr->args) arg = resolve(arg);
+        }
+    }
+}
+
+int removeUnreachableBlocks(IRFunction& fn) {
+    std::vector<bool> reached(fn.blockCount, false);
+    std::vector<IRBlock*> worklist = {fn.blocks[0]};
+    reached[fn.blocks[0]->id] = true;
+    while (!worklist.empty()) {
+        IRBlock* block = worklist.back();
+        worklist.pop_back();
+        for (IRBlock* succ : block->succs) {
+            if (!reached[succ->id]) {
+                reached[succ->id] = true;
+                worklist.push_back(succ);
+            }
+        }
+    }
+
+    int removed = 0;
+    std::vector<IRBlock*> kept;
+    for (IRBlock* block : fn.blocks) {
+        if (!reached[block->id]) {
+            removed += static_cast<int>(block->instrs.size());
+            continue;
+        }
+        kept.push_back(block);
+        for (size_t i = block->preds.size(); i-- > 0;) {
+            if (reached[block->preds[i]->id]) continue;
+            block->preds.erase(block->preds.begin() + i);
+            for (IRInstr* instr : block->instrs) {
+                if (instr->op != IROp::PHI) break;
+                instr->args.erase(instr->args.begin() + i);
+            }
+        }
+    }
+    fn.blocks = std::move(kept);
+    return removed;
+}
+
+// Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm"
+std::vector<IRBlock*> computeDominators(IRFunction& fn) {
+    std::vector<IRBlock*> postorder;
+    std::vector<int> state(fn.blockCount, 0);  // 0 new, 1 on the stack, 2 done
+    std::vector<std::pair<IRBlock*, size_t>> stack = {{fn.blocks[0], 0}};
+    state[fn.blocks[0]->id] = 1;
+    while (!stack.empty()) {
+        IRBlock* block = stack.back().first;
+        size_t& next = stack.back().second;
+        if (next < block->succs.size()) {
+            IRBlock* succ = block->succs[next++];
+            if (state[succ->id] == 0) {
+                state[succ->id] = 1;
+                stack.push_back({succ, 0});
+            }
+        } else {
+            state[block->id] = 2;
+            postorder.push_back(block);
+            stack.pop_back();
+        }
+    }
+
+    std::vector<int> rank(fn.blockCount, -1);  // position in postorder
+    for (size_t i = 0; i < postorder.size(); i++) rank[postorder[i]->id] = static_cast<int>(i);
+    for (IRBlock* block : fn.blocks) block->idom = nullptr;
+    IRBlock* entry = fn.blocks[0];
+    entry->idom = entry;
+
+    std::vector<IRBlock*> rpo(postorder.rbegin(), postorder.rend());
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (IRBlock* block : rpo) {
+            if (block == entry) continue;
+            IRBlock* idom = nullptr;
+            for (IRBlock* pred : block->preds) {
+                if (!pred->idom) continue;
+                if (!idom) {
+                    idom = pred;
+                    continue;
+                }
+                IRBlock* a = pred;
+                IRBlock* b = idom;
+                while (a != b) {
+                    while (rank[a->id] < rank[b->id]) a = a->idom;
+                    while (rank[b->id] < rank[a->id]) b = b->idom;
+                }
+                idom = a;
+            }
+            if (block->idom != idom) {
+                block->idom = idom;
+                changed = true;
+            }
+        }
+    }
+    return rpo;
+}
+
+static void printConstant(std::ostream& out, const Value& value) {
+    if (value.isNumber()) {
+        out << value.asNumber();
+    } else if (value.isString()) {
+        out << '"' << value.asString()->chars << '"';
+    } else if (value.isBool()) {
+        out << (value.asBool() ? "true" : "false");
+    } else {
+        out << "null";
+    }
+}
+
+static void printArgs(std::ostream& out, const IRInstr* instr, size_t first) {
+    for (size_t i = first; i < instr->args.size(); i++) {
+        out << (i > first ? ", %" : "%") << instr->args[i]->id;
+    }
+}
+
+void printIR(std::ostream& out, const IRFunction& fn) {
+    if (fn.isMain) {
+        out << "main:\n";
+    } else {
+        out << "function " << fn.name << ", arity " << fn.arity << ":\n";
+    }
+    for (const IRBlock* block : fn.blocks) {
+        out << "b" << block->id << ":";
+        for (size_t i = 0; i < block->preds.size(); i++) {
+            out << (i ? ", b" : "    ; preds b") << block->preds[i]->id;
+        }
+        out << "\n";
+        for (const IRInstr* instr : block->instrs) {
+            out << "    ";
+            if (producesValue(instr->op)) out << "%" << instr->id << " = ";
+            out << irOpName(instr->op);
+            switch (instr->op) {
+                case IROp::CONST:
+                    out << " ";
+                    printConstant(out, instr->constant);
+                    break;
+                case IROp::ENTRY:
+                    out << " " << instr->index;
+                    break;
+                case IROp::LOAD_GLOBAL:
+                    out << " " << *instr->name;
+                    break;
+                case IROp::STORE_GLOBAL:
+                    out << " " << *instr->name << ", ";
+                    printArgs(out, instr, 0);
+                    break;
+                case IROp::GET_FIELD:
+                case IROp::SET_FIELD:
+                    out << " ";
+                    printArgs(out, instr, 0);
+                    out << ", ";
+                    printConstant(out, instr->constant);
+                    break;
+                case IROp::CALL:
+                case IROp::TAIL_CALL:
+                    out << " " << *instr->name << "(";
+                    printArgs(out, instr, 0);
+                    out << ")";
+                    break;
+                case IROp::CALL_NATIVE:
+                    out << " " << nativeTable()[instr->index].name << "(";
+                    printArgs(out, instr, 0);
+                    out << ")";
+                    break;
+                case IROp::PHI:
+                    for (size_t i = 0; i < instr->args.size(); i++) {
+                        out << (i ? ", [%" : " [%") << instr->args[i]->id << ", b"
+                            << instr->block->preds[i]->id << "]";
+                    }
+                    break;
+                case IROp::JUMP:
+                    out << " b" << block->succs[0]->id;
+                    break;
+                case IROp::BRANCH:
+                    out << " ";
+                    printArgs(out, instr, 0);
+                    out << ", b" << block->succs[0]->id << ", b" << block->succs[1]->id;
+                    break;
+                default:
+                    if (!instr->args.empty()) out << " ";
+                    printArgs(out, instr, 0);
+                    break;
+            }
+            if (instr->name && instr->op != IROp::LOAD_GLOBAL && instr->op != IROp::STORE_GLOBAL &&
+                instr->op != IROp::CALL && instr->op != IROp::TAIL_CALL) {
+                out << "    ; " << *instr->name;
+            }
+            out << "\n";
+        }
+    }
+}
+
+void IRPassManager::run(IRFunction& fn) {
+    int unreachable = removeUnreachableBlocks(fn);
+    if (log && unreachable) *log << "  unreachable: " << unreachable << " removed\n";
+    for (const IRPass& pass : passes) {
+        int removed = pass.run(fn);
+        if (log) *log << "  " << pass.name << ": " << removed << " removed\n";
+    }
+}
@@ -0,0 +1,544 @@
+#include "../include/compiler.h"
+#include "../include/ir.h"
+#include "../include/native.h"
+#include "../include/runtime.h"
+#include <map>
+#include <stdexcept>
+
+// Builds SSA form straight from the AST, after Braun et al., "Simple and
+// Efficient Construction of Static Single Assignment Form". A function's
+// variables are the frame slots the Compiler's name resolution hands out,
+// so scoping works exactly as it did when the AST was compiled directly.
+//
+// A block is sealed once all its predecessors are known. Reading a variable
+// in an unsealed block (a loop header) creates a phi whose operands are
+// filled in when the block is sealed.
+class IRBuilder {
+private:
+    Compiler& compiler;
+    IRProgram& program;
+    IRFunction& fn;
+    IRBlock* current;
+    std::vector<std::map<int, IRInstr*>> definitions;  // by block id, slot -> value
+    std::vector<std::vector<std::pair<int, IRInstr*>>> incompletePhis;
+    std::vector<bool> sealed;
+    std::map<int, IRInstr*> entryValues;
+    std::map<int, const std::string*> slotNames;
+
+    IRBlock* newBlock() {
+        IRBlock* block = fn.newBlock();
+        definitions.resize(fn.blockCount);
+        incompletePhis.resize(fn.blockCount);
+        sealed.resize(fn.blockCount, false);
+        return block;
+    }
+
+    // Blocks are laid out in the order they are entered
+    void enter(IRBlock* block) {
+        fn.blocks.push_back(block);
+        current = block;
+    }
+
+    IRInstr* emit(IROp op, std::vector<IRInstr*> args = {}, int index = 0) {
+        IRInstr* instr = fn.newInstr(op);
+        instr->args = std::move(args);
+        instr->index = index;
+        instr->block = current;
+        current->instrs.push_back(instr);
+        return instr;
+    }
+
+    IRInstr* constant(const Value& value) {
+        IRInstr* instr = emit(IROp::CONST);
+        instr->constant = value;
+        return instr;
+    }
+
+    // Phis, then entry values, go ahead of everything else in a block
+    IRInstr* insertAtTop(IRBlock* block, IROp op) {
+        IRInstr* instr = fn.newInstr(op);
+        instr->block = block;
+        auto pos = block->instrs.begin();
+        while (pos != block->instrs.end() &&
+               ((*pos)->op == IROp::PHI || (op != IROp::PHI && (*pos)->op == IROp::ENTRY))) {
+            ++pos;
+        }
+        block->instrs.insert(pos, instr);
+        return instr;
+    }
+
+    void jump(IRBlock* target) {
+        emit(IROp::JUMP);
+        addEdge(current, target);
+    }
+
+    void branch(IRInstr* condition, IRBlock* ifTrue, IRBlock* ifFalse) {
+        emit(IROp::BRANCH, {condition});
+        addEdge(current, ifTrue);
+        addEdge(current, ifFalse);
+    }
+
+    // Ends the block without a successor. Statements after it are still
+    // built, into a block nothing reaches, so their names resolve as before.
+    IRInstr* endPath(IROp op, std::vector<IRInstr*> args = {}, int index = 0) {
+        IRInstr* instr = emit(op, std::move(args), index);
+        IRBlock* dead = newBlock();
+        seal(dead);
+        enter(dead);
+        return instr;
+    }
+
+    void writeVariable(int slot, IRBlock* block, IRInstr* value) {
+        definitions[block->id][slot] = value;
+    }
+
+    IRInstr* readVariable(int slot, IRBlock* block) {
+        auto found = definitions[block->id].find(slot);
+        if (found != definitions[block->id].end()) return found->second;
+
+        IRInstr* value;
+        if (!sealed[block->id]) {
+            value = newPhi(block, slot);
+            incompletePhis[block->id].push_back({slot, value});
+        } else if (block->preds.empty()) {
+            value = block == fn.blocks[0] ? entryValue(slot) : nullptr;
+            if (!value) {
+                // Nothing reaches this block; any value will do
+                value = insertAtTop(block, IROp::CONST);
+                value->constant = Value::Null();
+            }
+        } else if (block->preds.size() == 1) {
+            value = readVariable(slot, block->preds[0]);
+        } else {
+            // Defined first, so a loop reaching back here finds the phi
+            value = newPhi(block, slot);
+            writeVariable(slot, block, value);
+            addPhiOperands(slot, value);
+        }
+        writeVariable(slot, block, value);
+        return value;
+    }
+
+    IRInstr* newPhi(IRBlock* block, int slot) {
+        IRInstr* phi = insertAtTop(block, IROp::PHI);
+        phi->name = slotNames[slot];
+        return phi;
+    }
+
+    void addPhiOperands(int slot, IRInstr* phi) {
+        for (IRBlock* pred : phi->block->preds) {
+            phi->args.push_back(readVariable(slot, pred));
+        }
+    }
+
+    void seal(IRBlock* block) {
+        sealed[block->id] = true;
+        for (auto& incomplete : incompletePhis[block->id]) {
+            addPhiOperands(incomplete.first, incomplete.second);
+        }
+        incompletePhis[block->id].clear();
+    }
+
+    // Whatever the caller left in the slot: an argument, or the padding
+    // OP_MAKEFRAME pushes
+    IRInstr* entryValue(int slot) {
+        IRInstr*& value = entryValues[slot];
+        if (!value) {
+            value = insertAtTop(fn.blocks[0], IROp::ENTRY);
+            value->index = slot;
+            value->name = slotNames[slot];
+        }
+        return value;
+    }
+
+    // A phi over the values each predecessor of the current block brings
+    IRInstr* merge(const std::map<IRBlock*, IRInstr*>& incoming) {
+        IRInstr* phi = insertAtTop(current, IROp::PHI);
+        for (IRBlock* pred : current->preds) {
+            phi->args.push_back(incoming.at(pred));
+        }
+        return phi;
+    }
+
+    void declareLocal(const std::string& name, int slot) {
+        compiler.locals[name] = slot;
+        slotNames[slot] = &name;
+    }
+
+    void assign(const std::string& name, IRInstr* value) {
+        int slot = compiler.resolveLocal(name);
+        if (slot == -1 && compiler.inFunction) {
+            slot = compiler.localCount++;
+            declareLocal(name, slot);
+        }
+        if (slot != -1) {
+            IRInstr* copy = emit(IROp::COPY, {value});
+            copy->name = &name;
+            writeVariable(slot, current, copy);
+        } else {
+            IRInstr* store = emit(IROp::STORE_GLOBAL, {value}, compiler.resolveGlobal(name));
+            store->name = &name;
+        }
+    }
+
+    // Branches to ifTrue or ifFalse on the condition's truthiness. and, or
+    // and not become control flow instead of values.
+    void buildBranch(ASTNode* condition, IRBlock* ifTrue, IRBlock* ifFalse) {
+        if (compiler.optimizationsEnabled) {
+            Value folded;
+            if (compiler.optimizeConstantFolding(condition, folded)) {
+                jump(isTruthy(folded) ? ifTrue : ifFalse);
+                return;
+            }
+            if (condition->type == ASTNodeType::UNARY_OP &&
+                static_cast<UnaryOpNode*>(condition)->op == UnaryOp::NOT) {
+                buildBranch(static_cast<UnaryOpNode*>(condition)->operand, ifFalse, ifTrue);
+                return;
+            }
+            if (condition->type == ASTNodeType::BINARY_OP) {
+                BinaryOpNode* binNode = static_cast<BinaryOpNode*>(condition);
+                if (binNode->op == BinaryOp::AND || binNode->op == BinaryOp::OR) {
+                    IRBlock* right = newBlock();
+                    if (binNode->op == BinaryOp::AND) {
+                        buildBranch(binNode->left, right, ifFalse);
+                    } else {
+                        buildBranch(binNode->left, ifTrue, right);
+                    }
+                    enter(right);
+                    seal(right);
+                    buildBranch(binNode->right, ifTrue, ifFalse);
+                    return;
+                }
+            }
+        }
+        branch(buildExpression(condition), ifTrue, ifFalse);
+    }
+
+    void buildStatements(ASTNode* block) {
+        if (block->type != ASTNodeType::BLOCK) return;
+        for (auto& stmt : static_cast<BlockNode*>(block)->statements) {
+            buildStatement(stmt);
+        }
+    }
+
+    // Null for print, which leaves nothing behind
+    IRInstr* buildCall(FunctionCallNode* callNode) {
+        std::vector<IRInstr*> args;
+        for (auto& arg : callNode->arguments) {
+            args.push_back(buildExpression(arg));
+        }
+        int argc = static_cast<int>(args.size());
+        int nativeId = resolveNative(callNode->name, argc);
+        if (callNode->name == "print") {
+            emit(IROp::PRINT, std::move(args));
+            return nullptr;
+        }
+        if (nativeId >= 0) {
+            return emit(IROp::CALL_NATIVE, std::move(args), nativeId);
+        }
+        auto func = compiler.functions.find(callNode->name);
+        if (func == compiler.functions.end()) {
+            throw std::runtime_error("Undefined function: " + callNode->name);
+        }
+        IRInstr* call = emit(IROp::CALL, std::move(args), func->second);
+        call->name = &callNode->name;
+        return call;
+    }
+
+    IRInstr* buildExpression(ASTNode* node) {
+        Value folded;
+        if (compiler.optimizeConstantFolding(node, folded)) return constant(folded);
+        switch (node->type) {
+            case ASTNodeType::NUMBER:
+                return constant(Value(static_cast<NumberNode*>(node)->value));
+            case ASTNodeType::STRING:
+                return constant(Value(compiler.internString(static_cast<StringNode*>(node)->value)));
+            case ASTNodeType::BOOLEAN:
+                return constant(Value(static_cast<BooleanNode*>(node)->value));
+            case ASTNodeType::NULLVAL:
+                return constant(Value::Null());
+            case ASTNodeType::ARRAY: {
+                std::vector<IRInstr*> elements;
+                for (auto& elem : static_cast<ArrayNode*>(node)->elements) {
+                    elements.push_back(buildExpression(elem));
+                }
+                return emit(IROp::ARRAY, std::move(elements));
+            }
+            case ASTNodeType::HASHMAP: {
+                std::vector<IRInstr*> entries;
+                for (auto& pair : static_cast<HashMapNode*>(node)->pairs) {
+                    entries.push_back(buildExpression(pair.first));
+                    entries.push_back(buildExpression(pair.second));
+                }
+                return emit(IROp::HASHMAP, std::move(entries));
+            }
+            case ASTNodeType::INDEX: {
+                IndexNode* idxNode = static_cast<IndexNode*>(node);
+                IRInstr* container = buildExpression(idxNode->array);
+                if (compiler.optimizationsEnabled && idxNode->index->type == ASTNodeType::STRING) {
+                    IRInstr* get = emit(IROp::GET_FIELD, {container});
+                    get->constant = Value(compiler.internString(static_cast<StringNode*>(idxNode->index)->value));
+                    return get;
+                }
+                IRInstr* index = buildExpression(idxNode->index);
+                return emit(IROp::INDEX_GET, {container, index});
+            }
+            case ASTNodeType::IDENTIFIER: {
+                const std::string& name = static_cast<IdentifierNode*>(node)->name;
+                int slot = compiler.resolveLocal(name);
+                if (slot != -1) return readVariable(slot, current);
+                IRInstr* load = emit(IROp::LOAD_GLOBAL, {}, compiler.resolveGlobal(name));
+                load->name = &name;
+                return load;
+            }
+            case ASTNodeType::BINARY_OP:
+                return buildBinary(static_cast<BinaryOpNode*>(node));
+            case ASTNodeType::UNARY_OP: {
+                UnaryOpNode* unaryNode = static_cast<UnaryOpNode*>(node);
+                IRInstr* operand = buildExpression(unaryNode->operand);
+                return emit(unaryNode->op == UnaryOp::NEGATE ? IROp::NEGATE : IROp::NOT, {operand});
+            }
+            case ASTNodeType::TERNARY: {
+                TernaryNode* ternNode = static_cast<TernaryNode*>(node);
+                IRBlock* thenBlock = newBlock();
+                IRBlock* elseBlock = newBlock();
+                IRBlock* end = newBlock();
+                std::map<IRBlock*, IRInstr*> incoming;
+                buildBranch(ternNode->condition, thenBlock, elseBlock);
+                enter(thenBlock);
+                seal(thenBlock);
+                incoming[current] = buildExpression(ternNode->thenExpr);
+                jump(end);
+                enter(elseBlock);
+                seal(elseBlock);
+                incoming[current] = buildExpression(ternNode->elseExpr);
+                jump(end);
+                enter(end);
+                seal(end);
+                return merge(incoming);
+            }
+            case ASTNodeType::FUNCTION_CALL: {
+                // print(...) used as a value gives null
+                IRInstr* result = buildCall(static_cast<FunctionCallNode*>(node));
+                return result ? result : constant(Value::Null());
+            }
+            default:
+                // Statements never appear where the parser expects a value
+                return constant(Value::Null());
+        }
+    }
+
+    IRInstr* buildBinary(BinaryOpNode* binNode) {
+        if (binNode->op == BinaryOp::AND || binNode->op == BinaryOp::OR) {
+            // The result is the left operand when it decides, else the right
+            std::map<IRBlock*, IRInstr*> incoming;
+            IRInstr* left = buildExpression(binNode->left);
+            incoming[current] = left;
+            IRBlock* right = newBlock();
+            IRBlock* end = newBlock();
+            if (binNode->op == BinaryOp::AND) {
+                branch(left, right, end);
+            } else {
+                branch(left, end, right);
+            }
+            enter(right);
+            seal(right);
+            incoming[current] = buildExpression(binNode->right);
+            jump(end);
+            enter(end);
+            seal(end);
+            return merge(incoming);
+        }
+
+        IRInstr* left = buildExpression(binNode->left);
+        IRInstr* right = buildExpression(binNode->right);
+        IROp op = IROp::ADD;
+        switch (binNode->op) {
+            case BinaryOp::ADD: op = IROp::ADD; break;
+            case BinaryOp::SUBTRACT: op = IROp::SUBTRACT; break;
+            case BinaryOp::MULTIPLY: op = IROp::MULTIPLY; break;
+            case BinaryOp::DIVIDE: op = IROp::DIVIDE; break;
+            case BinaryOp::LESS: op = IROp::LESS; break;
+            case BinaryOp::GREATER: op = IROp::GREATER; break;
+            case BinaryOp::LESS_EQUAL: op = IROp::LESS_EQUAL; break;
+            case BinaryOp::GREATER_EQUAL: op = IROp::GREATER_EQUAL; break;
+            case BinaryOp::EQUAL: op = IROp::EQUAL; break;
+            case BinaryOp::NOT_EQUAL: op = IROp::NOT_EQUAL; break;
+            default: break;
+        }
+        return emit(op, {left, right});
+    }
+
+    void buildStatement(ASTNode* node) {
+        switch (node->type) {
+            case ASTNodeType::ASSIGNMENT: {
+                AssignmentNode* assignNode = static_cast<AssignmentNode*>(node);
+                assign(assignNode->name, buildExpression(assignNode->value));
+                break;
+            }
+            case ASTNodeType::INDEX_ASSIGNMENT: {
+                IndexAssignmentNode* assignNode = static_cast<IndexAssignmentNode*>(node);
+                IRInstr* container = buildExpression(assignNode->array);
+                if (compiler.optimizationsEnabled && assignNode->index->type == ASTNodeType::STRING) {
+                    IRInstr* value = buildExpression(assignNode->value);
+                    IRInstr* set = emit(IROp::SET_FIELD, {container, value});
+                    set->constant = Value(compiler.internString(static_cast<StringNode*>(assignNode->index)->value));
+                } else {
+                    IRInstr* index = buildExpression(assignNode->index);
+                    IRInstr* value = buildExpression(assignNode->value);
+                    emit(IROp::INDEX_SET, {container, index, value});
+                }
+                break;
+            }
+            case ASTNodeType::FUNCTION_CALL:
+                buildCall(static_cast<FunctionCallNode*>(node));
+                break;
+            case ASTNodeType::FUNCTION_DEF:
+                defineFunction(static_cast<FunctionDefNode*>(node));
+                break;
+            case ASTNodeType::RETURN: {
+                ReturnNode* retNode = static_cast<ReturnNode*>(node);
+                if (compiler.inFunction && compiler.isTailCall(retNode->value)) {
+                    FunctionCallNode* callNode = static_cast<FunctionCallNode*>(retNode->value);
+                    std::vector<IRInstr*> args;
+                    for (auto& arg : callNode->arguments) {
+                        args.push_back(buildExpression(arg));
+                    }
+                    IRInstr* call = endPath(IROp::TAIL_CALL, std::move(args), compiler.functions[callNode->name]);
+                    call->name = &callNode->name;
+                } else {
+                    endPath(IROp::RETURN, {buildExpression(retNode->value)});
+                }
+                break;
+            }
+            case ASTNodeType::IF_STATEMENT: {
+                IfStatementNode* ifNode = static_cast<IfStatementNode*>(node);
+                Value folded;
+                if (compiler.optimizeConstantFolding(ifNode->condition, folded)) {
+                    ASTNode* taken = isTruthy(folded) ? ifNode->thenBranch : ifNode->elseBranch;
+                    if (taken) buildStatements(taken);
+                    break;
+                }
+                IRBlock* thenBlock = newBlock();
+                IRBlock* elseBlock = ifNode->elseBranch ? newBlock() : nullptr;
+                IRBlock* end = newBlock();
+                buildBranch(ifNode->condition, thenBlock, elseBlock ? elseBlock : end);
+                enter(thenBlock);
+                seal(thenBlock);
+                buildStatements(ifNode->thenBranch);
+                jump(end);
+                if (elseBlock) {
+                    enter(elseBlock);
+                    seal(elseBlock);
+                    buildStatements(ifNode->elseBranch);
+                    jump(end);
+                }
+                enter(end);
+                seal(end);
+                break;
+            }
+            case ASTNodeType::WHILE_STATEMENT: {
+                WhileStatementNode* whileNode = static_cast<WhileStatementNode*>(node);
+                buildLoop(whileNode->condition, whileNode->body, nullptr);
+                break;
+            }
+            case ASTNodeType::FOR_STATEMENT: {
+                ForStatementNode* forNode = static_cast<ForStatementNode*>(node);
+                buildStatement(forNode->init);
+                buildLoop(forNode->condition, forNode->body, forNode->increment);
+                break;
+            }
+            case ASTNodeType::USE_STATEMENT:
+                compiler.loadStandardLibrary(static_cast<UseStatementNode*>(node)->library);
+                break;
+            case ASTNodeType::BREAK_STATEMENT:
+                endPath(IROp::BREAK);
+                break;
+            case ASTNodeType::CONTINUE_STATEMENT:
+                endPath(IROp::CONTINUE);
+                break;
+            default:
+                break;
+        }
+    }
+
+    void buildLoop(ASTNode* condition, ASTNode* body, ASTNode* increment) {
+        IRBlock* header = newBlock();
+        IRBlock* bodyBlock = newBlock();
+        IRBlock* exit = newBlock();
+        jump(header);
+        enter(header);
+        buildBranch(condition, bodyBlock, exit);
+        enter(bodyBlock);
+        seal(bodyBlock);
+        buildStatements(body);
+        if (increment) buildStatement(increment);
+        jump(header);
+        seal(header);
+        enter(exit);
+        seal(exit);
+    }
+
+    // The function gets its table slot before its body is built, so
+    // recursive calls resolve and nested definitions get slots of their own
+    void defineFunction(FunctionDefNode* funcNode) {
+        Function func;
+        func.name = funcNode->name;
+        func.arity = static_cast<int>(funcNode->params.size());
+        for (const std::string* param : funcNode->params) {
+            func.params.push_back(*param);
+        }
+        int id = static_cast<int>(compiler.functionTable.size());
+        compiler.functions[funcNode->name] = id;
+        compiler.functionTable.push_back(std::move(func));
+
+        std::map<std::string, int> outerLocals = std::move(compiler.locals);
+        int outerCount = compiler.localCount;
+        bool wasInFunction = compiler.inFunction;
+        compiler.locals.clear();
+        compiler.localCount = 0;
+        compiler.inFunction = true;
+
+        std::unique_ptr<IRFunction> body(new IRFunction());
+        body->name = funcNode->name;
+        body->arity = static_cast<int>(funcNode->params.size());
+        IRBuilder(compiler, program, *body).buildFunction(funcNode);
+
+        compiler.locals = std::move(outerLocals);
+        compiler.localCount = outerCount;
+        compiler.inFunction = wasInFunction;
+        if (program.functions.size() <= static_cast<size_t>(id)) program.functions.resize(id + 1);
+        program.functions[id] = std::move(body);
+    }
+
+public:
+    IRBuilder(Compiler& compiler, IRProgram& program, IRFunction& fn)
+        : compiler(compiler), program(program), fn(fn), current(nullptr) {
+        IRBlock* entry = newBlock();
+        enter(entry);
+        seal(entry);
+    }
+
+    void buildMain(ProgramNode* node) {
+        for (auto& stmt : node->statements) {
+            buildStatement(stmt);
+        }
+        emit(IROp::HALT);
+    }
+
+    void buildFunction(FunctionDefNode* funcNode) {
+        for (size_t i = 0; i < funcNode->params.size(); i++) {
+            declareLocal(*funcNode->params[i], static_cast<int>(i));
+            compiler.localCount++;
+        }
+        buildStatements(funcNode->body);
+        emit(IROp::RETURN, {constant(Value(0.0))});
+    }
+};
+
+void Compiler::buildIR(ProgramNode* program, IRProgram& ir) {
+    ir.main.reset(new IRFunction());
+    ir.main->name = "main";
+    ir.main->isMain = true;
+    IRBuilder(*this, ir, *ir.main).buildMain(program);
+}
@@ -0,0 +1,895 @@
+#include "../include/ir.h"
+#include <algorithm>
+#include <stdexcept>
+
+// Lowers SSA form to stack VM code, much as WebAssembly producers do: a
+// value used once, right where it is computed, stays on the operand stack
+// as part of its user's expression tree, and every other value lives in a
+// frame slot. Slots are shared by values whose live ranges do not overlap,
+// and phis are coalesced with their operands where possible so most merges
+// need no copies. Parameters keep the slots their arguments arrive in.
+// A merge whose value is used straight away, like the result of ?: or of
+// and/or, is carried into its block on the stack instead.
+class StackCodegen {
+private:
+    enum class Kind : uint8_t {
+        NONE,       // no code of its own, or a result nothing uses
+        CONSTANT,   // pushed again at every use
+        TREE,       // pushed by its only user's expression tree
+        SLOT,       // kept in a frame slot
+        STACK       // phi left on the stack by every predecessor, or an
+                    // and/or operand a peeking jump leaves for one
+    };
+
+    struct Fixup {
+        size_t operand;
+        int label;
+        bool conditional;
+    };
+
+    // A branch edge that needs phi copies, or would jump backwards
+    // conditionally, goes through a stub after the last block
+    struct Stub {
+        IRBlock* from;
+        IRBlock* to;
+    };
+
+    IRFunction& fn;
+    Chunk& chunk;
+    bool optimize;
+    std::vector<Kind> kind;         // by instruction id
+    std::vector<int> uses;
+    std::vector<IRInstr*> user;     // the last user seen
+    std::vector<bool> usedByPhi;
+    std::vector<std::vector<std::pair<IRInstr*, size_t>>> useSites;  // user, operand
+    std::vector<int> liveId;        // SLOT values, dense
+    std::vector<IRInstr*> liveValues;
+    std::vector<int> slot;          // by live id
+    std::vector<int> blockIndex;    // layout position by block id
+    std::vector<int> labels;        // code offset by label; blocks, then stubs
+    std::vector<Fixup> fixups;
+    std::vector<Stub> stubs;
+    std::vector<std::vector<IRInstr*>> roots;  // by block id: code outside trees, in order
+    std::vector<IRInstr*> stackPhi; // by block id
+    std::vector<bool> peekBranch;   // by block id: JUMP_IF_FALSE keeps the condition
+    // Already on the stack, so the next push of it emits nothing
+    IRInstr* pending = nullptr;
+
+    // Uses and classification
+
+    void countUses() {
+        kind.assign(fn.instrCount, Kind::NONE);
+        uses.assign(fn.instrCount, 0);
+        user.assign(fn.instrCount, nullptr);
+        usedByPhi.assign(fn.instrCount, false);
+        useSites.assign(fn.instrCount, {});
+        for (IRBlock* block : fn.blocks) {
+            for (IRInstr* instr : block->instrs) {
+                for (size_t i = 0; i < instr->args.size(); i++) {
+                    IRInstr* arg = instr->args[i];
+                    uses[arg->id]++;
+                    user[arg->id] = instr;
+                    useSites[arg->id].push_back({instr, i});
+                    if (instr->op == IROp::PHI) usedByPhi[arg->id] = true;
+                }
+            }
+        }
+    }
+
+    void appendTree(IRInstr* instr, std::vector<IRInstr*>& order) {
+        for (IRInstr* arg : instr->args) {
+            if (kind[arg->id] == Kind::TREE) appendTree(arg, order);
+        }
+        order.push_back(instr);
+    }
+
+    void classify() {
+        for (IRBlock* block : fn.blocks) {
+            for (IRInstr* instr : block->instrs) {
+                Kind& k = kind[instr->id];
+                if (instr->op == IROp::CONST) {
+                    k = Kind::CONSTANT;
+                } else if (!producesValue(instr->op) || uses[instr->id] == 0) {
+                    k = Kind::NONE;
+                } else if (instr->op == IROp::PHI || instr->op == IROp::ENTRY || uses[instr->id] > 1 ||
+                           usedByPhi[instr->id] || user[instr->id]->block != block) {
+                    k = Kind::SLOT;
+                } else {
+                    k = Kind::TREE;
+                }
+            }
+            // Trees are emitted at their root, so they must not reorder
+            // anything: the roots' trees, in order, have to reproduce the
+            // block. Passes keep that true; fall back to slots if not.
+            std::vector<IRInstr*> expected;
+            std::vector<IRInstr*> emitted;
+            for (IRInstr* instr : block->instrs) {
+                if (!hasCode(instr)) continue;
+                expected.push_back(instr);
+                if (kind[instr->id] != Kind::TREE) appendTree(instr, emitted);
+            }
+            if (emitted != expected) {
+                for (IRInstr* instr : block->instrs) {
+                    if (kind[instr->id] == Kind::TREE) kind[instr->id] = Kind::SLOT;
+                }
+            }
+        }
+    }
+
+    void findRoots() {
+        roots.assign(fn.blockCount, {});
+        for (IRBlock* block : fn.blocks) {
+            for (IRInstr* instr : block->instrs) {
+                if (isTerminator(instr->op) || (hasCode(instr) && kind[instr->id] != Kind::TREE)) {
+                    roots[block->id].push_back(instr);
+                }
+            }
+        }
+    }
+
+    // A phi can stay on the stack when its only use is the first push in its
+    // block and every predecessor comes before it and either jumps there or
+    // branches on the phi's operand, computed last, with the other successor
+    // right behind
+    void chooseStackPhis() {
+        stackPhi.assign(fn.blockCount, nullptr);
+        peekBranch.assign(fn.blockCount, false);
+        if (!optimize) return;
+        for (IRBlock* block : fn.blocks) {
+            for (IRInstr* instr : block->instrs) {
+                if (instr->op != IROp::PHI) break;
+                if (kind[instr->id] != Kind::SLOT || uses[instr->id] != 1 || usedByPhi[instr->id]) continue;
+                // Operands computed last in their block stay on the stack too
+                std::vector<IRInstr*> kept;
+                bool ok = true;
+                for (size_t i = 0; i < block->preds.size() && ok; i++) {
+                    IRBlock* pred = block->preds[i];
+                    IRInstr* end = pred->terminator();
+                    IRInstr* operand = instr->args[i];
+                    ok = blockIndex[pred->id] < blockIndex[block->id];
+                    if (!ok) break;
+                    if (end->op == IROp::JUMP) {
+                        if (computedLast(pred, operand) && uses[operand->id] == 1) kept.push_back(operand);
+                        continue;
+                    }
+                    ok = end->op == IROp::BRANCH && end->args[0] == operand && computedLast(pred, operand) &&
+                         uses[operand->id] == 2 && keepsCondition(pred, block);
+                    if (ok) kept.push_back(operand);
+                }
+                if (!ok) continue;
+                kind[instr->id] = Kind::STACK;
+                if (firstPush(block, roots[block->id][0]) == instr) {
+                    stackPhi[block->id] = instr;
+                    for (IRInstr* operand : kept) {
+                        kind[operand->id] = Kind::STACK;
+                        if (operand->block->terminator()->op == IROp::BRANCH) peekBranch[operand->block->id] = true;
+                    }
+                    break;
+                }
+                kind[instr->id] = Kind::SLOT;
+            }
+        }
+    }
+
+    // A slot value computed by the last root before block's terminator
+    bool computedLast(IRBlock* block, IRInstr* value) {
+        const std::vector<IRInstr*>& order = roots[block->id];
+        return value->block == block && value->op != IROp::PHI && kind[value->id] == Kind::SLOT &&
+               order.size() >= 2 && order[order.size() - 2] == value;
+    }
+
+    // Whether from's branch can peek at its condition and leave it on the
+    // stack for a phi in merge: the other successor must follow on from it
+    bool keepsCondition(IRBlock* from, IRBlock* merge) {
+        IRBlock* other = from->succs[0] == merge ? from->succs[1] : from->succs[0];
+        return other != merge && other->preds.size() == 1 && blockIndex[other->id] == blockIndex[from->id] + 1;
+    }
+
+    static bool hasCode(const IRInstr* instr) {
+        return instr->op != IROp::CONST && instr->op != IROp::PHI && instr->op != IROp::ENTRY;
+    }
+
+    // Slot values an instruction's tree reads
+    void treeReads(IRInstr* instr, std::vector<int>& reads) {
+        for (IRInstr* arg : instr->args) {
+            if (kind[arg->id] == Kind::TREE) {
+                treeReads(arg, reads);
+            } else if (kind[arg->id] == Kind::SLOT) {
+                reads.push_back(liveId[arg->id]);
+            }
+        }
+    }
+
+    // Liveness and slot assignment
+
+    void allocateSlots() {
+        liveId.assign(fn.instrCount, -1);
+        for (IRBlock* block : fn.blocks) {
+            for (IRInstr* instr : block->instrs) {
+                if (kind[instr->id] == Kind::SLOT) {
+                    liveId[instr->id] = static_cast<int>(liveValues.size());
+                    liveValues.push_back(instr);
+                }
+            }
+        }
+        size_t count = liveValues.size();
+        if (count == 0) return;
+
+        // Live-out sets, by walking back from each use to the definition
+        std::vector<std::vector<int>> liveOut(fn.blockCount);
+        std::vector<int> inMark(fn.blockCount, -1);
+        std::vector<int> outMark(fn.blockCount, -1);
+        std::vector<IRBlock*> worklist;
+        for (size_t v = 0; v < count; v++) {
+            IRInstr* value = liveValues[v];
+            IRBlock* home = value->block;
+            int id = static_cast<int>(v);
+            auto markOut = [&](IRBlock* block) {
+                if (outMark[block->id] == id) return;
+                outMark[block->id] = id;
+                liveOut[block->id].push_back(id);
+                if (block != home && inMark[block->id] != id) {
+                    inMark[block->id] = id;
+                    worklist.push_back(block);
+                }
+            };
+            for (auto& site : useSites[value->id]) {
+                IRBlock* block = site.first->block;
+                if (site.first->op == IROp::PHI) {
+                    markOut(block->preds[site.second]);
+                } else if (block != home && inMark[block->id] != id) {
+                    inMark[block->id] = id;
+                    worklist.push_back(block);
+                }
+            }
+            while (!worklist.empty()) {
+                IRBlock* block = worklist.back();
+                worklist.pop_back();
+                for (IRBlock* pred : block->preds) markOut(pred);
+            }
+        }
+
+        // Interference: values live at the same time need different slots
+        std::vector<std::vector<int>> interferes(count);
+        std::vector<bool> isLive(count, false);
+        std::vector<int> live;
+        auto interfere = [&](int v) {
+            for (int other : live) {
+                if (other == v || !isLive[other]) continue;
+                interferes[v].push_back(other);
+                interferes[other].push_back(v);
+            }
+        };
+        for (IRBlock* block : fn.blocks) {
+            live.clear();
+            for (int v : liveOut[block->id]) {
+                isLive[v] = true;
+                live.push_back(v);
+            }
+            std::vector<int> reads;
+            for (size_t i = block->instrs.size(); i-- > 0;) {
+                IRInstr* instr = block->instrs[i];
+                if (!hasCode(instr) || kind[instr->id] == Kind::TREE) continue;
+                if (kind[instr->id] == Kind::SLOT) {
+                    interfere(liveId[instr->id]);
+                    isLive[liveId[instr->id]] = false;
+                }
+                reads.clear();
+                treeReads(instr, reads);
+                for (int v : reads) {
+                    if (!isLive[v]) {
+                        isLive[v] = true;
+                        live.push_back(v);
+                    }
+                }
+            }
+            // Phis and entry values are all defined on entry to the block,
+            // so they interfere with each other as well
+            std::vector<int> atEntry;
+            for (IRInstr* instr : block->instrs) {
+                if (kind[instr->id] == Kind::SLOT && !hasCode(instr)) {
+                    int v = liveId[instr->id];
+                    atEntry.push_back(v);
+                    if (!isLive[v]) {
+                        isLive[v] = true;
+                        live.push_back(v);
+                    }
+                }
+            }
+            for (int v : atEntry) interfere(v);
+            for (int v : live) isLive[v] = false;
+        }
+
+        // Coalescing: a phi shares its operands' slot, and x + k the slot
+        // of x, unless they interfere
+        std::vector<int> parent(count);
+        std::vector<std::vector<int>> members(count);
+        std::vector<int> pinned(count, -1);
+        for (size_t v = 0; v < count; v++) {
+            parent[v] = static_cast<int>(v);
+            members[v].push_back(static_cast<int>(v));
+            if (liveValues[v]->op == IROp::ENTRY) pinned[v] = liveValues[v]->index;
+        }
+        auto find = [&](int v) {
+            while (parent[v] != v) v = parent[v] = parent[parent[v]];
+            return v;
+        };
+        auto unite = [&](IRInstr* a, IRInstr* b) {
+            if (kind[a->id] != Kind::SLOT || kind[b->id] != Kind::SLOT) return;
+            int ca = find(liveId[a->id]);
+            int cb = find(liveId[b->id]);
+            if (ca == cb) return;
+            if (pinned[ca] >= 0 && pinned[cb] >= 0) return;
+            if (members[ca].size() < members[cb].size()) std::swap(ca, cb);
+            for (int m : members[cb]) {
+                for (int other : interferes[m]) {
+                    if (find(other) == ca) return;
+                }
+            }
+            parent[cb] = ca;
+            members[ca].insert(members[ca].end(), members[cb].begin(), members[cb].end());
+            members[cb].clear();
+            if (pinned[ca] < 0) pinned[ca] = pinned[cb];
+        };
+        for (IRBlock* block : fn.blocks) {
+            for (IRInstr* instr : block->instrs) {
+                if (instr->op != IROp::PHI) break;
+                for (IRInstr* arg : instr->args) unite(instr, arg);
+            }
+        }
+        for (IRInstr* value : liveValues) {
+            if ((value->op == IROp::ADD && isNumberConstant(value->args[1])) || value->op == IROp::COPY) {
+                unite(value, value->args[0]);
+            }
+        }
+
+        // Colouring: parameters first, then the lowest free slot
+        std::vector<int> classSlot(count, -1);
+        for (size_t c = 0; c < count; c++) {
+            if (find(static_cast<int>(c)) == static_cast<int>(c) && pinned[c] >= 0) classSlot[c] = pinned[c];
+        }
+        for (size_t c = 0; c < count; c++) {
+            if (find(static_cast<int>(c)) != static_cast<int>(c) || classSlot[c] >= 0) continue;
+            std::vector<bool> taken;
+            for (int m : members[c]) {
+                for (int other : interferes[m]) {
+                    int s = classSlot[find(other)];
+                    if (s < 0) continue;
+                    if (static_cast<size_t>(s) >= taken.size()) taken.resize(s + 1, false);
+                    taken[s] = true;
+                }
+            }
+            int s = 0;
+            while (static_cast<size_t>(s) < taken.size() && taken[s]) s++;
+            classSlot[c] = s;
+        }
+        slot.resize(count);
+        for (size_t v = 0; v < count; v++) slot[v] = classSlot[find(static_cast<int>(v))];
+    }
+
+    // Emission
+
+    bool isNumberConstant(const IRInstr* instr) const {
+        return instr->op == IROp::CONST && instr->constant.isNumber();
+    }
+
+    // Constants the .zsc format can hold, for the *_CONST superinstructions
+    bool isPoolConstant(const IRInstr* instr) const {
+        return instr->op == IROp::CONST && (instr->constant.isNumber() || instr->constant.isString());
+    }
+
+    int slotOf(const IRInstr* instr) const { return slot[liveId[instr->id]]; }
+
+    bool inSlot(const IRInstr* instr) const { return kind[instr->id] == Kind::SLOT; }
+
+    // Stack phis are chosen before slots are assigned; nothing shares one yet
+    bool sameSlot(const IRInstr* a, const IRInstr* b) const {
+        return inSlot(a) && inSlot(b) && !slot.empty() && slotOf(a) == slotOf(b);
+    }
+
+    static size_t predIndex(const IRBlock* to, const IRBlock* from) {
+        return std::find(to->preds.begin(), to->preds.end(), from) - to->preds.begin();
+    }
+
+    // Superinstruction patterns, shared by emission and firstPush()
+
+    bool isAddLocals(const IRInstr* instr) const {
+        return optimize && inSlot(instr->args[0]) && inSlot(instr->args[1]);
+    }
+
+    bool isAddGlobals(const IRInstr* instr) const {
+        const IRInstr* a = instr->args[0];
+        const IRInstr* b = instr->args[1];
+        return optimize && kind[a->id] == Kind::TREE && a->op == IROp::LOAD_GLOBAL && kind[b->id] == Kind::TREE &&
+               b->op == IROp::LOAD_GLOBAL;
+    }
+
+    bool isIncGlobal(const IRInstr* store) const {
+        const IRInstr* value = store->args[0];
+        if (!optimize || kind[value->id] != Kind::TREE || value->op != IROp::ADD) return false;
+        const IRInstr* load = value->args[0];
+        return kind[load->id] == Kind::TREE && load->op == IROp::LOAD_GLOBAL && load->index == store->index &&
+               isNumberConstant(value->args[1]);
+    }
+
+    bool isIncLocal(const IRInstr* instr) const {
+        return optimize && instr->op == IROp::ADD && sameSlot(instr->args[0], instr) &&
+               isNumberConstant(instr->args[1]);
+    }
+
+    bool isCoalescedCopy(const IRInstr* instr) const {
+        return instr->op == IROp::COPY && sameSlot(instr->args[0], instr);
+    }
+
+    static bool isCompare(IROp op) {
+        return op == IROp::LESS || op == IROp::LESS_EQUAL || op == IROp::GREATER || op == IROp::GREATER_EQUAL;
+    }
+
+    // The slot or stack value a root's code reads before anything else, if
+    // any; this follows the emit functions below
+    IRInstr* firstPush(IRBlock* block, IRInstr* root) {
+        switch (root->op) {
+            case IROp::STORE_GLOBAL:
+                if ((optimize && isPoolConstant(root->args[0])) || isIncGlobal(root)) return nullptr;
+                return firstLeaf(root->args[0]);
+            case IROp::JUMP:
+                return firstMove(block, block->succs[0]);
+            case IROp::BRANCH: {
+                IRInstr* condition = root->args[0];
+                if (optimize && kind[condition->id] == Kind::TREE && isCompare(condition->op)) {
+                    return firstLeaf(condition->args[0]);
+                }
+                return firstLeaf(condition);
+            }
+            case IROp::HALT:
+            case IROp::BREAK:
+            case IROp::CONTINUE:
+                return nullptr;
+            case IROp::INDEX_SET:
+            case IROp::SET_FIELD:
+            case IROp::PRINT:
+            case IROp::RETURN:
+            case IROp::TAIL_CALL:
+                return root->args.empty() ? nullptr : firstLeaf(root->args[0]);
+            default:
+                break;
+        }
+        if (inSlot(root) && (isIncLocal(root) || isCoalescedCopy(root))) return nullptr;
+        return firstInTree(root);
+    }
+
+    IRInstr* firstLeaf(IRInstr* value) {
+        switch (kind[value->id]) {
+            case Kind::SLOT:
+            case Kind::STACK:
+                return value;
+            case Kind::TREE:
+                return firstInTree(value);
+            default:
+                return nullptr;
+        }
+    }
+
+    IRInstr* firstInTree(IRInstr* instr) {
+        switch (instr->op) {
+            case IROp::CONST:
+            case IROp::ENTRY:
+            case IROp::PHI:
+                return firstLeaf(instr);
+            case IROp::LOAD_GLOBAL:
+                return nullptr;
+            case IROp::ADD:
+                if (isAddLocals(instr) || isAddGlobals(instr)) return nullptr;
+                return firstLeaf(instr->args[0]);
+            default:
+                return instr->args.empty() ? nullptr : firstLeaf(instr->args[0]);
+        }
+    }
+
+    // The first value emitCopies() reads, or else the stack phi operand
+    IRInstr* firstMove(IRBlock* from, IRBlock* to) {
+        size_t pred = predIndex(to, from);
+        for (IRInstr* instr : to->instrs) {
+            if (instr->op != IROp::PHI) break;
+            if (!inSlot(instr)) continue;
+            IRInstr* source = instr->args[pred];
+            if (kind[source->id] != Kind::CONSTANT && slotOf(source) != slotOf(instr)) return source;
+        }
+        IRInstr* phi = stackPhi[to->id];
+        return phi ? firstLeaf(phi->args[pred]) : nullptr;
+    }
+
+    void pushConstant(const Value& value) {
+        if (value.isNumber()) {
+            if (optimize && value.raw() == Value(0.0).raw()) {
+                chunk.write(OpCode::OP_CONSTANT_0);
+            } else if (optimize && value.raw() == Value(1.0).raw()) {
+                chunk.write(OpCode::OP_CONSTANT_1);
+            } else {
+                chunk.writeOp(OpCode::OP_CONSTANT, {chunk.addConstant(value)});
+            }
+        } else if (value.isString()) {
+            chunk.writeOp(OpCode::OP_STRING, {chunk.addConstant(value)});
+        } else if (value.isBool()) {
+            chunk.write(value.asBool() ? OpCode::OP_TRUE : OpCode::OP_FALSE);
+        } else {
+            chunk.write(OpCode::OP_NULL);
+        }
+    }
+
+    void push(IRInstr* value) {
+        if (value == pending) {
+            pending = nullptr;
+            return;
+        }
+        switch (kind[value->id]) {
+            case Kind::CONSTANT:
+                pushConstant(value->constant);
+                break;
+            case Kind::SLOT:
+                chunk.writeOp(OpCode::OP_GET_LOCAL, {slotOf(value)});
+                break;
+            default:
+                pushTree(value);
+                break;
+        }
+    }
+
+    void pushArgs(IRInstr* instr) {
+        for (IRInstr* arg : instr->args) push(arg);
+    }
+
+    void storeLocal(int index) {
+        if (optimize) {
+            chunk.writeOp(OpCode::OP_SET_LOCAL_POP, {index});
+        } else {
+            chunk.writeOp(OpCode::OP_SET_LOCAL, {index});
+            chunk.write(OpCode::OP_POP);
+        }
+    }
+
+    static OpCode binaryOpCode(IROp op) {
+        switch (op) {
+            case IROp::ADD: return OpCode::OP_ADD;
+            case IROp::SUBTRACT: return OpCode::OP_SUBTRACT;
+            case IROp::MULTIPLY: return OpCode::OP_MULTIPLY;
+            case IROp::DIVIDE: return OpCode::OP_DIVIDE;
+            case IROp::LESS: return OpCode::OP_LESS;
+            case IROp::GREATER: return OpCode::OP_GREATER;
+            case IROp::LESS_EQUAL: return OpCode::OP_LESS_EQUAL;
+            case IROp::GREATER_EQUAL: return OpCode::OP_GREATER_EQUAL;
+            case IROp::EQUAL: return OpCode::OP_EQUAL;
+            default: return OpCode::OP_NOT_EQUAL;
+        }
+    }
+
+    // Pushes the result of a value-producing instruction
+    void pushTree(IRInstr* instr) {
+        switch (instr->op) {
+            case IROp::CONST:
+            case IROp::ENTRY:
+            case IROp::PHI:
+                push(instr);
+                break;
+            case IROp::COPY:
+                push(instr->args[0]);
+                break;
+            case IROp::LOAD_GLOBAL:
+                chunk.writeOp(OpCode::OP_GET_GLOBAL, {instr->index});
+                break;
+            case IROp::ADD: {
+                IRInstr* a = instr->args[0];
+                IRInstr* b = instr->args[1];
+                if (isAddLocals(instr)) {
+                    chunk.writeOp(OpCode::OP_ADD_LOCALS, {slotOf(a), slotOf(b)});
+                } else if (isAddGlobals(instr)) {
+                    chunk.writeOp(OpCode::OP_ADD_GLOBALS, {a->index, b->index});
+                } else {
+                    push(a);
+                    push(b);
+                    chunk.write(OpCode::OP_ADD);
+                }
+                break;
+            }
+            case IROp::NEGATE:
+            case IROp::NOT:
+                push(instr->args[0]);
+                chunk.write(instr->op == IROp::NEGATE ? OpCode::OP_NEGATE : OpCode::OP_NOT);
+                break;
+            case IROp::ARRAY:
+                pushArgs(instr);
+                chunk.writeOp(OpCode::OP_ARRAY, {static_cast<int>(instr->args.size())});
+                break;
+            case IROp::HASHMAP:
+                pushArgs(instr);
+                chunk.writeOp(OpCode::OP_HASHMAP, {static_cast<int>(instr->args.size() / 2)});
+                break;
+            case IROp::INDEX_GET:
+                pushArgs(instr);
+                chunk.write(OpCode::OP_INDEX_GET);
+                break;
+            case IROp::GET_FIELD:
+                push(instr->args[0]);
+                chunk.writeOp(OpCode::OP_GET_FIELD, {chunk.addConstant(instr->constant), chunk.addFieldCache()});
+                break;
+            case IROp::CALL:
+                pushArgs(instr);
+                chunk.writeOp(OpCode::OP_CALL, {instr->index, static_cast<int>(instr->args.size())});
+                break;
+            case IROp::CALL_NATIVE:
+                pushArgs(instr);
+                chunk.writeOp(OpCode::OP_CALL_NATIVE, {instr->index, static_cast<int>(instr->args.size())});
+                break;
+            default:
+                pushArgs(instr);
+                chunk.write(binaryOpCode(instr->op));
+                break;
+        }
+    }
+
+    void emitStoreGlobal(IRInstr* instr) {
+        IRInstr* value = instr->args[0];
+        int global = instr->index;
+        if (optimize && isPoolConstant(value)) {
+            chunk.writeOp(OpCode::OP_SET_GLOBAL_CONST, {global, chunk.addConstant(value->constant)});
+            return;
+        }
+        if (isIncGlobal(instr)) {
+            chunk.writeOp(OpCode::OP_INC_GLOBAL, {global, chunk.addConstant(value->args[1]->constant)});
+            return;
+        }
+        push(value);
+        if (optimize) {
+            chunk.writeOp(OpCode::OP_SET_GLOBAL_POP, {global});
+        } else {
+            chunk.writeOp(OpCode::OP_SET_GLOBAL, {global});
+            chunk.write(OpCode::OP_POP);
+        }
+    }
+
+    // Instructions that are not part of a tree, in block order. A slot value
+    // that the next root reads first is left on the stack for it, and only
+    // saved if something else reads it too.
+    void emitRoot(IRBlock* block, IRInstr* instr, IRInstr* next) {
+        switch (instr->op) {
+            case IROp::STORE_GLOBAL:
+                emitStoreGlobal(instr);
+                return;
+            case IROp::INDEX_SET:
+                pushArgs(instr);
+                chunk.write(OpCode::OP_INDEX_SET);
+                chunk.write(OpCode::OP_POP);
+                return;
+            case IROp::SET_FIELD:
+                pushArgs(instr);
+                chunk.writeOp(OpCode::OP_SET_FIELD, {chunk.addConstant(instr->constant), chunk.addFieldCache()});
+                return;
+            case IROp::PRINT:
+                pushArgs(instr);
+                chunk.writeOp(OpCode::OP_PRINT, {static_cast<int>(instr->args.size())});
+                return;
+            default:
+                break;
+        }
+        if (kind[instr->id] == Kind::SLOT) {
+            int target = slotOf(instr);
+            if (isIncLocal(instr)) {
+                chunk.writeOp(OpCode::OP_INC_LOCAL, {target, chunk.addConstant(instr->args[1]->constant)});
+            } else if (isCoalescedCopy(instr)) {
+                // Coalesced away
+            } else if (optimize && firstPush(block, next) == instr) {
+                pushTree(instr);
+                if (uses[instr->id] > 1) chunk.writeOp(OpCode::OP_SET_LOCAL, {target});
+                pending = instr;
+            } else {
+                pushTree(instr);
+                storeLocal(target);
+            }
+        } else if (kind[instr->id] == Kind::STACK) {
+            pushTree(instr);
+            pending = instr;
+        } else {
+            // Only run for its effect
+            pushTree(instr);
+            chunk.write(OpCode::OP_POP);
+        }
+    }
+
+    // Phi moves on the edge from -> to, as a parallel copy: every source is
+    // read before any slot is written
+    bool needsCopies(IRBlock* from, IRBlock* to) {
+        size_t pred = predIndex(to, from);
+        for (IRInstr* instr : to->instrs) {
+            if (instr->op != IROp::PHI) break;
+            if (!inSlot(instr)) continue;
+            IRInstr* source = instr->args[pred];
+            if (!inSlot(source) || slotOf(source) != slotOf(instr)) return true;
+        }
+        return false;
+    }
+
+    void emitCopies(IRBlock* from, IRBlock* to) {
+        size_t pred = predIndex(to, from);
+        std::vector<int> targets;
+        std::vector<IRInstr*> constants;
+        for (IRInstr* instr : to->instrs) {
+            if (instr->op != IROp::PHI) break;
+            if (!inSlot(instr)) continue;
+            IRInstr* source = instr->args[pred];
+            if (kind[source->id] == Kind::CONSTANT) {
+                constants.push_back(instr);
+            } else if (slotOf(source) != slotOf(instr)) {
+                push(source);
+                targets.push_back(slotOf(instr));
+            }
+        }
+        for (size_t i = targets.size(); i-- > 0;) storeLocal(targets[i]);
+        for (IRInstr* phi : constants) {
+            IRInstr* source = phi->args[pred];
+            if (optimize && isPoolConstant(source)) {
+                chunk.writeOp(OpCode::OP_SET_LOCAL_CONST, {slotOf(phi), chunk.addConstant(source->constant)});
+            } else {
+                pushConstant(source->constant);
+                storeLocal(slotOf(phi));
+            }
+        }
+    }
+
+    void emitJump(OpCode op, int label) {
+        chunk.write(op);
+        fixups.push_back({chunk.code.size(), label, op != OpCode::OP_JUMP});
+        chunk.write16(0);
+    }
+
+    int stubLabel(IRBlock* from, IRBlock* to) {
+        stubs.push_back({from, to});
+        return fn.blockCount + static_cast<int>(stubs.size()) - 1;
+    }
+
+    static OpCode compareJump(IROp op) {
+        switch (op) {
+            case IROp::LESS: return OpCode::OP_JUMP_IF_NOT_LESS;
+            case IROp::LESS_EQUAL: return OpCode::OP_JUMP_IF_NOT_LESS_EQUAL;
+            case IROp::GREATER: return OpCode::OP_JUMP_IF_NOT_GREATER;
+            case IROp::GREATER_EQUAL: return OpCode::OP_JUMP_IF_NOT_GREATER_EQUAL;
+            default: return OpCode::OP_POP_JUMP_IF_FALSE;
+        }
+    }
+
+    // An and/or operand: the merge takes the condition off the stack and
+    // the other successor, next in line, drops it
+    void emitPeekBranch(IRBlock* block, IRInstr* instr) {
+        IRBlock* ifTrue = block->succs[0];
+        IRBlock* ifFalse = block->succs[1];
+        IRInstr* condition = instr->args[0];
+        IRInstr* merge = stackPhi[ifFalse->id];
+        push(condition);
+        if (merge && merge->args[predIndex(ifFalse, block)] == condition) {
+            int label = needsCopies(block, ifFalse) ? stubLabel(block, ifFalse) : ifFalse->id;
+            emitJump(OpCode::OP_JUMP_IF_FALSE, label);
+            chunk.write(OpCode::OP_POP);
+        } else {
+            chunk.write(OpCode::OP_JUMP_IF_FALSE);
+            size_t operand = chunk.code.size();
+            chunk.write16(0);
+            emitCopies(block, ifTrue);
+            emitJump(OpCode::OP_JUMP, ifTrue->id);
+            size_t offset = chunk.code.size() - (operand + 2);
+            chunk.code[operand] = (offset >> 8) & 0xFF;
+            chunk.code[operand + 1] = offset & 0xFF;
+            chunk.write(OpCode::OP_POP);
+        }
+    }
+
+    void emitBranch(IRBlock* block, IRInstr* instr, IRBlock* next) {
+        if (peekBranch[block->id]) {
+            emitPeekBranch(block, instr);
+            return;
+        }
+        IRBlock* ifTrue = block->succs[0];
+        IRBlock* ifFalse = block->succs[1];
+        // Conditional jumps only go forwards
+        int falseLabel = ifFalse->id;
+        if (needsCopies(block, ifFalse) || blockIndex[ifFalse->id] <= blockIndex[block->id]) {
+            falseLabel = stubLabel(block, ifFalse);
+        }
+        IRInstr* condition = instr->args[0];
+        OpCode jump = OpCode::OP_POP_JUMP_IF_FALSE;
+        if (optimize && kind[condition->id] == Kind::TREE && isCompare(condition->op)) {
+            jump = compareJump(condition->op);
+        }
+        if (jump == OpCode::OP_POP_JUMP_IF_FALSE) {
+            push(condition);
+        } else {
+            pushArgs(condition);
+        }
+        emitJump(jump, falseLabel);
+        emitCopies(block, ifTrue);
+        if (ifTrue != next) emitJump(OpCode::OP_JUMP, ifTrue->id);
+    }
+
+    void emitTerminator(IRBlock* block, IRInstr* instr, IRBlock* next) {
+        switch (instr->op) {
+            case IROp::JUMP:
+                emitCopies(block, block->succs[0]);
+                if (IRInstr* phi = stackPhi[block->succs[0]->id]) push(phi->args[predIndex(phi->block, block)]);
+                if (block->succs[0] != next) emitJump(OpCode::OP_JUMP, block->succs[0]->id);
+                break;
+            case IROp::BRANCH:
+                emitBranch(block, instr, next);
+                break;
+            case IROp::RETURN:
+                push(instr->args[0]);
+                chunk.write(OpCode::OP_RET);
+                break;
+            case IROp::TAIL_CALL:
+                pushArgs(instr);
+                chunk.writeOp(OpCode::OP_TAIL_CALL, {instr->index, static_cast<int>(instr->args.size())});
+                break;
+            case IROp::HALT:
+                chunk.write(OpCode::OP_HALT);
+                break;
+            case IROp::BREAK:
+                chunk.write(OpCode::OP_BREAK);
+                break;
+            default:
+                chunk.write(OpCode::OP_CONTINUE);
+                break;
+        }
+    }
+
+    void patchJumps() {
+        for (const Fixup& fixup : fixups) {
+            long offset = static_cast<long>(labels[fixup.label]) - static_cast<long>(fixup.operand + 2);
+            bool fits = fixup.conditional ? offset >= 0 && offset <= 0xFFFF : offset >= -0x8000 && offset <= 0x7FFF;
+            if (!fits) throw std::runtime_error("Jump too far in " + fn.name + "; split it into smaller functions");
+            chunk.code[fixup.operand] = (offset >> 8) & 0xFF;
+            chunk.code[fixup.operand + 1] = offset & 0xFF;
+        }
+    }
+
+public:
+    StackCodegen(IRFunction& fn, Chunk& chunk, bool optimize) : fn(fn), chunk(chunk), optimize(optimize) {}
+
+    void run() {
+        removeUnreachableBlocks(fn);
+        countUses();
+        classify();
+        findRoots();
+        blockIndex.assign(fn.blockCount, -1);
+        for (size_t i = 0; i < fn.blocks.size(); i++) blockIndex[fn.blocks[i]->id] = static_cast<int>(i);
+        chooseStackPhis();
+        allocateSlots();
+
+        int frameSize = 0;
+        for (int s : slot) frameSize = std::max(frameSize, s + 1);
+        // The main chunk only needs a frame for temporaries
+        if (!fn.isMain || frameSize > 0) chunk.writeOp(OpCode::OP_MAKEFRAME, {frameSize});
+
+        labels.assign(fn.blockCount, -1);
+        for (size_t i = 0; i < fn.blocks.size(); i++) {
+            IRBlock* block = fn.blocks[i];
+            IRBlock* next = i + 1 < fn.blocks.size() ? fn.blocks[i + 1] : nullptr;
+            labels[block->id] = static_cast<int>(chunk.code.size());
+            pending = stackPhi[block->id];
+            const std::vector<IRInstr*>& order = roots[block->id];
+            for (size_t r = 0; r < order.size(); r++) {
+                if (isTerminator(order[r]->op)) {
+                    emitTerminator(block, order[r], next);
+                } else {
+                    emitRoot(block, order[r], order[r + 1]);
+                }
+            }
+        }
+        for (const Stub& stub : stubs) {
+            labels.push_back(static_cast<int>(chunk.code.size()));
+            emitCopies(stub.from, stub.to);
+            emitJump(OpCode::OP_JUMP, stub.to->id);
+        }
+        patchJumps();
+    }
+};
+
+void lowerToStackCode(IRFunction& fn, Chunk& chunk, bool optimize) {
+    StackCodegen(fn, chunk, optimize).run();
+}
@@ -0,0 +1,503 @@
+#include "../include/ir.h"
+#include "../include/native.h"
+#include "../include/runtime.h"
+#include <algorithm>
+#include <map>
+
+static void replaceWith(IRInstr* instr, IRInstr* value) {
+    instr->replacement = value;
+    // Keep the variable name around for dumps
+    if (!value->name && value->op != IROp::CONST) value->name = instr->name;
+}
+
+// Assignments between locals and phis that merge a single value make no
+// copies of their own: their uses read the original value directly
+int propagateCopies(IRFunction& fn) {
+    int removed = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (IRBlock* block : fn.blocks) {
+            for (IRInstr* instr : block->instrs) {
+                if (instr->replacement) continue;
+                IRInstr* same = nullptr;
+                if (instr->op == IROp::COPY) {
+                    same = resolve(instr->args[0]);
+                } else if (instr->op == IROp::PHI) {
+                    // Trivial when every argument is the phi itself or one other value
+                    for (IRInstr* arg : instr->args) {
+                        IRInstr* value = resolve(arg);
+                        if (value == instr || value == same) continue;
+                        if (same) {
+                            same = nullptr;
+                            break;
+                        }
+                        same = value;
+                    }
+                }
+                if (same && same != instr) {
+                    replaceWith(instr, same);
+                    removed++;
+                    changed = true;
+                }
+            }
+        }
+    }
+    applyReplacements(fn);
+    return removed;
+}
+
+// Values computed only from their operands: equal operands, equal results
+static bool isPure(IROp op) {
+    switch (op) {
+        case IROp::CONST:
+        case IROp::ADD:
+        case IROp::SUBTRACT:
+        case IROp::MULTIPLY:
+        case IROp::DIVIDE:
+        case IROp::LESS:
+        case IROp::GREATER:
+        case IROp::LESS_EQUAL:
+        case IROp::GREATER_EQUAL:
+        case IROp::EQUAL:
+        case IROp::NOT_EQUAL:
+        case IROp::NEGATE:
+        case IROp::NOT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Reads that give the same value until something writes to a container.
+// Globals are left alone: reloading one costs no more than reading back a
+// saved value.
+static bool isLoad(IROp op) {
+    return op == IROp::INDEX_GET || op == IROp::GET_FIELD;
+}
+
+static bool clobbersMemory(IROp op) {
+    switch (op) {
+        case IROp::INDEX_SET:
+        case IROp::SET_FIELD:
+        case IROp::CALL:
+        case IROp::CALL_NATIVE:
+        case IROp::TAIL_CALL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+typedef std::vector<uint64_t> ValueKey;
+
+static ValueKey valueKey(const IRInstr* instr) {
+    ValueKey key = {static_cast<uint64_t>(instr->op), instr->constant.raw()};
+    for (const IRInstr* arg : instr->args) key.push_back(static_cast<uint64_t>(arg->id));
+    bool commutative = instr->op == IROp::MULTIPLY || instr->op == IROp::EQUAL || instr->op == IROp::NOT_EQUAL;
+    if (commutative && key[2] > key[3]) std::swap(key[2], key[3]);
+    return key;
+}
+
+// Dominator-based value numbering: walking the dominator tree, a pure
+// instruction equal to one in a dominating block reuses its result. Loads
+// are only merged within a block, up to the next write or call.
+int numberValues(IRFunction& fn) {
+    std::vector<IRBlock*> rpo = computeDominators(fn);
+    std::vector<std::vector<IRBlock*>> children(fn.blockCount);
+    for (IRBlock* block : rpo) {
+        if (block->idom != block) children[block->idom->id].push_back(block);
+    }
+
+    int removed = 0;
+    std::map<ValueKey, IRInstr*> available;
+    std::vector<std::map<ValueKey, IRInstr*>::iterator> scope;
+    struct Visit {
+        IRBlock* block;
+        size_t nextChild;
+        size_t scopeStart;
+    };
+    std::vector<Visit> stack = {{rpo[0], 0, 0}};
+    bool entering = true;
+    while (!stack.empty()) {
+        Visit& visit = stack.back();
+        if (entering) {
+            std::map<ValueKey, IRInstr*> loads;
+            for (IRInstr* instr : visit.block->instrs) {
+                for (IRInstr*& arg : instr->args) arg = resolve(arg);
+                if (isPure(instr->op)) {
+                    auto inserted = available.insert({valueKey(instr), instr});
+                    if (inserted.second) {
+                        scope.push_back(inserted.first);
+                    } else {
+                        replaceWith(instr, inserted.first->second);
+                        removed++;
+                    }
+                } else if (isLoad(instr->op)) {
+                    auto inserted = loads.insert({valueKey(instr), instr});
+                    if (!inserted.second) {
+                        replaceWith(instr, inserted.first->second);
+                        removed++;
+                    }
+                } else if (clobbersMemory(instr->op)) {
+                    loads.clear();
+                }
+            }
+        }
+        if (visit.nextChild < children[visit.block->id].size()) {
+            IRBlock* child = children[visit.block->id][visit.nextChild++];
+            stack.push_back({child, 0, scope.size()});
+            entering = true;
+            continue;
+        }
+        while (scope.size() > visit.scopeStart) {
+            available.erase(scope.back());
+            scope.pop_back();
+        }
+        stack.pop_back();
+        entering = false;
+    }
+    applyReplacements(fn);
+    return removed;
+}
+
+namespace {
+
+enum class Lattice { UNKNOWN, CONSTANT, VARYING };
+
+struct LatticeValue {
+    Lattice state = Lattice::UNKNOWN;
+    Value constant;
+};
+
+// Sparse conditional constant propagation, after Wegman and Zadeck. A value
+// is unknown until a reached path defines it, then constant, then varying,
+// and only edges a reached branch can take are followed: a phi merging a
+// constant with a value from a path never taken stays constant, and
+// branches on constants become jumps.
+class ConstantPropagation {
+private:
+    IRFunction& fn;
+    std::vector<LatticeValue> values;               // by instruction id
+    std::vector<std::vector<IRInstr*>> users;       // by instruction id
+    std::vector<std::vector<bool>> takenEdges;      // by block id, per predecessor
+    std::vector<bool> reached;                      // by block id
+    std::vector<IRInstr*> worklist;
+
+    static bool canFold(const IRInstr* instr) {
+        switch (instr->op) {
+            case IROp::ADD:
+            case IROp::SUBTRACT:
+            case IROp::MULTIPLY:
+            case IROp::DIVIDE:
+            case IROp::LESS:
+            case IROp::GREATER:
+            case IROp::LESS_EQUAL:
+            case IROp::GREATER_EQUAL:
+            case IROp::EQUAL:
+            case IROp::NOT_EQUAL:
+            case IROp::NEGATE:
+            case IROp::NOT:
+                return true;
+            case IROp::CALL_NATIVE:
+                return nativeTable()[instr->index].pure;
+            default:
+                return false;
+        }
+    }
+
+    static void meet(LatticeValue& into, const LatticeValue& other) {
+        if (into.state == Lattice::VARYING || other.state == Lattice::UNKNOWN) return;
+        if (into.state == Lattice::UNKNOWN) {
+            into = other;
+        } else if (other.state == Lattice::VARYING || other.constant.raw() != into.constant.raw()) {
+            into.state = Lattice::VARYING;
+        }
+    }
+
+    void update(IRInstr* instr, const LatticeValue& next) {
+        LatticeValue& value = values[instr->id];
+        Lattice before = value.state;
+        meet(value, next);
+        if (value.state == before) return;
+        for (IRInstr* user : users[instr->id]) worklist.push_back(user);
+    }
+
+    void takeEdge(IRBlock* from, IRBlock* to) {
+        bool taken = false;
+        for (size_t i = 0; i < to->preds.size(); i++) {
+            if (to->preds[i] == from && !takenEdges[to->id][i]) {
+                takenEdges[to->id][i] = true;
+                taken = true;
+            }
+        }
+        if (!taken) return;
+        bool first = !reached[to->id];
+        reached[to->id] = true;
+        // A block seen before only has new phi arguments to look at
+        for (IRInstr* instr : to->instrs) {
+            if (!first && instr->op != IROp::PHI) break;
+            worklist.push_back(instr);
+        }
+    }
+
+    void visit(IRInstr* instr) {
+        IRBlock* block = instr->block;
+        if (!reached[block->id]) return;
+        LatticeValue next;
+        switch (instr->op) {
+            case IROp::CONST:
+                next.state = Lattice::CONSTANT;
+                next.constant = instr->constant;
+                update(instr, next);
+                return;
+            case IROp::PHI:
+                for (size_t i = 0; i < instr->args.size(); i++) {
+                    if (takenEdges[block->id][i]) meet(next, values[instr->args[i]->id]);
+                }
+                update(instr, next);
+                return;
+            case IROp::COPY:
+                update(instr, values[instr->args[0]->id]);
+                return;
+            case IROp::JUMP:
+                takeEdge(block, block->succs[0]);
+                return;
+            case IROp::BRANCH: {
+                const LatticeValue& condition = values[instr->args[0]->id];
+                if (condition.state == Lattice::CONSTANT) {
+                    takeEdge(block, block->succs[isTruthy(condition.constant) ? 0 : 1]);
+                } else if (condition.state == Lattice::VARYING) {
+                    takeEdge(block, block->succs[0]);
+                    takeEdge(block, block->succs[1]);
+                }
+                return;
+            }
+            default:
+                break;
+        }
+        if (!producesValue(instr->op)) return;
+        next.state = Lattice::VARYING;
+        if (canFold(instr)) {
+            std::vector<Value> args;
+            for (IRInstr* arg : instr->args) {
+                const LatticeValue& value = values[arg->id];
+                if (value.state == Lattice::UNKNOWN) return;
+                if (value.state == Lattice::VARYING) break;
+                args.push_back(value.constant);
+            }
+            if (args.size() == instr->args.size() &&
+                foldConstant(instr->op, instr->index, args, next.constant)) {
+                next.state = Lattice::CONSTANT;
+            }
+        }
+        update(instr, next);
+    }
+
+    void solve() {
+        IRBlock* entry = fn.blocks[0];
+        reached[entry->id] = true;
+        worklist.assign(entry->instrs.rbegin(), entry->instrs.rend());
+        for (;;) {
+            while (!worklist.empty()) {
+                IRInstr* instr = worklist.back();
+                worklist.pop_back();
+                visit(instr);
+            }
+            // A condition no reached path defines can go either way
+            for (IRBlock* block : fn.blocks) {
+                IRInstr* term = block->terminator();
+                if (reached[block->id] && term && term->op == IROp::BRANCH &&
+                    values[term->args[0]->id].state == Lattice::UNKNOWN) {
+                    LatticeValue varying;
+                    varying.state = Lattice::VARYING;
+                    update(term->args[0], varying);
+                }
+            }
+            if (worklist.empty()) break;
+        }
+    }
+
+    // Drops the edge to block->succs[index], along with the matching phi
+    // arguments
+    static void removeEdge(IRBlock* block, size_t index) {
+        IRBlock* succ = block->succs[index];
+        block->succs.erase(block->succs.begin() + index);
+        size_t pred = std::find(succ->preds.begin(), succ->preds.end(), block) - succ->preds.begin();
+        succ->preds.erase(succ->preds.begin() + pred);
+        for (IRInstr* instr : succ->instrs) {
+            if (instr->op != IROp::PHI) break;
+            instr->args.erase(instr->args.begin() + pred);
+        }
+    }
+
+public:
+    explicit ConstantPropagation(IRFunction& fn)
+        : fn(fn), values(fn.instrCount), users(fn.instrCount), takenEdges(fn.blockCount),
+          reached(fn.blockCount, false) {}
+
+    int run() {
+        for (IRBlock* block : fn.blocks) {
+            takenEdges[block->id].assign(block->preds.size(), false);
+            for (IRInstr* instr : block->instrs) {
+                for (IRInstr*& arg : instr->args) {
+                    arg = resolve(arg);
+                    users[arg->id].push_back(instr);
+                }
+            }
+        }
+        solve();
+
+        int folded = 0;
+        for (IRBlock* block : fn.blocks) {
+            if (!reached[block->id]) continue;
+            // Constants standing in for phis go after the last phi
+            std::vector<IRInstr*> instrs;
+            size_t phiEnd = 0;
+            for (IRInstr* instr : block->instrs) {
+                const LatticeValue& value = values[instr->id];
+                if (instr->op == IROp::CONST || value.state != Lattice::CONSTANT) {
+                    instrs.push_back(instr);
+                    if (instr->op == IROp::PHI) phiEnd = instrs.size();
+                    continue;
+                }
+                IRInstr* constant = fn.newInstr(IROp::CONST);
+                constant->constant = value.constant;
+                constant->block = block;
+                replaceWith(instr, constant);
+                instrs.insert(instr->op == IROp::PHI ? instrs.begin() + phiEnd : instrs.end(), constant);
+                folded++;
+            }
+            block->instrs = std::move(instrs);
+
+            IRInstr* term = block->terminator();
+            if (term && term->op == IROp::BRANCH && values[term->args[0]->id].state == Lattice::CONSTANT) {
+                bool truthy = isTruthy(values[term->args[0]->id].constant);
+                removeEdge(block, truthy ? 1 : 0);
+                term->op = IROp::JUMP;
+                term->args.clear();
+                folded++;
+            }
+        }
+        applyReplacements(fn);
+        return folded + removeUnreachableBlocks(fn);
+    }
+};
+
+}  // namespace
+
+int propagateConstants(IRFunction& fn) {
+    return ConstantPropagation(fn).run();
+}
+
+// Loads of globals stored exactly once, with a constant, in the straight
+// line of blocks main starts with (which runs once, in order). Main's reads
+// after the store see that constant, and so do functions' reads when no
+// script call comes before it, since functions only run through calls.
+// Main is folded again after every round, so globals computed from such
+// constants, and branches on them, follow.
+int propagateGlobalConstants(IRProgram& program) {
+    IRFunction& main = *program.main;
+    std::vector<IRFunction*> all = {&main};
+    for (auto& fn : program.functions) all.push_back(fn.get());
+
+    int replaced = 0;
+    for (;;) {
+        std::map<int, int> stores;  // by global slot
+        for (IRFunction* fn : all) {
+            for (IRBlock* block : fn->blocks) {
+                for (IRInstr* instr : block->instrs) {
+                    if (instr->op == IROp::STORE_GLOBAL) stores[instr->index]++;
+                }
+            }
+        }
+
+        std::vector<bool> once(main.blockCount, false);
+        for (IRBlock* block = main.blocks[0]; block && !once[block->id] && block->preds.size() <= 1;) {
+            if (block->preds.empty() != (block == main.blocks[0])) break;
+            once[block->id] = true;
+            IRInstr* term = block->terminator();
+            block = term && term->op == IROp::JUMP ? block->succs[0] : nullptr;
+        }
+
+        std::map<int, Value> inMain;
+        std::map<int, Value> everywhere;
+        bool called = false;
+        for (IRBlock* block : main.blocks) {
+            if (!once[block->id]) continue;
+            for (IRInstr* instr : block->instrs) {
+                if (instr->op == IROp::CALL || instr->op == IROp::TAIL_CALL) called = true;
+                IRInstr* value = instr->op == IROp::STORE_GLOBAL ? resolve(instr->args[0]) : nullptr;
+                if (value && value->op == IROp::CONST && stores[instr->index] == 1) {
+                    inMain[instr->index] = value->constant;
+                    if (!called) everywhere[instr->index] = value->constant;
+                }
+            }
+        }
+
+        // Reads in main's first blocks only see the stores ahead of them
+        std::map<int, Value> stored;
+        int round = 0;
+        for (IRFunction* fn : all) {
+            for (IRBlock* block : fn->blocks) {
+                bool first = fn == &main && once[block->id];
+                const std::map<int, Value>& known = fn != &main ? everywhere : first ? stored : inMain;
+                for (IRInstr*& instr : block->instrs) {
+                    if (first && instr->op == IROp::STORE_GLOBAL && inMain.count(instr->index)) {
+                        stored[instr->index] = inMain[instr->index];
+                    }
+                    if (instr->op != IROp::LOAD_GLOBAL) continue;
+                    auto found = known.find(instr->index);
+                    if (found == known.end()) continue;
+                    IRInstr* constant = fn->newInstr(IROp::CONST);
+                    constant->constant = found->second;
+                    constant->block = block;
+                    instr->replacement = constant;
+                    instr = constant;
+                    round++;
+                }
+            }
+            applyReplacements(*fn);
+        }
+        if (!round) break;
+        replaced += round;
+        propagateConstants(main);
+    }
+    return replaced;
+}
+
+// Drops instructions whose results nothing needs, including phis that only
+// feed each other around a loop
+int eliminateDeadCode(IRFunction& fn) {
+    std::vector<bool> live(fn.instrCount, false);
+    std::vector<IRInstr*> worklist;
+    for (IRBlock* block : fn.blocks) {
+        for (IRInstr* instr : block->instrs) {
+            if (hasSideEffects(instr->op)) {
+                live[instr->id] = true;
+                worklist.push_back(instr);
+            }
+        }
+    }
+    while (!worklist.empty()) {
+        IRInstr* instr = worklist.back();
+        worklist.pop_back();
+        for (IRInstr* arg : instr->args) {
+            if (!live[arg->id]) {
+                live[arg->id] = true;
+                worklist.push_back(arg);
+            }
+        }
+    }
+
+    int removed = 0;
+    for (IRBlock* block : fn.blocks) {
+        std::vector<IRInstr*>& instrs = block->instrs;
+        size_t before = instrs.size();
+        instrs.erase(std::remove_if(instrs.begin(), instrs.end(),
+                                    [&](IRInstr* instr) { return !live[instr->id]; }),
+                     instrs.end());
+        removed += static_cast<int>(before - instrs.size());
+    }
+    return removed;
+}
@@ -0,0 +1,960 @@
+#include "../include/ir.h"
+#include "../include/register_vm.h"
+#include <algorithm>
+#include <stdexcept>
+
+// Literals and prints longer than this are built a piece at a time, so the
+// argument area stays small
+static const int OPERAND_CHUNK = 64;
+
+// Lowers SSA form to register VM code. Values that outlive the instruction
+// computing them get registers by the same liveness, coalescing and
+// colouring as frame slots get in the stack lowering (ir_codegen.cpp):
+// phis share their operands' register where they do not interfere, and
+// parameters keep the registers their arguments arrive in.
+//
+// A frame is laid out as globals, values, arguments, scratch. Only the main
+// frame has globals: the top-level variables, which functions read in place
+// with REG_GETGLOBAL. Calls, builtins, print and literals take their
+// operands from the argument area, where a callee's window starts, so
+// nothing live sits above it; a value whose only use is as one of those
+// operands is computed straight into its place. Scratch registers hold
+// constants an instruction cannot take as a K operand.
+class RegisterCodegen {
+private:
+    enum class Kind : uint8_t {
+        NONE,       // no code of its own, or a result nothing uses
+        CONSTANT,   // a K operand, or loaded into scratch, at every use
+        GLOBAL,     // a top-level variable main reads in its own register
+        FUSED,      // comparison compiled into the branch that uses it
+        REG,        // kept in a value register
+        ARG,        // computed into the argument area for its only user
+        STORED      // computed into the register of the global its only
+                    // user stores it to
+    };
+
+    struct Fixup {
+        size_t operand;
+        int label;
+    };
+
+    // A branch edge that needs phi copies goes through a stub after the
+    // last block
+    struct Stub {
+        IRBlock* from;
+        IRBlock* to;
+    };
+
+    struct Move {
+        int target;
+        int source;
+    };
+
+    IRFunction& fn;
+    Chunk& chunk;
+    int frameGlobals;               // top-level variables in main frame registers
+    std::vector<Kind> kind;         // by instruction id
+    std::vector<int> uses;
+    std::vector<IRInstr*> user;     // the last user seen
+    std::vector<std::vector<std::pair<IRInstr*, size_t>>> useSites;  // user, operand
+    std::vector<int> position;      // index in its block
+    std::vector<int> argSlot;       // ARG values: register in the argument area
+    std::vector<int> liveId;        // REG values, dense
+    std::vector<IRInstr*> liveValues;
+    std::vector<int> colour;        // by live id
+    std::vector<int> labels;        // code offset by label; blocks, then stubs
+    std::vector<Fixup> fixups;
+    std::vector<Stub> stubs;
+    int valueBase = 0;
+    int argBase = 0;
+    int scratchBase = 0;
+    int nextScratch = 0;
+    int scratchUsed = 0;
+
+    // Uses and classification
+
+    void countUses() {
+        kind.assign(fn.instrCount, Kind::NONE);
+        uses.assign(fn.instrCount, 0);
+        user.assign(fn.instrCount, nullptr);
+        useSites.assign(fn.instrCount, {});
+        position.assign(fn.instrCount, 0);
+        argSlot.assign(fn.instrCount, -1);
+        for (IRBlock* block : fn.blocks) {
+            for (size_t i = 0; i < block->instrs.size(); i++) {
+                IRInstr* instr = block->instrs[i];
+                position[instr->id] = static_cast<int>(i);
+                for (size_t a = 0; a < instr->args.size(); a++) {
+                    IRInstr* arg = instr->args[a];
+                    uses[arg->id]++;
+                    user[arg->id] = instr;
+                    useSites[arg->id].push_back({instr, a});
+                }
+            }
+        }
+    }
+
+    static bool hasCode(const IRInstr* instr) {
+        return instr->op != IROp::CONST && instr->op != IROp::PHI && instr->op != IROp::ENTRY;
+    }
+
+    static bool isCompare(IROp op) {
+        return op == IROp::LESS || op == IROp::LESS_EQUAL || op == IROp::GREATER || op == IROp::GREATER_EQUAL;
+    }
+
+    // Instructions that take their operands from the argument area
+    static bool usesArgumentArea(IROp op) {
+        switch (op) {
+            case IROp::ARRAY:
+            case IROp::HASHMAP:
+            case IROp::CALL:
+            case IROp::CALL_NATIVE:
+            case IROp::PRINT:
+            case IROp::TAIL_CALL:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Whether instr takes more operands than one argument area holds. A
+    // literal then writes its result before it has read all its operands.
+    static bool isChunked(const IRInstr* instr) {
+        return (instr->op == IROp::ARRAY || instr->op == IROp::HASHMAP || instr->op == IROp::PRINT) &&
+               instr->args.size() > static_cast<size_t>(OPERAND_CHUNK);
+    }
+
+    bool emitsCode(const IRInstr* instr) const {
+        if (!hasCode(instr)) return false;
+        switch (kind[instr->id]) {
+            case Kind::FUSED:
+            case Kind::GLOBAL:
+                return false;
+            case Kind::NONE:
+                return !producesValue(instr->op) || hasSideEffects(instr->op);
+            default:
+                return true;
+        }
+    }
+
+    void classify() {
+        for (IRBlock* block : fn.blocks) {
+            for (IRInstr* instr : block->instrs) {
+                Kind& k = kind[instr->id];
+                if (instr->op == IROp::CONST) {
+                    k = Kind::CONSTANT;
+                } else if (!producesValue(instr->op) || uses[instr->id] == 0) {
+                    k = Kind::NONE;
+                } else if (isCompare(instr->op) && uses[instr->id] == 1 && user[instr->id]->op == IROp::BRANCH &&
+                           user[instr->id]->block == block) {
+                    k = Kind::FUSED;
+                } else {
+                    k = Kind::REG;
+                }
+            }
+        }
+        for (IRBlock* block : fn.blocks) {
+            for (IRInstr* instr : block->instrs) {
+                if (instr->op == IROp::LOAD_GLOBAL && kind[instr->id] == Kind::REG && readsInPlace(instr)) {
+                    kind[instr->id] = Kind::GLOBAL;
+                }
+            }
+        }
+        for (IRBlock* block : fn.blocks) {
+            for (IRInstr* instr : block->instrs) {
+                if (kind[instr->id] != Kind::REG || !hasCode(instr) || isChunked(instr)) continue;
+                if (storedInPlace(instr)) {
+                    kind[instr->id] = Kind::STORED;
+                } else if (computedInPlace(instr)) {
+                    kind[instr->id] = Kind::ARG;
+                }
+            }
+        }
+    }
+
+    // Main can read a top-level variable straight from its register when
+    // every use is in the load's block with no store to it in between.
+    // Functions never assign globals, so calls do not count.
+    bool readsInPlace(IRInstr* load) {
+        if (!fn.isMain || load->index >= frameGlobals) return false;
+        IRBlock* block = load->block;
+        int last = position[load->id];
+        for (auto& site : useSites[load->id]) {
+            IRInstr* at = site.first;
+            int pos;
+            if (at->op == IROp::PHI) {
+                // Phi copies read at the end of the predecessor
+                if (at->block->preds[site.second] != block) return false;
+                pos = static_cast<int>(block->instrs.size());
+            } else {
+                if (kind[at->id] == Kind::FUSED) at = user[at->id];
+                if (at->block != block) return false;
+                pos = position[at->id];
+            }
+            last = std::max(last, pos);
+        }
+        for (int i = position[load->id] + 1; i < last; i++) {
+            IRInstr* instr = block->instrs[i];
+            if (instr->op == IROp::STORE_GLOBAL && instr->index == load->index) return false;
+        }
+        return true;
+    }
+
+    // A value main stores to a top-level variable right after computing it
+    // can be computed into the variable's register
+    bool storedInPlace(IRInstr* value) {
+        if (!fn.isMain || uses[value->id] != 1) return false;
+        IRInstr* store = user[value->id];
+        if (store->op != IROp::STORE_GLOBAL || store->index >= frameGlobals || store->block != value->block) {
+            return false;
+        }
+        for (int i = position[value->id] + 1; i < position[store->id]; i++) {
+            if (emitsCode(value->block->instrs[i])) return false;
+        }
+        return true;
+    }
+
+    // A value used once, as an operand in the argument area, can be computed
+    // there if nothing else fills the area before its user runs
+    bool computedInPlace(IRInstr* value) {
+        if (uses[value->id] != 1) return false;
+        IRInstr* consumer = user[value->id];
+        if (!usesArgumentArea(consumer->op) || isChunked(consumer) || consumer->block != value->block) {
+            return false;
+        }
+        for (int i = position[value->id] + 1; i < position[consumer->id]; i++) {
+            IRInstr* between = value->block->instrs[i];
+            if (usesArgumentArea(between->op) && emitsCode(between)) return false;
+        }
+        size_t slot = std::find(consumer->args.begin(), consumer->args.end(), value) - consumer->args.begin();
+        argSlot[value->id] = static_cast<int>(slot);
+        return true;
+    }
+
+    // Value registers an instruction reads where its code is emitted
+    void reads(IRInstr* instr, std::vector<int>& out) {
+        for (IRInstr* arg : instr->args) {
+            if (kind[arg->id] == Kind::FUSED) {
+                reads(arg, out);
+            } else if (kind[arg->id] == Kind::REG) {
+                out.push_back(liveId[arg->id]);
+            }
+        }
+    }
+
+    // Liveness and register assignment
+
+    void allocateRegisters() {
+        liveId.assign(fn.instrCount, -1);
+        for (IRBlock* block : fn.blocks) {
+            for (IRInstr* instr : block->instrs) {
+                if (kind[instr->id] == Kind::REG) {
+                    liveId[instr->id] = static_cast<int>(liveValues.size());
+                    liveValues.push_back(instr);
+                }
+            }
+        }
+        size_t count = liveValues.size();
+        if (count == 0) return;
+
+        // Live-out sets, by walking back from each use to the definition
+        std::vector<std::vector<int>> liveOut(fn.blockCount);
+        std::vector<int> inMark(fn.blockCount, -1);
+        std::vector<int> outMark(fn.blockCount, -1);
+        std::vector<IRBlock*> worklist;
+        for (size_t v = 0; v < count; v++) {
+            IRInstr* value = liveValues[v];
+            IRBlock* home = value->block;
+            int id = static_cast<int>(v);
+            auto markOut = [&](IRBlock* block) {
+                if (outMark[block->id] == id) return;
+                outMark[block->id] = id;
+                liveOut[block->id].push_back(id);
+                if (block != home && inMark[block->id] != id) {
+                    inMark[block->id] = id;
+                    worklist.push_back(block);
+                }
+            };
+            for (auto& site : useSites[value->id]) {
+                IRBlock* block = site.first->block;
+                if (site.first->op == IROp::PHI) {
+                    markOut(block->preds[site.second]);
+                } else if (block != home && inMark[block->id] != id) {
+                    inMark[block->id] = id;
+                    worklist.push_back(block);
+                }
+            }
+            while (!worklist.empty()) {
+                IRBlock* block = worklist.back();
+                worklist.pop_back();
+                for (IRBlock* pred : block->preds) markOut(pred);
+            }
+        }
+
+        // Interference: values live at the same time need different
+        // registers. An instruction reads its operands before it writes its
+        // result, so the result may take a register an operand frees.
+        std::vector<std::vector<int>> interferes(count);
+        std::vector<bool> isLive(count, false);
+        std::vector<int> live;
+        auto interfere = [&](int v) {
+            for (int other : live) {
+                if (other == v || !isLive[other]) continue;
+                interferes[v].push_back(other);
+                interferes[other].push_back(v);
+            }
+        };
+        std::vector<int> read;
+        for (IRBlock* block : fn.blocks) {
+            live.clear();
+            for (int v : liveOut[block->id]) {
+                isLive[v] = true;
+                live.push_back(v);
+            }
+            for (size_t i = block->instrs.size(); i-- > 0;) {
+                IRInstr* instr = block->instrs[i];
+                if (!emitsCode(instr)) continue;
+                read.clear();
+                reads(instr, read);
+                auto markReads = [&]() {
+                    for (int v : read) {
+                        if (!isLive[v]) {
+                            isLive[v] = true;
+                            live.push_back(v);
+                        }
+                    }
+                };
+                // A chunked literal's operands are still read after its
+                // result is written
+                if (isChunked(instr)) markReads();
+                if (kind[instr->id] == Kind::REG) {
+                    interfere(liveId[instr->id]);
+                    isLive[liveId[instr->id]] = false;
+                }
+                markReads();
+            }
+            // Phis and entry values are all defined on entry to the block,
+            // so they interfere with each other as well
+            std::vector<int> atEntry;
+            for (IRInstr* instr : block->instrs) {
+                if (kind[instr->id] == Kind::REG && !hasCode(instr)) {
+                    int v = liveId[instr->id];
+                    atEntry.push_back(v);
+                    if (!isLive[v]) {
+                        isLive[v] = true;
+                        live.push_back(v);
+                    }
+                }
+            }
+            for (int v : atEntry) interfere(v);
+            for (int v : live) isLive[v] = false;
+        }
+
+        // Coalescing: a phi shares its operands' register, and a copy its
+        // source's, unless they interfere
+        std::vector<int> parent(count);
+        std::vector<std::vector<int>> members(count);
+        std::vector<int> pinned(count, -1);
+        for (size_t v = 0; v < count; v++) {
+            parent[v] = static_cast<int>(v);
+            members[v].push_back(static_cast<int>(v));
+            if (liveValues[v]->op == IROp::ENTRY) pinned[v] = liveValues[v]->index;
+        }
+        auto find = [&](int v) {
+            while (parent[v] != v) v = parent[v] = parent[parent[v]];
+            return v;
+        };
+        auto unite = [&](IRInstr* a, IRInstr* b) {
+            if (kind[a->id] != Kind::REG || kind[b->id] != Kind::REG) return;
+            int ca = find(liveId[a->id]);
+            int cb = find(liveId[b->id]);
+            if (ca == cb) return;
+            if (pinned[ca] >= 0 && pinned[cb] >= 0) return;
+            if (members[ca].size() < members[cb].size()) std::swap(ca, cb);
+            for (int m : members[cb]) {
+                for (int other : interferes[m]) {
+                    if (find(other) == ca) return;
+                }
+            }
+            parent[cb] = ca;
+            members[ca].insert(members[ca].end(), members[cb].begin(), members[cb].end());
+            members[cb].clear();
+            if (pinned[ca] < 0) pinned[ca] = pinned[cb];
+        };
+        for (IRBlock* block : fn.blocks) {
+            for (IRInstr* instr : block->instrs) {
+                if (instr->op != IROp::PHI) break;
+                for (IRInstr* arg : instr->args) unite(instr, arg);
+            }
+        }
+        for (IRInstr* value : liveValues) {
+            if (value->op == IROp::COPY) unite(value, value->args[0]);
+        }
+
+        // Colouring: parameters first, then the lowest free register
+        std::vector<int> classColour(count, -1);
+        for (size_t c = 0; c < count; c++) {
+            if (find(static_cast<int>(c)) == static_cast<int>(c) && pinned[c] >= 0) classColour[c] = pinned[c];
+        }
+        for (size_t c = 0; c < count; c++) {
+            if (find(static_cast<int>(c)) != static_cast<int>(c) || classColour[c] >= 0) continue;
+            std::vector<bool> taken;
+            for (int m : members[c]) {
+                for (int other : interferes[m]) {
+                    int r = classColour[find(other)];
+                    if (r < 0) continue;
+                    if (static_cast<size_t>(r) >= taken.size()) taken.resize(r + 1, false);
+                    taken[r] = true;
+                }
+            }
+            int r = 0;
+            while (static_cast<size_t>(r) < taken.size() && taken[r]) r++;
+            classColour[c] = r;
+        }
+        colour.resize(count);
+        for (size_t v = 0; v < count; v++) colour[v] = classColour[find(static_cast<int>(v))];
+    }
+
+    // Lays the frame out once registers are assigned
+    void layoutFrame() {
+        valueBase = fn.isMain ? frameGlobals : 0;
+        int colours = 0;
+        for (int c : colour) colours = std::max(colours, c + 1);
+        int argCount = 0;
+        for (IRBlock* block : fn.blocks) {
+            for (IRInstr* instr : block->instrs) {
+                if (!usesArgumentArea(instr->op) || !emitsCode(instr)) continue;
+                int count = std::min(static_cast<int>(instr->args.size()), OPERAND_CHUNK);
+                // Call windows start at the first argument, so a callee sees
+                // at most one frame's worth
+                if (!isChunked(instr) && instr->args.size() > 0xFF) throw std::runtime_error("Too many arguments");
+                argCount = std::max(argCount, count);
+            }
+        }
+        argBase = valueBase + colours;
+        scratchBase = argBase + argCount;
+    }
+
+    // Emission
+
+    int scratch() {
+        int reg = scratchBase + nextScratch++;
+        scratchUsed = std::max(scratchUsed, nextScratch);
+        return reg;
+    }
+
+    int reg(const IRInstr* value) const {
+        switch (kind[value->id]) {
+            case Kind::GLOBAL: return value->index;
+            case Kind::ARG: return argBase + argSlot[value->id];
+            case Kind::STORED: return user[value->id]->index;
+            default: return valueBase + colour[liveId[value->id]];
+        }
+    }
+
+    void emit(RegOpCode op, std::initializer_list<int> operands) {
+        chunk.write(static_cast<uint8_t>(op));
+        for (int operand : operands) chunk.write(static_cast<uint8_t>(operand));
+    }
+
+    void write24(int operand) {
+        if (operand > Chunk::MAX_OPERAND) throw std::runtime_error("Bytecode operand out of range");
+        chunk.write(static_cast<uint8_t>(operand >> 16));
+        chunk.write(static_cast<uint8_t>(operand >> 8));
+        chunk.write(static_cast<uint8_t>(operand));
+    }
+
+    // An instruction whose second operand is the 24-bit Bx
+    void emitWide(RegOpCode op, int a, int bx) {
+        chunk.write(static_cast<uint8_t>(op));
+        chunk.write(static_cast<uint8_t>(a));
+        write24(bx);
+    }
+
+    // A call: op with a one-byte function or native id when it fits, else
+    // wideOp with a 24-bit one. The id follows the operands in before.
+    void emitCall(RegOpCode op, RegOpCode wideOp, std::initializer_list<int> before, int id,
+                  std::initializer_list<int> after) {
+        bool wide = id > 0xFF;
+        chunk.write(static_cast<uint8_t>(wide ? wideOp : op));
+        for (int operand : before) chunk.write(static_cast<uint8_t>(operand));
+        if (wide) {
+            write24(id);
+        } else {
+            chunk.write(static_cast<uint8_t>(id));
+        }
+        for (int operand : after) chunk.write(static_cast<uint8_t>(operand));
+    }
+
+    void move(int target, int source) {
+        if (target != source) emit(RegOpCode::REG_MOVE, {target, source});
+    }
+
+    void loadConstant(int target, const Value& value) {
+        int k = chunk.addConstant(value);
+        if (k > 0xFF) {
+            emitWide(RegOpCode::REG_LOADK_WIDE, target, k);
+        } else {
+            emit(RegOpCode::REG_LOADK, {target, k});
+        }
+    }
+
+    // Register holding an operand, loading a constant into scratch
+    int operand(IRInstr* value) {
+        if (kind[value->id] != Kind::CONSTANT) return reg(value);
+        int target = scratch();
+        loadConstant(target, value->constant);
+        return target;
+    }
+
+    // Register for an instruction's result; scratch if nothing reads it
+    int result(IRInstr* instr) {
+        return kind[instr->id] == Kind::NONE ? scratch() : reg(instr);
+    }
+
+    // Index of a number constant an instruction can take as a K operand,
+    // or -1
+    int constantOperand(IRInstr* value) {
+        if (kind[value->id] != Kind::CONSTANT || !value->constant.isNumber()) return -1;
+        int k = chunk.addConstant(value->constant);
+        return k <= 0xFF ? k : -1;
+    }
+
+    // Fills the argument area with count of instr's operands from first on,
+    // or all of them
+    void placeArguments(IRInstr* instr, int first = 0, int count = -1) {
+        if (count < 0) count = static_cast<int>(instr->args.size());
+        for (int i = 0; i < count; i++) {
+            IRInstr* arg = instr->args[first + i];
+            int target = argBase + i;
+            if (kind[arg->id] == Kind::ARG) continue;
+            if (kind[arg->id] == Kind::CONSTANT) {
+                loadConstant(target, arg->constant);
+            } else {
+                move(target, reg(arg));
+            }
+        }
+    }
+
+    void emitArithmetic(IRInstr* instr) {
+        RegOpCode op;
+        RegOpCode opK;
+        switch (instr->op) {
+            case IROp::ADD: op = RegOpCode::REG_ADD; opK = RegOpCode::REG_ADDK; break;
+            case IROp::SUBTRACT: op = RegOpCode::REG_SUB; opK = RegOpCode::REG_SUBK; break;
+            case IROp::MULTIPLY: op = RegOpCode::REG_MUL; opK = RegOpCode::REG_MULK; break;
+            default: op = RegOpCode::REG_DIV; opK = RegOpCode::REG_DIVK; break;
+        }
+        IRInstr* left = instr->args[0];
+        IRInstr* right = instr->args[1];
+        int k = constantOperand(right);
+        // Numbers multiply in either order; + may concatenate, so it may not
+        if (k < 0 && instr->op == IROp::MULTIPLY && (k = constantOperand(left)) >= 0) std::swap(left, right);
+        int a = operand(left);
+        if (k >= 0) {
+            int target = result(instr);
+            emit(opK, {target, a, k});
+            return;
+        }
+        int b = operand(right);
+        int target = result(instr);
+        emit(op, {target, a, b});
+    }
+
+    static RegOpCode valueOpCode(IROp op) {
+        switch (op) {
+            case IROp::LESS: return RegOpCode::REG_LT;
+            case IROp::LESS_EQUAL: return RegOpCode::REG_LE;
+            case IROp::GREATER: return RegOpCode::REG_GT;
+            case IROp::GREATER_EQUAL: return RegOpCode::REG_GE;
+            case IROp::EQUAL: return RegOpCode::REG_EQ;
+            case IROp::NOT_EQUAL: return RegOpCode::REG_NE;
+            case IROp::NEGATE: return RegOpCode::REG_NEG;
+            default: return RegOpCode::REG_NOT;
+        }
+    }
+
+    void emitInstr(IRInstr* instr) {
+        nextScratch = 0;
+        switch (instr->op) {
+            case IROp::COPY: {
+                IRInstr* source = instr->args[0];
+                int target = result(instr);
+                if (kind[source->id] == Kind::CONSTANT) {
+                    loadConstant(target, source->constant);
+                } else {
+                    move(target, reg(source));
+                }
+                break;
+            }
+            case IROp::LOAD_GLOBAL: {
+                int target = result(instr);
+                if (instr->index >= frameGlobals) {
+                    emitWide(RegOpCode::REG_GETGLOBAL_WIDE, target, instr->index - frameGlobals);
+                } else if (fn.isMain) {
+                    move(target, instr->index);
+                } else {
+                    emit(RegOpCode::REG_GETGLOBAL, {target, instr->index});
+                }
+                break;
+            }
+            case IROp::ADD:
+            case IROp::SUBTRACT:
+            case IROp::MULTIPLY:
+            case IROp::DIVIDE:
+                emitArithmetic(instr);
+                break;
+            case IROp::LESS:
+            case IROp::LESS_EQUAL:
+            case IROp::GREATER:
+            case IROp::GREATER_EQUAL:
+            case IROp::EQUAL:
+            case IROp::NOT_EQUAL:
+            case IROp::INDEX_GET: {
+                int a = operand(instr->args[0]);
+                int b = operand(instr->args[1]);
+                int target = result(instr);
+                emit(instr->op == IROp::INDEX_GET ? RegOpCode::REG_GETINDEX : valueOpCode(instr->op), {target, a, b});
+                break;
+            }
+            case IROp::NEGATE:
+            case IROp::NOT: {
+                int a = operand(instr->args[0]);
+                int target = result(instr);
+                emit(valueOpCode(instr->op), {target, a});
+                break;
+            }
+            case IROp::ARRAY: {
+                int count = static_cast<int>(instr->args.size());
+                int first = std::min(count, OPERAND_CHUNK);
+                placeArguments(instr, 0, first);
+                int target = result(instr);
+                emit(RegOpCode::REG_NEWARRAY, {target, argBase, first});
+                for (int i = first; i < count; i += OPERAND_CHUNK) {
+                    int n = std::min(count - i, OPERAND_CHUNK);
+                    placeArguments(instr, i, n);
+                    emit(RegOpCode::REG_APPEND, {target, argBase, n});
+                }
+                break;
+            }
+            case IROp::HASHMAP: {
+                // Pairs past the first chunk are stored one at a time
+                int count = static_cast<int>(instr->args.size());
+                int first = std::min(count, OPERAND_CHUNK);
+                placeArguments(instr, 0, first);
+                int target = result(instr);
+                emit(RegOpCode::REG_NEWMAP, {target, argBase, first / 2});
+                for (int i = first; i < count; i += 2) {
+                    nextScratch = 0;
+                    int key = operand(instr->args[i]);
+                    int value = operand(instr->args[i + 1]);
+                    emit(RegOpCode::REG_SETINDEX, {target, key, value});
+                }
+                break;
+            }
+            case IROp::GET_FIELD: {
+                int container = operand(instr->args[0]);
+                int key = chunk.addConstant(instr->constant);
+                if (key <= 0xFF && chunk.fieldCaches.size() <= 0xFF) {
+                    int cache = chunk.addFieldCache();
+                    int target = result(instr);
+                    emit(RegOpCode::REG_GETFIELD, {target, container, key, cache});
+                } else {
+                    int index = scratch();
+                    loadConstant(index, instr->constant);
+                    int target = result(instr);
+                    emit(RegOpCode::REG_GETINDEX, {target, container, index});
+                }
+                break;
+            }
+            case IROp::CALL:
+            case IROp::CALL_NATIVE: {
+                placeArguments(instr);
+                int target = result(instr);
+                if (instr->op == IROp::CALL) {
+                    emitCall(RegOpCode::REG_CALL, RegOpCode::REG_CALL_WIDE, {target}, instr->index,
+                             {argBase, static_cast<int>(instr->args.size())});
+                } else {
+                    emitCall(RegOpCode::REG_BUILTIN, RegOpCode::REG_BUILTIN_WIDE, {target}, instr->index,
+                             {argBase, static_cast<int>(instr->args.size())});
+                }
+                break;
+            }
+            case IROp::STORE_GLOBAL: {
+                // Only the top level assigns globals
+                if (!fn.isMain) throw std::runtime_error("Global store in function " + fn.name);
+                IRInstr* value = instr->args[0];
+                if (instr->index >= frameGlobals) {
+                    emitWide(RegOpCode::REG_SETGLOBAL_WIDE, operand(value), instr->index - frameGlobals);
+                } else if (kind[value->id] == Kind::STORED) {
+                    break;
+                } else if (kind[value->id] == Kind::CONSTANT) {
+                    loadConstant(instr->index, value->constant);
+                } else {
+                    move(instr->index, reg(value));
+                }
+                break;
+            }
+            case IROp::INDEX_SET: {
+                int container = operand(instr->args[0]);
+                int index = operand(instr->args[1]);
+                int value = operand(instr->args[2]);
+                emit(RegOpCode::REG_SETINDEX, {container, index, value});
+                break;
+            }
+            case IROp::SET_FIELD: {
+                int container = operand(instr->args[0]);
+                int value = operand(instr->args[1]);
+                int key = chunk.addConstant(instr->constant);
+                if (key <= 0xFF && chunk.fieldCaches.size() <= 0xFF) {
+                    emit(RegOpCode::REG_SETFIELD, {container, key, value, chunk.addFieldCache()});
+                } else {
+                    int index = scratch();
+                    loadConstant(index, instr->constant);
+                    emit(RegOpCode::REG_SETINDEX, {container, index, value});
+                }
+                break;
+            }
+            case IROp::PRINT: {
+                int count = static_cast<int>(instr->args.size());
+                for (int i = 0; i + OPERAND_CHUNK < count; i += OPERAND_CHUNK) {
+                    placeArguments(instr, i, OPERAND_CHUNK);
+                    emit(RegOpCode::REG_PRINTPART, {argBase, OPERAND_CHUNK});
+                }
+                int last = count > OPERAND_CHUNK ? (count - 1) / OPERAND_CHUNK * OPERAND_CHUNK : 0;
+                placeArguments(instr, last, count - last);
+                emit(RegOpCode::REG_PRINT, {argBase, count - last});
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    // Phi moves on the edge from -> to, as a parallel copy: every source is
+    // read before any register is written
+    bool needsCopies(IRBlock* from, IRBlock* to) {
+        size_t pred = predIndex(to, from);
+        for (IRInstr* instr : to->instrs) {
+            if (instr->op != IROp::PHI) break;
+            if (kind[instr->id] != Kind::REG) continue;
+            IRInstr* source = instr->args[pred];
+            if (kind[source->id] == Kind::CONSTANT || reg(source) != reg(instr)) return true;
+        }
+        return false;
+    }
+
+    void emitCopies(IRBlock* from, IRBlock* to) {
+        size_t pred = predIndex(to, from);
+        std::vector<Move> moves;
+        std::vector<IRInstr*> constants;
+        for (IRInstr* instr : to->instrs) {
+            if (instr->op != IROp::PHI) break;
+            if (kind[instr->id] != Kind::REG) continue;
+            IRInstr* source = instr->args[pred];
+            if (kind[source->id] == Kind::CONSTANT) {
+                constants.push_back(instr);
+            } else if (reg(source) != reg(instr)) {
+                moves.push_back({reg(instr), reg(source)});
+            }
+        }
+        // A move goes once no other reads its target; a cycle is broken by
+        // saving one target in scratch
+        int saved = -1;
+        while (!moves.empty()) {
+            bool progress = false;
+            for (size_t i = 0; i < moves.size(); i++) {
+                bool read = false;
+                for (const Move& other : moves) read = read || other.source == moves[i].target;
+                if (read) continue;
+                move(moves[i].target, moves[i].source);
+                moves.erase(moves.begin() + i);
+                progress = true;
+                break;
+            }
+            if (progress) continue;
+            if (saved < 0) saved = scratch();
+            int target = moves[0].target;
+            move(saved, target);
+            for (Move& other : moves) {
+                if (other.source == target) other.source = saved;
+            }
+        }
+        for (IRInstr* phi : constants) loadConstant(reg(phi), phi->args[pred]->constant);
+    }
+
+    static size_t predIndex(const IRBlock* to, const IRBlock* from) {
+        return std::find(to->preds.begin(), to->preds.end(), from) - to->preds.begin();
+    }
+
+    void emitJump(RegOpCode op, std::initializer_list<int> operands, int label) {
+        emit(op, operands);
+        fixups.push_back({chunk.code.size(), label});
+        chunk.write16(0);
+    }
+
+    int stubLabel(IRBlock* from, IRBlock* to) {
+        stubs.push_back({from, to});
+        return fn.blockCount + static_cast<int>(stubs.size()) - 1;
+    }
+
+    int edgeLabel(IRBlock* from, IRBlock* to) {
+        return needsCopies(from, to) ? stubLabel(from, to) : to->id;
+    }
+
+    // Jumps to label unless the comparison holds. A constant on the left
+    // swaps the comparison so it can be a K operand.
+    void emitCompareJump(IRInstr* compare, int label) {
+        IROp op = compare->op;
+        IRInstr* left = compare->args[0];
+        IRInstr* right = compare->args[1];
+        int k = constantOperand(right);
+        if (k < 0 && (k = constantOperand(left)) >= 0) {
+            std::swap(left, right);
+            switch (op) {
+                case IROp::LESS: op = IROp::GREATER; break;
+                case IROp::LESS_EQUAL: op = IROp::GREATER_EQUAL; break;
+                case IROp::GREATER: op = IROp::LESS; break;
+                default: op = IROp::LESS_EQUAL; break;
+            }
+        }
+        RegOpCode jump;
+        RegOpCode jumpK;
+        switch (op) {
+            case IROp::LESS: jump = RegOpCode::REG_JNLT; jumpK = RegOpCode::REG_JNLTK; break;
+            case IROp::LESS_EQUAL: jump = RegOpCode::REG_JNLE; jumpK = RegOpCode::REG_JNLEK; break;
+            case IROp::GREATER: jump = RegOpCode::REG_JNGT; jumpK = RegOpCode::REG_JNGTK; break;
+            default: jump = RegOpCode::REG_JNGE; jumpK = RegOpCode::REG_JNGEK; break;
+        }
+        int a = operand(left);
+        if (k >= 0) {
+            emitJump(jumpK, {a, k}, label);
+        } else {
+            int b = operand(right);
+            emitJump(jump, {a, b}, label);
+        }
+    }
+
+    void emitBranch(IRBlock* block, IRInstr* instr, IRBlock* next) {
+        IRBlock* ifTrue = block->succs[0];
+        IRBlock* ifFalse = block->succs[1];
+        IRInstr* condition = instr->args[0];
+        if (kind[condition->id] == Kind::FUSED) {
+            emitCompareJump(condition, edgeLabel(block, ifFalse));
+        } else {
+            int reg = operand(condition);
+            if (ifFalse == next && !needsCopies(block, ifFalse)) {
+                emitJump(RegOpCode::REG_JMPT, {reg}, edgeLabel(block, ifTrue));
+                return;
+            }
+            emitJump(RegOpCode::REG_JMPF, {reg}, edgeLabel(block, ifFalse));
+        }
+        emitCopies(block, ifTrue);
+        if (ifTrue != next) emitJump(RegOpCode::REG_JMP, {}, ifTrue->id);
+    }
+
+    void emitTerminator(IRBlock* block, IRInstr* instr, IRBlock* next) {
+        nextScratch = 0;
+        switch (instr->op) {
+            case IROp::JUMP:
+                emitCopies(block, block->succs[0]);
+                if (block->succs[0] != next) emitJump(RegOpCode::REG_JMP, {}, block->succs[0]->id);
+                break;
+            case IROp::BRANCH:
+                emitBranch(block, instr, next);
+                break;
+            case IROp::RETURN:
+                emit(RegOpCode::REG_RET, {operand(instr->args[0])});
+                break;
+            case IROp::TAIL_CALL:
+                placeArguments(instr);
+                emitCall(RegOpCode::REG_TAILCALL, RegOpCode::REG_TAILCALL_WIDE, {}, instr->index,
+                         {argBase, static_cast<int>(instr->args.size())});
+                break;
+            case IROp::HALT:
+                emit(RegOpCode::REG_HALT, {});
+                break;
+            case IROp::BREAK:
+                emit(RegOpCode::REG_BREAK, {});
+                break;
+            default:
+                emit(RegOpCode::REG_CONTINUE, {});
+                break;
+        }
+    }
+
+    void patchJumps() {
+        for (const Fixup& fixup : fixups) {
+            long offset = static_cast<long>(labels[fixup.label]) - static_cast<long>(fixup.operand + 2);
+            if (offset < -0x8000 || offset > 0x7FFF) {
+                throw std::runtime_error("Jump too far in " + fn.name + "; split it into smaller functions");
+            }
+            chunk.code[fixup.operand] = (offset >> 8) & 0xFF;
+            chunk.code[fixup.operand + 1] = offset & 0xFF;
+        }
+    }
+
+public:
+    RegisterCodegen(IRFunction& fn, Chunk& chunk, int frameGlobals)
+        : fn(fn), chunk(chunk), frameGlobals(frameGlobals) {}
+
+    // Returns how many registers past the 255 a frame can address it needs
+    int run() {
+        removeUnreachableBlocks(fn);
+        countUses();
+        classify();
+        allocateRegisters();
+        layoutFrame();
+
+        // Operand is patched with the frame size once the code is emitted
+        emit(RegOpCode::REG_ENTER, {0});
+        labels.assign(fn.blockCount, -1);
+        for (size_t i = 0; i < fn.blocks.size(); i++) {
+            IRBlock* block = fn.blocks[i];
+            IRBlock* next = i + 1 < fn.blocks.size() ? fn.blocks[i + 1] : nullptr;
+            labels[block->id] = static_cast<int>(chunk.code.size());
+            for (IRInstr* instr : block->instrs) {
+                if (!emitsCode(instr)) continue;
+                if (isTerminator(instr->op)) {
+                    emitTerminator(block, instr, next);
+                } else {
+                    emitInstr(instr);
+                }
+            }
+        }
+        for (const Stub& stub : stubs) {
+            labels.push_back(static_cast<int>(chunk.code.size()));
+            nextScratch = 0;
+            emitCopies(stub.from, stub.to);
+            emitJump(RegOpCode::REG_JMP, {}, stub.to->id);
+        }
+        patchJumps();
+
+        int frameSize = scratchBase + scratchUsed;
+        if (frameSize > 0xFF) return frameSize - 0xFF;
+        chunk.code[1] = static_cast<uint8_t>(frameSize);
+        return 0;
+    }
+};
+
+void lowerToRegisterCode(IRFunction& fn, Chunk& chunk, int globalCount, int& frameGlobals) {
+    if (!fn.isMain) {
+        if (RegisterCodegen(fn, chunk, frameGlobals).run() > 0) {
+            throw std::runtime_error("Function " + fn.name + " needs more than 255 registers");
+        }
+        return;
+    }
+    // Main keeps the first top-level variables in its frame and spills the
+    // rest, as many as its own values leave no room for
+    frameGlobals = std::min(globalCount, 0xFF);
+    for (;;) {
+        Chunk attempt;
+        int excess = RegisterCodegen(fn, attempt, frameGlobals).run();
+        if (excess == 0) {
+            chunk = std::move(attempt);
+            break;
+        }
+        if (frameGlobals == 0) throw std::runtime_error("main needs more than 255 registers");
+        frameGlobals = std::max(frameGlobals - excess, 0);
+    }
+}
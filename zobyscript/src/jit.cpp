@@ -0,0 +1,1103 @@
+#include "../include/jit.h"
+#include "../include/vm.h"
+#include "../include/runtime.h"
+#include "../include/native.h"
+#include "../include/x64_assembler.h"
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <stdexcept>
+
+// Return point and caller base pointer saved by a script call
+struct JitFrame {
+    const void* returnCode;
+    Value* bp;
+};
+
+// State shared between generated code and its helpers. Generated code keeps
+// sp and bp in registers and stores sp here before calling a helper.
+struct JitState {
+    Value* sp;
+    Value* bp;
+    Value* stackBase;
+    Value* stackEnd;
+    Value* globals;
+    JitFrame* frameTop;
+    JitFrame* frameBase;
+    JitFrame* frameEnd;
+    std::exception_ptr error;
+};
+
+#ifdef ZS_JIT_X64
+
+namespace {
+
+using namespace x64;
+
+// ---------------------------------------------------------------------------
+// Helpers called from generated code. They run the same runtime code as the
+// interpreter and return nonzero after recording an error, which makes the
+// generated code leave through the exit stub; exceptions never unwind
+// through machine code.
+
+void collectIfNeeded() {
+    Heap& heap = Heap::instance();
+    if (heap.shouldCollect()) heap.collect();
+}
+
+template <typename Body>
+int guarded(JitState* st, Body body) {
+    try {
+        body();
+        return 0;
+    } catch (...) {
+        st->error = std::current_exception();
+        return 1;
+    }
+}
+
+void push(JitState* st, const Value& value) {
+    if (st->sp == st->stackEnd) throw std::runtime_error("Stack overflow");
+    *st->sp++ = value;
+}
+
+Value pop(JitState* st) {
+    if (st->sp == st->stackBase) throw std::runtime_error("Stack underflow");
+    return *--st->sp;
+}
+
+int helperFail(JitState* st, const char* message) {
+    st->error = std::make_exception_ptr(std::runtime_error(message));
+    return 1;
+}
+
+int helperTruthy(const Value* value) {
+    return isTruthy(*value);
+}
+
+int helperAdd(JitState* st) {
+    return guarded(st, [&] {
+        Value b = pop(st);
+        Value a = pop(st);
+        push(st, addValues(a, b));
+        collectIfNeeded();
+    });
+}
+
+int helperEqual(JitState* st, int negate) {
+    return guarded(st, [&] {
+        Value b = pop(st);
+        Value a = pop(st);
+        push(st, Value(valuesEqual(a, b) != (negate != 0)));
+    });
+}
+
+// dest = dest + amount, for OP_INC_LOCAL and OP_INC_GLOBAL
+int helperAddInto(JitState* st, Value* dest, const Value* amount) {
+    return guarded(st, [&] {
+        *dest = addValues(*dest, *amount);
+        collectIfNeeded();
+    });
+}
+
+// push(a + b), for OP_ADD_LOCALS and OP_ADD_GLOBALS
+int helperPushSum(JitState* st, const Value* a, const Value* b) {
+    return guarded(st, [&] {
+        push(st, addValues(*a, *b));
+        collectIfNeeded();
+    });
+}
+
+int helperArray(JitState* st, int size) {
+    return guarded(st, [&] {
+        ObjArray* arr = Heap::instance().newArray();
+        arr->assign(st->sp - size, st->sp);
+        st->sp -= size;
+        push(st, Value(arr));
+        collectIfNeeded();
+    });
+}
+
+int helperHashMap(JitState* st, int size) {
+    return guarded(st, [&] {
+        ObjHashMap* hm = Heap::instance().newHashMap();
+        for (Value* pair = st->sp - size * 2; pair < st->sp; pair += 2) {
+            hm->set(pair[0], pair[1]);
+        }
+        st->sp -= size * 2;
+        push(st, Value(hm));
+        collectIfNeeded();
+    });
+}
+
+int helperIndexGet(JitState* st) {
+    return guarded(st, [&] {
+        Value index = pop(st);
+        Value array = pop(st);
+        push(st, indexGet(array, index));
+        if (array.isString()) collectIfNeeded();
+    });
+}
+
+int helperIndexSet(JitState* st) {
+    return guarded(st, [&] {
+        Value value = pop(st);
+        Value index = pop(st);
+        Value array = pop(st);
+        indexSet(array, index, value);
+        push(st, array);
+        collectIfNeeded();
+    });
+}
+
+int helperGetField(JitState* st, const Value* key, FieldCache* cache) {
+    return guarded(st, [&] {
+        Value container = pop(st);
+        push(st, getField(container, *key, *cache));
+    });
+}
+
+int helperSetField(JitState* st, const Value* key, FieldCache* cache) {
+    return guarded(st, [&] {
+        Value value = pop(st);
+        Value container = pop(st);
+        setField(container, *key, value, *cache);
+        collectIfNeeded();
+    });
+}
+
+int helperPrint(JitState* st, int argc) {
+    return guarded(st, [&] {
+        printValues(st->sp - argc, argc);
+        st->sp -= argc;
+    });
+}
+
+int helperCallNative(JitState* st, const NativeFunction* native, int argc) {
+    return guarded(st, [&] {
+        Value* args = st->sp - argc;
+        Value result = native->fn(args, argc, native->userdata);
+        st->sp = args;
+        push(st, result);
+        collectIfNeeded();
+    });
+}
+
+// ---------------------------------------------------------------------------
+// Bytecode decoding
+
+struct Instr {
+    OpCode op;
+    size_t pc;    // first byte, including an OP_WIDE prefix
+    size_t next;  // first byte of the following instruction
+    int a;
+    int b;
+    long target;  // jump destination, -1 if not a jump
+};
+
+// One-byte index/count operands per opcode, or -1 for instructions the JIT
+// does not translate: OP_AND/OP_OR (no handler in the interpreter either)
+// and the cached global forms, whose length depends on the cache state
+int operandCount(OpCode op) {
+    switch (op) {
+        case OpCode::OP_CONSTANT:
+        case OpCode::OP_STRING:
+        case OpCode::OP_ARRAY:
+        case OpCode::OP_HASHMAP:
+        case OpCode::OP_GET_GLOBAL:
+        case OpCode::OP_SET_GLOBAL:
+        case OpCode::OP_GET_LOCAL:
+        case OpCode::OP_SET_LOCAL:
+        case OpCode::OP_MAKEFRAME:
+        case OpCode::OP_PRINT:
+        case OpCode::OP_SET_GLOBAL_POP:
+        case OpCode::OP_SET_LOCAL_POP:
+            return 1;
+        case OpCode::OP_CALL:
+        case OpCode::OP_CALL_NATIVE:
+        case OpCode::OP_TAIL_CALL:
+        case OpCode::OP_GET_FIELD:
+        case OpCode::OP_SET_FIELD:
+        case OpCode::OP_SET_GLOBAL_CONST:
+        case OpCode::OP_SET_LOCAL_CONST:
+        case OpCode::OP_INC_GLOBAL:
+        case OpCode::OP_INC_LOCAL:
+        case OpCode::OP_ADD_GLOBALS:
+        case OpCode::OP_ADD_LOCALS:
+            return 2;
+        case OpCode::OP_AND:
+        case OpCode::OP_OR:
+        case OpCode::OP_WIDE:
+            return -1;
+        default:
+            return static_cast<int>(op) <= static_cast<int>(OpCode::OP_CALL_NATIVE) ? 0 : -1;
+    }
+}
+
+bool isJump(OpCode op) {
+    switch (op) {
+        case OpCode::OP_JUMP:
+        case OpCode::OP_JUMP_IF_FALSE:
+        case OpCode::OP_POP_JUMP_IF_FALSE:
+        case OpCode::OP_JUMP_IF_NOT_LESS:
+        case OpCode::OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OpCode::OP_JUMP_IF_NOT_GREATER:
+        case OpCode::OP_JUMP_IF_NOT_GREATER_EQUAL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Decodes every instruction of code; false on anything the JIT cannot
+// translate, including jumps that do not land on an instruction
+bool decode(const std::vector<uint8_t>& code, std::vector<Instr>& out) {
+    size_t pc = 0;
+    while (pc < code.size()) {
+        Instr instr = {};
+        instr.pc = pc;
+        instr.target = -1;
+        bool wide = code[pc] == static_cast<uint8_t>(OpCode::OP_WIDE);
+        if (wide) pc++;
+        if (pc >= code.size()) return false;
+        instr.op = static_cast<OpCode>(code[pc++]);
+        int operands = operandCount(instr.op);
+        if (operands < 0) return false;
+        if (wide && (operands == 0 || isJump(instr.op))) return false;
+        int width = wide ? 3 : 1;
+        if (pc + operands * width > code.size()) return false;
+        int values[2] = {0, 0};
+        for (int i = 0; i < operands; i++) {
+            for (int j = 0; j < width; j++) values[i] = (values[i] << 8) | code[pc++];
+        }
+        instr.a = values[0];
+        instr.b = values[1];
+        if (isJump(instr.op)) {
+            if (pc + 2 > code.size()) return false;
+            int offset = (code[pc] << 8) | code[pc + 1];
+            pc += 2;
+            // Only OP_JUMP goes backwards
+            if (instr.op == OpCode::OP_JUMP && (offset & 0x8000)) offset -= 0x10000;
+            instr.target = static_cast<long>(pc) + offset;
+        }
+        instr.next = pc;
+        out.push_back(instr);
+    }
+    std::vector<bool> starts(code.size(), false);
+    for (const Instr& instr : out) starts[instr.pc] = true;
+    for (const Instr& instr : out) {
+        if (instr.target < 0) continue;
+        if (instr.target >= static_cast<long>(code.size()) || !starts[instr.target]) return false;
+    }
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Translation. Register assignment in generated code:
+//   rbx  value stack pointer (one past the top)
+//   r12  frame base pointer
+//   r13  JitState*
+//   r14  globals
+//   r15  end of the value stack
+//   rbp  Value::QNAN, for number tests
+// All are callee-saved, so they survive helper calls. rax, rcx, rdx and
+// xmm0-2 are scratch.
+
+const Reg SP = RBX, BP = R12, STATE = R13, GLOBALS = R14, STACK_END = R15, QNAN_REG = RBP;
+
+const int32_t ST_SP = offsetof(JitState, sp);
+const int32_t ST_BP = offsetof(JitState, bp);
+const int32_t ST_STACK_BASE = offsetof(JitState, stackBase);
+const int32_t ST_STACK_END = offsetof(JitState, stackEnd);
+const int32_t ST_GLOBALS = offsetof(JitState, globals);
+const int32_t ST_FRAME_TOP = offsetof(JitState, frameTop);
+const int32_t ST_FRAME_BASE = offsetof(JitState, frameBase);
+const int32_t ST_FRAME_END = offsetof(JitState, frameEnd);
+
+const uint64_t FALSE_BITS = Value(false).raw();
+const uint64_t TRUE_BITS = Value(true).raw();
+
+class Translator {
+private:
+    Assembler as;
+    std::vector<Function>& functions;
+    std::vector<int> functionLabels;
+    std::vector<std::function<void()>> coldCode;  // slow paths, placed after each chunk
+    int exitLabel;    // leaves with the status in eax
+    int exitOkLabel;
+    int overflowLabel;
+    int underflowLabel;
+    int divideByZeroLabel;
+    int breakLabel;
+    int continueLabel;
+
+    static int32_t slot(int index) { return index * static_cast<int32_t>(sizeof(Value)); }
+
+    // Stores sp, calls fn (arguments already in rsi/rdx), leaves on error
+    // and reloads sp, which the helper may have moved
+    void callHelper(const void* fn) {
+        as.store(STATE, ST_SP, SP);
+        as.mov(RDI, STATE);
+        as.call(fn);
+        as.alu32(ALU_TEST, RAX, RAX);
+        as.jcc(CC_NE, exitLabel);
+        as.load(SP, STATE, ST_SP);
+    }
+
+    void checkPush() {
+        as.alu(ALU_CMP, SP, STACK_END);
+        as.jcc(CC_E, overflowLabel);
+    }
+
+    // Stack underflow as the interpreter's pop() reports it
+    void checkPop(int count) {
+        if (count == 1) {
+            as.cmpMem(SP, STATE, ST_STACK_BASE);
+            as.jcc(CC_BE, underflowLabel);
+        } else {
+            as.lea(RAX, SP, -slot(count));
+            as.cmpMem(RAX, STATE, ST_STACK_BASE);
+            as.jcc(CC_B, underflowLabel);
+        }
+    }
+
+    void pushBits(uint64_t bits) {
+        checkPush();
+        if (bits <= 0x7FFFFFFFULL) {
+            as.storeImm(SP, 0, static_cast<int32_t>(bits));
+        } else {
+            as.movImm(RAX, bits);
+            as.store(SP, 0, RAX);
+        }
+        as.addImm(SP, 8);
+    }
+
+    void storeBits(Reg base, int32_t disp, uint64_t bits) {
+        if (bits <= 0x7FFFFFFFULL) {
+            as.storeImm(base, disp, static_cast<int32_t>(bits));
+        } else {
+            as.movImm(RAX, bits);
+            as.store(base, disp, RAX);
+        }
+    }
+
+    // Jumps to notNumber unless r holds a number; clobbers rdx
+    void guardNumber(Reg r, int notNumber) {
+        as.mov(RDX, r);
+        as.alu(ALU_AND, RDX, QNAN_REG);
+        as.alu(ALU_CMP, RDX, QNAN_REG);
+        as.jcc(CC_E, notNumber);
+    }
+
+    // Jumps to falsy unless the value at [base + disp] is truthy
+    void branchIfFalsy(Reg base, int32_t disp, int falsy) {
+        int truthy = as.newLabel();
+        int slow = as.newLabel();
+        as.load(RAX, base, disp);
+        as.movImm(RCX, FALSE_BITS);
+        as.alu(ALU_CMP, RAX, RCX);
+        as.jcc(CC_E, falsy);
+        as.movImm(RCX, TRUE_BITS);
+        as.alu(ALU_CMP, RAX, RCX);
+        as.jcc(CC_E, truthy);
+        guardNumber(RAX, slow);
+        // Numbers are falsy only as +0 and -0
+        as.shl(RAX, 1);
+        as.jcc(CC_E, falsy);
+        as.jmp(truthy);
+        as.bind(slow);
+        as.lea(RDI, base, disp);
+        as.call(reinterpret_cast<const void*>(&helperTruthy));
+        as.alu32(ALU_TEST, RAX, RAX);
+        as.jcc(CC_E, falsy);
+        as.bind(truthy);
+    }
+
+    // rax = false/true bits from the byte condition in al
+    void boolFromAl() {
+        as.movzx8(RAX, RAX);
+        as.movImm(RCX, FALSE_BITS);
+        as.alu(ALU_ADD, RAX, RCX);
+    }
+
+    // Operands of the numeric operators: a top-of-stack slot that does not
+    // hold a number is overwritten with 0 out of line, as toNumber reads it
+    void numberOperands(int count) {
+        for (int i = 1; i <= count; i++) {
+            int notNumber = as.newLabel();
+            int done = as.newLabel();
+            int32_t disp = -slot(i);
+            as.load(RAX, SP, disp);
+            guardNumber(RAX, notNumber);
+            as.bind(done);
+            coldCode.push_back([=] {
+                as.bind(notNumber);
+                as.storeImm(SP, disp, 0);
+                as.jmp(done);
+            });
+        }
+    }
+
+    // A NaN result becomes Value::CANONICAL_NAN, as Value(double) makes it;
+    // x86 produces NaNs with the sign bit set, which print as -nan
+    void canonicalizeNaN(int xmm) {
+        int isNaN = as.newLabel();
+        int done = as.newLabel();
+        as.ucomisd(xmm, xmm);
+        as.jcc(CC_P, isNaN);
+        as.bind(done);
+        coldCode.push_back([=] {
+            as.bind(isNaN);
+            as.movImm(RAX, Value::CANONICAL_NAN);
+            as.movqToXmm(xmm, RAX);
+            as.jmp(done);
+        });
+    }
+
+    // Pops two operands and pushes a op b
+    void numericBinary(uint8_t sseOp) {
+        checkPop(2);
+        numberOperands(2);
+        as.movsdLoad(0, SP, -16);
+        as.sse(0xF2, sseOp, 0, SP, -8);
+        canonicalizeNaN(0);
+        as.movsdStore(SP, -16, 0);
+        as.subImm(SP, 8);
+    }
+
+    // OP_ADD_INT and friends: operands truncated to 32-bit ints
+    void intBinary(OpCode op) {
+        checkPop(2);
+        numberOperands(2);
+        as.movsdLoad(0, SP, -16);
+        as.cvttsd2si(RAX, 0);
+        as.movsdLoad(1, SP, -8);
+        as.cvttsd2si(RCX, 1);
+        if (op == OpCode::OP_ADD_INT) as.alu32(ALU_ADD, RAX, RCX);
+        else if (op == OpCode::OP_SUB_INT) as.alu32(ALU_SUB, RAX, RCX);
+        else as.imul32(RAX, RCX);
+        as.xorpd(0, 0);
+        as.cvtsi2sd(0, RAX);
+        as.movsdStore(SP, -16, 0);
+        as.subImm(SP, 8);
+    }
+
+    // Ordered comparisons leave flags for "a op b" as CC_A/CC_AE: a < b is
+    // tested as b > a so that NaN operands compare false
+    Cond compare(OpCode op, int32_t aDisp, int32_t bDisp) {
+        bool swapped = op == OpCode::OP_LESS || op == OpCode::OP_LESS_EQUAL ||
+                       op == OpCode::OP_JUMP_IF_NOT_LESS || op == OpCode::OP_JUMP_IF_NOT_LESS_EQUAL;
+        as.movsdLoad(0, SP, swapped ? bDisp : aDisp);
+        as.ucomisdMem(0, SP, swapped ? aDisp : bDisp);
+        bool orEqual = op == OpCode::OP_LESS_EQUAL || op == OpCode::OP_GREATER_EQUAL ||
+                       op == OpCode::OP_JUMP_IF_NOT_LESS_EQUAL || op == OpCode::OP_JUMP_IF_NOT_GREATER_EQUAL;
+        return orEqual ? CC_AE : CC_A;
+    }
+
+    void translateAdd() {
+        int slow = as.newLabel();
+        int done = as.newLabel();
+        checkPop(2);
+        as.load(RAX, SP, -16);
+        as.load(RCX, SP, -8);
+        guardNumber(RAX, slow);
+        guardNumber(RCX, slow);
+        as.movqToXmm(0, RAX);
+        as.movqToXmm(1, RCX);
+        as.arith(SSE_ADD, 0, 1);
+        canonicalizeNaN(0);
+        as.movsdStore(SP, -16, 0);
+        as.subImm(SP, 8);
+        as.bind(done);
+        coldCode.push_back([=] {
+            as.bind(slow);
+            callHelper(reinterpret_cast<const void*>(&helperAdd));
+            as.jmp(done);
+        });
+    }
+
+    void translateEquality(bool negate) {
+        int slow = as.newLabel();
+        int done = as.newLabel();
+        checkPop(2);
+        as.load(RAX, SP, -16);
+        as.load(RCX, SP, -8);
+        guardNumber(RAX, slow);
+        guardNumber(RCX, slow);
+        as.movqToXmm(0, RAX);
+        as.movqToXmm(1, RCX);
+        as.ucomisd(0, 1);
+        if (negate) {
+            as.setcc(CC_NE, RAX);
+            as.setcc(CC_P, RCX);
+            as.or8(RAX, RCX);
+        } else {
+            as.setcc(CC_E, RAX);
+            as.setcc(CC_NP, RCX);
+            as.and8(RAX, RCX);
+        }
+        boolFromAl();
+        as.store(SP, -16, RAX);
+        as.subImm(SP, 8);
+        as.bind(done);
+        coldCode.push_back([=] {
+            as.bind(slow);
+            as.movImm(RSI, negate ? 1 : 0);
+            callHelper(reinterpret_cast<const void*>(&helperEqual));
+            as.jmp(done);
+        });
+    }
+
+    // dest += constant with an inline number path (OP_INC_LOCAL/GLOBAL)
+    void translateIncrement(Reg base, int32_t disp, const Value* amount) {
+        int slow = as.newLabel();
+        int done = as.newLabel();
+        as.load(RAX, base, disp);
+        guardNumber(RAX, slow);
+        as.movqToXmm(0, RAX);
+        as.movImm(RCX, amount->raw());
+        as.movqToXmm(1, RCX);
+        as.arith(SSE_ADD, 0, 1);
+        canonicalizeNaN(0);
+        as.movsdStore(base, disp, 0);
+        as.bind(done);
+        coldCode.push_back([=] {
+            as.bind(slow);
+            as.lea(RSI, base, disp);
+            as.movImm(RDX, reinterpret_cast<uint64_t>(amount));
+            callHelper(reinterpret_cast<const void*>(&helperAddInto));
+            as.jmp(done);
+        });
+    }
+
+    // push(a + b) for two variables (OP_ADD_LOCALS/GLOBALS)
+    void translateSum(Reg base, int32_t aDisp, int32_t bDisp) {
+        int slow = as.newLabel();
+        int done = as.newLabel();
+        checkPush();
+        as.load(RAX, base, aDisp);
+        as.load(RCX, base, bDisp);
+        guardNumber(RAX, slow);
+        guardNumber(RCX, slow);
+        as.movqToXmm(0, RAX);
+        as.movqToXmm(1, RCX);
+        as.arith(SSE_ADD, 0, 1);
+        canonicalizeNaN(0);
+        as.movsdStore(SP, 0, 0);
+        as.addImm(SP, 8);
+        as.bind(done);
+        coldCode.push_back([=] {
+            as.bind(slow);
+            as.lea(RSI, base, aDisp);
+            as.lea(RDX, base, bDisp);
+            callHelper(reinterpret_cast<const void*>(&helperPushSum));
+            as.jmp(done);
+        });
+    }
+
+    void translateCall(int funcId, int argc) {
+        int returnPoint = as.newLabel();
+        as.load(RAX, STATE, ST_FRAME_TOP);
+        as.cmpMem(RAX, STATE, ST_FRAME_END);
+        as.jcc(CC_E, overflowLabel);
+        as.leaLabel(RCX, returnPoint);
+        as.store(RAX, 0, RCX);
+        as.store(RAX, 8, BP);
+        as.addImm(RAX, sizeof(JitFrame));
+        as.store(STATE, ST_FRAME_TOP, RAX);
+        as.lea(BP, SP, -slot(argc));
+        as.jmp(functionLabels[funcId]);
+        as.bind(returnPoint);
+    }
+
+    // The arguments move down over the caller's locals and the callee runs
+    // in its frame, so no JitFrame is pushed
+    void translateTailCall(int funcId, int argc) {
+        for (int i = 0; i < argc; i++) {
+            as.load(RAX, SP, -slot(argc - i));
+            as.store(BP, slot(i), RAX);
+        }
+        as.lea(SP, BP, slot(argc));
+        as.jmp(functionLabels[funcId]);
+    }
+
+    void translateReturn() {
+        // A return at the top level ends the script
+        as.load(RAX, STATE, ST_FRAME_TOP);
+        as.cmpMem(RAX, STATE, ST_FRAME_BASE);
+        as.jcc(CC_E, exitOkLabel);
+        checkPop(1);
+        as.load(RCX, SP, -8);
+        as.mov(SP, BP);
+        as.subImm(RAX, sizeof(JitFrame));
+        as.store(STATE, ST_FRAME_TOP, RAX);
+        as.load(BP, RAX, 8);
+        as.store(SP, 0, RCX);
+        as.addImm(SP, 8);
+        as.jmpMem(RAX, 0);
+    }
+
+    void translateMakeFrame(int localCount) {
+        int loop = as.newLabel();
+        int done = as.newLabel();
+        as.lea(RAX, BP, slot(localCount));
+        as.alu(ALU_CMP, RAX, STACK_END);
+        as.jcc(CC_A, overflowLabel);
+        as.bind(loop);
+        as.alu(ALU_CMP, SP, RAX);
+        as.jcc(CC_AE, done);
+        as.storeImm(SP, 0, 0);
+        as.addImm(SP, 8);
+        as.jmp(loop);
+        as.bind(done);
+    }
+
+    void translate(const Instr& in, const Chunk& chunk, const std::vector<int>& pcLabels) {
+        const std::vector<Value>& k = chunk.constants;
+        switch (in.op) {
+            case OpCode::OP_CONSTANT:
+            case OpCode::OP_STRING:
+                pushBits(k[in.a].raw());
+                break;
+            case OpCode::OP_CONSTANT_0:
+                pushBits(Value(0.0).raw());
+                break;
+            case OpCode::OP_CONSTANT_1:
+                pushBits(Value(1.0).raw());
+                break;
+            case OpCode::OP_TRUE:
+                pushBits(TRUE_BITS);
+                break;
+            case OpCode::OP_FALSE:
+                pushBits(FALSE_BITS);
+                break;
+            case OpCode::OP_NULL:
+                pushBits(Value::Null().raw());
+                break;
+            case OpCode::OP_ARRAY:
+                as.movImm(RSI, in.a);
+                callHelper(reinterpret_cast<const void*>(&helperArray));
+                break;
+            case OpCode::OP_HASHMAP:
+                as.movImm(RSI, in.a);
+                callHelper(reinterpret_cast<const void*>(&helperHashMap));
+                break;
+            case OpCode::OP_INDEX_GET:
+            case OpCode::OP_INDEX_GET_ARRAY:
+                callHelper(reinterpret_cast<const void*>(&helperIndexGet));
+                break;
+            case OpCode::OP_INDEX_SET:
+                callHelper(reinterpret_cast<const void*>(&helperIndexSet));
+                break;
+            case OpCode::OP_GET_FIELD:
+                as.movImm(RSI, reinterpret_cast<uint64_t>(&k[in.a]));
+                as.movImm(RDX, reinterpret_cast<uint64_t>(&chunk.fieldCaches[in.b]));
+                callHelper(reinterpret_cast<const void*>(&helperGetField));
+                break;
+            case OpCode::OP_SET_FIELD:
+                as.movImm(RSI, reinterpret_cast<uint64_t>(&k[in.a]));
+                as.movImm(RDX, reinterpret_cast<uint64_t>(&chunk.fieldCaches[in.b]));
+                callHelper(reinterpret_cast<const void*>(&helperSetField));
+                break;
+            case OpCode::OP_ADD:
+            case OpCode::OP_ADD_NUM:
+                translateAdd();
+                break;
+            case OpCode::OP_SUBTRACT:
+                numericBinary(SSE_SUB);
+                break;
+            case OpCode::OP_MULTIPLY:
+                numericBinary(SSE_MUL);
+                break;
+            case OpCode::OP_DIVIDE: {
+                int nonZero = as.newLabel();
+                checkPop(2);
+                numberOperands(2);
+                as.movsdLoad(1, SP, -8);
+                as.xorpd(2, 2);
+                as.ucomisd(1, 2);
+                as.jcc(CC_P, nonZero);
+                as.jcc(CC_E, divideByZeroLabel);
+                as.bind(nonZero);
+                as.movsdLoad(0, SP, -16);
+                as.arith(SSE_DIV, 0, 1);
+                canonicalizeNaN(0);
+                as.movsdStore(SP, -16, 0);
+                as.subImm(SP, 8);
+                break;
+            }
+            case OpCode::OP_ADD_INT:
+            case OpCode::OP_SUB_INT:
+            case OpCode::OP_MUL_INT:
+                intBinary(in.op);
+                break;
+            case OpCode::OP_NEGATE:
+                checkPop(1);
+                numberOperands(1);
+                as.movsdLoad(0, SP, -8);
+                as.movImm(RAX, Value::SIGN_BIT);
+                as.movqToXmm(1, RAX);
+                as.xorpd(0, 1);
+                canonicalizeNaN(0);
+                as.movsdStore(SP, -8, 0);
+                break;
+            case OpCode::OP_NOT: {
+                int falsy = as.newLabel();
+                int store = as.newLabel();
+                checkPop(1);
+                branchIfFalsy(SP, -8, falsy);
+                as.movImm(RAX, FALSE_BITS);
+                as.jmp(store);
+                as.bind(falsy);
+                as.movImm(RAX, TRUE_BITS);
+                as.bind(store);
+                as.store(SP, -8, RAX);
+                break;
+            }
+            case OpCode::OP_LESS:
+            case OpCode::OP_GREATER:
+            case OpCode::OP_LESS_EQUAL:
+            case OpCode::OP_GREATER_EQUAL: {
+                checkPop(2);
+                numberOperands(2);
+                Cond cond = compare(in.op, -16, -8);
+                as.setcc(cond, RAX);
+                boolFromAl();
+                as.store(SP, -16, RAX);
+                as.subImm(SP, 8);
+                break;
+            }
+            case OpCode::OP_EQUAL:
+            case OpCode::OP_EQUAL_NUM:
+                translateEquality(false);
+                break;
+            case OpCode::OP_NOT_EQUAL:
+            case OpCode::OP_NOT_EQUAL_NUM:
+                translateEquality(true);
+                break;
+
+            // Globals never move while the JIT runs: compile() sizes the table
+            // for every index the program uses. The cached global opcodes are
+            // never translated, so stores have no caches to invalidate.
+            case OpCode::OP_GET_GLOBAL:
+                checkPush();
+                as.load(RAX, GLOBALS, slot(in.a));
+                as.store(SP, 0, RAX);
+                as.addImm(SP, 8);
+                break;
+            case OpCode::OP_SET_GLOBAL:
+                as.load(RAX, SP, -8);
+                as.store(GLOBALS, slot(in.a), RAX);
+                break;
+            case OpCode::OP_SET_GLOBAL_POP:
+                checkPop(1);
+                as.subImm(SP, 8);
+                as.load(RAX, SP, 0);
+                as.store(GLOBALS, slot(in.a), RAX);
+                break;
+            case OpCode::OP_SET_GLOBAL_CONST:
+                storeBits(GLOBALS, slot(in.a), k[in.b].raw());
+                break;
+            case OpCode::OP_INC_GLOBAL:
+                translateIncrement(GLOBALS, slot(in.a), &k[in.b]);
+                break;
+            case OpCode::OP_ADD_GLOBALS:
+                translateSum(GLOBALS, slot(in.a), slot(in.b));
+                break;
+            case OpCode::OP_GET_LOCAL:
+                checkPush();
+                as.load(RAX, BP, slot(in.a));
+                as.store(SP, 0, RAX);
+                as.addImm(SP, 8);
+                break;
+            case OpCode::OP_SET_LOCAL:
+                as.load(RAX, SP, -8);
+                as.store(BP, slot(in.a), RAX);
+                break;
+            case OpCode::OP_SET_LOCAL_POP:
+                checkPop(1);
+                as.subImm(SP, 8);
+                as.load(RAX, SP, 0);
+                as.store(BP, slot(in.a), RAX);
+                break;
+            case OpCode::OP_SET_LOCAL_CONST:
+                storeBits(BP, slot(in.a), k[in.b].raw());
+                break;
+            case OpCode::OP_INC_LOCAL:
+                translateIncrement(BP, slot(in.a), &k[in.b]);
+                break;
+            case OpCode::OP_ADD_LOCALS:
+                translateSum(BP, slot(in.a), slot(in.b));
+                break;
+
+            case OpCode::OP_JUMP:
+                as.jmp(pcLabels[in.target]);
+                break;
+            case OpCode::OP_JUMP_IF_FALSE:
+                branchIfFalsy(SP, -8, pcLabels[in.target]);
+                break;
+            case OpCode::OP_POP_JUMP_IF_FALSE:
+                checkPop(1);
+                as.subImm(SP, 8);
+                branchIfFalsy(SP, 0, pcLabels[in.target]);
+                break;
+            case OpCode::OP_JUMP_IF_NOT_LESS:
+            case OpCode::OP_JUMP_IF_NOT_LESS_EQUAL:
+            case OpCode::OP_JUMP_IF_NOT_GREATER:
+            case OpCode::OP_JUMP_IF_NOT_GREATER_EQUAL: {
+                checkPop(2);
+                numberOperands(2);
+                as.subImm(SP, 16);
+                Cond cond = compare(in.op, 0, 8);
+                as.jcc(cond == CC_A ? CC_BE : CC_B, pcLabels[in.target]);
+                break;
+            }
+            case OpCode::OP_BREAK:
+                as.jmp(breakLabel);
+                break;
+            case OpCode::OP_CONTINUE:
+                as.jmp(continueLabel);
+                break;
+
+            case OpCode::OP_CALL:
+                translateCall(in.a, in.b);
+                break;
+            case OpCode::OP_TAIL_CALL:
+                translateTailCall(in.a, in.b);
+                break;
+            case OpCode::OP_CALL_NATIVE:
+                as.movImm(RSI, reinterpret_cast<uint64_t>(&nativeTable()[in.a]));
+                as.movImm(RDX, in.b);
+                callHelper(reinterpret_cast<const void*>(&helperCallNative));
+                break;
+            case OpCode::OP_RET:
+                translateReturn();
+                break;
+            case OpCode::OP_MAKEFRAME:
+                translateMakeFrame(in.a);
+                break;
+            case OpCode::OP_POPFRAME:
+                break;
+            case OpCode::OP_PRINT:
+                as.movImm(RSI, in.a);
+                callHelper(reinterpret_cast<const void*>(&helperPrint));
+                break;
+            case OpCode::OP_POP:
+                checkPop(1);
+                as.subImm(SP, 8);
+                break;
+            case OpCode::OP_HALT:
+                as.jmp(exitOkLabel);
+                break;
+            default:
+                // Filtered out by operandCount()
+                break;
+        }
+    }
+
+    // Operands that index tables must be in range, or the program is left
+    // to the interpreter
+    bool operandsValid(const Instr& in, const Chunk& chunk) const {
+        int constants = static_cast<int>(chunk.constants.size());
+        switch (in.op) {
+            case OpCode::OP_CONSTANT:
+            case OpCode::OP_STRING:
+                return in.a < constants;
+            case OpCode::OP_SET_GLOBAL_CONST:
+            case OpCode::OP_SET_LOCAL_CONST:
+            case OpCode::OP_INC_GLOBAL:
+            case OpCode::OP_INC_LOCAL:
+                return in.b < constants;
+            case OpCode::OP_CALL:
+            case OpCode::OP_TAIL_CALL:
+                return in.a < static_cast<int>(functions.size());
+            case OpCode::OP_CALL_NATIVE:
+                return in.a < static_cast<int>(nativeTable().size());
+            case OpCode::OP_GET_FIELD:
+            case OpCode::OP_SET_FIELD:
+                return in.a < constants && in.b < static_cast<int>(chunk.fieldCaches.size());
+            default:
+                return true;
+        }
+    }
+
+    bool translateChunk(const Chunk& chunk, int entryLabel) {
+        std::vector<Instr> instrs;
+        if (!decode(chunk.code, instrs)) return false;
+        std::vector<int> pcLabels(chunk.code.size(), -1);
+        for (const Instr& in : instrs) {
+            if (!operandsValid(in, chunk)) return false;
+            pcLabels[in.pc] = as.newLabel();
+        }
+        as.bind(entryLabel);
+        for (const Instr& in : instrs) {
+            as.bind(pcLabels[in.pc]);
+            translate(in, chunk, pcLabels);
+        }
+        // Running off the end stops the program like OP_HALT
+        as.jmp(exitOkLabel);
+        for (const auto& emitCold : coldCode) emitCold();
+        coldCode.clear();
+        return true;
+    }
+
+    void errorStub(int label, const char* message) {
+        as.bind(label);
+        as.mov(RDI, STATE);
+        as.movImm(RSI, reinterpret_cast<uint64_t>(message));
+        as.call(reinterpret_cast<const void*>(&helperFail));
+        as.jmp(exitLabel);
+    }
+
+public:
+    explicit Translator(std::vector<Function>& funcs) : functions(funcs) {
+        exitLabel = as.newLabel();
+        exitOkLabel = as.newLabel();
+        overflowLabel = as.newLabel();
+        underflowLabel = as.newLabel();
+        divideByZeroLabel = as.newLabel();
+        breakLabel = as.newLabel();
+        continueLabel = as.newLabel();
+        for (size_t i = 0; i < functions.size(); i++) functionLabels.push_back(as.newLabel());
+    }
+
+    // Entry stub: int entry(JitState* state, const void* code). Saves the
+    // callee-saved registers, loads the pinned ones and jumps to code; the
+    // exit stub undoes it and returns the status in eax.
+    size_t emitStubs() {
+        size_t entry = as.code.size();
+        as.push(RBX);
+        as.push(RBP);
+        as.push(R12);
+        as.push(R13);
+        as.push(R14);
+        as.push(R15);
+        as.subImm(RSP, 8);  // keeps rsp 16-byte aligned at helper calls
+        as.mov(STATE, RDI);
+        as.load(SP, STATE, ST_SP);
+        as.load(BP, STATE, ST_BP);
+        as.load(GLOBALS, STATE, ST_GLOBALS);
+        as.load(STACK_END, STATE, ST_STACK_END);
+        as.movImm(QNAN_REG, Value::QNAN);
+        as.jmpReg(RSI);
+
+        as.bind(exitOkLabel);
+        as.alu32(ALU_XOR, RAX, RAX);
+        as.bind(exitLabel);
+        as.store(STATE, ST_SP, SP);
+        as.store(STATE, ST_BP, BP);
+        as.addImm(RSP, 8);
+        as.pop(R15);
+        as.pop(R14);
+        as.pop(R13);
+        as.pop(R12);
+        as.pop(RBP);
+        as.pop(RBX);
+        as.ret();
+
+        errorStub(overflowLabel, "Stack overflow");
+        errorStub(underflowLabel, "Stack underflow");
+        errorStub(divideByZeroLabel, "Division by zero");
+        errorStub(breakLabel, "break outside loop");
+        errorStub(continueLabel, "continue outside loop");
+        return entry;
+    }
+
+    // Returns the main chunk's code offset, or -1 if the program cannot be
+    // translated
+    long translateProgram(const Chunk& mainChunk) {
+        int mainLabel = as.newLabel();
+        if (!translateChunk(mainChunk, mainLabel)) return -1;
+        for (size_t i = 0; i < functions.size(); i++) {
+            if (!translateChunk(functions[i].chunk, functionLabels[i])) return -1;
+        }
+        if (!as.finish()) return -1;
+        return as.offset(mainLabel);
+    }
+
+    const std::vector<uint8_t>& code() const { return as.code; }
+};
+
+}  // namespace
+
+bool Jit::supported() {
+    return true;
+}
+
+bool Jit::compile(Chunk& mainChunk, std::vector<Function>& functions) {
+    Translator translator(functions);
+    size_t entry = translator.emitStubs();
+    long main = translator.translateProgram(mainChunk);
+    if (main < 0) return false;
+
+    const std::vector<uint8_t>& bytes = translator.code();
+    code = mapExecutable(bytes);
+    if (!code) return false;
+    codeSize = bytes.size();
+    entryOffset = entry;
+    mainOffset = static_cast<size_t>(main);
+    return true;
+}
+
+void Jit::run() {
+    if (!code) throw std::runtime_error("JIT: nothing compiled");
+    std::vector<JitFrame> frames(vm.maxFrames);
+    JitState st;
+    st.sp = vm.stack.data();
+    st.bp = st.sp;
+    st.stackBase = vm.stack.data();
+    st.stackEnd = vm.stackEnd;
+    st.globals = vm.globals.data();
+    st.frameTop = frames.data();
+    st.frameBase = frames.data();
+    st.frameEnd = frames.data() + frames.size();
+
+    typedef int (*Entry)(JitState*, const void*);
+    Entry entry = reinterpret_cast<Entry>(code + entryOffset);
+    state = &st;
+    int status = entry(&st, code + mainOffset);
+    state = nullptr;
+    if (status != 0) {
+        if (st.error) std::rethrow_exception(st.error);
+        throw std::runtime_error("JIT: execution failed");
+    }
+}
+
+Jit::~Jit() {
+    if (code) unmapExecutable(code, codeSize);
+    Heap::instance().removeRoots(this);
+}
+
+#else
+
+bool Jit::supported() {
+    return false;
+}
+
+bool Jit::compile(Chunk&, std::vector<Function>&) {
+    return false;
+}
+
+void Jit::run() {
+    throw std::runtime_error("The JIT is not supported on this platform");
+}
+
+Jit::~Jit() {
+    Heap::instance().removeRoots(this);
+}
+
+#endif
+
+Jit::Jit(VM& owner) : vm(owner), code(nullptr), codeSize(0), entryOffset(0), mainOffset(0), state(nullptr) {
+    Heap::instance().addRoots(this);
+}
+
+// The interpreter's own stack pointer is idle while compiled code runs, so
+// the live part of the value stack is marked from here
+void Jit::markRoots(Heap& heap) {
+    if (!state) return;
+    for (const Value* slot = state->stackBase; slot < state->sp; slot++) {
+        heap.markValue(*slot);
+    }
+}
@@ -130,6 +130,11 @@ std::vector<Token> Lexer::tokenize() {
             tokens.push_back(Token(TokenType::MINUS, "-", line, column));
             advance();
         }
+        else if (current() == '=' && peek() == '=') {
+            tokens.push_back(Token(TokenType::EQUAL, "==", line, column));
+            advance();
+            advance();
+        }
         else if (current() == '=') {
             tokens.push_back(Token(TokenType::ASSIGN, "=", line, column));
             advance();
@@ -185,11 +190,6 @@ std::vector<Token> Lexer::tokenize() {
                 advance();
             }
         }
-        else if (current() == '=' && peek() == '=') {
-            tokens.push_back(Token(TokenType::EQUAL, "==", line, column));
-            advance();
-            advance();
-        }
         else if (current() == '!' && peek() == '=') {
             tokens.push_back(Token(TokenType::NOT_EQUAL, "!=", line, column));
             advance();
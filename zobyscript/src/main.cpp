@@ -2,6 +2,8 @@
 #include "../include/parser.h"
 #include "../include/compiler.h"
 #include "../include/vm.h"
+#include "../include/register_vm.h"
+#include "../include/jit.h"
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -89,17 +91,59 @@ void obfuscateFile(const std::string& filename, const std::string& source) {
 
 int main(int argc, char* argv[]) {
     if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <script.zs|script.zsc>" << std::endl;
+        std::cerr << "Usage: " << argv[0] << " <script.zs|script.zsc> [--stack-size=<slots>] [--engine=stack|register] [--jit[=method|trace]] [--dump-ir]" << std::endl;
         return 1;
     }
     
     try {
         std::string filename = argv[1];
+        size_t stackSlots = VM::DEFAULT_STACK_SLOTS;
+        bool registerEngine = false;
+        bool jit = false;
+        bool traceJit = false;
+        bool dumpIR = false;
+        for (int i = 2; i < argc; i++) {
+            std::string option = argv[i];
+            if (option.compare(0, 13, "--stack-size=") == 0) {
+                stackSlots = std::stoul(option.substr(13));
+                if (stackSlots == 0) throw std::runtime_error("--stack-size must be positive");
+            } else if (option.compare(0, 9, "--engine=") == 0) {
+                std::string engine = option.substr(9);
+                if (engine != "stack" && engine != "register") throw std::runtime_error("Unknown engine: " + engine);
+                registerEngine = engine == "register";
+            } else if (option == "--jit" || option == "--jit=method") {
+                jit = true;
+            } else if (option == "--jit=trace") {
+                traceJit = true;
+            } else if (option == "--dump-ir") {
+                dumpIR = true;
+            } else {
+                throw std::runtime_error("Unknown option: " + option);
+            }
+        }
         bool isBytecode = filename.size() >= 4 && filename.substr(filename.size() - 4) == ".zsc";
+        if (isBytecode && registerEngine) {
+            throw std::runtime_error("--engine=register needs a .zs source file");
+        }
+        if (dumpIR && isBytecode) {
+            throw std::runtime_error("--dump-ir needs a .zs source file");
+        }
+        if (jit && traceJit) {
+            throw std::runtime_error("Choose one of --jit=method and --jit=trace");
+        }
+        if ((jit || traceJit) && registerEngine) {
+            throw std::runtime_error("--jit works with the stack engine only");
+        }
+        if ((jit || traceJit) && !Jit::supported()) {
+            throw std::runtime_error("--jit is not supported on this platform");
+        }
         
         Compiler compiler;
+        compiler.enableIRDump(dumpIR);
         Chunk mainChunk;
         std::string source;
+        Arena arena;
+        ProgramNode* program = nullptr;
         
         if (isBytecode) {
             std::cout << "[VM] Loading bytecode from '" << filename << "'..." << std::endl;
@@ -116,10 +160,10 @@ int main(int argc, char* argv[]) {
             Lexer lexer(source);
             std::vector<Token> tokens = lexer.tokenize();
             
-            Parser parser(tokens);
-            auto program = parser.parse();
+            Parser parser(tokens, arena);
+            program = parser.parse();
             
-            mainChunk = compiler.compile(program.get());
+            mainChunk = registerEngine ? compiler.compileRegisters(program) : compiler.compile(program);
         }
         
         if (compiler.isObfuscated()) {
@@ -131,14 +175,25 @@ int main(int argc, char* argv[]) {
             std::cout << std::endl;
         }
         
-        VM vm;
         auto start = std::chrono::high_resolution_clock::now();
-        vm.run(mainChunk, compiler.getFunctions());
+        if (registerEngine) {
+            RegisterVM vm(stackSlots);
+            vm.run(mainChunk, compiler.getFunctions());
+        } else {
+            VM vm(stackSlots);
+            vm.enableJit(jit);
+            vm.enableTraceJit(traceJit);
+            vm.run(mainChunk, compiler.getFunctions());
+        }
         auto end = std::chrono::high_resolution_clock::now();
         auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
         
         if (!compiler.isObfuscated() && !isBytecode) {
             std::cout << "\n[Performance] Execution time: " << duration.count() << "ms" << std::endl;
+            if (!registerEngine) {
+                std::cout << "[Performance] Peephole optimizer removed " << compiler.peepholeRemovedCount()
+                          << " instructions" << std::endl;
+            }
         }
         
         if (compiler.isObfuscated() && !isBytecode) {
@@ -155,7 +210,11 @@ int main(int argc, char* argv[]) {
                 zscFile += ".zsc";
             }
             
-            compiler.saveBytecode(zscFile, mainChunk);
+            // .zsc files hold stack bytecode as compiled: the stack VM has
+            // quickened mainChunk in place, and the register engine's chunk
+            // is a different instruction set
+            Compiler stackCompiler;
+            compiler.saveBytecode(zscFile, stackCompiler.compile(program));
             std::cout << "[OBFUSCATOR] Bytecode saved to '" << zscFile << "'" << std::endl;
             std::cout << "[OBFUSCATOR] Run with: " << argv[0] << " " << zscFile << std::endl;
             std::cout << "[OBFUSCATOR] Original code replaced with obfuscated version." << std::endl;
@@ -0,0 +1,280 @@
+#include "../include/native.h"
+#include "../include/numeric.h"
+#include "../include/runtime.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cmath>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdio>
+#include <stdexcept>
+
+// Built-ins check argc themselves. Calls with the wrong argument count or
+// types give 0.
+static Value nativeLen(const Value* args, int argc, void*) {
+    if (argc < 1) return Value(0.0);
+    if (args[0].isArray()) return Value(static_cast<double>(args[0].asArray()->elements.size()));
+    if (args[0].isString()) return Value(static_cast<double>(args[0].stringLength()));
+    return Value(0.0);
+}
+
+// Arrays are shared by reference, so push/pop mutate in place and
+// `arr = push(arr, x)` stays amortized O(1)
+static Value nativePush(const Value* args, int argc, void*) {
+    if (argc != 2 || !args[0].isArray()) return Value(0.0);
+    args[0].asArray()->push(args[1]);
+    return args[0];
+}
+
+static Value nativePop(const Value* args, int argc, void*) {
+    if (argc < 1 || !args[0].isArray() || args[0].asArray()->elements.empty()) return Value(0.0);
+    return args[0].asArray()->pop();
+}
+
+// One-argument math builtins
+#define ZS_MATH_NATIVE(fnName, expr) \
+    static Value fnName(const Value* args, int argc, void*) { \
+        if (argc < 1) return Value(0.0); \
+        double x = toNumber(args[0]); \
+        return Value(expr); \
+    }
+ZS_MATH_NATIVE(nativeSqrt, std::sqrt(x))
+ZS_MATH_NATIVE(nativeAbs, std::abs(x))
+ZS_MATH_NATIVE(nativeFloor, std::floor(x))
+ZS_MATH_NATIVE(nativeCeil, std::ceil(x))
+ZS_MATH_NATIVE(nativeRound, std::round(x))
+ZS_MATH_NATIVE(nativeSin, std::sin(x))
+ZS_MATH_NATIVE(nativeCos, std::cos(x))
+ZS_MATH_NATIVE(nativeTan, std::tan(x))
+#undef ZS_MATH_NATIVE
+
+static Value nativePow(const Value* args, int argc, void*) {
+    if (argc != 2) return Value(0.0);
+    return Value(std::pow(toNumber(args[0]), toNumber(args[1])));
+}
+
+static Value nativeRandom(const Value*, int, void*) {
+    return Value(static_cast<double>(rand()) / RAND_MAX);
+}
+
+// min/max take two numbers or reduce one array
+static Value nativeMin(const Value* args, int argc, void*) {
+    if (argc == 2) return Value(std::min(toNumber(args[0]), toNumber(args[1])));
+    if (argc == 1 && args[0].isArray()) {
+        double result;
+        return arrayMin(args[0].asArray(), result) ? Value(result) : Value::Null();
+    }
+    return Value(0.0);
+}
+
+static Value nativeMax(const Value* args, int argc, void*) {
+    if (argc == 2) return Value(std::max(toNumber(args[0]), toNumber(args[1])));
+    if (argc == 1 && args[0].isArray()) {
+        double result;
+        return arrayMax(args[0].asArray(), result) ? Value(result) : Value::Null();
+    }
+    return Value(0.0);
+}
+
+static Value nativeSum(const Value* args, int argc, void*) {
+    if (argc != 1 || !args[0].isArray()) return Value(0.0);
+    return Value(arraySum(args[0].asArray()));
+}
+
+static Value nativeMean(const Value* args, int argc, void*) {
+    if (argc != 1 || !args[0].isArray()) return Value(0.0);
+    const ObjArray* arr = args[0].asArray();
+    if (arr->elements.empty()) return Value(0.0);
+    return Value(arraySum(arr) / static_cast<double>(arr->elements.size()));
+}
+
+static Value nativeDot(const Value* args, int argc, void*) {
+    if (argc != 2 || !args[0].isArray() || !args[1].isArray()) return Value(0.0);
+    return Value(arrayDot(args[0].asArray(), args[1].asArray()));
+}
+
+static Value nativeStr(const Value* args, int argc, void*) {
+    if (argc != 1) return Value(0.0);
+    if (args[0].isNumber()) {
+        return makeString(std::to_string(static_cast<int>(args[0].asNumber())));
+    } else if (args[0].isBool()) {
+        return makeString(args[0].asBool() ? "true" : "false");
+    }
+    return args[0];
+}
+
+static Value nativeNum(const Value* args, int argc, void*) {
+    if (argc != 1 || !args[0].isString()) return Value(0.0);
+    try {
+        return Value(std::stod(args[0].asString()->chars));
+    } catch (...) {
+        return Value(0.0);
+    }
+}
+
+static Value nativeType(const Value* args, int argc, void*) {
+    if (argc != 1) return Value(0.0);
+    if (args[0].isNumber()) return makeString("number");
+    if (args[0].isString()) return makeString("string");
+    if (args[0].isBool()) return makeString("boolean");
+    if (args[0].isArray()) return makeString("array");
+    return Value(0.0);
+}
+
+static Value nativeInput(const Value* args, int argc, void*) {
+    if (argc < 1 || !args[0].isString()) return Value(0.0);
+    std::cout << args[0].asString()->chars;
+    std::string input;
+    std::getline(std::cin, input);
+    return makeString(input);
+}
+
+static Value nativeUpper(const Value* args, int argc, void*) {
+    if (argc != 1 || !args[0].isString()) return Value(0.0);
+    std::string result = args[0].asString()->chars;
+    for (char& c : result) c = std::toupper(c);
+    return makeString(result);
+}
+
+static Value nativeLower(const Value* args, int argc, void*) {
+    if (argc != 1 || !args[0].isString()) return Value(0.0);
+    std::string result = args[0].asString()->chars;
+    for (char& c : result) c = std::tolower(c);
+    return makeString(result);
+}
+
+static Value nativeSplit(const Value* args, int argc, void*) {
+    if (argc != 2 || !args[0].isString() || !args[1].isString()) return Value(0.0);
+    ObjArray* arr = Heap::instance().newArray();
+    std::string str = args[0].asString()->chars;
+    const std::string& delim = args[1].asString()->chars;
+    size_t pos = 0;
+    while ((pos = str.find(delim)) != std::string::npos) {
+        arr->push(makeString(str.substr(0, pos)));
+        str.erase(0, pos + delim.length());
+    }
+    if (!str.empty()) arr->push(makeString(str));
+    return Value(arr);
+}
+
+static Value nativeJoin(const Value* args, int argc, void*) {
+    if (argc != 2 || !args[0].isArray() || !args[1].isString()) return Value(0.0);
+    const std::vector<Value>& elements = args[0].asArray()->elements;
+    std::string result;
+    for (size_t i = 0; i < elements.size(); i++) {
+        if (elements[i].isString()) {
+            result += elements[i].asString()->chars;
+        }
+        if (i < elements.size() - 1) result += args[1].asString()->chars;
+    }
+    return makeString(result);
+}
+
+static Value nativeKeys(const Value* args, int argc, void*) {
+    if (argc != 1 || !args[0].isHashMap()) return Value(0.0);
+    ObjArray* arr = Heap::instance().newArray();
+    for (const auto& entry : args[0].asHashMap()->entries) {
+        arr->push(entry.key);
+    }
+    return Value(arr);
+}
+
+static Value nativeValues(const Value* args, int argc, void*) {
+    if (argc != 1 || !args[0].isHashMap()) return Value(0.0);
+    ObjArray* arr = Heap::instance().newArray();
+    for (const auto& entry : args[0].asHashMap()->entries) {
+        arr->push(entry.value);
+    }
+    return Value(arr);
+}
+
+static Value nativeRead(const Value* args, int argc, void*) {
+    if (argc != 1 || !args[0].isString()) return Value(0.0);
+    std::ifstream file(args[0].asString()->chars);
+    if (!file.is_open()) return Value::Null();
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    return makeString(buffer.str());
+}
+
+static Value nativeWrite(const Value* args, int argc, void*) {
+    if (argc != 2 || !args[0].isString() || !args[1].isString()) return Value(0.0);
+    std::ofstream file(args[0].asString()->chars);
+    if (!file.is_open()) return Value(false);
+    file << args[1].asString()->chars;
+    file.close();
+    return Value(true);
+}
+
+static Value nativeAppend(const Value* args, int argc, void*) {
+    if (argc != 2 || !args[0].isString() || !args[1].isString()) return Value(0.0);
+    std::ofstream file(args[0].asString()->chars, std::ios::app);
+    if (!file.is_open()) return Value(false);
+    file << args[1].asString()->chars;
+    file.close();
+    return Value(true);
+}
+
+static Value nativeExists(const Value* args, int argc, void*) {
+    if (argc != 1 || !args[0].isString()) return Value(0.0);
+    std::ifstream file(args[0].asString()->chars);
+    return Value(file.good());
+}
+
+static Value nativeDelete(const Value* args, int argc, void*) {
+    if (argc != 1 || !args[0].isString()) return Value(0.0);
+    return Value(std::remove(args[0].asString()->chars.c_str()) == 0);
+}
+
+// Built on first use so hosts can register from their own static initializers
+static std::vector<NativeFunction>& natives() {
+    static std::vector<NativeFunction> table = {
+        {"len", nativeLen, -1, true},       {"push", nativePush, -1},           {"pop", nativePop, -1},
+        {"sqrt", nativeSqrt, -1, true},     {"pow", nativePow, -1, true},       {"abs", nativeAbs, -1, true},
+        {"floor", nativeFloor, -1, true},   {"ceil", nativeCeil, -1, true},     {"sin", nativeSin, -1, true},
+        {"cos", nativeCos, -1, true},       {"tan", nativeTan, -1, true},       {"random", nativeRandom, -1},
+        {"min", nativeMin, -1, true},       {"max", nativeMax, -1, true},       {"round", nativeRound, -1, true},
+        {"sum", nativeSum, -1, true},       {"mean", nativeMean, -1, true},     {"dot", nativeDot, -1, true},
+        {"str", nativeStr, -1, true},       {"num", nativeNum, -1, true},       {"type", nativeType, -1, true},
+        {"input", nativeInput, -1},         {"upper", nativeUpper, -1, true},   {"lower", nativeLower, -1, true},
+        {"split", nativeSplit, -1},         {"join", nativeJoin, -1},           {"keys", nativeKeys, -1},
+        {"values", nativeValues, -1},       {"read", nativeRead, -1},           {"write", nativeWrite, -1},
+        {"append", nativeAppend, -1},       {"exists", nativeExists, -1},       {"delete", nativeDelete, -1},
+    };
+    return table;
+}
+
+const std::vector<NativeFunction>& nativeTable() {
+    return natives();
+}
+
+static int findNative(const std::string& name) {
+    const std::vector<NativeFunction>& table = natives();
+    for (size_t i = 0; i < table.size(); i++) {
+        if (table[i].name == name) return static_cast<int>(i);
+    }
+    return -1;
+}
+
+int registerNative(const std::string& name, int arity, NativeFn fn, bool pure, void* userdata) {
+    if (!fn) throw std::runtime_error("registerNative: null function for '" + name + "'");
+    if (arity < 0) throw std::runtime_error("registerNative: negative arity for '" + name + "'");
+    if (name == "print" || findNative(name) >= 0) {
+        throw std::runtime_error("registerNative: '" + name + "' is already defined");
+    }
+    natives().push_back(NativeFunction{name, fn, arity, pure, userdata});
+    return static_cast<int>(natives().size()) - 1;
+}
+
+int resolveNative(const std::string& name, int argc) {
+    int id = findNative(name);
+    if (id >= 0) {
+        int arity = natives()[id].arity;
+        if (arity >= 0 && argc != arity) {
+            throw std::runtime_error(name + "() takes " + std::to_string(arity) + " argument" +
+                                     (arity == 1 ? "" : "s") + ", got " + std::to_string(argc));
+        }
+    }
+    return id;
+}
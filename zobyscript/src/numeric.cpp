@@ -0,0 +1,206 @@
+#include "../include/numeric.h"
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define ZS_HAVE_AVX2 1
+#define ZS_TARGET_AVX2 __attribute__((target("avx2")))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <immintrin.h>
+#include <intrin.h>
+#define ZS_HAVE_AVX2 1
+#define ZS_TARGET_AVX2
+#endif
+
+// Number Values are plain doubles, so a packed element buffer can be loaded
+// as float64 lanes directly
+static inline const double* lanes(const Value* values) {
+    return reinterpret_cast<const double*>(values);
+}
+
+static double sumScalar(const Value* values, size_t count) {
+    double total = 0;
+    for (size_t i = 0; i < count; i++) total += values[i].asNumber();
+    return total;
+}
+
+static double minScalar(const Value* values, size_t count) {
+    double result = values[0].asNumber();
+    for (size_t i = 1; i < count; i++) result = std::min(result, values[i].asNumber());
+    return result;
+}
+
+static double maxScalar(const Value* values, size_t count) {
+    double result = values[0].asNumber();
+    for (size_t i = 1; i < count; i++) result = std::max(result, values[i].asNumber());
+    return result;
+}
+
+static double dotScalar(const Value* a, const Value* b, size_t count) {
+    double total = 0;
+    for (size_t i = 0; i < count; i++) total += a[i].asNumber() * b[i].asNumber();
+    return total;
+}
+
+#ifdef ZS_HAVE_AVX2
+static bool detectAvx2() {
+#if defined(__GNUC__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+#else
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+    __cpuid(info, 1);
+    // AVX state must be enabled by the OS, not just present
+    if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0) return false;
+    if ((_xgetbv(0) & 6) != 6) return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#endif
+}
+
+static bool hasAvx2() {
+    static const bool supported = detectAvx2();
+    return supported;
+}
+
+ZS_TARGET_AVX2 static double horizontalSum(__m256d v) {
+    __m128d lo = _mm256_castpd256_pd128(v);
+    __m128d hi = _mm256_extractf128_pd(v, 1);
+    lo = _mm_add_pd(lo, hi);
+    return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+// Two independent accumulators hide the add latency
+ZS_TARGET_AVX2 static double sumAvx2(const Value* values, size_t count) {
+    const double* p = lanes(values);
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(p + i));
+        acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(p + i + 4));
+    }
+    double total = horizontalSum(_mm256_add_pd(acc0, acc1));
+    for (; i < count; i++) total += values[i].asNumber();
+    return total;
+}
+
+ZS_TARGET_AVX2 static double dotAvx2(const Value* a, const Value* b, size_t count) {
+    const double* pa = lanes(a);
+    const double* pb = lanes(b);
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_loadu_pd(pa + i), _mm256_loadu_pd(pb + i)));
+        acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_loadu_pd(pa + i + 4), _mm256_loadu_pd(pb + i + 4)));
+    }
+    double total = horizontalSum(_mm256_add_pd(acc0, acc1));
+    for (; i < count; i++) total += a[i].asNumber() * b[i].asNumber();
+    return total;
+}
+
+ZS_TARGET_AVX2 static double minAvx2(const Value* values, size_t count) {
+    if (count < 4) return minScalar(values, count);
+    const double* p = lanes(values);
+    __m256d acc = _mm256_loadu_pd(p);
+    size_t i = 4;
+    for (; i + 4 <= count; i += 4) acc = _mm256_min_pd(acc, _mm256_loadu_pd(p + i));
+    alignas(32) double out[4];
+    _mm256_store_pd(out, acc);
+    double result = std::min(std::min(out[0], out[1]), std::min(out[2], out[3]));
+    for (; i < count; i++) result = std::min(result, values[i].asNumber());
+    return result;
+}
+
+ZS_TARGET_AVX2 static double maxAvx2(const Value* values, size_t count) {
+    if (count < 4) return maxScalar(values, count);
+    const double* p = lanes(values);
+    __m256d acc = _mm256_loadu_pd(p);
+    size_t i = 4;
+    for (; i + 4 <= count; i += 4) acc = _mm256_max_pd(acc, _mm256_loadu_pd(p + i));
+    alignas(32) double out[4];
+    _mm256_store_pd(out, acc);
+    double result = std::max(std::max(out[0], out[1]), std::max(out[2], out[3]));
+    for (; i < count; i++) result = std::max(result, values[i].asNumber());
+    return result;
+}
+#endif
+
+double arraySum(const ObjArray* arr) {
+    const std::vector<Value>& elements = arr->elements;
+    if (arr->isPacked()) {
+#ifdef ZS_HAVE_AVX2
+        if (hasAvx2()) return sumAvx2(elements.data(), elements.size());
+#endif
+        return sumScalar(elements.data(), elements.size());
+    }
+    double total = 0;
+    for (const Value& v : elements) {
+        if (v.isNumber()) total += v.asNumber();
+    }
+    return total;
+}
+
+bool arrayMin(const ObjArray* arr, double& result) {
+    const std::vector<Value>& elements = arr->elements;
+    if (arr->isPacked()) {
+        if (elements.empty()) return false;
+#ifdef ZS_HAVE_AVX2
+        if (hasAvx2()) {
+            result = minAvx2(elements.data(), elements.size());
+            return true;
+        }
+#endif
+        result = minScalar(elements.data(), elements.size());
+        return true;
+    }
+    bool found = false;
+    for (const Value& v : elements) {
+        if (!v.isNumber()) continue;
+        result = found ? std::min(result, v.asNumber()) : v.asNumber();
+        found = true;
+    }
+    return found;
+}
+
+bool arrayMax(const ObjArray* arr, double& result) {
+    const std::vector<Value>& elements = arr->elements;
+    if (arr->isPacked()) {
+        if (elements.empty()) return false;
+#ifdef ZS_HAVE_AVX2
+        if (hasAvx2()) {
+            result = maxAvx2(elements.data(), elements.size());
+            return true;
+        }
+#endif
+        result = maxScalar(elements.data(), elements.size());
+        return true;
+    }
+    bool found = false;
+    for (const Value& v : elements) {
+        if (!v.isNumber()) continue;
+        result = found ? std::max(result, v.asNumber()) : v.asNumber();
+        found = true;
+    }
+    return found;
+}
+
+double arrayDot(const ObjArray* a, const ObjArray* b) {
+    size_t count = std::min(a->elements.size(), b->elements.size());
+    if (a->isPacked() && b->isPacked()) {
+#ifdef ZS_HAVE_AVX2
+        if (hasAvx2()) return dotAvx2(a->elements.data(), b->elements.data(), count);
+#endif
+        return dotScalar(a->elements.data(), b->elements.data(), count);
+    }
+    double total = 0;
+    for (size_t i = 0; i < count; i++) {
+        Value x = a->elements[i];
+        Value y = b->elements[i];
+        if (x.isNumber() && y.isNumber()) total += x.asNumber() * y.asNumber();
+    }
+    return total;
+}
@@ -1,16 +1,16 @@
 #include "../include/parser.h"
 #include <stdexcept>
 
-Parser::Parser(const std::vector<Token>& toks) : tokens(toks), position(0) {}
+Parser::Parser(const std::vector<Token>& toks, Arena& arena) : tokens(toks), position(0), arena(arena) {}
 
-Token& Parser::current() {
+const Token& Parser::current() {
     if (position >= tokens.size()) {
         return tokens.back();
     }
     return tokens[position];
 }
 
-Token& Parser::peek() {
+const Token& Parser::peek() {
     if (position + 1 >= tokens.size()) {
         return tokens.back();
     }
@@ -32,31 +32,52 @@ void Parser::consume(TokenType type, const std::string& message) {
     position++;
 }
 
-std::unique_ptr<ASTNode> Parser::parseFactor() {
+ArenaList<ASTNode*> Parser::finishList(size_t start) {
+    ArenaList<ASTNode*> list = arena.list(scratch.data() + start, scratch.size() - start);
+    scratch.resize(start);
+    return list;
+}
+
+static BinaryOp binaryOpFor(TokenType type) {
+    switch (type) {
+        case TokenType::PLUS: return BinaryOp::ADD;
+        case TokenType::MINUS: return BinaryOp::SUBTRACT;
+        case TokenType::MULTIPLY: return BinaryOp::MULTIPLY;
+        case TokenType::DIVIDE: return BinaryOp::DIVIDE;
+        case TokenType::LESS: return BinaryOp::LESS;
+        case TokenType::GREATER: return BinaryOp::GREATER;
+        case TokenType::LESS_EQUAL: return BinaryOp::LESS_EQUAL;
+        case TokenType::GREATER_EQUAL: return BinaryOp::GREATER_EQUAL;
+        case TokenType::EQUAL: return BinaryOp::EQUAL;
+        default: return BinaryOp::NOT_EQUAL;
+    }
+}
+
+ASTNode* Parser::parseFactor() {
     if (current().type == TokenType::NUMBER) {
         double value = std::stod(current().value);
         position++;
-        return std::make_unique<NumberNode>(value);
+        return arena.make<NumberNode>(value);
     }
     else if (current().type == TokenType::STRING) {
-        std::string value = current().value;
+        const std::string& value = arena.intern(current().value);
         position++;
-        return std::make_unique<StringNode>(value);
+        return arena.make<StringNode>(value);
     }
     else if (current().type == TokenType::TRUE) {
         position++;
-        return std::make_unique<BooleanNode>(true);
+        return arena.make<BooleanNode>(true);
     }
     else if (current().type == TokenType::FALSE) {
         position++;
-        return std::make_unique<BooleanNode>(false);
+        return arena.make<BooleanNode>(false);
     }
     else if (current().type == TokenType::NULLKW) {
         position++;
-        return std::make_unique<NullNode>();
+        return arena.make<NullNode>();
     }
     else if (current().type == TokenType::IDENTIFIER) {
-        std::string name = current().value;
+        const std::string& name = arena.intern(current().value);
         position++;
         if (current().type == TokenType::LPAREN) {
             position--;
@@ -64,39 +85,42 @@ std::unique_ptr<ASTNode> Parser::parseFactor() {
         }
         if (current().type == TokenType::LBRACKET) {
             position--;
-            auto id = std::make_unique<IdentifierNode>(name);
+            auto id = arena.make<IdentifierNode>(name);
             position++;
             consume(TokenType::LBRACKET, "Expected '['");
             auto index = parseLogicalOr();
             consume(TokenType::RBRACKET, "Expected ']'");
-            return std::make_unique<IndexNode>(std::move(id), std::move(index));
+            return arena.make<IndexNode>(id, index);
         }
-        return std::make_unique<IdentifierNode>(name);
+        return arena.make<IdentifierNode>(name);
     }
     else if (match(TokenType::LBRACKET)) {
         return parseArray();
     }
     else if (match(TokenType::LBRACE)) {
-        std::vector<std::pair<std::string, std::unique_ptr<ASTNode>>> pairs;
+        std::vector<std::pair<ASTNode*, ASTNode*>> pairs;
         if (current().type != TokenType::RBRACE) {
             do {
-                std::string key;
+                ASTNode* key;
                 if (current().type == TokenType::STRING) {
-                    key = current().value;
+                    key = arena.make<StringNode>(arena.intern(current().value));
                     position++;
                 } else if (current().type == TokenType::IDENTIFIER) {
-                    key = current().value;
+                    key = arena.make<StringNode>(arena.intern(current().value));
+                    position++;
+                } else if (current().type == TokenType::NUMBER) {
+                    key = arena.make<NumberNode>(std::stod(current().value));
                     position++;
                 } else {
-                    throw std::runtime_error("Expected string or identifier as hashmap key");
+                    throw std::runtime_error("Expected string, identifier or number as hashmap key");
                 }
                 consume(TokenType::COLON, "Expected ':' after hashmap key");
                 auto value = parseLogicalOr();
-                pairs.push_back({key, std::move(value)});
+                pairs.push_back({key, value});
             } while (match(TokenType::COMMA));
         }
         consume(TokenType::RBRACE, "Expected '}' after hashmap");
-        return std::make_unique<HashMapNode>(std::move(pairs));
+        return arena.make<HashMapNode>(arena.list(pairs.data(), pairs.size()));
     }
     else if (match(TokenType::LPAREN)) {
         auto expr = parseLogicalOr();
@@ -107,78 +131,78 @@ std::unique_ptr<ASTNode> Parser::parseFactor() {
     throw std::runtime_error("Expected number, string, boolean, identifier, or '('");
 }
 
-std::unique_ptr<ASTNode> Parser::parseUnary() {
+ASTNode* Parser::parseUnary() {
     if (match(TokenType::MINUS)) {
         auto operand = parseUnary();
-        return std::make_unique<UnaryOpNode>("-", std::move(operand));
+        return arena.make<UnaryOpNode>(UnaryOp::NEGATE, operand);
     }
     if (match(TokenType::NOT)) {
         auto operand = parseUnary();
-        return std::make_unique<UnaryOpNode>("!", std::move(operand));
+        return arena.make<UnaryOpNode>(UnaryOp::NOT, operand);
     }
     return parseFactor();
 }
 
-std::unique_ptr<ASTNode> Parser::parseTerm() {
+ASTNode* Parser::parseTerm() {
     auto left = parseUnary();
     
     while (current().type == TokenType::MULTIPLY || current().type == TokenType::DIVIDE) {
-        std::string op = current().value;
+        BinaryOp op = binaryOpFor(current().type);
         position++;
         auto right = parseUnary();
-        left = std::make_unique<BinaryOpNode>(op, std::move(left), std::move(right));
+        left = arena.make<BinaryOpNode>(op, left, right);
     }
     
     return left;
 }
 
-std::unique_ptr<ASTNode> Parser::parseExpression() {
+ASTNode* Parser::parseExpression() {
     auto left = parseTerm();
     
     while (current().type == TokenType::PLUS || current().type == TokenType::MINUS) {
-        std::string op = current().value;
+        BinaryOp op = binaryOpFor(current().type);
         position++;
         auto right = parseTerm();
-        left = std::make_unique<BinaryOpNode>(op, std::move(left), std::move(right));
+        left = arena.make<BinaryOpNode>(op, left, right);
     }
     
     return left;
 }
 
-std::unique_ptr<ASTNode> Parser::parseComparison() {
+ASTNode* Parser::parseComparison() {
     auto left = parseExpression();
     
     while (current().type == TokenType::LESS || current().type == TokenType::GREATER ||
            current().type == TokenType::LESS_EQUAL || current().type == TokenType::GREATER_EQUAL ||
            current().type == TokenType::EQUAL || current().type == TokenType::NOT_EQUAL) {
-        std::string op = current().value;
+        BinaryOp op = binaryOpFor(current().type);
         position++;
         auto right = parseExpression();
-        left = std::make_unique<BinaryOpNode>(op, std::move(left), std::move(right));
+        left = arena.make<BinaryOpNode>(op, left, right);
     }
     
     return left;
 }
 
-std::unique_ptr<ASTNode> Parser::parseLogicalAnd() {
+ASTNode* Parser::parseLogicalAnd() {
     auto left = parseComparison();
     
     while (current().type == TokenType::AND) {
         position++;
         auto right = parseComparison();
-        left = std::make_unique<BinaryOpNode>("and", std::move(left), std::move(right));
+        left = arena.make<BinaryOpNode>(BinaryOp::AND, left, right);
     }
     
     return left;
 }
 
-std::unique_ptr<ASTNode> Parser::parseLogicalOr() {
+ASTNode* Parser::parseLogicalOr() {
     auto left = parseLogicalAnd();
     
     while (current().type == TokenType::OR) {
         position++;
         auto right = parseLogicalAnd();
-        left = std::make_unique<BinaryOpNode>("or", std::move(left), std::move(right));
+        left = arena.make<BinaryOpNode>(BinaryOp::OR, left, right);
     }
     
     if (current().type == TokenType::QUESTION) {
@@ -186,93 +210,93 @@ std::unique_ptr<ASTNode> Parser::parseLogicalOr() {
         auto thenExpr = parseLogicalOr();
         consume(TokenType::COLON, "Expected ':' in ternary operator");
         auto elseExpr = parseLogicalOr();
-        return std::make_unique<TernaryNode>(std::move(left), std::move(thenExpr), std::move(elseExpr));
+        return arena.make<TernaryNode>(left, thenExpr, elseExpr);
     }
     
     return left;
 }
 
-std::unique_ptr<ASTNode> Parser::parseAssignment() {
-    std::string name = current().value;
+ASTNode* Parser::parseAssignment() {
+    const std::string& name = arena.intern(current().value);
     position++;
     consume(TokenType::ASSIGN, "Expected '=' in assignment");
     auto value = parseLogicalOr();
-    return std::make_unique<AssignmentNode>(name, std::move(value));
+    return arena.make<AssignmentNode>(name, value);
 }
 
-std::unique_ptr<ASTNode> Parser::parseFunctionCall() {
-    std::string name = current().value;
+ASTNode* Parser::parseFunctionCall() {
+    const std::string& name = arena.intern(current().value);
     position++;
     consume(TokenType::LPAREN, "Expected '(' after function name");
     
-    std::vector<std::unique_ptr<ASTNode>> arguments;
+    size_t start = scratch.size();
     
     if (current().type != TokenType::RPAREN) {
-        arguments.push_back(parseLogicalOr());
+        scratch.push_back(parseLogicalOr());
         
         while (match(TokenType::COMMA)) {
-            arguments.push_back(parseLogicalOr());
+            scratch.push_back(parseLogicalOr());
         }
     }
     
     consume(TokenType::RPAREN, "Expected ')' after arguments");
-    return std::make_unique<FunctionCallNode>(name, std::move(arguments));
+    return arena.make<FunctionCallNode>(name, finishList(start));
 }
 
-std::unique_ptr<ASTNode> Parser::parseFunctionDef() {
+ASTNode* Parser::parseFunctionDef() {
     consume(TokenType::FUNC, "Expected 'func'");
-    std::string name = current().value;
+    const std::string& name = arena.intern(current().value);
     consume(TokenType::IDENTIFIER, "Expected function name");
     consume(TokenType::LPAREN, "Expected '(' after function name");
     
-    std::vector<std::string> params;
+    std::vector<const std::string*> params;
     if (current().type == TokenType::IDENTIFIER) {
-        params.push_back(current().value);
+        params.push_back(&arena.intern(current().value));
         position++;
         while (match(TokenType::COMMA)) {
-            params.push_back(current().value);
+            params.push_back(&arena.intern(current().value));
             consume(TokenType::IDENTIFIER, "Expected parameter name");
         }
     }
     
     consume(TokenType::RPAREN, "Expected ')' after parameters");
     auto body = parseBlock();
-    return std::make_unique<FunctionDefNode>(name, std::move(params), std::move(body));
+    return arena.make<FunctionDefNode>(name, arena.list(params.data(), params.size()), body);
 }
 
-std::unique_ptr<ASTNode> Parser::parseReturn() {
+ASTNode* Parser::parseReturn() {
     consume(TokenType::RETURN, "Expected 'return'");
     auto value = parseLogicalOr();
-    return std::make_unique<ReturnNode>(std::move(value));
+    return arena.make<ReturnNode>(value);
 }
 
-std::unique_ptr<ASTNode> Parser::parseIfStatement() {
+ASTNode* Parser::parseIfStatement() {
     consume(TokenType::IF, "Expected 'if'");
     consume(TokenType::LPAREN, "Expected '(' after 'if'");
     auto condition = parseLogicalOr();
     consume(TokenType::RPAREN, "Expected ')' after condition");
     
     auto thenBranch = parseBlock();
-    std::unique_ptr<ASTNode> elseBranch = nullptr;
+    ASTNode* elseBranch = nullptr;
     
     if (match(TokenType::ELSE)) {
         elseBranch = parseBlock();
     }
     
-    return std::make_unique<IfStatementNode>(std::move(condition), std::move(thenBranch), std::move(elseBranch));
+    return arena.make<IfStatementNode>(condition, thenBranch, elseBranch);
 }
 
-std::unique_ptr<ASTNode> Parser::parseWhileStatement() {
+ASTNode* Parser::parseWhileStatement() {
     consume(TokenType::WHILE, "Expected 'while'");
     consume(TokenType::LPAREN, "Expected '(' after 'while'");
     auto condition = parseLogicalOr();
     consume(TokenType::RPAREN, "Expected ')' after condition");
     
     auto body = parseBlock();
-    return std::make_unique<WhileStatementNode>(std::move(condition), std::move(body));
+    return arena.make<WhileStatementNode>(condition, body);
 }
 
-std::unique_ptr<ASTNode> Parser::parseForStatement() {
+ASTNode* Parser::parseForStatement() {
     consume(TokenType::FOR, "Expected 'for'");
     consume(TokenType::LPAREN, "Expected '(' after 'for'");
     
@@ -286,43 +310,43 @@ std::unique_ptr<ASTNode> Parser::parseForStatement() {
     consume(TokenType::RPAREN, "Expected ')' after for clauses");
     
     auto body = parseBlock();
-    return std::make_unique<ForStatementNode>(std::move(init), std::move(condition), std::move(increment), std::move(body));
+    return arena.make<ForStatementNode>(init, condition, increment, body);
 }
 
-std::unique_ptr<ASTNode> Parser::parseUseStatement() {
+ASTNode* Parser::parseUseStatement() {
     consume(TokenType::USE, "Expected 'use'");
-    std::string libName = current().value;
+    const std::string& libName = arena.intern(current().value);
     consume(TokenType::IDENTIFIER, "Expected library name");
-    return std::make_unique<UseStatementNode>(libName);
+    return arena.make<UseStatementNode>(libName);
 }
 
-std::unique_ptr<ASTNode> Parser::parseArray() {
-    std::vector<std::unique_ptr<ASTNode>> elements;
+ASTNode* Parser::parseArray() {
+    size_t start = scratch.size();
     
     if (current().type != TokenType::RBRACKET) {
-        elements.push_back(parseLogicalOr());
+        scratch.push_back(parseLogicalOr());
         while (match(TokenType::COMMA)) {
-            elements.push_back(parseLogicalOr());
+            scratch.push_back(parseLogicalOr());
         }
     }
     
     consume(TokenType::RBRACKET, "Expected ']' after array elements");
-    return std::make_unique<ArrayNode>(std::move(elements));
+    return arena.make<ArrayNode>(finishList(start));
 }
 
-std::unique_ptr<ASTNode> Parser::parseBlock() {
+ASTNode* Parser::parseBlock() {
     consume(TokenType::LBRACE, "Expected '{'");
-    std::vector<std::unique_ptr<ASTNode>> statements;
+    size_t start = scratch.size();
     
     while (current().type != TokenType::RBRACE && current().type != TokenType::END_OF_FILE) {
-        statements.push_back(parseStatement());
+        scratch.push_back(parseStatement());
     }
     
     consume(TokenType::RBRACE, "Expected '}'");
-    return std::make_unique<BlockNode>(std::move(statements));
+    return arena.make<BlockNode>(finishList(start));
 }
 
-std::unique_ptr<ASTNode> Parser::parseStatement() {
+ASTNode* Parser::parseStatement() {
     if (current().type == TokenType::USE) {
         return parseUseStatement();
     }
@@ -334,11 +358,11 @@ std::unique_ptr<ASTNode> Parser::parseStatement() {
     }
     if (current().type == TokenType::BREAK) {
         position++;
-        return std::make_unique<BreakStatementNode>();
+        return arena.make<BreakStatementNode>();
     }
     if (current().type == TokenType::CONTINUE) {
         position++;
-        return std::make_unique<ContinueStatementNode>();
+        return arena.make<ContinueStatementNode>();
     }
     if (current().type == TokenType::IF) {
         return parseIfStatement();
@@ -356,17 +380,24 @@ std::unique_ptr<ASTNode> Parser::parseStatement() {
         else if (peek().type == TokenType::LPAREN) {
             return parseFunctionCall();
         }
+        else if (peek().type == TokenType::LBRACKET) {
+            auto target = parseFactor();
+            consume(TokenType::ASSIGN, "Expected '=' in index assignment");
+            auto value = parseLogicalOr();
+            IndexNode* idxNode = static_cast<IndexNode*>(target);
+            return arena.make<IndexAssignmentNode>(std::move(idxNode->array), std::move(idxNode->index), value);
+        }
     }
     
     throw std::runtime_error("Expected statement");
 }
 
-std::unique_ptr<ProgramNode> Parser::parse() {
-    std::vector<std::unique_ptr<ASTNode>> statements;
+ProgramNode* Parser::parse() {
+    size_t start = scratch.size();
     
     while (current().type != TokenType::END_OF_FILE) {
-        statements.push_back(parseStatement());
+        scratch.push_back(parseStatement());
     }
     
-    return std::make_unique<ProgramNode>(std::move(statements));
+    return arena.make<ProgramNode>(finishList(start));
 }
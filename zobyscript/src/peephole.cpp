@@ -0,0 +1,337 @@
+#include "../include/compiler.h"
+#include "../include/verifier.h"
+#include <algorithm>
+
+// Peephole optimizer over finished stack VM chunks. The code is decoded into
+// a list with jump targets as list indices, rewritten until nothing changes
+// and encoded again with every jump offset recomputed.
+//
+// Each round applies the rule table below, threads jumps through
+// unconditional jumps and drops code no path reaches. A rule's window may
+// start at a jump target but must not contain one, so no jump lands in the
+// middle of what it replaces.
+
+namespace {
+
+struct PeepholeInstr {
+    OpCode op;
+    int a;
+    int b;
+    int target;  // jump destination as a list index, -1 if not a jump
+};
+
+typedef std::vector<PeepholeInstr> InstrList;
+
+// Fills out with the replacement for a matched window, or returns false to
+// leave it alone. at is the window's first index.
+typedef bool (*Rewrite)(const Chunk& chunk, const InstrList& code, size_t at, InstrList& out);
+
+struct PeepholeRule {
+    const char* name;
+    std::vector<OpCode> pattern;
+    Rewrite rewrite;
+};
+
+PeepholeInstr make(OpCode op, int a = 0, int b = 0) { return {op, a, b, -1}; }
+
+bool isNumber(const Chunk& chunk, int index, double number) {
+    return chunk.constants[index].raw() == Value(number).raw();
+}
+
+// Constant pushes and loads have no effect if the value is dropped
+bool dropPair(const Chunk&, const InstrList&, size_t, InstrList&) { return true; }
+
+// SET_x; POP -> SET_x_POP
+bool storePop(const Chunk&, const InstrList& code, size_t at, InstrList& out) {
+    OpCode op = code[at].op == OpCode::OP_SET_LOCAL ? OpCode::OP_SET_LOCAL_POP : OpCode::OP_SET_GLOBAL_POP;
+    out.push_back(make(op, code[at].a));
+    return true;
+}
+
+// SET_x_POP n; GET_x n -> SET_x n
+bool storeReload(const Chunk&, const InstrList& code, size_t at, InstrList& out) {
+    if (code[at].a != code[at + 1].a) return false;
+    OpCode op = code[at].op == OpCode::OP_SET_LOCAL_POP ? OpCode::OP_SET_LOCAL : OpCode::OP_SET_GLOBAL;
+    out.push_back(make(op, code[at].a));
+    return true;
+}
+
+// GET_x n; SET_x_POP n stores a variable into itself
+bool selfStore(const Chunk&, const InstrList& code, size_t at, InstrList&) {
+    return code[at].a == code[at + 1].a;
+}
+
+// CONSTANT k -> CONSTANT_0 or CONSTANT_1
+bool smallConstant(const Chunk& chunk, const InstrList& code, size_t at, InstrList& out) {
+    if (isNumber(chunk, code[at].a, 0.0)) {
+        out.push_back(make(OpCode::OP_CONSTANT_0));
+    } else if (isNumber(chunk, code[at].a, 1.0)) {
+        out.push_back(make(OpCode::OP_CONSTANT_1));
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// CONSTANT k; SET_x_POP n -> SET_x_CONST n k
+bool constantStore(const Chunk&, const InstrList& code, size_t at, InstrList& out) {
+    OpCode op = code[at + 1].op == OpCode::OP_SET_LOCAL_POP ? OpCode::OP_SET_LOCAL_CONST : OpCode::OP_SET_GLOBAL_CONST;
+    out.push_back(make(op, code[at + 1].a, code[at].a));
+    return true;
+}
+
+// NOT; NOT; POP_JUMP_IF_FALSE -> POP_JUMP_IF_FALSE: truthiness survives
+bool doubleNot(const Chunk&, const InstrList& code, size_t at, InstrList& out) {
+    out.push_back(code[at + 2]);
+    return true;
+}
+
+// NOT; POP_JUMP_IF_FALSE L; JUMP M; L: -> POP_JUMP_IF_FALSE M; L:
+bool invertBranch(const Chunk&, const InstrList& code, size_t at, InstrList& out) {
+    const PeepholeInstr& branch = code[at + 1];
+    const PeepholeInstr& jump = code[at + 2];
+    // Conditional jumps only go forwards
+    if (branch.target != static_cast<int>(at + 3) || jump.target <= static_cast<int>(at + 2)) return false;
+    PeepholeInstr inverted = branch;
+    inverted.target = jump.target;
+    out.push_back(inverted);
+    return true;
+}
+
+// A jump to the next instruction; a popping one still has to pop
+bool jumpToNext(const Chunk&, const InstrList& code, size_t at, InstrList& out) {
+    if (code[at].target != static_cast<int>(at + 1)) return false;
+    if (code[at].op == OpCode::OP_POP_JUMP_IF_FALSE) out.push_back(make(OpCode::OP_POP));
+    return true;
+}
+
+const PeepholeRule rules[] = {
+    {"store-pop", {OpCode::OP_SET_LOCAL, OpCode::OP_POP}, storePop},
+    {"store-pop", {OpCode::OP_SET_GLOBAL, OpCode::OP_POP}, storePop},
+    {"store-reload", {OpCode::OP_SET_LOCAL_POP, OpCode::OP_GET_LOCAL}, storeReload},
+    {"store-reload", {OpCode::OP_SET_GLOBAL_POP, OpCode::OP_GET_GLOBAL}, storeReload},
+    {"self-store", {OpCode::OP_GET_LOCAL, OpCode::OP_SET_LOCAL_POP}, selfStore},
+    {"self-store", {OpCode::OP_GET_GLOBAL, OpCode::OP_SET_GLOBAL_POP}, selfStore},
+    {"push-pop", {OpCode::OP_GET_LOCAL, OpCode::OP_POP}, dropPair},
+    {"push-pop", {OpCode::OP_GET_GLOBAL, OpCode::OP_POP}, dropPair},
+    {"push-pop", {OpCode::OP_CONSTANT, OpCode::OP_POP}, dropPair},
+    {"push-pop", {OpCode::OP_CONSTANT_0, OpCode::OP_POP}, dropPair},
+    {"push-pop", {OpCode::OP_CONSTANT_1, OpCode::OP_POP}, dropPair},
+    {"push-pop", {OpCode::OP_STRING, OpCode::OP_POP}, dropPair},
+    {"push-pop", {OpCode::OP_TRUE, OpCode::OP_POP}, dropPair},
+    {"push-pop", {OpCode::OP_FALSE, OpCode::OP_POP}, dropPair},
+    {"push-pop", {OpCode::OP_NULL, OpCode::OP_POP}, dropPair},
+    {"constant-store", {OpCode::OP_CONSTANT, OpCode::OP_SET_LOCAL_POP}, constantStore},
+    {"constant-store", {OpCode::OP_CONSTANT, OpCode::OP_SET_GLOBAL_POP}, constantStore},
+    {"constant-store", {OpCode::OP_STRING, OpCode::OP_SET_LOCAL_POP}, constantStore},
+    {"constant-store", {OpCode::OP_STRING, OpCode::OP_SET_GLOBAL_POP}, constantStore},
+    {"small-constant", {OpCode::OP_CONSTANT}, smallConstant},
+    {"double-not", {OpCode::OP_NOT, OpCode::OP_NOT, OpCode::OP_POP_JUMP_IF_FALSE}, doubleNot},
+    {"invert-branch", {OpCode::OP_NOT, OpCode::OP_POP_JUMP_IF_FALSE, OpCode::OP_JUMP}, invertBranch},
+    {"jump-next", {OpCode::OP_JUMP}, jumpToNext},
+    {"jump-next", {OpCode::OP_JUMP_IF_FALSE}, jumpToNext},
+    {"jump-next", {OpCode::OP_POP_JUMP_IF_FALSE}, jumpToNext},
+};
+
+class PeepholeOptimizer {
+private:
+    Chunk& chunk;
+    InstrList code;
+
+    bool decode() {
+        const std::vector<uint8_t>& bytes = chunk.code;
+        std::vector<int> indexAt(bytes.size() + 1, -1);
+        std::vector<long> targets;
+        size_t pc = 0;
+        while (pc < bytes.size()) {
+            indexAt[pc] = static_cast<int>(code.size());
+            bool wide = bytes[pc] == static_cast<uint8_t>(OpCode::OP_WIDE);
+            if (wide) pc++;
+            PeepholeInstr instr = make(static_cast<OpCode>(bytes[pc++]));
+            int operands = operandCount(instr.op);
+            if (operands < 0) return false;
+            int values[2] = {0, 0};
+            for (int i = 0; i < operands; i++) {
+                for (int j = 0; j < (wide ? 3 : 1); j++) values[i] = (values[i] << 8) | bytes[pc++];
+            }
+            instr.a = values[0];
+            instr.b = values[1];
+            long target = -1;
+            if (isJump(instr.op)) {
+                int offset = (bytes[pc] << 8) | bytes[pc + 1];
+                pc += 2;
+                if (instr.op == OpCode::OP_JUMP && (offset & 0x8000)) offset -= 0x10000;
+                target = static_cast<long>(pc) + offset;
+            }
+            targets.push_back(target);
+            code.push_back(instr);
+        }
+        for (size_t i = 0; i < code.size(); i++) {
+            if (targets[i] < 0) continue;
+            if (targets[i] >= static_cast<long>(bytes.size()) || indexAt[targets[i]] < 0) return false;
+            code[i].target = indexAt[targets[i]];
+        }
+        return true;
+    }
+
+    std::vector<bool> jumpTargets() const {
+        std::vector<bool> marked(code.size(), false);
+        for (const PeepholeInstr& instr : code) {
+            if (instr.target >= 0) marked[instr.target] = true;
+        }
+        return marked;
+    }
+
+    // Replaces code with rebuilt, where newIndex maps every old index to
+    // the instruction that now stands at or after it
+    void replace(InstrList& rebuilt, std::vector<int>& newIndex) {
+        newIndex.push_back(static_cast<int>(rebuilt.size()));
+        for (PeepholeInstr& instr : rebuilt) {
+            if (instr.target >= 0) instr.target = newIndex[instr.target];
+        }
+        code.swap(rebuilt);
+    }
+
+    bool applyRules() {
+        std::vector<bool> targeted = jumpTargets();
+        InstrList rebuilt;
+        std::vector<int> newIndex(code.size());
+        bool changed = false;
+        size_t i = 0;
+        while (i < code.size()) {
+            size_t matched = 0;
+            InstrList out;
+            for (const PeepholeRule& rule : rules) {
+                size_t length = rule.pattern.size();
+                if (i + length > code.size()) continue;
+                bool match = true;
+                for (size_t k = 0; k < length && match; k++) {
+                    match = code[i + k].op == rule.pattern[k] && (k == 0 || !targeted[i + k]);
+                }
+                out.clear();
+                if (match && rule.rewrite(chunk, code, i, out)) {
+                    matched = length;
+                    break;
+                }
+            }
+            if (!matched) {
+                newIndex[i] = static_cast<int>(rebuilt.size());
+                rebuilt.push_back(code[i++]);
+                continue;
+            }
+            for (size_t k = 0; k < matched; k++) newIndex[i + k] = static_cast<int>(rebuilt.size());
+            rebuilt.insert(rebuilt.end(), out.begin(), out.end());
+            i += matched;
+            changed = true;
+        }
+        replace(rebuilt, newIndex);
+        return changed;
+    }
+
+    // Jumps to an unconditional jump go straight to its destination.
+    // Conditional jumps only take a destination ahead of them.
+    bool threadJumps() {
+        bool changed = false;
+        for (size_t i = 0; i < code.size(); i++) {
+            PeepholeInstr& instr = code[i];
+            if (instr.target < 0) continue;
+            int target = instr.target;
+            for (int hops = 0; hops < 8 && code[target].op == OpCode::OP_JUMP; hops++) {
+                int next = code[target].target;
+                if (instr.op != OpCode::OP_JUMP && next <= static_cast<int>(i)) break;
+                target = next;
+            }
+            if (target != instr.target) {
+                instr.target = target;
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    // Drops instructions no path from the entry reaches, such as code after
+    // OP_RET
+    bool removeUnreachable() {
+        std::vector<bool> reached(code.size(), false);
+        std::vector<int> worklist = {0};
+        reached[0] = true;
+        auto reach = [&](int index) {
+            if (index < static_cast<int>(code.size()) && !reached[index]) {
+                reached[index] = true;
+                worklist.push_back(index);
+            }
+        };
+        while (!worklist.empty()) {
+            int index = worklist.back();
+            worklist.pop_back();
+            const PeepholeInstr& instr = code[index];
+            if (instr.target >= 0) reach(instr.target);
+            if (!endsPath(instr.op)) reach(index + 1);
+        }
+        InstrList rebuilt;
+        std::vector<int> newIndex(code.size());
+        bool changed = false;
+        for (size_t i = 0; i < code.size(); i++) {
+            newIndex[i] = static_cast<int>(rebuilt.size());
+            if (reached[i]) {
+                rebuilt.push_back(code[i]);
+            } else {
+                changed = true;
+            }
+        }
+        replace(rebuilt, newIndex);
+        return changed;
+    }
+
+    // Fails if a jump no longer fits its 16-bit offset
+    bool encode(std::vector<uint8_t>& bytes) const {
+        std::vector<size_t> position(code.size() + 1, 0);
+        for (size_t i = 0; i < code.size(); i++) {
+            const PeepholeInstr& instr = code[i];
+            int operands = operandCount(instr.op);
+            bool wide = instr.a > 0xFF || instr.b > 0xFF;
+            size_t size = 1 + (wide ? 1 + operands * 3 : operands) + (isJump(instr.op) ? 2 : 0);
+            position[i + 1] = position[i] + size;
+        }
+        Chunk out;
+        for (size_t i = 0; i < code.size(); i++) {
+            const PeepholeInstr& instr = code[i];
+            switch (operandCount(instr.op)) {
+                case 0: out.write(instr.op); break;
+                case 1: out.writeOp(instr.op, {instr.a}); break;
+                default: out.writeOp(instr.op, {instr.a, instr.b}); break;
+            }
+            if (instr.target < 0) continue;
+            long offset = static_cast<long>(position[instr.target]) - static_cast<long>(position[i + 1]);
+            bool fits = instr.op == OpCode::OP_JUMP ? offset >= -0x8000 && offset <= 0x7FFF : offset >= 0 && offset <= 0xFFFF;
+            if (!fits) return false;
+            out.write16(static_cast<int>(offset));
+        }
+        bytes.swap(out.code);
+        return true;
+    }
+
+public:
+    explicit PeepholeOptimizer(Chunk& chunk) : chunk(chunk) {}
+
+    int run() {
+        if (!decode() || code.empty()) return 0;
+        size_t before = code.size();
+        bool changed = true;
+        while (changed) {
+            changed = applyRules();
+            changed = threadJumps() || changed;
+            changed = removeUnreachable() || changed;
+        }
+        std::vector<uint8_t> bytes;
+        if (!encode(bytes)) return 0;
+        chunk.code.swap(bytes);
+        return static_cast<int>(before - code.size());
+    }
+};
+
+}  // namespace
+
+int Compiler::peepholeOptimize(Chunk& chunk) {
+    return PeepholeOptimizer(chunk).run();
+}
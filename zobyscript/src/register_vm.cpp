@@ -1,222 +1,444 @@
 #include "../include/register_vm.h"
-#include <iostream>
-#include <cmath>
+#include "../include/runtime.h"
+#include "../include/native.h"
+#include <stdexcept>
 #include <algorithm>
 
-RegisterVM::RegisterVM() {
-    globals.resize(256);
-    callStack.reserve(256);
-    callStack.emplace_back(256);
-    currentFrame = &callStack[0];
+RegisterVM::RegisterVM(size_t registerSlots)
+    : registers(registerSlots), functions(nullptr), mainChunk(nullptr) {
+    registersEnd = registers.data() + registers.size();
+    top = registers.data();
+    maxFrames = std::max<size_t>(registerSlots / 4, 1);
+    frames.reserve(std::min<size_t>(maxFrames, 1024));
+    Heap::instance().addRoots(this);
 }
 
-Value RegisterVM::callBuiltin(const std::string& name, const std::vector<Value>& args) {
-    if (name == "sqrt") return Value(std::sqrt(args[0].number));
-    if (name == "pow") return Value(std::pow(args[0].number, args[1].number));
-    if (name == "abs") return Value(std::abs(args[0].number));
-    if (name == "floor") return Value(std::floor(args[0].number));
-    if (name == "ceil") return Value(std::ceil(args[0].number));
-    if (name == "min") return Value(std::min(args[0].number, args[1].number));
-    if (name == "max") return Value(std::max(args[0].number, args[1].number));
-    if (name == "random") return Value(static_cast<double>(rand()) / RAND_MAX);
-    return Value(0.0);
+RegisterVM::~RegisterVM() {
+    Heap::instance().removeRoots(this);
 }
 
-void RegisterVM::run(const Chunk& mainChunk, const std::vector<Function>& funcs) {
-    functions = &funcs;
-    const uint8_t* code = mainChunk.code.data();
-    int pc = 0;
-    
-    // Computed goto dispatch table (2x faster than switch)
-    #ifdef __GNUC__
-    static void* dispatchTable[] = {
-        &&OP_REG_ADD, &&OP_REG_SUB, &&OP_REG_MUL, &&OP_REG_DIV,
-        &&OP_REG_ADDI, &&OP_REG_SUBI, &&OP_REG_MULI,
-        &&OP_REG_LOADK, &&OP_REG_LOAD0, &&OP_REG_LOAD1, &&OP_REG_MOVE,
-        &&OP_REG_LT, &&OP_REG_LE, &&OP_REG_EQ,
-        &&OP_REG_JMP, &&OP_REG_JMPF, &&OP_REG_JMPT,
-        &&OP_REG_CALL, &&OP_REG_RET,
-        &&OP_REG_GETGLOBAL, &&OP_REG_SETGLOBAL,
-        &&OP_REG_PRINT, &&OP_REG_HALT
-    };
-    
-    #define DISPATCH() goto *dispatchTable[code[pc++]]
-    #define CASE(op) OP_##op:
-    
-    DISPATCH();
-    
-    CASE(REG_ADD) {
-        int a = code[pc++], b = code[pc++], c = code[pc++];
-        R(a).number = R(b).number + R(c).number;
-        DISPATCH();
-    }
-    
-    CASE(REG_SUB) {
-        int a = code[pc++], b = code[pc++], c = code[pc++];
-        R(a).number = R(b).number - R(c).number;
-        DISPATCH();
-    }
-    
-    CASE(REG_MUL) {
-        int a = code[pc++], b = code[pc++], c = code[pc++];
-        R(a).number = R(b).number * R(c).number;
-        DISPATCH();
-    }
-    
-    CASE(REG_DIV) {
-        int a = code[pc++], b = code[pc++], c = code[pc++];
-        R(a).number = R(b).number / R(c).number;
-        DISPATCH();
-    }
-    
-    CASE(REG_ADDI) {
-        int a = code[pc++], b = code[pc++], c = code[pc++];
-        R(a).number = R(b).number + c;
-        DISPATCH();
-    }
-    
-    CASE(REG_SUBI) {
-        int a = code[pc++], b = code[pc++], c = code[pc++];
-        R(a).number = R(b).number - c;
-        DISPATCH();
-    }
-    
-    CASE(REG_MULI) {
-        int a = code[pc++], b = code[pc++], c = code[pc++];
-        R(a).number = R(b).number * c;
-        DISPATCH();
-    }
-    
-    CASE(REG_LOADK) {
-        int a = code[pc++], b = code[pc++];
-        R(a) = mainChunk.constants[b];
-        DISPATCH();
-    }
-    
-    CASE(REG_LOAD0) {
-        int a = code[pc++];
-        R(a) = Value(0.0);
-        DISPATCH();
-    }
-    
-    CASE(REG_LOAD1) {
-        int a = code[pc++];
-        R(a) = Value(1.0);
-        DISPATCH();
+void RegisterVM::markRoots(Heap& heap) {
+    // Every live frame lies below top; REG_ENTER clears a window before
+    // it is used, so stale registers above it are never scanned
+    for (const Value* reg = registers.data(); reg < top; reg++) {
+        heap.markValue(*reg);
     }
-    
-    CASE(REG_MOVE) {
-        int a = code[pc++], b = code[pc++];
-        R(a) = R(b);
-        DISPATCH();
-    }
-    
-    CASE(REG_LT) {
-        int a = code[pc++], b = code[pc++], c = code[pc++];
-        R(a) = Value(R(b).number < R(c).number);
-        DISPATCH();
-    }
-    
-    CASE(REG_LE) {
-        int a = code[pc++], b = code[pc++], c = code[pc++];
-        R(a) = Value(R(b).number <= R(c).number);
-        DISPATCH();
-    }
-    
-    CASE(REG_EQ) {
-        int a = code[pc++], b = code[pc++], c = code[pc++];
-        R(a) = Value(R(b).number == R(c).number);
-        DISPATCH();
-    }
-    
-    CASE(REG_JMP) {
-        int offset = (code[pc] << 8) | code[pc + 1];
-        pc += 2;
-        if (offset & 0x8000) offset |= 0xFFFF0000;
-        pc += offset;
-        DISPATCH();
-    }
-    
-    CASE(REG_JMPF) {
-        int a = code[pc++];
-        int offset = (code[pc] << 8) | code[pc + 1];
-        pc += 2;
-        if (R(a).type == Value::BOOLEAN && !R(a).boolean) {
-            pc += offset;
+    heap.markValues(spilledGlobals);
+    if (mainChunk) heap.markValues(mainChunk->constants);
+    if (functions) {
+        for (const Function& func : *functions) {
+            heap.markValues(func.chunk.constants);
         }
-        DISPATCH();
     }
-    
-    CASE(REG_JMPT) {
-        int a = code[pc++];
-        int offset = (code[pc] << 8) | code[pc + 1];
-        pc += 2;
-        if (R(a).type == Value::BOOLEAN && R(a).boolean) {
-            pc += offset;
-        }
-        DISPATCH();
+}
+
+static inline int readOffset(const uint8_t* pc) {
+    return static_cast<int16_t>((pc[0] << 8) | pc[1]);
+}
+
+// Reads the 24-bit Bx operand of a _WIDE instruction
+static inline int readWide(const uint8_t* pc) {
+    return (pc[0] << 16) | (pc[1] << 8) | pc[2];
+}
+
+static inline bool truthy(const Value& value) {
+    return value.isBool() ? value.asBool() : isTruthy(value);
+}
+
+// Same dispatch scheme as the stack VM: a label table under GCC and Clang,
+// a switch otherwise or with ZS_SWITCH_DISPATCH defined
+#if defined(__GNUC__) && !defined(ZS_SWITCH_DISPATCH)
+#define ZS_COMPUTED_GOTO 1
+#endif
+
+#ifdef ZS_COMPUTED_GOTO
+#define REG_CASE(op) L_##op:
+#define DISPATCH() goto *dispatchTable[*pc++]
+#else
+#define REG_CASE(op) case RegOpCode::op:
+#define DISPATCH() break
+#endif
+
+// Numeric comparison jumps; the second operand is a register or a constant
+#define COMPARE_JUMP(cmp, rhs)                                              \
+    {                                                                       \
+        double lhs = toNumber(base[pc[0]]);                                 \
+        double value = toNumber(rhs);                                       \
+        int offset = readOffset(pc + 2);                                    \
+        pc += 4;                                                            \
+        if (!(lhs cmp value)) pc += offset;                                 \
+        DISPATCH();                                                         \
     }
-    
-    CASE(REG_GETGLOBAL) {
-        int a = code[pc++], b = code[pc++];
-        R(a) = globals[b];
-        DISPATCH();
+
+// Calls: the function id is one byte or, in the _WIDE forms, 24 bits, and
+// the first argument register and the argument count always end the
+// instruction, length bytes of operands in all
+#define CALL_FUNCTION(funcIdOperand, length)                                         \
+    {                                                                                \
+        int dest = pc[0];                                                            \
+        int funcId = (funcIdOperand);                                                \
+        int firstArg = pc[(length) - 2];                                             \
+        int argc = pc[(length) - 1];                                                 \
+        if (frames.size() == maxFrames) throw std::runtime_error("Stack overflow");  \
+        frames.push_back(RegisterFrame{chunk, pc + (length), base, top, static_cast<uint8_t>(dest)}); \
+        base += firstArg;                                                            \
+        top = base + argc;                                                           \
+        chunk = &(*functions)[funcId].chunk;                                         \
+        pc = chunk->code.data();                                                     \
+        DISPATCH();                                                                  \
     }
-    
-    CASE(REG_SETGLOBAL) {
-        int a = code[pc++], b = code[pc++];
-        globals[a] = R(b);
-        DISPATCH();
+
+// The arguments move to the bottom of the window and the callee returns
+// straight to this frame's caller
+#define TAIL_CALL_FUNCTION(funcIdOperand, length)                                    \
+    {                                                                                \
+        int funcId = (funcIdOperand);                                                \
+        Value* args = base + pc[(length) - 2];                                       \
+        int argc = pc[(length) - 1];                                                 \
+        std::copy(args, args + argc, base);                                          \
+        top = base + argc;                                                           \
+        chunk = &(*functions)[funcId].chunk;                                         \
+        pc = chunk->code.data();                                                     \
+        DISPATCH();                                                                  \
     }
-    
-    CASE(REG_PRINT) {
-        int count = code[pc++];
-        for (int i = 0; i < count; i++) {
-            int reg = code[pc++];
-            if (R(reg).type == Value::NUMBER) {
-                double num = R(reg).number;
-                if (num == static_cast<int>(num)) {
-                    std::cout << static_cast<int>(num);
+
+void RegisterVM::execute(const Chunk& entry) {
+    const Chunk* chunk = &entry;
+    const uint8_t* pc = chunk->code.data();
+    Value* base = registers.data();
+    Value* const globals = registers.data();
+    Value* const spilled = spilledGlobals.data();
+    const NativeFunction* const natives = nativeTable().data();
+    Heap& heap = Heap::instance();
+
+#ifdef ZS_COMPUTED_GOTO
+    // Indexed by RegOpCode; keep in the same order as the enum
+    static void* const dispatchTable[] = {
+        &&L_REG_MOVE, &&L_REG_LOADK, &&L_REG_GETGLOBAL, &&L_REG_LOADK_WIDE, &&L_REG_GETGLOBAL_WIDE,
+        &&L_REG_SETGLOBAL_WIDE, &&L_REG_ADD, &&L_REG_SUB, &&L_REG_MUL, &&L_REG_DIV, &&L_REG_ADDK,
+        &&L_REG_SUBK, &&L_REG_MULK, &&L_REG_DIVK, &&L_REG_NEG, &&L_REG_NOT, &&L_REG_LT, &&L_REG_LE,
+        &&L_REG_GT, &&L_REG_GE, &&L_REG_EQ, &&L_REG_NE, &&L_REG_JMP, &&L_REG_JMPF, &&L_REG_JMPT,
+        &&L_REG_JNLT, &&L_REG_JNLE, &&L_REG_JNGT, &&L_REG_JNGE, &&L_REG_JNLTK, &&L_REG_JNLEK,
+        &&L_REG_JNGTK, &&L_REG_JNGEK, &&L_REG_NEWARRAY, &&L_REG_NEWMAP, &&L_REG_APPEND,
+        &&L_REG_GETINDEX, &&L_REG_SETINDEX, &&L_REG_GETFIELD, &&L_REG_SETFIELD, &&L_REG_ENTER,
+        &&L_REG_CALL, &&L_REG_TAILCALL, &&L_REG_BUILTIN, &&L_REG_RET, &&L_REG_CALL_WIDE,
+        &&L_REG_TAILCALL_WIDE, &&L_REG_BUILTIN_WIDE, &&L_REG_PRINT, &&L_REG_PRINTPART,
+        &&L_REG_BREAK, &&L_REG_CONTINUE, &&L_REG_HALT
+    };
+    static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) ==
+                      static_cast<size_t>(RegOpCode::REG_HALT) + 1,
+                  "dispatch table out of sync with RegOpCode");
+    DISPATCH();
+#else
+    for (;;) {
+        switch (static_cast<RegOpCode>(*pc++)) {
+#endif
+            REG_CASE(REG_MOVE) {
+                base[pc[0]] = base[pc[1]];
+                pc += 2;
+                DISPATCH();
+            }
+            REG_CASE(REG_LOADK) {
+                base[pc[0]] = chunk->constants[pc[1]];
+                pc += 2;
+                DISPATCH();
+            }
+            REG_CASE(REG_GETGLOBAL) {
+                base[pc[0]] = globals[pc[1]];
+                pc += 2;
+                DISPATCH();
+            }
+            REG_CASE(REG_LOADK_WIDE) {
+                base[pc[0]] = chunk->constants[readWide(pc + 1)];
+                pc += 4;
+                DISPATCH();
+            }
+            REG_CASE(REG_GETGLOBAL_WIDE) {
+                base[pc[0]] = spilled[readWide(pc + 1)];
+                pc += 4;
+                DISPATCH();
+            }
+            REG_CASE(REG_SETGLOBAL_WIDE) {
+                spilled[readWide(pc + 1)] = base[pc[0]];
+                pc += 4;
+                DISPATCH();
+            }
+            REG_CASE(REG_ADD) {
+                Value b = base[pc[1]];
+                Value c = base[pc[2]];
+                Value& a = base[pc[0]];
+                pc += 3;
+                if (b.isNumber() && c.isNumber()) {
+                    a = Value(b.asNumber() + c.asNumber());
                 } else {
-                    std::cout << num;
+                    a = addValues(b, c);
+                    collectIfNeeded();
                 }
-            } else if (R(reg).type == Value::STRING) {
-                std::cout << R(reg).string;
+                DISPATCH();
             }
-            if (i < count - 1) std::cout << " ";
-        }
-        std::cout << std::endl;
-        DISPATCH();
-    }
-    
-    CASE(REG_CALL) {
-        // Simplified - full implementation needed
-        DISPATCH();
-    }
-    
-    CASE(REG_RET) {
-        return;
-    }
-    
-    CASE(REG_HALT) {
-        return;
-    }
-    
-    #else
-    // Fallback to switch for non-GCC compilers
-    while (pc < static_cast<int>(mainChunk.code.size())) {
-        RegOpCode op = static_cast<RegOpCode>(code[pc++]);
-        switch (op) {
-            case RegOpCode::REG_ADD: {
-                int a = code[pc++], b = code[pc++], c = code[pc++];
-                R(a).number = R(b).number + R(c).number;
-                break;
-            }
-            case RegOpCode::REG_HALT:
+            REG_CASE(REG_SUB) {
+                base[pc[0]] = Value(toNumber(base[pc[1]]) - toNumber(base[pc[2]]));
+                pc += 3;
+                DISPATCH();
+            }
+            REG_CASE(REG_MUL) {
+                base[pc[0]] = Value(toNumber(base[pc[1]]) * toNumber(base[pc[2]]));
+                pc += 3;
+                DISPATCH();
+            }
+            REG_CASE(REG_DIV) {
+                double divisor = toNumber(base[pc[2]]);
+                if (divisor == 0) throw std::runtime_error("Division by zero");
+                base[pc[0]] = Value(toNumber(base[pc[1]]) / divisor);
+                pc += 3;
+                DISPATCH();
+            }
+            REG_CASE(REG_ADDK) {
+                Value b = base[pc[1]];
+                Value c = chunk->constants[pc[2]];
+                Value& a = base[pc[0]];
+                pc += 3;
+                if (b.isNumber()) {
+                    a = Value(b.asNumber() + c.asNumber());
+                } else {
+                    a = addValues(b, c);
+                    collectIfNeeded();
+                }
+                DISPATCH();
+            }
+            REG_CASE(REG_SUBK) {
+                base[pc[0]] = Value(toNumber(base[pc[1]]) - chunk->constants[pc[2]].asNumber());
+                pc += 3;
+                DISPATCH();
+            }
+            REG_CASE(REG_MULK) {
+                base[pc[0]] = Value(toNumber(base[pc[1]]) * chunk->constants[pc[2]].asNumber());
+                pc += 3;
+                DISPATCH();
+            }
+            REG_CASE(REG_DIVK) {
+                double divisor = chunk->constants[pc[2]].asNumber();
+                if (divisor == 0) throw std::runtime_error("Division by zero");
+                base[pc[0]] = Value(toNumber(base[pc[1]]) / divisor);
+                pc += 3;
+                DISPATCH();
+            }
+            REG_CASE(REG_NEG) {
+                base[pc[0]] = Value(-toNumber(base[pc[1]]));
+                pc += 2;
+                DISPATCH();
+            }
+            REG_CASE(REG_NOT) {
+                base[pc[0]] = Value(!truthy(base[pc[1]]));
+                pc += 2;
+                DISPATCH();
+            }
+            REG_CASE(REG_LT) {
+                base[pc[0]] = Value(toNumber(base[pc[1]]) < toNumber(base[pc[2]]));
+                pc += 3;
+                DISPATCH();
+            }
+            REG_CASE(REG_LE) {
+                base[pc[0]] = Value(toNumber(base[pc[1]]) <= toNumber(base[pc[2]]));
+                pc += 3;
+                DISPATCH();
+            }
+            REG_CASE(REG_GT) {
+                base[pc[0]] = Value(toNumber(base[pc[1]]) > toNumber(base[pc[2]]));
+                pc += 3;
+                DISPATCH();
+            }
+            REG_CASE(REG_GE) {
+                base[pc[0]] = Value(toNumber(base[pc[1]]) >= toNumber(base[pc[2]]));
+                pc += 3;
+                DISPATCH();
+            }
+            REG_CASE(REG_EQ) {
+                base[pc[0]] = Value(valuesEqual(base[pc[1]], base[pc[2]]));
+                pc += 3;
+                DISPATCH();
+            }
+            REG_CASE(REG_NE) {
+                base[pc[0]] = Value(!valuesEqual(base[pc[1]], base[pc[2]]));
+                pc += 3;
+                DISPATCH();
+            }
+            REG_CASE(REG_JMP) {
+                pc += 2 + readOffset(pc);
+                DISPATCH();
+            }
+            REG_CASE(REG_JMPF) {
+                bool taken = !truthy(base[pc[0]]);
+                int offset = readOffset(pc + 1);
+                pc += 3;
+                if (taken) pc += offset;
+                DISPATCH();
+            }
+            REG_CASE(REG_JMPT) {
+                bool taken = truthy(base[pc[0]]);
+                int offset = readOffset(pc + 1);
+                pc += 3;
+                if (taken) pc += offset;
+                DISPATCH();
+            }
+            REG_CASE(REG_JNLT) COMPARE_JUMP(<, base[pc[1]])
+            REG_CASE(REG_JNLE) COMPARE_JUMP(<=, base[pc[1]])
+            REG_CASE(REG_JNGT) COMPARE_JUMP(>, base[pc[1]])
+            REG_CASE(REG_JNGE) COMPARE_JUMP(>=, base[pc[1]])
+            REG_CASE(REG_JNLTK) COMPARE_JUMP(<, chunk->constants[pc[1]])
+            REG_CASE(REG_JNLEK) COMPARE_JUMP(<=, chunk->constants[pc[1]])
+            REG_CASE(REG_JNGTK) COMPARE_JUMP(>, chunk->constants[pc[1]])
+            REG_CASE(REG_JNGEK) COMPARE_JUMP(>=, chunk->constants[pc[1]])
+            REG_CASE(REG_NEWARRAY) {
+                Value* first = base + pc[1];
+                ObjArray* arr = heap.newArray();
+                arr->assign(first, first + pc[2]);
+                base[pc[0]] = Value(arr);
+                pc += 3;
+                collectIfNeeded();
+                DISPATCH();
+            }
+            REG_CASE(REG_NEWMAP) {
+                Value* first = base + pc[1];
+                ObjHashMap* hm = heap.newHashMap();
+                for (Value* pair = first; pair < first + pc[2] * 2; pair += 2) {
+                    hm->set(pair[0], pair[1]);
+                }
+                base[pc[0]] = Value(hm);
+                pc += 3;
+                collectIfNeeded();
+                DISPATCH();
+            }
+            REG_CASE(REG_APPEND) {
+                ObjArray* arr = base[pc[0]].asArray();
+                for (Value* elem = base + pc[1]; elem < base + pc[1] + pc[2]; elem++) {
+                    arr->push(*elem);
+                }
+                pc += 3;
+                DISPATCH();
+            }
+            REG_CASE(REG_GETINDEX) {
+                Value container = base[pc[1]];
+                Value index = base[pc[2]];
+                Value& result = base[pc[0]];
+                pc += 3;
+                if (container.isArray() && index.isNumber()) {
+                    const std::vector<Value>& elements = container.asArray()->elements;
+                    int idx = static_cast<int>(index.asNumber());
+                    result = idx >= 0 && idx < static_cast<int>(elements.size()) ? elements[idx] : Value(0.0);
+                } else {
+                    result = indexGet(container, index);
+                    if (container.isString()) collectIfNeeded();
+                }
+                DISPATCH();
+            }
+            REG_CASE(REG_SETINDEX) {
+                indexSet(base[pc[0]], base[pc[1]], base[pc[2]]);
+                pc += 3;
+                collectIfNeeded();
+                DISPATCH();
+            }
+            REG_CASE(REG_GETFIELD) {
+                Value container = base[pc[1]];
+                FieldCache& cache = chunk->fieldCaches[pc[3]];
+                if (container.isHashMap() && container.asHashMap()->shape == cache.shape) {
+                    base[pc[0]] = container.asHashMap()->entries[cache.index].value;
+                } else {
+                    base[pc[0]] = getField(container, chunk->constants[pc[2]], cache);
+                }
+                pc += 4;
+                DISPATCH();
+            }
+            REG_CASE(REG_SETFIELD) {
+                Value container = base[pc[0]];
+                FieldCache& cache = chunk->fieldCaches[pc[3]];
+                if (container.isHashMap() && container.asHashMap()->shape == cache.shape) {
+                    container.asHashMap()->entries[cache.index].value = base[pc[2]];
+                } else {
+                    setField(container, chunk->constants[pc[1]], base[pc[2]], cache);
+                    collectIfNeeded();
+                }
+                pc += 4;
+                DISPATCH();
+            }
+            REG_CASE(REG_ENTER) {
+                Value* frameEnd = base + *pc++;
+                if (frameEnd > registersEnd) throw std::runtime_error("Stack overflow");
+                while (top < frameEnd) {
+                    *top++ = Value();
+                }
+                top = frameEnd;
+                DISPATCH();
+            }
+            REG_CASE(REG_CALL) CALL_FUNCTION(pc[1], 4)
+            REG_CASE(REG_TAILCALL) TAIL_CALL_FUNCTION(pc[0], 3)
+            REG_CASE(REG_BUILTIN) {
+                base[pc[0]] = natives[pc[1]].fn(base + pc[2], pc[3], natives[pc[1]].userdata);
+                pc += 4;
+                collectIfNeeded();
+                DISPATCH();
+            }
+            REG_CASE(REG_RET) {
+                Value result = base[pc[0]];
+                // A return at the top level ends the script
+                if (frames.empty()) return;
+
+                const RegisterFrame& frame = frames.back();
+                chunk = frame.chunk;
+                pc = frame.returnPC;
+                base = frame.base;
+                top = frame.top;
+                base[frame.returnReg] = result;
+                frames.pop_back();
+                DISPATCH();
+            }
+            REG_CASE(REG_CALL_WIDE) CALL_FUNCTION(readWide(pc + 1), 6)
+            REG_CASE(REG_TAILCALL_WIDE) TAIL_CALL_FUNCTION(readWide(pc), 5)
+            REG_CASE(REG_BUILTIN_WIDE) {
+                int nativeId = readWide(pc + 1);
+                base[pc[0]] = natives[nativeId].fn(base + pc[4], pc[5], natives[nativeId].userdata);
+                pc += 6;
+                collectIfNeeded();
+                DISPATCH();
+            }
+            REG_CASE(REG_PRINT) {
+                printValues(base + pc[0], pc[1]);
+                pc += 2;
+                DISPATCH();
+            }
+            REG_CASE(REG_PRINTPART) {
+                printValues(base + pc[0], pc[1], false);
+                pc += 2;
+                DISPATCH();
+            }
+            REG_CASE(REG_BREAK) {
+                throw std::runtime_error("break outside loop");
+            }
+            REG_CASE(REG_CONTINUE) {
+                throw std::runtime_error("continue outside loop");
+            }
+            REG_CASE(REG_HALT) {
                 return;
+            }
+#ifndef ZS_COMPUTED_GOTO
             default:
-                break;
+                throw std::runtime_error("Unknown register opcode " + std::to_string(pc[-1]));
         }
     }
-    #endif
+#endif
+}
+
+#undef COMPARE_JUMP
+#undef CALL_FUNCTION
+#undef TAIL_CALL_FUNCTION
+#undef REG_CASE
+#undef DISPATCH
+
+void RegisterVM::run(const Chunk& chunk, const std::vector<Function>& funcs) {
+    functions = &funcs;
+    mainChunk = &chunk;
+    spilledGlobals.assign(chunk.globalCount, Value());
+    top = registers.data();
+    frames.clear();
+    execute(chunk);
 }
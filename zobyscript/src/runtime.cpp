@@ -0,0 +1,137 @@
+#include "../include/runtime.h"
+#include <iostream>
+
+// Long results become ropes, so building a string in a loop stays linear
+Value addValues(const Value& a, const Value& b) {
+    if (!a.isString() && !b.isString()) return Value(toNumber(a) + toNumber(b));
+    Heap& heap = Heap::instance();
+    Obj* left = a.isString() ? a.asObj()
+        : heap.newString(a.isNumber() ? std::to_string(static_cast<int>(a.asNumber())) : "");
+    Obj* right = b.isString() ? b.asObj()
+        : heap.newString(b.isNumber() ? std::to_string(static_cast<int>(b.asNumber())) : "");
+    return Value(heap.concatenate(left, right));
+}
+
+bool isTruthy(const Value& value) {
+    if (value.isBool()) return value.asBool();
+    if (value.isNumber()) return value.asNumber() != 0;
+    if (value.isString()) return value.stringLength() != 0;
+    if (value.isArray()) return !value.asArray()->elements.empty();
+    return false;
+}
+
+bool valuesEqual(const Value& a, const Value& b) {
+    // Strings are interned, so everything but numbers compares by identity
+    // once ropes are flattened
+    if (a.isNumber() && b.isNumber()) return a.asNumber() == b.asNumber();
+    if (a.isString() && b.isString()) return a.asString() == b.asString();
+    return a.raw() == b.raw();
+}
+
+Value indexGet(const Value& container, const Value& index) {
+    if (container.isHashMap()) {
+        const Value* entry = container.asHashMap()->get(index);
+        return entry ? *entry : Value::Null();
+    }
+    if (container.isArray() && index.isNumber()) {
+        const std::vector<Value>& elements = container.asArray()->elements;
+        int idx = static_cast<int>(index.asNumber());
+        if (idx >= 0 && idx < static_cast<int>(elements.size())) return elements[idx];
+        return Value(0.0);
+    }
+    if (container.isString() && index.isNumber()) {
+        const std::string& str = container.asString()->chars;
+        int idx = static_cast<int>(index.asNumber());
+        if (idx >= 0 && idx < static_cast<int>(str.length())) return makeString(std::string(1, str[idx]));
+        return makeString("");
+    }
+    return Value::Null();
+}
+
+void indexSet(const Value& container, const Value& index, const Value& value) {
+    if (container.isArray() && index.isNumber()) {
+        ObjArray* arr = container.asArray();
+        int idx = static_cast<int>(index.asNumber());
+        if (idx >= 0 && idx < static_cast<int>(arr->elements.size())) {
+            arr->set(idx, value);
+        }
+    } else if (container.isHashMap()) {
+        container.asHashMap()->set(index, value);
+    }
+}
+
+// Dictionary-mode maps have no stable layout to cache
+static void fillCache(FieldCache& cache, const ObjHashMap* map, int idx) {
+    if (map->shape == Shape::dictionary()) return;
+    cache.shape = map->shape;
+    cache.index = static_cast<uint32_t>(idx);
+}
+
+Value getField(const Value& container, const Value& key, FieldCache& cache) {
+    if (!container.isHashMap()) return indexGet(container, key);
+    ObjHashMap* map = container.asHashMap();
+    if (map->shape == cache.shape) return map->entries[cache.index].value;
+    int idx = map->find(key);
+    if (idx < 0) return Value::Null();
+    fillCache(cache, map, idx);
+    return map->entries[idx].value;
+}
+
+void setField(const Value& container, const Value& key, const Value& value, FieldCache& cache) {
+    if (!container.isHashMap()) {
+        indexSet(container, key, value);
+        return;
+    }
+    ObjHashMap* map = container.asHashMap();
+    if (map->shape == cache.shape) {
+        map->entries[cache.index].value = value;
+        return;
+    }
+    map->set(key, value);
+    fillCache(cache, map, map->find(key));
+}
+
+void printValues(const Value* values, int count, bool endLine) {
+    for (int i = 0; i < count; i++) {
+        Value val = values[i];
+        if (val.isNumber()) {
+            double num = val.asNumber();
+            if (num == static_cast<int>(num)) {
+                std::cout << static_cast<int>(num);
+            } else {
+                std::cout << num;
+            }
+        } else if (val.isString()) {
+            std::cout << val.asString()->chars;
+        } else if (val.isBool()) {
+            std::cout << (val.asBool() ? "true" : "false");
+        } else if (val.isArray()) {
+            const std::vector<Value>& elements = val.asArray()->elements;
+            std::cout << "[";
+            for (size_t j = 0; j < elements.size(); j++) {
+                Value elem = elements[j];
+                if (elem.isNumber()) {
+                    double num = elem.asNumber();
+                    if (num == static_cast<int>(num)) {
+                        std::cout << static_cast<int>(num);
+                    } else {
+                        std::cout << num;
+                    }
+                } else if (elem.isString()) {
+                    std::cout << "\"" << elem.asString()->chars << "\"";
+                } else if (elem.isBool()) {
+                    std::cout << (elem.asBool() ? "true" : "false");
+                }
+                if (j < elements.size() - 1) std::cout << ", ";
+            }
+            std::cout << "]";
+        }
+        if (i < count - 1) std::cout << " ";
+    }
+    // A print split over several calls continues on the same line
+    if (endLine) {
+        std::cout << std::endl;
+    } else {
+        std::cout << " ";
+    }
+}
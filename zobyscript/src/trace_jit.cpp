@@ -0,0 +1,819 @@
+#include "../include/trace_jit.h"
+#include "../include/vm.h"
+#include "../include/x64_assembler.h"
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+// A recorded loop: the root fragment starts at the loop header, side
+// fragments at one of its exits, and every fragment ends back at the header.
+// All fragments share one set of variable registers and compile into one
+// block of code, so a guard with a side trace jumps straight into it.
+struct Trace {
+    struct Var {
+        bool global;
+        int index;
+        bool written;
+    };
+    enum class Kind : uint8_t {
+        PUSH_CONST,    // push(k)
+        PUSH_VAR,      // push(var)
+        STORE,         // var = top
+        STORE_POP,     // var = pop()
+        STORE_CONST,   // var = k
+        INC,           // var = var + k
+        ADD_VARS,      // push(var + var2)
+        ARITH,         // b = pop(), a = pop(); push(a op b)
+        NEGATE,        // push(-pop())
+        POP,
+        COMPARE_GUARD, // b = pop(), a = pop(); exit unless (a op b) == expect
+        TRUTHY_GUARD   // exit unless truthy(pop()) == expect
+    };
+    struct Op {
+        Kind kind;
+        OpCode op;  // ARITH and COMPARE_GUARD: the operator
+        int var;
+        int var2;
+        double k;
+        bool expect;
+        int exit;  // guards, and ARITH for division by zero
+    };
+    struct Exit {
+        uint8_t* ip;   // where the interpreter resumes
+        int depth;     // stack values the exit pushes for it
+        int count;
+        int fragment;  // side trace taken instead, or -1
+        bool abandoned;
+    };
+    struct Fragment {
+        std::vector<Op> ops;
+    };
+
+    std::vector<Var> vars;
+    std::vector<Fragment> fragments;
+    std::vector<Exit> exits;
+    // Set by compileTrace()
+    int maxDepth;
+    int localSlots;
+    uint8_t* code;
+    size_t codeSize;
+
+    Trace() : maxDepth(0), localSlots(0), code(nullptr), codeSize(0) {}
+    ~Trace() {
+        if (code) x64::unmapExecutable(code, codeSize);
+    }
+};
+
+namespace {
+
+const int MAX_TRACE_LENGTH = 500;  // instructions per fragment
+const int MAX_FRAGMENTS = 16;
+
+int jumpOffset(const uint8_t* operand) {
+    return (operand[0] << 8) | operand[1];
+}
+
+// Executes instructions exactly as the interpreter does while logging them,
+// for as long as every value involved is a number and control stays inside
+// the loop. It stops before the first instruction it cannot follow, so the
+// interpreter carries on from there with nothing lost.
+class Recorder {
+private:
+    Trace& trace;
+    const Chunk& chunk;
+    const uint8_t* header;
+    Value*& sp;
+    Value* bp;
+    Value* stackEnd;
+    std::vector<Value>& globals;
+    Value* startSp;
+    Trace::Fragment fragment;
+
+    int depth() const { return static_cast<int>(sp - startSp); }
+    bool room() const { return sp != stackEnd; }
+
+    int var(bool global, int index, bool write) {
+        for (size_t i = 0; i < trace.vars.size(); i++) {
+            if (trace.vars[i].global == global && trace.vars[i].index == index) {
+                trace.vars[i].written = trace.vars[i].written || write;
+                return static_cast<int>(i);
+            }
+        }
+        trace.vars.push_back(Trace::Var{global, index, write});
+        return static_cast<int>(trace.vars.size()) - 1;
+    }
+
+    // The variable's slot, or nullptr if it does not hold a number. Locals
+    // must lie below the stack the trace works on.
+    Value* slot(bool global, int index) {
+        Value* value;
+        if (global) {
+            if (index >= static_cast<int>(globals.size())) return nullptr;
+            value = &globals[index];
+        } else {
+            value = bp + index;
+            if (value >= startSp) return nullptr;
+        }
+        return value->isNumber() ? value : nullptr;
+    }
+
+    void store(bool global, int index, const Value& value) {
+        if (global) {
+            globals[index] = value;
+        } else {
+            bp[index] = value;
+        }
+    }
+
+    int addExit(uint8_t* ip, int exitDepth) {
+        trace.exits.push_back(Trace::Exit{ip, exitDepth, 0, -1, false});
+        return static_cast<int>(trace.exits.size()) - 1;
+    }
+
+    void emit(Trace::Kind kind, int varIdx = -1, double k = 0) {
+        fragment.ops.push_back(Trace::Op{kind, OpCode::OP_HALT, varIdx, -1, k, false, -1});
+    }
+
+    void emitGuard(Trace::Kind kind, OpCode op, bool expect, uint8_t* exitIp) {
+        fragment.ops.push_back(Trace::Op{kind, op, -1, -1, 0, expect, addExit(exitIp, depth())});
+    }
+
+    static bool compare(OpCode op, double a, double b) {
+        switch (op) {
+            case OpCode::OP_LESS:
+            case OpCode::OP_JUMP_IF_NOT_LESS:
+                return a < b;
+            case OpCode::OP_LESS_EQUAL:
+            case OpCode::OP_JUMP_IF_NOT_LESS_EQUAL:
+                return a <= b;
+            case OpCode::OP_GREATER:
+            case OpCode::OP_JUMP_IF_NOT_GREATER:
+                return a > b;
+            case OpCode::OP_GREATER_EQUAL:
+            case OpCode::OP_JUMP_IF_NOT_GREATER_EQUAL:
+                return a >= b;
+            case OpCode::OP_EQUAL:
+                return a == b;
+            default:
+                return a != b;
+        }
+    }
+
+    static OpCode baseOp(OpCode op) {
+        switch (op) {
+            case OpCode::OP_ADD_NUM: return OpCode::OP_ADD;
+            case OpCode::OP_EQUAL_NUM: return OpCode::OP_EQUAL;
+            case OpCode::OP_NOT_EQUAL_NUM: return OpCode::OP_NOT_EQUAL;
+            case OpCode::OP_JUMP_IF_NOT_LESS: return OpCode::OP_LESS;
+            case OpCode::OP_JUMP_IF_NOT_LESS_EQUAL: return OpCode::OP_LESS_EQUAL;
+            case OpCode::OP_JUMP_IF_NOT_GREATER: return OpCode::OP_GREATER;
+            case OpCode::OP_JUMP_IF_NOT_GREATER_EQUAL: return OpCode::OP_GREATER_EQUAL;
+            default: return op;
+        }
+    }
+
+    // Runs one instruction; false if it cannot be traced (ip unchanged)
+    bool step(uint8_t*& ip) {
+        OpCode op = static_cast<OpCode>(*ip);
+        switch (op) {
+            case OpCode::OP_CONSTANT:
+            case OpCode::OP_CONSTANT_0:
+            case OpCode::OP_CONSTANT_1: {
+                Value k = op == OpCode::OP_CONSTANT ? chunk.constants[ip[1]] : Value(op == OpCode::OP_CONSTANT_1 ? 1.0 : 0.0);
+                if (!k.isNumber() || !room()) return false;
+                *sp++ = k;
+                emit(Trace::Kind::PUSH_CONST, -1, k.asNumber());
+                ip += op == OpCode::OP_CONSTANT ? 2 : 1;
+                return true;
+            }
+            case OpCode::OP_GET_GLOBAL:
+            case OpCode::OP_GET_LOCAL: {
+                bool global = op == OpCode::OP_GET_GLOBAL;
+                Value* value = slot(global, ip[1]);
+                if (!value || !room()) return false;
+                *sp++ = *value;
+                emit(Trace::Kind::PUSH_VAR, var(global, ip[1], false));
+                ip += 2;
+                return true;
+            }
+            case OpCode::OP_SET_GLOBAL:
+            case OpCode::OP_SET_LOCAL:
+            case OpCode::OP_SET_GLOBAL_POP:
+            case OpCode::OP_SET_LOCAL_POP: {
+                bool global = op == OpCode::OP_SET_GLOBAL || op == OpCode::OP_SET_GLOBAL_POP;
+                bool popValue = op == OpCode::OP_SET_GLOBAL_POP || op == OpCode::OP_SET_LOCAL_POP;
+                // Stores may retype a variable, but only ever to a number
+                if (depth() < 1 || (global ? ip[1] >= static_cast<int>(globals.size()) : bp + ip[1] >= startSp)) {
+                    return false;
+                }
+                store(global, ip[1], sp[-1]);
+                if (popValue) sp--;
+                emit(popValue ? Trace::Kind::STORE_POP : Trace::Kind::STORE, var(global, ip[1], true));
+                ip += 2;
+                return true;
+            }
+            case OpCode::OP_SET_GLOBAL_CONST:
+            case OpCode::OP_SET_LOCAL_CONST: {
+                bool global = op == OpCode::OP_SET_GLOBAL_CONST;
+                const Value& k = chunk.constants[ip[2]];
+                if (!k.isNumber() || (global ? ip[1] >= static_cast<int>(globals.size()) : bp + ip[1] >= startSp)) {
+                    return false;
+                }
+                store(global, ip[1], k);
+                emit(Trace::Kind::STORE_CONST, var(global, ip[1], true), k.asNumber());
+                ip += 3;
+                return true;
+            }
+            case OpCode::OP_INC_GLOBAL:
+            case OpCode::OP_INC_LOCAL: {
+                bool global = op == OpCode::OP_INC_GLOBAL;
+                Value* value = slot(global, ip[1]);
+                const Value& k = chunk.constants[ip[2]];
+                if (!value || !k.isNumber()) return false;
+                store(global, ip[1], Value(value->asNumber() + k.asNumber()));
+                emit(Trace::Kind::INC, var(global, ip[1], true), k.asNumber());
+                ip += 3;
+                return true;
+            }
+            case OpCode::OP_ADD_GLOBALS:
+            case OpCode::OP_ADD_LOCALS: {
+                bool global = op == OpCode::OP_ADD_GLOBALS;
+                Value* a = slot(global, ip[1]);
+                Value* b = slot(global, ip[2]);
+                if (!a || !b || !room()) return false;
+                *sp++ = Value(a->asNumber() + b->asNumber());
+                emit(Trace::Kind::ADD_VARS, var(global, ip[1], false));
+                fragment.ops.back().var2 = var(global, ip[2], false);
+                ip += 3;
+                return true;
+            }
+            case OpCode::OP_ADD:
+            case OpCode::OP_ADD_NUM:
+            case OpCode::OP_SUBTRACT:
+            case OpCode::OP_MULTIPLY:
+            case OpCode::OP_DIVIDE:
+            case OpCode::OP_ADD_INT:
+            case OpCode::OP_SUB_INT:
+            case OpCode::OP_MUL_INT: {
+                if (depth() < 2 || !sp[-2].isNumber() || !sp[-1].isNumber()) return false;
+                double a = sp[-2].asNumber();
+                double b = sp[-1].asNumber();
+                double result;
+                int exit = -1;
+                switch (op) {
+                    case OpCode::OP_SUBTRACT: result = a - b; break;
+                    case OpCode::OP_MULTIPLY: result = a * b; break;
+                    case OpCode::OP_DIVIDE:
+                        // Left to the interpreter, which throws
+                        if (b == 0) return false;
+                        exit = addExit(ip, depth());
+                        result = a / b;
+                        break;
+                    case OpCode::OP_ADD_INT: result = static_cast<int>(a) + static_cast<int>(b); break;
+                    case OpCode::OP_SUB_INT: result = static_cast<int>(a) - static_cast<int>(b); break;
+                    case OpCode::OP_MUL_INT: result = static_cast<int>(a) * static_cast<int>(b); break;
+                    default: result = a + b; break;
+                }
+                sp--;
+                sp[-1] = Value(result);
+                fragment.ops.push_back(Trace::Op{Trace::Kind::ARITH, baseOp(op), -1, -1, 0, false, exit});
+                ip++;
+                return true;
+            }
+            case OpCode::OP_NEGATE:
+                if (depth() < 1 || !sp[-1].isNumber()) return false;
+                sp[-1] = Value(-sp[-1].asNumber());
+                emit(Trace::Kind::NEGATE);
+                ip++;
+                return true;
+            case OpCode::OP_LESS:
+            case OpCode::OP_LESS_EQUAL:
+            case OpCode::OP_GREATER:
+            case OpCode::OP_GREATER_EQUAL:
+            case OpCode::OP_EQUAL:
+            case OpCode::OP_EQUAL_NUM:
+            case OpCode::OP_NOT_EQUAL:
+            case OpCode::OP_NOT_EQUAL_NUM:
+            case OpCode::OP_JUMP_IF_NOT_LESS:
+            case OpCode::OP_JUMP_IF_NOT_LESS_EQUAL:
+            case OpCode::OP_JUMP_IF_NOT_GREATER:
+            case OpCode::OP_JUMP_IF_NOT_GREATER_EQUAL: {
+                // Booleans never reach the virtual stack: a plain compare is
+                // only traced together with the branch that consumes it
+                bool fused = op >= OpCode::OP_JUMP_IF_NOT_LESS && op <= OpCode::OP_JUMP_IF_NOT_GREATER_EQUAL;
+                const uint8_t* offset = fused ? ip + 1 : ip + 2;
+                if (!fused && static_cast<OpCode>(ip[1]) != OpCode::OP_POP_JUMP_IF_FALSE) return false;
+                if (depth() < 2 || !sp[-2].isNumber() || !sp[-1].isNumber()) return false;
+                bool holds = compare(baseOp(op), sp[-2].asNumber(), sp[-1].asNumber());
+                uint8_t* next = ip + (fused ? 3 : 4);
+                uint8_t* target = next + jumpOffset(offset);
+                sp -= 2;
+                emitGuard(Trace::Kind::COMPARE_GUARD, baseOp(op), holds, holds ? target : next);
+                ip = holds ? next : target;
+                return true;
+            }
+            case OpCode::OP_POP_JUMP_IF_FALSE: {
+                if (depth() < 1 || !sp[-1].isNumber()) return false;
+                bool truthy = sp[-1].asNumber() != 0;
+                uint8_t* next = ip + 3;
+                uint8_t* target = next + jumpOffset(ip + 1);
+                sp--;
+                emitGuard(Trace::Kind::TRUTHY_GUARD, op, truthy, truthy ? target : next);
+                ip = truthy ? next : target;
+                return true;
+            }
+            case OpCode::OP_POP:
+                if (depth() < 1) return false;
+                sp--;
+                emit(Trace::Kind::POP);
+                ip++;
+                return true;
+            case OpCode::OP_JUMP:
+            case OpCode::OP_LOOP_TRACE: {
+                int offset = jumpOffset(ip + 1);
+                if (op == OpCode::OP_LOOP_TRACE || (offset & 0x8000)) {
+                    // Only the loop's own back-edge; inner loops end the trace
+                    if (ip + 3 + (offset | ~0xFFFF) != header) return false;
+                    ip = ip + 3 + (offset | ~0xFFFF);
+                } else {
+                    ip += 3 + offset;
+                }
+                return true;
+            }
+            default:
+                return false;
+        }
+    }
+
+public:
+    Recorder(Trace& t, const Chunk& c, const uint8_t* loopHeader, Value*& stackTop, Value* basePointer, Value* end,
+             std::vector<Value>& globalSlots)
+        : trace(t), chunk(c), header(loopHeader), sp(stackTop), bp(basePointer), stackEnd(end), globals(globalSlots),
+          startSp(stackTop) {}
+
+    // Runs from ip until control comes back to the loop header, then adds
+    // the fragment to the trace. Returns false if it stopped early; either
+    // way ip is the next instruction for the interpreter.
+    bool record(uint8_t*& ip) {
+        size_t varCount = trace.vars.size();
+        size_t exitCount = trace.exits.size();
+        for (int steps = 0; steps < MAX_TRACE_LENGTH; steps++) {
+            if (!step(ip)) break;
+            if (ip == header) {
+                if (depth() != 0) break;
+                trace.fragments.push_back(fragment);
+                return true;
+            }
+        }
+        trace.vars.resize(varCount);
+        trace.exits.resize(exitCount);
+        return false;
+    }
+};
+
+#ifdef ZS_JIT_X64
+
+using namespace x64;
+
+// Compiles every fragment of a trace into one function
+//   int trace(Value* bp, Value* globals, Value* sp)
+// returning the exit taken, or -1 if a variable was not a number on entry.
+// Variable i lives in xmm i, the virtual stack slot at depth d in xmm
+// (variable count + d), and xmm15 is scratch. The virtual stack tracks
+// constants and variable reads lazily; values only land in their slot
+// register when an operation needs them there.
+class TraceCompiler {
+private:
+    struct Slot {
+        bool constant;
+        double k;
+        int reg;
+    };
+
+    static const int SCRATCH = 15;
+
+    Assembler as;
+    Trace& trace;
+    std::vector<Slot> stack;
+    std::vector<int> exitLabels;
+    std::vector<int> fragmentLabels;
+    std::map<uint64_t, int> constantLabels;
+    std::vector<std::function<void()>> exitStubs;
+    int loopLabel;
+    int firstTemp;
+    int maxDepth;
+
+    Reg base(const Trace::Var& v) const { return v.global ? RSI : RDI; }
+    static int32_t disp(const Trace::Var& v) { return v.index * static_cast<int32_t>(sizeof(Value)); }
+
+    int constantLabel(double k) {
+        uint64_t bits = Value(k).raw();
+        auto found = constantLabels.find(bits);
+        if (found != constantLabels.end()) return found->second;
+        int label = as.newLabel();
+        constantLabels[bits] = label;
+        return label;
+    }
+
+    void loadConstant(int xmm, double k) { as.sseLabel(0xF2, SSE_LOAD, xmm, constantLabel(k)); }
+
+    // dst = dst op b
+    void arith(uint8_t op, int dst, const Slot& b) {
+        if (b.constant) as.sseLabel(0xF2, op, dst, constantLabel(b.k));
+        else as.arith(op, dst, b.reg);
+    }
+
+    // Register holding the slot's value, loading constants into scratch
+    int operand(const Slot& slot) {
+        if (!slot.constant) return slot.reg;
+        loadConstant(SCRATCH, slot.k);
+        return SCRATCH;
+    }
+
+    bool push(const Slot& slot) {
+        stack.push_back(slot);
+        maxDepth = std::max(maxDepth, static_cast<int>(stack.size()));
+        return firstTemp + static_cast<int>(stack.size()) <= SCRATCH;
+    }
+
+    // Moves the slot at pos into its own register
+    void materialize(size_t pos) {
+        Slot& slot = stack[pos];
+        int reg = firstTemp + static_cast<int>(pos);
+        if (slot.constant) loadConstant(reg, slot.k);
+        else if (slot.reg != reg) as.movsd(reg, slot.reg);
+        slot = Slot{false, 0, reg};
+    }
+
+    // Pending reads of a variable must see its old value
+    void beforeWrite(int varReg) {
+        for (size_t i = 0; i < stack.size(); i++) {
+            if (!stack[i].constant && stack[i].reg == varReg) materialize(i);
+        }
+    }
+
+    // Stores xmm to [base + disp] as Value(double) would: a NaN, which x86
+    // produces with the sign bit set, is written as Value::CANONICAL_NAN
+    void storeNumber(Reg base, int32_t disp, int xmm) {
+        int ordered = as.newLabel();
+        as.movsdStore(base, disp, xmm);
+        as.ucomisd(xmm, xmm);
+        as.jcc(CC_NP, ordered);
+        as.movImm(RAX, Value::CANONICAL_NAN);
+        as.store(base, disp, RAX);
+        as.bind(ordered);
+    }
+
+    int guardTarget(int exit) {
+        int fragment = trace.exits[exit].fragment;
+        return fragment >= 0 ? fragmentLabels[fragment] : exitLabels[exit];
+    }
+
+    // The exit stub writes the variables back, pushes the live part of the
+    // virtual stack for the interpreter and returns the exit number
+    void addExitStub(int exit) {
+        if (trace.exits[exit].fragment >= 0) return;
+        std::vector<Slot> snapshot = stack;
+        exitStubs.push_back([this, exit, snapshot] {
+            as.bind(exitLabels[exit]);
+            for (size_t i = 0; i < trace.vars.size(); i++) {
+                if (trace.vars[i].written) storeNumber(base(trace.vars[i]), disp(trace.vars[i]), static_cast<int>(i));
+            }
+            for (size_t i = 0; i < snapshot.size(); i++) {
+                int32_t offset = static_cast<int32_t>(i * sizeof(Value));
+                if (snapshot[i].constant) {
+                    as.movImm(RAX, Value(snapshot[i].k).raw());
+                    as.store(RDX, offset, RAX);
+                } else {
+                    storeNumber(RDX, offset, snapshot[i].reg);
+                }
+            }
+            as.movImm(RAX, static_cast<uint64_t>(exit));
+            as.ret();
+        });
+    }
+
+    void compareGuard(const Trace::Op& op, const Slot& a, const Slot& b) {
+        int target = guardTarget(op.exit);
+        if (op.op == OpCode::OP_EQUAL || op.op == OpCode::OP_NOT_EQUAL) {
+            int reg = operand(a);
+            if (b.constant) as.sseLabel(0x66, 0x2E, reg, constantLabel(b.k));
+            else as.ucomisd(reg, b.reg);
+            // Equal means ZF set and PF (unordered) clear
+            if ((op.op == OpCode::OP_EQUAL) == op.expect) {
+                as.jcc(CC_P, target);
+                as.jcc(CC_NE, target);
+            } else {
+                int skip = as.newLabel();
+                as.jcc(CC_P, skip);
+                as.jcc(CC_E, target);
+                as.bind(skip);
+            }
+            return;
+        }
+        // a < b is tested as b > a so that NaN operands compare false
+        bool swapped = op.op == OpCode::OP_LESS || op.op == OpCode::OP_LESS_EQUAL;
+        bool orEqual = op.op == OpCode::OP_LESS_EQUAL || op.op == OpCode::OP_GREATER_EQUAL;
+        const Slot& first = swapped ? b : a;
+        const Slot& second = swapped ? a : b;
+        int reg = operand(first);
+        if (second.constant) as.sseLabel(0x66, 0x2E, reg, constantLabel(second.k));
+        else as.ucomisd(reg, second.reg);
+        if (op.expect) as.jcc(orEqual ? CC_B : CC_BE, target);
+        else as.jcc(orEqual ? CC_AE : CC_A, target);
+    }
+
+    void truthyGuard(const Trace::Op& op, const Slot& value) {
+        int target = guardTarget(op.exit);
+        if (value.constant) {
+            if ((value.k != 0) != op.expect) as.jmp(target);
+            return;
+        }
+        // Only +0 and -0 are falsy; NaN compares unordered and is truthy
+        as.xorpd(SCRATCH, SCRATCH);
+        as.ucomisd(value.reg, SCRATCH);
+        if (op.expect) {
+            int skip = as.newLabel();
+            as.jcc(CC_P, skip);
+            as.jcc(CC_E, target);
+            as.bind(skip);
+        } else {
+            as.jcc(CC_P, target);
+            as.jcc(CC_NE, target);
+        }
+    }
+
+    void divisionGuard(const Trace::Op& op, const Slot& divisor) {
+        int target = guardTarget(op.exit);
+        if (divisor.constant) {
+            if (divisor.k == 0) as.jmp(target);
+            return;
+        }
+        int nonZero = as.newLabel();
+        as.xorpd(SCRATCH, SCRATCH);
+        as.ucomisd(divisor.reg, SCRATCH);
+        as.jcc(CC_P, nonZero);
+        as.jcc(CC_E, target);
+        as.bind(nonZero);
+    }
+
+    // storeTo is the variable the next op stores the result into, or -1
+    bool arithmetic(const Trace::Op& op, int storeTo) {
+        size_t pos = stack.size() - 2;
+        int dst = firstTemp + static_cast<int>(pos);
+        if (op.op == OpCode::OP_DIVIDE) {
+            addExitStub(op.exit);
+            divisionGuard(op, stack[pos + 1]);
+        }
+        Slot b = stack[pos + 1];
+        bool intOp = op.op == OpCode::OP_ADD_INT || op.op == OpCode::OP_SUB_INT || op.op == OpCode::OP_MUL_INT;
+        if (!intOp && storeTo >= 0 && !stack[pos].constant && stack[pos].reg == storeTo) {
+            // x = x op b: update x in place rather than through a temp,
+            // which keeps loop-carried chains as short as native code
+            stack.pop_back();
+            stack.pop_back();
+            beforeWrite(storeTo);
+            stack.push_back(Slot{false, 0, storeTo});
+            dst = storeTo;
+        } else if (intOp) {
+            // Operands truncated to 32-bit ints, as the interpreter does
+            as.cvttsd2si(RAX, operand(stack[pos]));
+            as.cvttsd2si(RCX, operand(b));
+            if (op.op == OpCode::OP_ADD_INT) as.alu32(ALU_ADD, RAX, RCX);
+            else if (op.op == OpCode::OP_SUB_INT) as.alu32(ALU_SUB, RAX, RCX);
+            else as.imul32(RAX, RCX);
+            as.xorpd(dst, dst);
+            as.cvtsi2sd(dst, RAX);
+            stack[pos] = Slot{false, 0, dst};
+            stack.pop_back();
+            return true;
+        } else {
+            materialize(pos);
+            stack.pop_back();
+        }
+        uint8_t sseOp = SSE_ADD;
+        if (op.op == OpCode::OP_SUBTRACT) sseOp = SSE_SUB;
+        else if (op.op == OpCode::OP_MULTIPLY) sseOp = SSE_MUL;
+        else if (op.op == OpCode::OP_DIVIDE) sseOp = SSE_DIV;
+        arith(sseOp, dst, b);
+        return true;
+    }
+
+    bool compileOp(const Trace::Op& op, int storeTo) {
+        switch (op.kind) {
+            case Trace::Kind::PUSH_CONST:
+                return push(Slot{true, op.k, -1});
+            case Trace::Kind::PUSH_VAR:
+                return push(Slot{false, 0, op.var});
+            case Trace::Kind::STORE:
+            case Trace::Kind::STORE_POP: {
+                if (stack.empty()) return false;
+                if (stack.back().constant || stack.back().reg != op.var) {
+                    beforeWrite(op.var);
+                    const Slot& top = stack.back();
+                    if (top.constant) loadConstant(op.var, top.k);
+                    else as.movsd(op.var, top.reg);
+                }
+                if (op.kind == Trace::Kind::STORE_POP) stack.pop_back();
+                return true;
+            }
+            case Trace::Kind::STORE_CONST:
+                beforeWrite(op.var);
+                loadConstant(op.var, op.k);
+                return true;
+            case Trace::Kind::INC:
+                beforeWrite(op.var);
+                arith(SSE_ADD, op.var, Slot{true, op.k, -1});
+                return true;
+            case Trace::Kind::ADD_VARS: {
+                if (storeTo == op.var) {
+                    beforeWrite(op.var);
+                    as.arith(SSE_ADD, op.var, op.var2);
+                    return push(Slot{false, 0, op.var});
+                }
+                int dst = firstTemp + static_cast<int>(stack.size());
+                if (!push(Slot{false, 0, dst})) return false;
+                as.movsd(dst, op.var);
+                as.arith(SSE_ADD, dst, op.var2);
+                return true;
+            }
+            case Trace::Kind::ARITH:
+                if (stack.size() < 2) return false;
+                return arithmetic(op, storeTo);
+            case Trace::Kind::NEGATE: {
+                if (stack.empty()) return false;
+                size_t pos = stack.size() - 1;
+                materialize(pos);
+                as.movImm(RAX, Value::SIGN_BIT);
+                as.movqToXmm(SCRATCH, RAX);
+                as.xorpd(stack[pos].reg, SCRATCH);
+                return true;
+            }
+            case Trace::Kind::POP:
+                if (stack.empty()) return false;
+                stack.pop_back();
+                return true;
+            case Trace::Kind::COMPARE_GUARD: {
+                if (stack.size() < 2) return false;
+                Slot b = stack.back();
+                stack.pop_back();
+                Slot a = stack.back();
+                stack.pop_back();
+                addExitStub(op.exit);
+                compareGuard(op, a, b);
+                return true;
+            }
+            case Trace::Kind::TRUTHY_GUARD: {
+                if (stack.empty()) return false;
+                Slot value = stack.back();
+                stack.pop_back();
+                addExitStub(op.exit);
+                truthyGuard(op, value);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool compileFragment(const Trace::Fragment& fragment) {
+        stack.clear();
+        for (size_t i = 0; i < fragment.ops.size(); i++) {
+            const Trace::Op* next = i + 1 < fragment.ops.size() ? &fragment.ops[i + 1] : nullptr;
+            int storeTo = next && next->kind == Trace::Kind::STORE_POP ? next->var : -1;
+            if (!compileOp(fragment.ops[i], storeTo)) return false;
+        }
+        if (!stack.empty()) return false;
+        as.jmp(loopLabel);
+        return true;
+    }
+
+public:
+    explicit TraceCompiler(Trace& t) : trace(t), loopLabel(-1), firstTemp(static_cast<int>(t.vars.size())), maxDepth(0) {}
+
+    bool compile() {
+        if (firstTemp >= SCRATCH) return false;
+        for (size_t i = 0; i < trace.exits.size(); i++) exitLabels.push_back(as.newLabel());
+        for (size_t i = 0; i < trace.fragments.size(); i++) fragmentLabels.push_back(as.newLabel());
+        loopLabel = as.newLabel();
+        int typeMismatch = as.newLabel();
+
+        // Every variable must hold a number on entry; the trace itself only
+        // ever stores numbers, so the check never repeats inside the loop
+        as.movImm(R8, Value::QNAN);
+        for (const Trace::Var& v : trace.vars) {
+            as.load(RAX, base(v), disp(v));
+            as.alu(ALU_AND, RAX, R8);
+            as.alu(ALU_CMP, RAX, R8);
+            as.jcc(CC_E, typeMismatch);
+        }
+        for (size_t i = 0; i < trace.vars.size(); i++) {
+            as.movsdLoad(static_cast<int>(i), base(trace.vars[i]), disp(trace.vars[i]));
+        }
+        as.bind(loopLabel);
+        as.bind(fragmentLabels[0]);
+        if (!compileFragment(trace.fragments[0])) return false;
+        for (size_t i = 1; i < trace.fragments.size(); i++) {
+            as.bind(fragmentLabels[i]);
+            if (!compileFragment(trace.fragments[i])) return false;
+        }
+
+        as.bind(typeMismatch);
+        as.movImm(RAX, 0xFFFFFFFFULL);  // eax = -1
+        as.ret();
+        for (const auto& emitStub : exitStubs) emitStub();
+        for (const auto& constant : constantLabels) {
+            as.bind(constant.second);
+            as.qword(constant.first);
+        }
+        if (!as.finish()) return false;
+
+        uint8_t* code = mapExecutable(as.code);
+        if (!code) return false;
+        if (trace.code) unmapExecutable(trace.code, trace.codeSize);
+        trace.code = code;
+        trace.codeSize = as.code.size();
+        trace.maxDepth = maxDepth;
+        trace.localSlots = 0;
+        for (const Trace::Var& v : trace.vars) {
+            if (!v.global) trace.localSlots = std::max(trace.localSlots, v.index + 1);
+        }
+        return true;
+    }
+};
+
+// Replaces the trace's code only on success
+bool compileTrace(Trace& trace) {
+    TraceCompiler compiler(trace);
+    return compiler.compile();
+}
+
+#else
+
+bool compileTrace(Trace&) {
+    return false;
+}
+
+#endif
+
+}  // namespace
+
+TraceJit::TraceJit() {
+    std::fill(hotCounts, hotCounts + HOT_SLOTS, static_cast<uint16_t>(HOT_LOOP));
+}
+
+TraceJit::~TraceJit() {}
+
+uint8_t* TraceJit::recordLoop(VM& vm, Chunk& chunk, uint8_t* jump, uint8_t* header) {
+    if (blacklist.count(jump)) return header;
+    std::unique_ptr<Trace> trace(new Trace());
+    Recorder recorder(*trace, chunk, header, vm.sp, vm.bp, vm.stackEnd, vm.globals);
+    uint8_t* ip = header;
+    if (recorder.record(ip) && compileTrace(*trace)) {
+        *jump = static_cast<uint8_t>(OpCode::OP_LOOP_TRACE);
+        traces[jump] = std::move(trace);
+    } else {
+        blacklist.insert(jump);
+    }
+    return ip;
+}
+
+uint8_t* TraceJit::enter(VM& vm, Chunk& chunk, uint8_t* jump, uint8_t* header) {
+    auto found = traces.find(jump);
+    if (found == traces.end()) return header;
+    Trace& trace = *found->second;
+    // Room for the values an exit pushes, and the locals the trace uses
+    if (vm.stackEnd - vm.sp < trace.maxDepth || vm.sp - vm.bp < trace.localSlots) return header;
+
+    typedef int (*TraceFn)(Value* bp, Value* globals, Value* sp);
+    int exitIdx = reinterpret_cast<TraceFn>(trace.code)(vm.bp, vm.globals.data(), vm.sp);
+    if (exitIdx < 0) return header;  // a variable stopped being a number
+    Trace::Exit& exit = trace.exits[exitIdx];
+    vm.sp += exit.depth;
+    uint8_t* ip = exit.ip;
+    if (exit.depth != 0 || exit.abandoned || ++exit.count < HOT_EXIT) return ip;
+
+    // A hot exit: record where it leads and compile that in as a side trace
+    if (static_cast<int>(trace.fragments.size()) == MAX_FRAGMENTS) {
+        exit.abandoned = true;
+        return ip;
+    }
+    size_t varCount = trace.vars.size();
+    size_t exitCount = trace.exits.size();
+    Recorder recorder(trace, chunk, header, vm.sp, vm.bp, vm.stackEnd, vm.globals);
+    if (!recorder.record(ip)) {
+        trace.exits[exitIdx].abandoned = true;
+        return ip;
+    }
+    trace.exits[exitIdx].fragment = static_cast<int>(trace.fragments.size()) - 1;
+    if (!compileTrace(trace)) {
+        // Keep running the code compiled without it
+        trace.fragments.pop_back();
+        trace.vars.resize(varCount);
+        trace.exits.resize(exitCount);
+        trace.exits[exitIdx].fragment = -1;
+        trace.exits[exitIdx].abandoned = true;
+    }
+    return ip;
+}
@@ -0,0 +1,405 @@
+#include "../include/value.h"
+#include <algorithm>
+#include <memory>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define ZS_HAVE_SSE2 1
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+static const size_t INITIAL_GC_THRESHOLD = 1024 * 1024;
+// Shorter concatenations are cheaper to copy than to defer
+static const size_t ROPE_MIN_LENGTH = 64;
+static ObjString* const TOMBSTONE = reinterpret_cast<ObjString*>(static_cast<uintptr_t>(1));
+
+uint32_t hashString(const char* chars, size_t length) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= static_cast<uint8_t>(chars[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static const size_t GROUP_WIDTH = 16;
+static const int8_t CTRL_EMPTY = -128;
+
+static inline uint64_t mixHash(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline uint32_t lowestBit(uint32_t mask) {
+#if defined(_MSC_VER)
+    unsigned long idx;
+    _BitScanForward(&idx, mask);
+    return static_cast<uint32_t>(idx);
+#else
+    return static_cast<uint32_t>(__builtin_ctz(mask));
+#endif
+}
+
+// Bit i of match is set when control[i] == h2, bit i of empty when the slot is free
+static inline void matchGroup(const int8_t* group, int8_t h2, uint32_t& match, uint32_t& empty) {
+#ifdef ZS_HAVE_SSE2
+    __m128i ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+    match = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(h2))));
+    empty = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(CTRL_EMPTY))));
+#else
+    match = 0;
+    empty = 0;
+    for (size_t i = 0; i < GROUP_WIDTH; i++) {
+        if (group[i] == h2) match |= 1u << i;
+        if (group[i] == CTRL_EMPTY) empty |= 1u << i;
+    }
+#endif
+}
+
+// Strings are looked up by their interned object and -0 folds into 0, so
+// equal keys always have equal bits
+static inline Value normalizeKey(Value key) {
+    if (key.isString()) return Value(key.asString());
+    if (key.isNumber() && key.asNumber() == 0) return Value(0.0);
+    return key;
+}
+
+static inline uint64_t hashKey(Value key) {
+    if (key.isString()) return mixHash(key.asString()->hash);
+    return mixHash(key.raw());
+}
+
+size_t ObjHashMap::findSlot(Value key, uint64_t hash) const {
+    size_t groupMask = control.size() / GROUP_WIDTH - 1;
+    int8_t h2 = static_cast<int8_t>(hash & 0x7F);
+    size_t group = (hash >> 7) & groupMask;
+    for (size_t step = 1;; step++) {
+        size_t base = group * GROUP_WIDTH;
+        uint32_t match, empty;
+        matchGroup(&control[base], h2, match, empty);
+        while (match) {
+            size_t slot = base + lowestBit(match);
+            if (entries[slots[slot]].key.raw() == key.raw()) return slot;
+            match &= match - 1;
+        }
+        if (empty) return SIZE_MAX;
+        group = (group + step) & groupMask;
+    }
+}
+
+void ObjHashMap::insertSlot(uint32_t entryIdx, uint64_t hash) {
+    size_t groupMask = control.size() / GROUP_WIDTH - 1;
+    size_t group = (hash >> 7) & groupMask;
+    for (size_t step = 1;; step++) {
+        size_t base = group * GROUP_WIDTH;
+        uint32_t match, empty;
+        matchGroup(&control[base], 0, match, empty);
+        if (empty) {
+            size_t slot = base + lowestBit(empty);
+            control[slot] = static_cast<int8_t>(hash & 0x7F);
+            slots[slot] = entryIdx;
+            return;
+        }
+        group = (group + step) & groupMask;
+    }
+}
+
+void ObjHashMap::rehash(size_t capacity) {
+    control.assign(capacity, CTRL_EMPTY);
+    slots.assign(capacity, 0);
+    for (size_t i = 0; i < entries.size(); i++) {
+        insertSlot(static_cast<uint32_t>(i), hashKey(entries[i].key));
+    }
+}
+
+const Value* ObjHashMap::get(Value key) const {
+    int idx = find(key);
+    return idx < 0 ? nullptr : &entries[idx].value;
+}
+
+int ObjHashMap::find(Value key) const {
+    if (entries.empty()) return -1;
+    key = normalizeKey(key);
+    size_t slot = findSlot(key, hashKey(key));
+    return slot == SIZE_MAX ? -1 : static_cast<int>(slots[slot]);
+}
+
+void ObjHashMap::set(Value key, Value value) {
+    key = normalizeKey(key);
+    uint64_t hash = hashKey(key);
+    if (!entries.empty()) {
+        size_t slot = findSlot(key, hash);
+        if (slot != SIZE_MAX) {
+            entries[slots[slot]].value = value;
+            return;
+        }
+    }
+    // Keep the load factor at or below 7/8 so every probe finds an empty slot
+    if ((entries.size() + 1) * 8 > control.size() * 7) {
+        rehash(control.empty() ? GROUP_WIDTH : control.size() * 2);
+    }
+    entries.push_back({key, value});
+    insertSlot(static_cast<uint32_t>(entries.size() - 1), hash);
+    shape = shape->withKey(key);
+}
+
+static std::vector<std::unique_ptr<Shape>>& shapeStore() {
+    static std::vector<std::unique_ptr<Shape>> shapes;
+    return shapes;
+}
+
+Shape* Shape::empty() {
+    static Shape* root = [] {
+        shapeStore().push_back(std::unique_ptr<Shape>(new Shape(0)));
+        return shapeStore().back().get();
+    }();
+    return root;
+}
+
+Shape* Shape::dictionary() {
+    static Shape dict(UINT32_MAX);
+    return &dict;
+}
+
+Shape* Shape::withKey(Value key) {
+    if (this == dictionary()) return this;
+    auto it = transitions.find(key.raw());
+    if (it != transitions.end()) return it->second;
+    std::vector<std::unique_ptr<Shape>>& shapes = shapeStore();
+    if (!key.isString() || keyCount == MAX_KEYS || shapes.size() == MAX_SHAPES) return dictionary();
+    shapes.push_back(std::unique_ptr<Shape>(new Shape(keyCount + 1)));
+    Shape* next = shapes.back().get();
+    transitions[key.raw()] = next;
+    return next;
+}
+
+ObjString* StringTable::find(const std::string& chars, uint32_t hash) const {
+    if (slots.empty()) return nullptr;
+    size_t mask = slots.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        ObjString* entry = slots[i];
+        if (entry == nullptr) return nullptr;
+        if (entry != TOMBSTONE && entry->hash == hash && entry->chars == chars) return entry;
+    }
+}
+
+void StringTable::grow() {
+    // Size for the live entries only; tombstones are dropped by the rehash
+    size_t live = 0;
+    for (ObjString* entry : slots) {
+        if (entry != nullptr && entry != TOMBSTONE) live++;
+    }
+    size_t capacity = 64;
+    while (capacity * 3 < live * 8) capacity *= 2;
+    std::vector<ObjString*> old;
+    old.swap(slots);
+    slots.assign(capacity, nullptr);
+    used = 0;
+    for (ObjString* entry : old) {
+        if (entry != nullptr && entry != TOMBSTONE) insert(entry);
+    }
+}
+
+void StringTable::insert(ObjString* str) {
+    if ((used + 1) * 4 > slots.size() * 3) grow();
+    size_t mask = slots.size() - 1;
+    size_t i = str->hash & mask;
+    while (slots[i] != nullptr && slots[i] != TOMBSTONE) i = (i + 1) & mask;
+    if (slots[i] == nullptr) used++;
+    slots[i] = str;
+}
+
+void StringTable::removeUnmarked() {
+    for (ObjString*& entry : slots) {
+        if (entry != nullptr && entry != TOMBSTONE && !entry->marked) entry = TOMBSTONE;
+    }
+}
+
+Heap::Heap() : objects(nullptr), bytesAllocated(0), nextGC(INITIAL_GC_THRESHOLD) {}
+
+Heap::~Heap() {
+    Obj* obj = objects;
+    while (obj) {
+        Obj* next = obj->next;
+        freeObject(obj);
+        obj = next;
+    }
+}
+
+Heap& Heap::instance() {
+    static Heap heap;
+    return heap;
+}
+
+void Heap::link(Obj* obj, size_t size) {
+    obj->next = objects;
+    objects = obj;
+    bytesAllocated += size;
+}
+
+void Heap::freeObject(Obj* obj) {
+    switch (obj->type) {
+        case ObjType::STRING: delete static_cast<ObjString*>(obj); break;
+        case ObjType::ROPE: delete static_cast<ObjRope*>(obj); break;
+        case ObjType::ARRAY: delete static_cast<ObjArray*>(obj); break;
+        case ObjType::HASHMAP: delete static_cast<ObjHashMap*>(obj); break;
+    }
+}
+
+size_t Heap::objectSize(Obj* obj) const {
+    switch (obj->type) {
+        case ObjType::STRING:
+            return sizeof(ObjString) + static_cast<ObjString*>(obj)->chars.capacity();
+        case ObjType::ROPE:
+            return sizeof(ObjRope);
+        case ObjType::ARRAY:
+            return sizeof(ObjArray) + static_cast<ObjArray*>(obj)->elements.capacity() * sizeof(Value);
+        case ObjType::HASHMAP: {
+            const ObjHashMap* hm = static_cast<ObjHashMap*>(obj);
+            return sizeof(ObjHashMap) + hm->entries.capacity() * sizeof(ObjHashMap::Entry) +
+                   hm->control.size() * (sizeof(int8_t) + sizeof(uint32_t));
+        }
+    }
+    return 0;
+}
+
+ObjString* Heap::newString(std::string chars) {
+    uint32_t hash = hashString(chars.data(), chars.size());
+    ObjString* interned = strings.find(chars, hash);
+    if (interned) return interned;
+    auto* str = new ObjString(std::move(chars), hash);
+    link(str, sizeof(ObjString) + str->chars.capacity());
+    strings.insert(str);
+    return str;
+}
+
+static size_t objLength(Obj* obj) {
+    if (obj->type == ObjType::ROPE) return static_cast<ObjRope*>(obj)->length;
+    return static_cast<ObjString*>(obj)->chars.size();
+}
+
+Obj* Heap::concatenate(Obj* left, Obj* right) {
+    size_t length = objLength(left) + objLength(right);
+    if (length < ROPE_MIN_LENGTH) {
+        return newString(Value(left).asString()->chars + Value(right).asString()->chars);
+    }
+    auto* rope = new ObjRope(left, right, length);
+    link(rope, sizeof(ObjRope));
+    return rope;
+}
+
+ObjString* Heap::flatten(ObjRope* rope) {
+    if (rope->flat) return rope->flat;
+    std::string chars;
+    chars.reserve(rope->length);
+    // Concatenation chains are deep on the left, so walk them iteratively
+    std::vector<Obj*> pending = {rope->right, rope->left};
+    while (!pending.empty()) {
+        Obj* node = pending.back();
+        pending.pop_back();
+        if (node->type == ObjType::STRING) {
+            chars += static_cast<ObjString*>(node)->chars;
+            continue;
+        }
+        auto* inner = static_cast<ObjRope*>(node);
+        if (inner->flat) {
+            chars += inner->flat->chars;
+        } else {
+            pending.push_back(inner->right);
+            pending.push_back(inner->left);
+        }
+    }
+    rope->flat = newString(std::move(chars));
+    // The pieces are no longer needed once the flat copy exists
+    rope->left = rope->flat;
+    rope->right = nullptr;
+    return rope->flat;
+}
+
+ObjArray* Heap::newArray() {
+    auto* arr = new ObjArray();
+    link(arr, sizeof(ObjArray));
+    return arr;
+}
+
+ObjHashMap* Heap::newHashMap() {
+    auto* hm = new ObjHashMap();
+    link(hm, sizeof(ObjHashMap));
+    return hm;
+}
+
+void Heap::addRoots(GCRoots* root) {
+    roots.push_back(root);
+}
+
+void Heap::removeRoots(GCRoots* root) {
+    roots.erase(std::remove(roots.begin(), roots.end(), root), roots.end());
+}
+
+void Heap::markObject(Obj* obj) {
+    if (obj == nullptr || obj->marked) return;
+    obj->marked = true;
+    // Strings have no outgoing references, no need to trace them
+    if (obj->type != ObjType::STRING) grayStack.push_back(obj);
+}
+
+void Heap::blacken(Obj* obj) {
+    switch (obj->type) {
+        case ObjType::STRING:
+            break;
+        case ObjType::ROPE: {
+            auto* rope = static_cast<ObjRope*>(obj);
+            markObject(rope->left);
+            markObject(rope->right);
+            markObject(rope->flat);
+            break;
+        }
+        case ObjType::ARRAY: {
+            auto* arr = static_cast<ObjArray*>(obj);
+            if (!arr->isPacked()) markValues(arr->elements);
+            break;
+        }
+        case ObjType::HASHMAP:
+            for (const auto& entry : static_cast<ObjHashMap*>(obj)->entries) {
+                markValue(entry.key);
+                markValue(entry.value);
+            }
+            break;
+    }
+}
+
+void Heap::sweep() {
+    Obj** link = &objects;
+    size_t live = 0;
+    while (*link) {
+        Obj* obj = *link;
+        if (obj->marked) {
+            obj->marked = false;
+            live += objectSize(obj);
+            link = &obj->next;
+        } else {
+            *link = obj->next;
+            freeObject(obj);
+        }
+    }
+    bytesAllocated = live;
+}
+
+void Heap::collect() {
+    for (GCRoots* root : roots) {
+        root->markRoots(*this);
+    }
+    while (!grayStack.empty()) {
+        Obj* obj = grayStack.back();
+        grayStack.pop_back();
+        blacken(obj);
+    }
+    strings.removeUnmarked();
+    sweep();
+    nextGC = std::max(bytesAllocated * 2, INITIAL_GC_THRESHOLD);
+}
@@ -0,0 +1,406 @@
+#include "../include/verifier.h"
+#include "../include/native.h"
+#include <algorithm>
+
+// Index/count operands per opcode, or -1 for bytes the VM has no handler
+// for (OP_AND/OP_OR, a nested OP_WIDE and anything past the enum)
+int operandCount(OpCode op) {
+    switch (op) {
+        case OpCode::OP_CONSTANT:
+        case OpCode::OP_STRING:
+        case OpCode::OP_ARRAY:
+        case OpCode::OP_HASHMAP:
+        case OpCode::OP_GET_GLOBAL:
+        case OpCode::OP_SET_GLOBAL:
+        case OpCode::OP_GET_LOCAL:
+        case OpCode::OP_SET_LOCAL:
+        case OpCode::OP_MAKEFRAME:
+        case OpCode::OP_PRINT:
+        case OpCode::OP_SET_GLOBAL_POP:
+        case OpCode::OP_SET_LOCAL_POP:
+            return 1;
+        case OpCode::OP_CALL:
+        case OpCode::OP_CALL_NATIVE:
+        case OpCode::OP_TAIL_CALL:
+        case OpCode::OP_GET_FIELD:
+        case OpCode::OP_SET_FIELD:
+        case OpCode::OP_SET_GLOBAL_CONST:
+        case OpCode::OP_SET_LOCAL_CONST:
+        case OpCode::OP_INC_GLOBAL:
+        case OpCode::OP_INC_LOCAL:
+        case OpCode::OP_ADD_GLOBALS:
+        case OpCode::OP_ADD_LOCALS:
+            return 2;
+        case OpCode::OP_AND:
+        case OpCode::OP_OR:
+        case OpCode::OP_WIDE:
+            return -1;
+        default:
+            return static_cast<int>(op) <= static_cast<int>(OpCode::OP_LOOP_TRACE) ? 0 : -1;
+    }
+}
+
+bool isJump(OpCode op) {
+    switch (op) {
+        case OpCode::OP_JUMP:
+        case OpCode::OP_LOOP_TRACE:
+        case OpCode::OP_JUMP_IF_FALSE:
+        case OpCode::OP_POP_JUMP_IF_FALSE:
+        case OpCode::OP_JUMP_IF_NOT_LESS:
+        case OpCode::OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OpCode::OP_JUMP_IF_NOT_GREATER:
+        case OpCode::OP_JUMP_IF_NOT_GREATER_EQUAL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Instructions after which execution never reaches the next one
+bool endsPath(OpCode op) {
+    switch (op) {
+        case OpCode::OP_JUMP:
+        case OpCode::OP_LOOP_TRACE:
+        case OpCode::OP_RET:
+        case OpCode::OP_TAIL_CALL:
+        case OpCode::OP_HALT:
+        case OpCode::OP_BREAK:     // both throw
+        case OpCode::OP_CONTINUE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+namespace {
+
+struct Instr {
+    OpCode op;
+    size_t pc;    // first byte, including an OP_WIDE prefix
+    size_t next;  // first byte of the following instruction
+    int a;
+    int b;
+    long target;  // jump destination, -1 if not a jump
+};
+
+class ChunkVerifier {
+private:
+    const Chunk& chunk;
+    const std::vector<Function>& functions;
+    uint32_t globalCount;
+    uint32_t usedGlobals;  // 1 + the highest global index seen
+    bool isFunction;
+    int frameSize;  // locals reserved by the leading OP_MAKEFRAME
+    std::vector<Instr> instrs;
+    std::vector<int> instrAt;  // index into instrs by pc, -1 mid-instruction
+    std::string& error;
+
+    bool fail(size_t pc, const std::string& message) {
+        error = message + " at offset " + std::to_string(pc);
+        return false;
+    }
+
+    bool decode() {
+        const std::vector<uint8_t>& code = chunk.code;
+        instrAt.assign(code.size(), -1);
+        size_t pc = 0;
+        while (pc < code.size()) {
+            Instr instr = {};
+            instr.pc = pc;
+            instr.target = -1;
+            bool wide = code[pc] == static_cast<uint8_t>(OpCode::OP_WIDE);
+            if (wide) pc++;
+            if (pc >= code.size()) return fail(instr.pc, "truncated instruction");
+            instr.op = static_cast<OpCode>(code[pc++]);
+            int operands = operandCount(instr.op);
+            if (operands < 0) return fail(instr.pc, "unknown opcode " + std::to_string(code[pc - 1]));
+            if (wide && operands == 0) return fail(instr.pc, "wide prefix on an instruction without operands");
+            int width = wide ? 3 : 1;
+            if (pc + operands * width > code.size()) return fail(instr.pc, "truncated instruction");
+            int values[2] = {0, 0};
+            for (int i = 0; i < operands; i++) {
+                for (int j = 0; j < width; j++) values[i] = (values[i] << 8) | code[pc++];
+            }
+            instr.a = values[0];
+            instr.b = values[1];
+            if (isJump(instr.op)) {
+                if (pc + 2 > code.size()) return fail(instr.pc, "truncated instruction");
+                int offset = (code[pc] << 8) | code[pc + 1];
+                pc += 2;
+                // Only OP_JUMP goes either way; OP_LOOP_TRACE always goes back
+                if (instr.op == OpCode::OP_JUMP && (offset & 0x8000)) offset -= 0x10000;
+                if (instr.op == OpCode::OP_LOOP_TRACE) offset -= 0x10000;
+                instr.target = static_cast<long>(pc) + offset;
+                if (instr.target < 0 || instr.target >= static_cast<long>(code.size())) {
+                    return fail(instr.pc, "jump to " + std::to_string(instr.target) + " is outside the code");
+                }
+            }
+            instr.next = pc;
+            instrAt[instr.pc] = static_cast<int>(instrs.size());
+            instrs.push_back(instr);
+        }
+        for (const Instr& instr : instrs) {
+            if (instr.target >= 0 && instrAt[instr.target] < 0) {
+                return fail(instr.pc, "jump to " + std::to_string(instr.target) + " is not an instruction");
+            }
+        }
+        return true;
+    }
+
+    bool checkConstant(const Instr& in, int index) {
+        if (index >= static_cast<int>(chunk.constants.size())) {
+            return fail(in.pc, "constant " + std::to_string(index) + " out of range");
+        }
+        return true;
+    }
+
+    bool checkGlobal(const Instr& in, int index) {
+        if (static_cast<uint32_t>(index) >= globalCount) {
+            return fail(in.pc, "global " + std::to_string(index) + " out of range");
+        }
+        usedGlobals = std::max(usedGlobals, static_cast<uint32_t>(index) + 1);
+        return true;
+    }
+
+    bool checkLocal(const Instr& in, int index) {
+        if (index >= frameSize) return fail(in.pc, "local " + std::to_string(index) + " outside the frame");
+        return true;
+    }
+
+    // Table operands, and the frame: only a chunk's first instruction may
+    // be OP_MAKEFRAME
+    bool checkOperands(const Instr& in) {
+        switch (in.op) {
+            case OpCode::OP_CONSTANT:
+            case OpCode::OP_STRING:
+                return checkConstant(in, in.a);
+            case OpCode::OP_GET_GLOBAL:
+            case OpCode::OP_SET_GLOBAL:
+            case OpCode::OP_SET_GLOBAL_POP:
+                return checkGlobal(in, in.a);
+            case OpCode::OP_SET_GLOBAL_CONST:
+                return checkGlobal(in, in.a) && checkConstant(in, in.b);
+            case OpCode::OP_ADD_GLOBALS:
+                return checkGlobal(in, in.a) && checkGlobal(in, in.b);
+            case OpCode::OP_GET_LOCAL:
+            case OpCode::OP_SET_LOCAL:
+            case OpCode::OP_SET_LOCAL_POP:
+                return checkLocal(in, in.a);
+            case OpCode::OP_SET_LOCAL_CONST:
+                return checkLocal(in, in.a) && checkConstant(in, in.b);
+            case OpCode::OP_ADD_LOCALS:
+                return checkLocal(in, in.a) && checkLocal(in, in.b);
+            case OpCode::OP_INC_GLOBAL:
+            case OpCode::OP_INC_LOCAL:
+                // The fast paths add the constant without checking its type
+                if (!(in.op == OpCode::OP_INC_GLOBAL ? checkGlobal(in, in.a) : checkLocal(in, in.a)) ||
+                    !checkConstant(in, in.b)) {
+                    return false;
+                }
+                if (!chunk.constants[in.b].isNumber()) return fail(in.pc, "increment by a non-number");
+                return true;
+            case OpCode::OP_GET_FIELD:
+            case OpCode::OP_SET_FIELD:
+                if (!checkConstant(in, in.a)) return false;
+                if (!chunk.constants[in.a].isString()) return fail(in.pc, "field key is not a string");
+                if (in.b >= static_cast<int>(chunk.fieldCaches.size())) {
+                    return fail(in.pc, "field cache " + std::to_string(in.b) + " out of range");
+                }
+                return true;
+            case OpCode::OP_CALL:
+            case OpCode::OP_TAIL_CALL:
+                if (in.a >= static_cast<int>(functions.size())) {
+                    return fail(in.pc, "call to undefined function " + std::to_string(in.a));
+                }
+                return true;
+            case OpCode::OP_CALL_NATIVE: {
+                const std::vector<NativeFunction>& natives = nativeTable();
+                if (in.a >= static_cast<int>(natives.size())) {
+                    return fail(in.pc, "call to undefined native " + std::to_string(in.a));
+                }
+                // Fixed-arity natives read their arguments without checking argc
+                int arity = natives[in.a].arity;
+                if (arity >= 0 && in.b != arity) {
+                    return fail(in.pc, natives[in.a].name + "() called with " + std::to_string(in.b) +
+                                           " arguments, expects " + std::to_string(arity));
+                }
+                return true;
+            }
+            case OpCode::OP_MAKEFRAME:
+                if (in.pc != 0) return fail(in.pc, "frame set up outside a prologue");
+                return true;
+            default:
+                return true;
+        }
+    }
+
+    // Values an instruction needs on the stack and the change it makes
+    void stackEffect(const Instr& in, long& needs, long& delta) const {
+        switch (in.op) {
+            case OpCode::OP_CONSTANT:
+            case OpCode::OP_STRING:
+            case OpCode::OP_TRUE:
+            case OpCode::OP_FALSE:
+            case OpCode::OP_NULL:
+            case OpCode::OP_CONSTANT_0:
+            case OpCode::OP_CONSTANT_1:
+            case OpCode::OP_GET_GLOBAL:
+            case OpCode::OP_GET_LOCAL:
+            case OpCode::OP_ADD_GLOBALS:
+            case OpCode::OP_ADD_LOCALS:
+                needs = 0, delta = 1;
+                return;
+            case OpCode::OP_ARRAY:
+                needs = in.a, delta = 1 - static_cast<long>(in.a);
+                return;
+            case OpCode::OP_HASHMAP:
+                needs = 2L * in.a, delta = 1 - 2L * in.a;
+                return;
+            case OpCode::OP_INDEX_SET:
+                needs = 3, delta = -2;
+                return;
+            case OpCode::OP_NEGATE:
+            case OpCode::OP_NOT:
+            case OpCode::OP_GET_FIELD:
+            case OpCode::OP_SET_GLOBAL:
+            case OpCode::OP_SET_LOCAL:
+            case OpCode::OP_JUMP_IF_FALSE:
+                needs = 1, delta = 0;
+                return;
+            case OpCode::OP_SET_GLOBAL_POP:
+            case OpCode::OP_SET_LOCAL_POP:
+            case OpCode::OP_POP_JUMP_IF_FALSE:
+            case OpCode::OP_POP:
+            case OpCode::OP_RET:
+                needs = 1, delta = -1;
+                return;
+            case OpCode::OP_SET_FIELD:
+            case OpCode::OP_JUMP_IF_NOT_LESS:
+            case OpCode::OP_JUMP_IF_NOT_LESS_EQUAL:
+            case OpCode::OP_JUMP_IF_NOT_GREATER:
+            case OpCode::OP_JUMP_IF_NOT_GREATER_EQUAL:
+                needs = 2, delta = -2;
+                return;
+            case OpCode::OP_INDEX_GET:
+            case OpCode::OP_INDEX_GET_ARRAY:
+            case OpCode::OP_ADD:
+            case OpCode::OP_ADD_NUM:
+            case OpCode::OP_ADD_INT:
+            case OpCode::OP_SUBTRACT:
+            case OpCode::OP_SUB_INT:
+            case OpCode::OP_MULTIPLY:
+            case OpCode::OP_MUL_INT:
+            case OpCode::OP_DIVIDE:
+            case OpCode::OP_LESS:
+            case OpCode::OP_GREATER:
+            case OpCode::OP_LESS_EQUAL:
+            case OpCode::OP_GREATER_EQUAL:
+            case OpCode::OP_EQUAL:
+            case OpCode::OP_EQUAL_NUM:
+            case OpCode::OP_NOT_EQUAL:
+            case OpCode::OP_NOT_EQUAL_NUM:
+                needs = 2, delta = -1;
+                return;
+            case OpCode::OP_CALL:
+            case OpCode::OP_CALL_NATIVE:
+                needs = in.b, delta = 1 - static_cast<long>(in.b);
+                return;
+            case OpCode::OP_TAIL_CALL:
+                needs = in.b, delta = -static_cast<long>(in.b);
+                return;
+            case OpCode::OP_PRINT:
+                needs = in.a, delta = -static_cast<long>(in.a);
+                return;
+            default:
+                needs = 0, delta = 0;
+                return;
+        }
+    }
+
+public:
+    ChunkVerifier(const Chunk& chunk, const std::vector<Function>& functions, uint32_t globalCount,
+                  bool isFunction, std::string& error)
+        : chunk(chunk), functions(functions), globalCount(globalCount), usedGlobals(0), isFunction(isFunction),
+          frameSize(0), error(error) {}
+
+    uint32_t globalsUsed() const { return usedGlobals; }
+
+    // Depths count operand slots above the frame: the slots OP_MAKEFRAME
+    // reserves, or the bottom of the stack in a main chunk without one
+    bool verify(uint32_t& maxStack) {
+        if (chunk.code.empty()) return fail(0, "empty chunk");
+        if (!decode()) return false;
+        // The main chunk only has a frame when it keeps temporaries
+        if (instrs[0].op == OpCode::OP_MAKEFRAME) {
+            frameSize = instrs[0].a;
+        } else if (isFunction) {
+            return fail(0, "function without a frame");
+        }
+        for (const Instr& in : instrs) {
+            if (!checkOperands(in)) return false;
+        }
+
+        std::vector<long> depthAt(instrs.size(), -1);
+        std::vector<int> worklist;
+        depthAt[0] = 0;
+        worklist.push_back(0);
+        long maxDepth = 0;
+        while (!worklist.empty()) {
+            int index = worklist.back();
+            worklist.pop_back();
+            const Instr& in = instrs[index];
+            long depth = depthAt[index];
+            long needs, delta;
+            stackEffect(in, needs, delta);
+            // A top-level return stops the script before it pops anything
+            if (in.op == OpCode::OP_RET && !isFunction) needs = 0, delta = 0;
+            if (depth < needs) return fail(in.pc, "stack underflow");
+            depth += delta;
+            maxDepth = std::max(maxDepth, depth);
+
+            int successors[2];
+            int count = 0;
+            if (in.target >= 0) successors[count++] = instrAt[in.target];
+            if (!endsPath(in.op)) {
+                if (in.next >= chunk.code.size()) return fail(in.pc, "execution runs off the end of the code");
+                successors[count++] = instrAt[in.next];
+            }
+            for (int i = 0; i < count; i++) {
+                long& seen = depthAt[successors[i]];
+                if (seen == -1) {
+                    seen = depth;
+                    worklist.push_back(successors[i]);
+                } else if (seen != depth) {
+                    return fail(instrs[successors[i]].pc, "stack depth " + std::to_string(depth) +
+                                                              " differs from " + std::to_string(seen) +
+                                                              " on another path");
+                }
+            }
+        }
+        maxStack = static_cast<uint32_t>(maxDepth);
+        return true;
+    }
+};
+
+}  // namespace
+
+bool verifyProgram(Chunk& mainChunk, std::vector<Function>& functions, std::string* error,
+                   uint32_t* globalsUsed) {
+    std::string reason;
+    ChunkVerifier verifier(mainChunk, functions, mainChunk.globalCount, false, reason);
+    if (!verifier.verify(mainChunk.maxStack)) {
+        if (error) *error = "main chunk: " + reason;
+        return false;
+    }
+    uint32_t used = verifier.globalsUsed();
+    for (Function& func : functions) {
+        ChunkVerifier funcVerifier(func.chunk, functions, mainChunk.globalCount, true, reason);
+        if (!funcVerifier.verify(func.chunk.maxStack)) {
+            if (error) *error = "function " + func.name + ": " + reason;
+            return false;
+        }
+        used = std::max(used, funcVerifier.globalsUsed());
+    }
+    if (globalsUsed) *globalsUsed = used;
+    return true;
+}
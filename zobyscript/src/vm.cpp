@@ -1,560 +1,844 @@
 #include "../include/vm.h"
-#include <iostream>
-#include <fstream>
-#include <sstream>
+#include "../include/runtime.h"
+#include "../include/native.h"
+#include "../include/jit.h"
+#include "../include/trace_jit.h"
+#include "../include/verifier.h"
 #include <stdexcept>
-#include <cmath>
 #include <algorithm>
-#include <cstdlib>
-#include <cstdio>
+#include <iostream>
+
+VM::VM(size_t stackSlots)
+    : stack(stackSlots), globalsVersion(0), functions(nullptr), mainChunk(nullptr), optimizationsEnabled(true),
+      jitEnabled(false), running(false) {
+    sp = stack.data();
+    stackEnd = stack.data() + stack.size();
+    bp = sp;
+    // Also scaled from the stack size, so recursion that never grows the
+    // value stack (no arguments or locals) still overflows cleanly
+    maxFrames = std::max<size_t>(stackSlots / 4, 1);
+    frames.reserve(std::min<size_t>(maxFrames, 1024));
+    Heap::instance().addRoots(this);
+}
+
+VM::~VM() {
+    Heap::instance().removeRoots(this);
+}
+
+void VM::enableTraceJit(bool enable) {
+    if (enable && !tracer) tracer.reset(new TraceJit());
+    if (!enable) tracer.reset();
+}
 
-VM::VM() : ip(0), bp(0), optimizationsEnabled(true) {
-    globals.resize(256);
-    globalCaches.resize(256);
+void VM::markRoots(Heap& heap) {
+    for (const Value* slot = stack.data(); slot < sp; slot++) {
+        heap.markValue(*slot);
+    }
+    heap.markValues(globals);
+    for (const Value& reg : fastReg) {
+        heap.markValue(reg);
+    }
+    if (mainChunk) heap.markValues(mainChunk->constants);
+    if (functions) {
+        for (const Function& func : *functions) {
+            heap.markValues(func.chunk.constants);
+        }
+    }
 }
 
 void VM::push(const Value& value) {
-    stack.push_back(value);
+    if (sp == stackEnd) throw std::runtime_error("Stack overflow");
+    *sp++ = value;
 }
 
 Value VM::pop() {
-    if (stack.empty()) throw std::runtime_error("Stack underflow");
-    Value value = stack.back();
-    stack.pop_back();
-    return value;
+    if (sp == stack.data()) throw std::runtime_error("Stack underflow");
+    return *--sp;
 }
 
 Value VM::peek(int offset) {
-    return stack[stack.size() - 1 - offset];
+    return sp[-1 - offset];
 }
 
-bool VM::isTruthy(const Value& value) {
-    if (value.type == Value::BOOLEAN) return value.boolean;
-    if (value.type == Value::NUMBER) return value.number != 0;
-    if (value.type == Value::STRING) return !value.string.empty();
-    if (value.type == Value::ARRAY) return value.array && !value.array->empty();
-    return false;
+// Gives every global the program names a slot before any code runs.
+// Values the host set beforehand are kept.
+void VM::link(const Chunk& mainChunk) {
+    if (mainChunk.globalCount > globals.size()) {
+        globals.resize(mainChunk.globalCount);
+        globalsVersion++;
+    }
 }
 
-Value VM::callBuiltin(const std::string& name, const std::vector<Value>& args) {
-    if (name == "len") {
-        if (args[0].type == Value::ARRAY) return Value(static_cast<double>(args[0].array->size()));
-        if (args[0].type == Value::STRING) return Value(static_cast<double>(args[0].string.length()));
-        return Value(0.0);
-    }
-    if (name == "push" && args.size() == 2 && args[0].type == Value::ARRAY) {
-        args[0].array->push_back(args[1]);
-        return args[0];
-    }
-    if (name == "pop" && args[0].type == Value::ARRAY && !args[0].array->empty()) {
-        Value val = args[0].array->back();
-        args[0].array->pop_back();
-        return val;
-    }
-    if (name == "sqrt") return Value(std::sqrt(args[0].number));
-    if (name == "pow" && args.size() == 2) return Value(std::pow(args[0].number, args[1].number));
-    if (name == "abs") return Value(std::abs(args[0].number));
-    if (name == "floor") return Value(std::floor(args[0].number));
-    if (name == "ceil") return Value(std::ceil(args[0].number));
-    if (name == "sin") return Value(std::sin(args[0].number));
-    if (name == "cos") return Value(std::cos(args[0].number));
-    if (name == "tan") return Value(std::tan(args[0].number));
-    if (name == "random") return Value(static_cast<double>(rand()) / RAND_MAX);
-    if (name == "min" && args.size() == 2) return Value(std::min(args[0].number, args[1].number));
-    if (name == "max" && args.size() == 2) return Value(std::max(args[0].number, args[1].number));
-    if (name == "round") return Value(std::round(args[0].number));
-    if (name == "str" && args.size() == 1) {
-        if (args[0].type == Value::NUMBER) {
-            return Value(std::to_string(static_cast<int>(args[0].number)));
-        } else if (args[0].type == Value::BOOLEAN) {
-            return Value(args[0].boolean ? "true" : "false");
-        }
-        return args[0];
-    }
-    if (name == "num" && args.size() == 1 && args[0].type == Value::STRING) {
-        try {
-            return Value(std::stod(args[0].string));
-        } catch (...) {
-            return Value(0.0);
-        }
-    }
-    if (name == "type" && args.size() == 1) {
-        if (args[0].type == Value::NUMBER) return Value("number");
-        if (args[0].type == Value::STRING) return Value("string");
-        if (args[0].type == Value::BOOLEAN) return Value("boolean");
-        if (args[0].type == Value::ARRAY) return Value("array");
-    }
-    if (name == "input" && args.size() >= 1 && args[0].type == Value::STRING) {
-        std::cout << args[0].string;
-        std::string input;
-        std::getline(std::cin, input);
-        return Value(input);
-    }
-    if (name == "upper" && args.size() == 1 && args[0].type == Value::STRING) {
-        std::string result = args[0].string;
-        for (char& c : result) c = std::toupper(c);
-        return Value(result);
-    }
-    if (name == "lower" && args.size() == 1 && args[0].type == Value::STRING) {
-        std::string result = args[0].string;
-        for (char& c : result) c = std::tolower(c);
-        return Value(result);
-    }
-    if (name == "split" && args.size() == 2 && args[0].type == Value::STRING && args[1].type == Value::STRING) {
-        auto* arr = new std::vector<Value>();
-        std::string str = args[0].string;
-        std::string delim = args[1].string;
-        size_t pos = 0;
-        while ((pos = str.find(delim)) != std::string::npos) {
-            arr->push_back(Value(str.substr(0, pos)));
-            str.erase(0, pos + delim.length());
-        }
-        if (!str.empty()) arr->push_back(Value(str));
-        return Value(arr);
-    }
-    if (name == "join" && args.size() == 2 && args[0].type == Value::ARRAY && args[1].type == Value::STRING) {
-        std::string result;
-        for (size_t i = 0; i < args[0].array->size(); i++) {
-            if ((*args[0].array)[i].type == Value::STRING) {
-                result += (*args[0].array)[i].string;
-            }
-            if (i < args[0].array->size() - 1) result += args[1].string;
-        }
-        return Value(result);
-    }
-    if (name == "keys" && args.size() == 1 && args[0].type == Value::HASHMAP) {
-        auto* arr = new std::vector<Value>();
-        for (const auto& pair : *args[0].hashmap) {
-            arr->push_back(Value(pair.first));
-        }
-        return Value(arr);
-    }
-    if (name == "values" && args.size() == 1 && args[0].type == Value::HASHMAP) {
-        auto* arr = new std::vector<Value>();
-        for (const auto& pair : *args[0].hashmap) {
-            arr->push_back(pair.second);
-        }
-        return Value(arr);
-    }
-    if (name == "read" && args.size() == 1 && args[0].type == Value::STRING) {
-        std::ifstream file(args[0].string);
-        if (!file.is_open()) return Value::Null();
-        std::stringstream buffer;
-        buffer << file.rdbuf();
-        return Value(buffer.str());
-    }
-    if (name == "write" && args.size() == 2 && args[0].type == Value::STRING && args[1].type == Value::STRING) {
-        std::ofstream file(args[0].string);
-        if (!file.is_open()) return Value(false);
-        file << args[1].string;
-        file.close();
-        return Value(true);
-    }
-    if (name == "append" && args.size() == 2 && args[0].type == Value::STRING && args[1].type == Value::STRING) {
-        std::ofstream file(args[0].string, std::ios::app);
-        if (!file.is_open()) return Value(false);
-        file << args[1].string;
-        file.close();
-        return Value(true);
-    }
-    if (name == "exists" && args.size() == 1 && args[0].type == Value::STRING) {
-        std::ifstream file(args[0].string);
-        return Value(file.good());
-    }
-    if (name == "delete" && args.size() == 1 && args[0].type == Value::STRING) {
-        return Value(std::remove(args[0].string.c_str()) == 0);
+Value VM::getGlobal(int slot) const {
+    if (slot < 0 || slot >= static_cast<int>(globals.size())) return Value(0.0);
+    return globals[slot];
+}
+
+void VM::setGlobal(int slot, const Value& value) {
+    if (slot < 0) throw std::runtime_error("Invalid global slot");
+    if (slot >= static_cast<int>(globals.size())) {
+        // Growing would move the slots out from under the running program
+        if (running) throw std::runtime_error("Global slot " + std::to_string(slot) + " is not linked");
+        globals.resize(slot + 1);
     }
-    return Value(0.0);
+    globals[slot] = value;
+    globalsVersion++;
 }
 
-void VM::executeChunk(const Chunk& chunk) {
-    ip = 0;
-    
-    while (ip < chunk.code.size()) {
-        OpCode op = static_cast<OpCode>(chunk.code[ip++]);
-        
-        switch (op) {
-            case OpCode::OP_CONSTANT: {
-                int constIdx = chunk.code[ip++];
-                push(chunk.constants[constIdx]);
-                break;
-            }
-            case OpCode::OP_CONSTANT_0: {
-                push(Value(0.0));
-                break;
-            }
-            case OpCode::OP_CONSTANT_1: {
-                push(Value(1.0));
-                break;
-            }
-            case OpCode::OP_STRING: {
-                int constIdx = chunk.code[ip++];
-                push(chunk.constants[constIdx]);
-                break;
-            }
-            case OpCode::OP_TRUE: {
-                push(Value(true));
-                break;
-            }
-            case OpCode::OP_FALSE: {
-                push(Value(false));
-                break;
-            }
-            case OpCode::OP_ARRAY: {
-                int size = chunk.code[ip++];
-                auto* arr = new std::vector<Value>();
-                for (int i = size - 1; i >= 0; i--) {
-                    arr->insert(arr->begin(), pop());
-                }
-                push(Value(arr));
-                break;
-            }
-            case OpCode::OP_INDEX_GET: {
-                Value index = pop();
-                Value array = pop();
-                if (array.type == Value::HASHMAP && index.type == Value::STRING) {
-                    if (array.hashmap->find(index.string) != array.hashmap->end()) {
-                        push((*array.hashmap)[index.string]);
-                    } else {
-                        push(Value::Null());
-                    }
-                } else if (array.type == Value::ARRAY && index.type == Value::NUMBER) {
-                    int idx = static_cast<int>(index.number);
-                    if (idx >= 0 && idx < static_cast<int>(array.array->size())) {
-                        push((*array.array)[idx]);
-                    } else {
-                        push(Value(0.0));
-                    }
-                } else if (array.type == Value::STRING && index.type == Value::NUMBER) {
-                    int idx = static_cast<int>(index.number);
-                    if (idx >= 0 && idx < static_cast<int>(array.string.length())) {
-                        push(Value(std::string(1, array.string[idx])));
-                    } else {
-                        push(Value(""));
-                    }
+// Case bodies are shared between the two dispatch strategies. With GCC and
+// Clang each handler jumps straight to the next one through a label table;
+// elsewhere, or with ZS_SWITCH_DISPATCH defined, DISPATCH() falls back to
+// the switch.
+#if defined(__GNUC__) && !defined(ZS_SWITCH_DISPATCH)
+#define ZS_COMPUTED_GOTO 1
+#endif
+
+#ifdef ZS_COMPUTED_GOTO
+#define VM_CASE(op) L_##op:
+#define DISPATCH() goto *dispatchTable[*ip++]
+#else
+#define VM_CASE(op) case OpCode::op:
+#define DISPATCH() break
+#endif
+
+// Swaps the opcode of the executing operand-less instruction. Quickened
+// handlers that miss their guard rewrite back to the generic form and
+// re-dispatch it with REDISPATCH().
+#define REWRITE(op) (ip[-1] = static_cast<uint8_t>(OpCode::op))
+#define REDISPATCH() \
+    {                \
+        ip--;        \
+        DISPATCH();  \
+    }
+
+// Reads a 24-bit operand after an OP_WIDE prefix
+#define WIDE_OPERAND() (ip += 3, (ip[-3] << 16) | (ip[-2] << 8) | ip[-1])
+
+// Verified code can neither pop below its frame nor push past the room
+// OP_MAKEFRAME checked for, so the unchecked loop touches the stack directly
+#define PUSH(value) (Checked ? push(value) : void(*sp++ = (value)))
+#define POP() (Checked ? pop() : *--sp)
+
+template <bool Checked>
+void VM::executeChunk(Chunk& entry) {
+    // Compiled and loaded chunks always end in OP_HALT or OP_RET, so the
+    // loop needs no bounds test. Calls and returns switch chunk and ip in
+    // place rather than recursing.
+    Chunk* chunk = &entry;
+    uint8_t* ip = chunk->code.data();
+    const NativeFunction* const natives = nativeTable().data();
+    // Sized at link time; setGlobal refuses to grow it while code runs
+    Value* const globalSlots = globals.data();
+
+#ifdef ZS_COMPUTED_GOTO
+    // Indexed by OpCode; keep in the same order as the enum
+    static void* const dispatchTable[] = {
+        &&L_OP_CONSTANT, &&L_OP_STRING, &&L_OP_TRUE, &&L_OP_FALSE, &&L_OP_NULL, &&L_OP_ARRAY,
+        &&L_OP_HASHMAP, &&L_OP_INDEX_GET, &&L_OP_INDEX_SET, &&L_OP_ADD, &&L_OP_SUBTRACT,
+        &&L_OP_MULTIPLY, &&L_OP_DIVIDE, &&L_OP_NEGATE, &&L_OP_NOT, &&L_OP_LESS, &&L_OP_GREATER,
+        &&L_OP_LESS_EQUAL, &&L_OP_GREATER_EQUAL, &&L_OP_EQUAL, &&L_OP_NOT_EQUAL, &&L_OP_UNKNOWN,
+        &&L_OP_UNKNOWN, &&L_OP_GET_GLOBAL, &&L_OP_SET_GLOBAL, &&L_OP_GET_LOCAL, &&L_OP_SET_LOCAL,
+        &&L_OP_JUMP, &&L_OP_JUMP_IF_FALSE, &&L_OP_BREAK, &&L_OP_CONTINUE, &&L_OP_CALL, &&L_OP_RET,
+        &&L_OP_MAKEFRAME, &&L_OP_POPFRAME, &&L_OP_PRINT, &&L_OP_POP, &&L_OP_HALT, &&L_OP_ADD_INT,
+        &&L_OP_SUB_INT, &&L_OP_MUL_INT, &&L_OP_CONSTANT_0, &&L_OP_CONSTANT_1,
+        &&L_OP_SET_GLOBAL_POP, &&L_OP_SET_LOCAL_POP,
+        &&L_OP_SET_GLOBAL_CONST, &&L_OP_SET_LOCAL_CONST, &&L_OP_INC_GLOBAL, &&L_OP_INC_LOCAL,
+        &&L_OP_ADD_GLOBALS, &&L_OP_ADD_LOCALS, &&L_OP_POP_JUMP_IF_FALSE, &&L_OP_JUMP_IF_NOT_LESS,
+        &&L_OP_JUMP_IF_NOT_LESS_EQUAL, &&L_OP_JUMP_IF_NOT_GREATER, &&L_OP_JUMP_IF_NOT_GREATER_EQUAL,
+        &&L_OP_ADD_NUM, &&L_OP_EQUAL_NUM, &&L_OP_NOT_EQUAL_NUM, &&L_OP_INDEX_GET_ARRAY, &&L_OP_WIDE,
+        &&L_OP_CALL_NATIVE, &&L_OP_TAIL_CALL, &&L_OP_GET_FIELD, &&L_OP_SET_FIELD,
+        &&L_OP_LOOP_TRACE
+    };
+    static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) ==
+                      static_cast<size_t>(OpCode::OP_LOOP_TRACE) + 1,
+                  "dispatch table out of sync with OpCode");
+    DISPATCH();
+#else
+    for (;;) {
+        switch (static_cast<OpCode>(*ip++)) {
+#endif
+            VM_CASE(OP_CONSTANT) {
+                int constIdx = *ip++;
+                PUSH(chunk->constants[constIdx]);
+                DISPATCH();
+            }
+            VM_CASE(OP_CONSTANT_0) {
+                PUSH(Value(0.0));
+                DISPATCH();
+            }
+            VM_CASE(OP_CONSTANT_1) {
+                PUSH(Value(1.0));
+                DISPATCH();
+            }
+            VM_CASE(OP_STRING) {
+                int constIdx = *ip++;
+                PUSH(chunk->constants[constIdx]);
+                DISPATCH();
+            }
+            VM_CASE(OP_TRUE) {
+                PUSH(Value(true));
+                DISPATCH();
+            }
+            VM_CASE(OP_FALSE) {
+                PUSH(Value(false));
+                DISPATCH();
+            }
+            VM_CASE(OP_NULL) {
+                PUSH(Value::Null());
+                DISPATCH();
+            }
+            VM_CASE(OP_ARRAY) {
+                int size = *ip++;
+                ObjArray* arr = Heap::instance().newArray();
+                arr->assign(sp - size, sp);
+                sp -= size;
+                PUSH(Value(arr));
+                collectIfNeeded();
+                DISPATCH();
+            }
+            VM_CASE(OP_HASHMAP) {
+                int size = *ip++;
+                ObjHashMap* hm = Heap::instance().newHashMap();
+                for (Value* pair = sp - size * 2; pair < sp; pair += 2) {
+                    hm->set(pair[0], pair[1]);
                 }
-                break;
-            }
-            case OpCode::OP_INDEX_SET: {
-                Value value = pop();
-                Value index = pop();
-                Value array = pop();
-                if (array.type == Value::ARRAY && index.type == Value::NUMBER) {
-                    int idx = static_cast<int>(index.number);
-                    if (idx >= 0 && idx < static_cast<int>(array.array->size())) {
-                        (*array.array)[idx] = value;
-                    }
+                sp -= size * 2;
+                PUSH(Value(hm));
+                collectIfNeeded();
+                DISPATCH();
+            }
+            VM_CASE(OP_INDEX_GET) {
+                Value index = POP();
+                Value array = POP();
+                if (array.isArray() && index.isNumber()) REWRITE(OP_INDEX_GET_ARRAY);
+                PUSH(indexGet(array, index));
+                if (array.isString()) collectIfNeeded();
+                DISPATCH();
+            }
+            // The quickened forms work on the stack top in place: the
+            // compiler guarantees their operands, so no bounds checks
+            VM_CASE(OP_INDEX_GET_ARRAY) {
+                Value array = sp[-2];
+                Value index = sp[-1];
+                if (!array.isArray() || !index.isNumber()) {
+                    REWRITE(OP_INDEX_GET);
+                    REDISPATCH();
                 }
-                push(array);
-                break;
-            }
-            case OpCode::OP_ADD: {
-                Value b = pop();
-                Value a = pop();
-                if (a.type == Value::STRING || b.type == Value::STRING) {
-                    std::string result;
-                    if (a.type == Value::STRING) result += a.string;
-                    else if (a.type == Value::NUMBER) result += std::to_string(static_cast<int>(a.number));
-                    if (b.type == Value::STRING) result += b.string;
-                    else if (b.type == Value::NUMBER) result += std::to_string(static_cast<int>(b.number));
-                    push(Value(result));
+                const std::vector<Value>& elements = array.asArray()->elements;
+                int idx = static_cast<int>(index.asNumber());
+                sp[-2] = idx >= 0 && idx < static_cast<int>(elements.size()) ? elements[idx] : Value(0.0);
+                sp--;
+                DISPATCH();
+            }
+            VM_CASE(OP_INDEX_SET) {
+                Value value = POP();
+                Value index = POP();
+                Value array = POP();
+                indexSet(array, index, value);
+                PUSH(array);
+                collectIfNeeded();
+                DISPATCH();
+            }
+            // A record whose shape the site has seen is one compare and a
+            // load; everything else goes through the runtime, which
+            // refills the cache
+            VM_CASE(OP_GET_FIELD) {
+                const Value& key = chunk->constants[*ip++];
+                FieldCache& cache = chunk->fieldCaches[*ip++];
+                Value container = sp[-1];
+                if (container.isHashMap() && container.asHashMap()->shape == cache.shape) {
+                    sp[-1] = container.asHashMap()->entries[cache.index].value;
                 } else {
-                    push(Value(a.number + b.number));
+                    sp[-1] = getField(container, key, cache);
                 }
-                break;
-            }
-            case OpCode::OP_ADD_INT: {
-                Value b = pop();
-                Value a = pop();
-                int result = static_cast<int>(a.number) + static_cast<int>(b.number);
-                push(Value(static_cast<double>(result)));
-                break;
-            }
-            case OpCode::OP_SUBTRACT: {
-                Value b = pop();
-                Value a = pop();
-                push(Value(a.number - b.number));
-                break;
-            }
-            case OpCode::OP_SUB_INT: {
-                Value b = pop();
-                Value a = pop();
-                int result = static_cast<int>(a.number) - static_cast<int>(b.number);
-                push(Value(static_cast<double>(result)));
-                break;
-            }
-            case OpCode::OP_MULTIPLY: {
-                Value b = pop();
-                Value a = pop();
-                push(Value(a.number * b.number));
-                break;
-            }
-            case OpCode::OP_MUL_INT: {
-                Value b = pop();
-                Value a = pop();
-                int result = static_cast<int>(a.number) * static_cast<int>(b.number);
-                push(Value(static_cast<double>(result)));
-                break;
-            }
-            case OpCode::OP_DIVIDE: {
-                Value b = pop();
-                Value a = pop();
-                if (b.number == 0) throw std::runtime_error("Division by zero");
-                push(Value(a.number / b.number));
-                break;
-            }
-            case OpCode::OP_NEGATE: {
-                Value a = pop();
-                push(Value(-a.number));
-                break;
-            }
-            case OpCode::OP_NOT: {
-                Value a = pop();
-                push(Value(!isTruthy(a)));
-                break;
-            }
-            case OpCode::OP_LESS: {
-                Value b = pop();
-                Value a = pop();
-                push(Value(a.number < b.number));
-                break;
-            }
-            case OpCode::OP_GREATER: {
-                Value b = pop();
-                Value a = pop();
-                push(Value(a.number > b.number));
-                break;
-            }
-            case OpCode::OP_LESS_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(Value(a.number <= b.number));
-                break;
-            }
-            case OpCode::OP_GREATER_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(Value(a.number >= b.number));
-                break;
-            }
-            case OpCode::OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                if (a.type != b.type) {
-                    push(Value(false));
-                } else if (a.type == Value::NUMBER) {
-                    push(Value(a.number == b.number));
-                } else if (a.type == Value::STRING) {
-                    push(Value(a.string == b.string));
+                DISPATCH();
+            }
+            VM_CASE(OP_SET_FIELD) {
+                const Value& key = chunk->constants[*ip++];
+                FieldCache& cache = chunk->fieldCaches[*ip++];
+                Value container = sp[-2];
+                if (container.isHashMap() && container.asHashMap()->shape == cache.shape) {
+                    container.asHashMap()->entries[cache.index].value = sp[-1];
+                    sp -= 2;
                 } else {
-                    push(Value(a.boolean == b.boolean));
+                    setField(container, key, sp[-1], cache);
+                    sp -= 2;
+                    collectIfNeeded();
                 }
-                break;
-            }
-            case OpCode::OP_NOT_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                if (a.type != b.type) {
-                    push(Value(true));
-                } else if (a.type == Value::NUMBER) {
-                    push(Value(a.number != b.number));
-                } else if (a.type == Value::STRING) {
-                    push(Value(a.string != b.string));
+                DISPATCH();
+            }
+            VM_CASE(OP_ADD) {
+                Value b = POP();
+                Value a = POP();
+                if (a.isNumber() && b.isNumber()) {
+                    REWRITE(OP_ADD_NUM);
+                    PUSH(Value(a.asNumber() + b.asNumber()));
                 } else {
-                    push(Value(a.boolean != b.boolean));
+                    PUSH(addValues(a, b));
+                    collectIfNeeded();
                 }
-                break;
-            }
-            case OpCode::OP_GET_GLOBAL: {
-                int globalIdx = chunk.code[ip++];
-                if (globalIdx < static_cast<int>(globals.size())) {
-                    push(globals[globalIdx]);
-                } else {
-                    push(Value(0.0));
+                DISPATCH();
+            }
+            VM_CASE(OP_ADD_NUM) {
+                Value a = sp[-2];
+                Value b = sp[-1];
+                if (!a.isNumber() || !b.isNumber()) {
+                    REWRITE(OP_ADD);
+                    REDISPATCH();
                 }
-                break;
-            }
-            case OpCode::OP_GET_GLOBAL_CACHED: {
-                int cacheIdx = chunk.code[ip++];
-                if (cacheIdx < static_cast<int>(globalCaches.size()) && globalCaches[cacheIdx].valid) {
-                    push(globalCaches[cacheIdx].cachedValue);
-                } else {
-                    int globalIdx = chunk.code[ip++];
-                    if (globalIdx < static_cast<int>(globals.size())) {
-                        push(globals[globalIdx]);
-                        if (cacheIdx < static_cast<int>(globalCaches.size())) {
-                            globalCaches[cacheIdx].cachedValue = globals[globalIdx];
-                            globalCaches[cacheIdx].valid = true;
-                        }
-                    } else {
-                        push(Value(0.0));
-                    }
+                sp[-2] = Value(a.asNumber() + b.asNumber());
+                sp--;
+                DISPATCH();
+            }
+            VM_CASE(OP_ADD_INT) {
+                Value b = POP();
+                Value a = POP();
+                int result = static_cast<int>(toNumber(a)) + static_cast<int>(toNumber(b));
+                PUSH(Value(static_cast<double>(result)));
+                DISPATCH();
+            }
+            VM_CASE(OP_SUBTRACT) {
+                Value b = POP();
+                Value a = POP();
+                PUSH(Value(toNumber(a) - toNumber(b)));
+                DISPATCH();
+            }
+            VM_CASE(OP_SUB_INT) {
+                Value b = POP();
+                Value a = POP();
+                int result = static_cast<int>(toNumber(a)) - static_cast<int>(toNumber(b));
+                PUSH(Value(static_cast<double>(result)));
+                DISPATCH();
+            }
+            VM_CASE(OP_MULTIPLY) {
+                Value b = POP();
+                Value a = POP();
+                PUSH(Value(toNumber(a) * toNumber(b)));
+                DISPATCH();
+            }
+            VM_CASE(OP_MUL_INT) {
+                Value b = POP();
+                Value a = POP();
+                int result = static_cast<int>(toNumber(a)) * static_cast<int>(toNumber(b));
+                PUSH(Value(static_cast<double>(result)));
+                DISPATCH();
+            }
+            VM_CASE(OP_DIVIDE) {
+                Value b = POP();
+                Value a = POP();
+                if (toNumber(b) == 0) throw std::runtime_error("Division by zero");
+                PUSH(Value(toNumber(a) / toNumber(b)));
+                DISPATCH();
+            }
+            VM_CASE(OP_NEGATE) {
+                Value a = POP();
+                PUSH(Value(-toNumber(a)));
+                DISPATCH();
+            }
+            VM_CASE(OP_NOT) {
+                Value a = POP();
+                PUSH(Value(!isTruthy(a)));
+                DISPATCH();
+            }
+            VM_CASE(OP_LESS) {
+                Value b = POP();
+                Value a = POP();
+                PUSH(Value(toNumber(a) < toNumber(b)));
+                DISPATCH();
+            }
+            VM_CASE(OP_GREATER) {
+                Value b = POP();
+                Value a = POP();
+                PUSH(Value(toNumber(a) > toNumber(b)));
+                DISPATCH();
+            }
+            VM_CASE(OP_LESS_EQUAL) {
+                Value b = POP();
+                Value a = POP();
+                PUSH(Value(toNumber(a) <= toNumber(b)));
+                DISPATCH();
+            }
+            VM_CASE(OP_GREATER_EQUAL) {
+                Value b = POP();
+                Value a = POP();
+                PUSH(Value(toNumber(a) >= toNumber(b)));
+                DISPATCH();
+            }
+            VM_CASE(OP_EQUAL) {
+                Value b = POP();
+                Value a = POP();
+                if (a.isNumber() && b.isNumber()) REWRITE(OP_EQUAL_NUM);
+                PUSH(Value(valuesEqual(a, b)));
+                DISPATCH();
+            }
+            VM_CASE(OP_EQUAL_NUM) {
+                Value a = sp[-2];
+                Value b = sp[-1];
+                if (!a.isNumber() || !b.isNumber()) {
+                    REWRITE(OP_EQUAL);
+                    REDISPATCH();
                 }
-                break;
-            }
-            case OpCode::OP_SET_GLOBAL: {
-                int globalIdx = chunk.code[ip++];
-                if (globalIdx >= static_cast<int>(globals.size())) {
-                    globals.resize(globalIdx + 1);
+                sp[-2] = Value(a.asNumber() == b.asNumber());
+                sp--;
+                DISPATCH();
+            }
+            VM_CASE(OP_NOT_EQUAL) {
+                Value b = POP();
+                Value a = POP();
+                if (a.isNumber() && b.isNumber()) REWRITE(OP_NOT_EQUAL_NUM);
+                PUSH(Value(!valuesEqual(a, b)));
+                DISPATCH();
+            }
+            VM_CASE(OP_NOT_EQUAL_NUM) {
+                Value a = sp[-2];
+                Value b = sp[-1];
+                if (!a.isNumber() || !b.isNumber()) {
+                    REWRITE(OP_NOT_EQUAL);
+                    REDISPATCH();
                 }
-                globals[globalIdx] = peek(0);
-                if (globalIdx < static_cast<int>(globalCaches.size())) {
-                    globalCaches[globalIdx].valid = false;
+                sp[-2] = Value(a.asNumber() != b.asNumber());
+                sp--;
+                DISPATCH();
+            }
+            VM_CASE(OP_GET_GLOBAL) {
+                int globalIdx = *ip++;
+                PUSH(globalSlots[globalIdx]);
+                DISPATCH();
+            }
+            VM_CASE(OP_SET_GLOBAL) {
+                int globalIdx = *ip++;
+                globalSlots[globalIdx] = peek(0);
+                DISPATCH();
+            }
+            VM_CASE(OP_SET_GLOBAL_POP) {
+                int globalIdx = *ip++;
+                globalSlots[globalIdx] = POP();
+                DISPATCH();
+            }
+            VM_CASE(OP_SET_GLOBAL_CONST) {
+                int globalIdx = *ip++;
+                globalSlots[globalIdx] = chunk->constants[*ip++];
+                DISPATCH();
+            }
+            VM_CASE(OP_INC_GLOBAL) {
+                int globalIdx = *ip++;
+                const Value& amount = chunk->constants[*ip++];
+                Value& current = globalSlots[globalIdx];
+                if (current.isNumber()) {
+                    current = Value(current.asNumber() + amount.asNumber());
+                } else {
+                    current = addValues(current, amount);
+                    collectIfNeeded();
                 }
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_SET_GLOBAL_CACHED: {
-                int cacheIdx = chunk.code[ip++];
-                int globalIdx = chunk.code[ip++];
-                if (globalIdx >= static_cast<int>(globals.size())) {
-                    globals.resize(globalIdx + 1);
+            VM_CASE(OP_ADD_GLOBALS) {
+                Value a = globalSlots[ip[0]];
+                Value b = globalSlots[ip[1]];
+                ip += 2;
+                if (a.isNumber() && b.isNumber()) {
+                    PUSH(Value(a.asNumber() + b.asNumber()));
+                } else {
+                    PUSH(addValues(a, b));
+                    collectIfNeeded();
                 }
-                globals[globalIdx] = peek(0);
-                if (cacheIdx < static_cast<int>(globalCaches.size())) {
-                    globalCaches[cacheIdx].cachedValue = peek(0);
-                    globalCaches[cacheIdx].valid = true;
+                DISPATCH();
+            }
+            VM_CASE(OP_GET_LOCAL) {
+                int localIdx = *ip++;
+                PUSH(bp[localIdx]);
+                DISPATCH();
+            }
+            VM_CASE(OP_SET_LOCAL) {
+                int localIdx = *ip++;
+                bp[localIdx] = peek(0);
+                DISPATCH();
+            }
+            VM_CASE(OP_SET_LOCAL_POP) {
+                int localIdx = *ip++;
+                bp[localIdx] = POP();
+                DISPATCH();
+            }
+            VM_CASE(OP_SET_LOCAL_CONST) {
+                int localIdx = *ip++;
+                bp[localIdx] = chunk->constants[*ip++];
+                DISPATCH();
+            }
+            VM_CASE(OP_INC_LOCAL) {
+                Value& local = bp[*ip++];
+                const Value& amount = chunk->constants[*ip++];
+                if (local.isNumber()) {
+                    local = Value(local.asNumber() + amount.asNumber());
+                } else {
+                    local = addValues(local, amount);
+                    collectIfNeeded();
                 }
-                break;
-            }
-            case OpCode::OP_GET_LOCAL: {
-                int localIdx = chunk.code[ip++];
-                push(stack[static_cast<size_t>(bp) + localIdx]);
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_SET_LOCAL: {
-                int localIdx = chunk.code[ip++];
-                if (static_cast<size_t>(bp + localIdx) >= stack.size()) {
-                    stack.resize(static_cast<size_t>(bp + localIdx + 1));
+            VM_CASE(OP_ADD_LOCALS) {
+                Value a = bp[ip[0]];
+                Value b = bp[ip[1]];
+                ip += 2;
+                if (a.isNumber() && b.isNumber()) {
+                    PUSH(Value(a.asNumber() + b.asNumber()));
+                } else {
+                    PUSH(addValues(a, b));
+                    collectIfNeeded();
                 }
-                stack[static_cast<size_t>(bp) + localIdx] = peek(0);
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_JUMP: {
-                int offset = (chunk.code[ip] << 8) | chunk.code[ip + 1];
+            VM_CASE(OP_JUMP) {
+                int offset = (ip[0] << 8) | ip[1];
                 ip += 2;
                 if (offset & 0x8000) {
                     offset |= 0xFFFF0000;
+                    // Loop back-edge
+                    if (tracer && tracer->countBackEdge(ip - 3)) {
+                        ip = tracer->recordLoop(*this, *chunk, ip - 3, ip + offset);
+                        DISPATCH();
+                    }
                 }
                 ip += offset;
-                break;
+                DISPATCH();
             }
-            case OpCode::OP_JUMP_IF_FALSE: {
-                int offset = (chunk.code[ip] << 8) | chunk.code[ip + 1];
+            VM_CASE(OP_LOOP_TRACE) {
+                int offset = ((ip[0] << 8) | ip[1]) | 0xFFFF0000;
+                ip += 2;
+                ip = tracer ? tracer->enter(*this, *chunk, ip - 3, ip + offset) : ip + offset;
+                DISPATCH();
+            }
+            VM_CASE(OP_JUMP_IF_FALSE) {
+                int offset = (ip[0] << 8) | ip[1];
                 ip += 2;
                 if (!isTruthy(peek(0))) {
                     ip += offset;
                 }
-                break;
+                DISPATCH();
+            }
+            VM_CASE(OP_POP_JUMP_IF_FALSE) {
+                int offset = (ip[0] << 8) | ip[1];
+                ip += 2;
+                if (!isTruthy(POP())) {
+                    ip += offset;
+                }
+                DISPATCH();
+            }
+            VM_CASE(OP_JUMP_IF_NOT_LESS) {
+                int offset = (ip[0] << 8) | ip[1];
+                ip += 2;
+                Value b = POP();
+                Value a = POP();
+                if (!(toNumber(a) < toNumber(b))) ip += offset;
+                DISPATCH();
+            }
+            VM_CASE(OP_JUMP_IF_NOT_LESS_EQUAL) {
+                int offset = (ip[0] << 8) | ip[1];
+                ip += 2;
+                Value b = POP();
+                Value a = POP();
+                if (!(toNumber(a) <= toNumber(b))) ip += offset;
+                DISPATCH();
+            }
+            VM_CASE(OP_JUMP_IF_NOT_GREATER) {
+                int offset = (ip[0] << 8) | ip[1];
+                ip += 2;
+                Value b = POP();
+                Value a = POP();
+                if (!(toNumber(a) > toNumber(b))) ip += offset;
+                DISPATCH();
+            }
+            VM_CASE(OP_JUMP_IF_NOT_GREATER_EQUAL) {
+                int offset = (ip[0] << 8) | ip[1];
+                ip += 2;
+                Value b = POP();
+                Value a = POP();
+                if (!(toNumber(a) >= toNumber(b))) ip += offset;
+                DISPATCH();
             }
-            case OpCode::OP_BREAK: {
+            VM_CASE(OP_BREAK) {
                 throw std::runtime_error("break outside loop");
             }
-            case OpCode::OP_CONTINUE: {
+            VM_CASE(OP_CONTINUE) {
                 throw std::runtime_error("continue outside loop");
             }
-            case OpCode::OP_CALL: {
-                int funcId = chunk.code[ip++];
-                int argc = chunk.code[ip++];
+            VM_CASE(OP_CALL) {
+                int funcId = *ip++;
+                int argc = *ip++;
                 
-                if (funcId == 255) {
-                    int nameIdx = chunk.code[ip++];
-                    std::string funcName = chunk.constants[nameIdx].string;
-                    std::vector<Value> args;
-                    for (int i = 0; i < argc; i++) {
-                        args.insert(args.begin(), pop());
-                    }
-                    Value result = callBuiltin(funcName, args);
-                    push(result);
-                    break;
-                }
-                
-                CallFrame frame;
-                frame.returnIP = ip;
-                frame.basePointer = bp;
-                frame.functionId = funcId;
-                callStack.push_back(frame);
+                if (frames.size() == maxFrames) throw std::runtime_error("Stack overflow");
+                frames.push_back(CallFrame{chunk, ip, bp});
                 
-                bp = static_cast<int>(stack.size()) - argc;
+                chunk = &(*functions)[funcId].chunk;
+                ip = chunk->code.data();
+                bp = sp - argc;
+                DISPATCH();
+            }
+            VM_CASE(OP_CALL_NATIVE) {
+                int nativeId = *ip++;
+                int argc = *ip++;
+                // Arguments stay on the stack (and rooted) during the call
+                Value* args = sp - argc;
+                Value result = natives[nativeId].fn(args, argc, natives[nativeId].userdata);
+                sp = args;
+                PUSH(result);
+                collectIfNeeded();
+                DISPATCH();
+            }
+            VM_CASE(OP_TAIL_CALL) {
+                int funcId = *ip++;
+                int argc = *ip++;
+                // The arguments replace the caller's locals; the callee
+                // returns straight to the caller's caller
+                Value* args = sp - argc;
+                std::copy(args, sp, bp);
+                sp = bp + argc;
+                chunk = &(*functions)[funcId].chunk;
+                ip = chunk->code.data();
+                DISPATCH();
+            }
+            VM_CASE(OP_RET) {
+                // A return at the top level ends the script
+                if (frames.empty()) return;
                 
-                executeChunk((*functions)[funcId].chunk);
+                Value retVal = POP();
+                sp = bp;
                 
-                Value retVal = pop();
+                const CallFrame& frame = frames.back();
+                chunk = frame.chunk;
+                ip = frame.returnIP;
+                bp = frame.basePointer;
+                frames.pop_back();
                 
-                while (static_cast<int>(stack.size()) > bp) {
-                    stack.pop_back();
+                PUSH(retVal);
+                DISPATCH();
+            }
+            VM_CASE(OP_MAKEFRAME) {
+                int localCount = *ip++;
+                if (bp + localCount > stackEnd) throw std::runtime_error("Stack overflow");
+                while (sp < bp + localCount) {
+                    *sp++ = Value();
                 }
-                
-                CallFrame lastFrame = callStack.back();
-                callStack.pop_back();
-                bp = lastFrame.basePointer;
-                ip = lastFrame.returnIP;
-                
-                push(retVal);
-                break;
+                if (!Checked && stackEnd - sp < chunk->maxStack) throw std::runtime_error("Stack overflow");
+                DISPATCH();
+            }
+            VM_CASE(OP_POPFRAME) {
+                DISPATCH();
+            }
+            VM_CASE(OP_PRINT) {
+                int argc = *ip++;
+                printValues(sp - argc, argc);
+                sp -= argc;
+                DISPATCH();
+            }
+            VM_CASE(OP_POP) {
+                POP();
+                DISPATCH();
             }
-            case OpCode::OP_RET: {
+            VM_CASE(OP_HALT) {
                 return;
             }
-            case OpCode::OP_MAKEFRAME: {
-                int localCount = chunk.code[ip++];
-                break;
-            }
-            case OpCode::OP_POPFRAME: {
-                break;
-            }
-            case OpCode::OP_PRINT: {
-                int argc = chunk.code[ip++];
-                for (int i = argc - 1; i >= 0; i--) {
-                    Value val = peek(i);
-                    if (val.type == Value::NUMBER) {
-                        double num = val.number;
-                        if (num == static_cast<int>(num)) {
-                            std::cout << static_cast<int>(num);
-                        } else {
-                            std::cout << num;
+            // Rare forms with 24-bit operands, kept out of the hot handlers
+            VM_CASE(OP_WIDE) {
+                OpCode op = static_cast<OpCode>(*ip++);
+                switch (op) {
+                    case OpCode::OP_CONSTANT:
+                    case OpCode::OP_STRING:
+                        PUSH(chunk->constants[WIDE_OPERAND()]);
+                        break;
+                    case OpCode::OP_ARRAY: {
+                        int size = WIDE_OPERAND();
+                        ObjArray* arr = Heap::instance().newArray();
+                        arr->assign(sp - size, sp);
+                        sp -= size;
+                        PUSH(Value(arr));
+                        collectIfNeeded();
+                        break;
+                    }
+                    case OpCode::OP_HASHMAP: {
+                        int size = WIDE_OPERAND();
+                        ObjHashMap* hm = Heap::instance().newHashMap();
+                        for (Value* pair = sp - size * 2; pair < sp; pair += 2) {
+                            hm->set(pair[0], pair[1]);
                         }
-                    } else if (val.type == Value::STRING) {
-                        std::cout << val.string;
-                    } else if (val.type == Value::BOOLEAN) {
-                        std::cout << (val.boolean ? "true" : "false");
-                    } else if (val.type == Value::ARRAY) {
-                        std::cout << "[";
-                        for (size_t j = 0; j < val.array->size(); j++) {
-                            Value elem = (*val.array)[j];
-                            if (elem.type == Value::NUMBER) {
-                                double num = elem.number;
-                                if (num == static_cast<int>(num)) {
-                                    std::cout << static_cast<int>(num);
-                                } else {
-                                    std::cout << num;
-                                }
-                            } else if (elem.type == Value::STRING) {
-                                std::cout << "\"" << elem.string << "\"";
-                            } else if (elem.type == Value::BOOLEAN) {
-                                std::cout << (elem.boolean ? "true" : "false");
-                            }
-                            if (j < val.array->size() - 1) std::cout << ", ";
+                        sp -= size * 2;
+                        PUSH(Value(hm));
+                        collectIfNeeded();
+                        break;
+                    }
+                    case OpCode::OP_GET_GLOBAL:
+                        PUSH(globalSlots[WIDE_OPERAND()]);
+                        break;
+                    case OpCode::OP_SET_GLOBAL:
+                        globalSlots[WIDE_OPERAND()] = peek(0);
+                        break;
+                    case OpCode::OP_SET_GLOBAL_POP: {
+                        int globalIdx = WIDE_OPERAND();
+                        globalSlots[globalIdx] = POP();
+                        break;
+                    }
+                    case OpCode::OP_SET_GLOBAL_CONST: {
+                        int globalIdx = WIDE_OPERAND();
+                        globalSlots[globalIdx] = chunk->constants[WIDE_OPERAND()];
+                        break;
+                    }
+                    case OpCode::OP_INC_GLOBAL: {
+                        int globalIdx = WIDE_OPERAND();
+                        globalSlots[globalIdx] = addValues(globalSlots[globalIdx], chunk->constants[WIDE_OPERAND()]);
+                        collectIfNeeded();
+                        break;
+                    }
+                    case OpCode::OP_ADD_GLOBALS: {
+                        Value a = globalSlots[WIDE_OPERAND()];
+                        PUSH(addValues(a, globalSlots[WIDE_OPERAND()]));
+                        collectIfNeeded();
+                        break;
+                    }
+                    case OpCode::OP_GET_LOCAL:
+                        PUSH(bp[WIDE_OPERAND()]);
+                        break;
+                    case OpCode::OP_SET_LOCAL:
+                        bp[WIDE_OPERAND()] = peek(0);
+                        break;
+                    case OpCode::OP_SET_LOCAL_POP: {
+                        int localIdx = WIDE_OPERAND();
+                        bp[localIdx] = POP();
+                        break;
+                    }
+                    case OpCode::OP_SET_LOCAL_CONST: {
+                        int localIdx = WIDE_OPERAND();
+                        bp[localIdx] = chunk->constants[WIDE_OPERAND()];
+                        break;
+                    }
+                    case OpCode::OP_INC_LOCAL: {
+                        Value& local = bp[WIDE_OPERAND()];
+                        local = addValues(local, chunk->constants[WIDE_OPERAND()]);
+                        collectIfNeeded();
+                        break;
+                    }
+                    case OpCode::OP_ADD_LOCALS: {
+                        Value a = bp[WIDE_OPERAND()];
+                        PUSH(addValues(a, bp[WIDE_OPERAND()]));
+                        collectIfNeeded();
+                        break;
+                    }
+                    case OpCode::OP_MAKEFRAME: {
+                        int localCount = WIDE_OPERAND();
+                        if (bp + localCount > stackEnd) throw std::runtime_error("Stack overflow");
+                        while (sp < bp + localCount) {
+                            *sp++ = Value();
                         }
-                        std::cout << "]";
+                        if (!Checked && stackEnd - sp < chunk->maxStack) throw std::runtime_error("Stack overflow");
+                        break;
                     }
-                    if (i > 0) std::cout << " ";
+                    case OpCode::OP_PRINT: {
+                        int argc = WIDE_OPERAND();
+                        printValues(sp - argc, argc);
+                        sp -= argc;
+                        break;
+                    }
+                    case OpCode::OP_CALL: {
+                        int funcId = WIDE_OPERAND();
+                        int argc = WIDE_OPERAND();
+                        if (frames.size() == maxFrames) throw std::runtime_error("Stack overflow");
+                        frames.push_back(CallFrame{chunk, ip, bp});
+                        chunk = &(*functions)[funcId].chunk;
+                        ip = chunk->code.data();
+                        bp = sp - argc;
+                        break;
+                    }
+                    case OpCode::OP_TAIL_CALL: {
+                        int funcId = WIDE_OPERAND();
+                        int argc = WIDE_OPERAND();
+                        Value* args = sp - argc;
+                        std::copy(args, sp, bp);
+                        sp = bp + argc;
+                        chunk = &(*functions)[funcId].chunk;
+                        ip = chunk->code.data();
+                        break;
+                    }
+                    case OpCode::OP_GET_FIELD: {
+                        const Value& key = chunk->constants[WIDE_OPERAND()];
+                        FieldCache& cache = chunk->fieldCaches[WIDE_OPERAND()];
+                        sp[-1] = getField(sp[-1], key, cache);
+                        break;
+                    }
+                    case OpCode::OP_SET_FIELD: {
+                        const Value& key = chunk->constants[WIDE_OPERAND()];
+                        FieldCache& cache = chunk->fieldCaches[WIDE_OPERAND()];
+                        setField(sp[-2], key, sp[-1], cache);
+                        sp -= 2;
+                        collectIfNeeded();
+                        break;
+                    }
+                    case OpCode::OP_CALL_NATIVE: {
+                        int nativeId = WIDE_OPERAND();
+                        int argc = WIDE_OPERAND();
+                        Value* args = sp - argc;
+                        Value result = natives[nativeId].fn(args, argc, natives[nativeId].userdata);
+                        sp = args;
+                        PUSH(result);
+                        collectIfNeeded();
+                        break;
+                    }
+                    default:
+                        throw std::runtime_error("Invalid operand for wide prefix: opcode " +
+                                                 std::to_string(static_cast<int>(op)));
                 }
-                std::cout << std::endl;
-                for (int i = 0; i < argc; i++) pop();
-                break;
-            }
-            case OpCode::OP_POP: {
-                pop();
-                break;
-            }
-            case OpCode::OP_HALT: {
-                return;
-            }
+                DISPATCH();
+            }
+#ifdef ZS_COMPUTED_GOTO
+            L_OP_UNKNOWN:
+#else
+            default:
+#endif
+                throw std::runtime_error("Unknown opcode " + std::to_string(ip[-1]));
+#ifndef ZS_COMPUTED_GOTO
         }
     }
+#endif
 }
 
-void VM::run(const Chunk& mainChunk, const std::vector<Function>& funcs) {
+#undef VM_CASE
+#undef DISPATCH
+#undef REWRITE
+#undef WIDE_OPERAND
+#undef REDISPATCH
+#undef PUSH
+#undef POP
+
+void VM::run(Chunk& chunk, std::vector<Function>& funcs) {
     functions = &funcs;
-    executeChunk(mainChunk);
+    mainChunk = &chunk;
+    sp = stack.data();
+    bp = sp;
+    frames.clear();
+    link(chunk);
+    // Loaded .zsc files were verified already; this also covers compiled
+    // programs and embedders' chunks. Nothing runs that the verifier could
+    // not prove safe: the handlers index the stack, constants, globals and
+    // locals without range checks.
+    std::string error;
+    if (!verifyProgram(chunk, funcs, &error)) throw std::runtime_error("Invalid bytecode: " + error);
+    // Compiled code and the interpreter keep pointers into globals until
+    // the program ends, however it ends
+    struct Running {
+        bool& flag;
+        bool outer;
+        explicit Running(bool& f) : flag(f), outer(f) { flag = true; }
+        ~Running() { flag = outer; }
+    } runningScope(running);
+    if (jitEnabled) {
+        Jit jit(*this);
+        if (jit.compile(chunk, funcs)) {
+            jit.run();
+            return;
+        }
+        std::cerr << "[JIT] Program uses instructions the JIT does not support, interpreting" << std::endl;
+    }
+    // A frame deeper than the whole stack is only caught push by push
+    if (chunk.maxStack <= stack.size()) {
+        executeChunk<false>(chunk);
+    } else {
+        executeChunk<true>(chunk);
+    }
 }
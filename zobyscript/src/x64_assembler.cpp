@@ -0,0 +1,38 @@
+#include "../include/x64_assembler.h"
+
+#ifdef ZS_JIT_X64
+#include <sys/mman.h>
+#endif
+
+namespace x64 {
+
+#ifdef ZS_JIT_X64
+
+// Pages are written while mapped read-write and only then made executable,
+// so no page is ever writable and executable at once
+uint8_t* mapExecutable(const std::vector<uint8_t>& code) {
+    void* memory = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return nullptr;
+    std::memcpy(memory, code.data(), code.size());
+    if (mprotect(memory, code.size(), PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, code.size());
+        return nullptr;
+    }
+    return static_cast<uint8_t*>(memory);
+}
+
+void unmapExecutable(uint8_t* code, size_t size) {
+    munmap(code, size);
+}
+
+#else
+
+uint8_t* mapExecutable(const std::vector<uint8_t>&) {
+    return nullptr;
+}
+
+void unmapExecutable(uint8_t*, size_t) {}
+
+#endif
+
+}  // namespace x64